@@ -18,6 +18,9 @@
 #include "messenger.h"
 #include "transformer_ctx.h"
 
+// How hidden states are pooled for embedding: the last position, mean of all positions, or not pooled
+enum class PoolingMode { LAST_TOKEN, MEAN, NONE };
+
 class AbstractDecoder {
 public:
     // Forward function with the input IDs with shape of dims - (batchSize, beamSize, seqLen)
@@ -35,9 +38,27 @@ public:
     //                    |<----------------------- vocabSize  ----------------------------->|
     virtual std::tuple<float *, int, int> forward(int *ids, int64_t *dims, int step, bool logits_all = false) = 0;
 
+    // Prefill the input IDs with shape of dims - (batchSize, 1, seqLen), and compute the log-probability of the target
+    // token at each position, without keeping the logits; logprobs is only filled on master
+    virtual void score(int *ids, int64_t *dims, const int *targets, float *logprobs) = 0;
+
+    // Prefill the input IDs with shape of dims - (batchSize, 1, seqLen), and output the hidden states after the final
+    // layer norm (pooled by pooling) without running the LM head; output is only filled on master
+    virtual void embed(int *ids, int64_t *dims, PoolingMode pooling, float *output) = 0;
+
     // Reorder cached keys and values, size=batchSize*beamSize
     virtual void reorderCache(int *idx, int size) = 0;
 
+    // Only keep the samples in idx (ascending order) for following steps, size is the new batch size
+    virtual void squeezeCache(int *idx, int size) = 0;
+
+    // Drop the last tokens of all samples from KV cache (like rejected draft tokens), they are overwritten by next
+    // forward; only after the first step
+    virtual void rollbackCache(int tokens) = 0;
+
+    // Whether rollbackCache() is supported, which drafting (like prompt lookup) depends on
+    virtual bool supportsRollback() = 0;
+
     virtual DecoderContext *getContext() = 0;
 
     virtual Messenger &getMessenger() = 0;
@@ -49,4 +70,28 @@ public:
     virtual void setPrefix(int *ids, int seqLen) = 0;
 
     virtual void unsetPrefix() = 0;
+
+    // Keep KV cache of the first seqLen tokens of a sample as a session, return the memory size (0 if not supported)
+    virtual size_t saveSession(int sessionId, int sampleIdx, int seqLen) = 0;
+
+    // Use KV cache of a session as the prefix of next input until unsetPrefix(), return false if not found
+    virtual bool loadSession(int sessionId) = 0;
+
+    virtual void dropSession(int sessionId) = 0;
+
+    // Whether KV cache can be kept as a session, otherwise saveSession() keeps nothing
+    virtual bool supportsSessions() = 0;
+
+    // Prompts of next forward() at step 0 are left padded: the first padLens[b] tokens of sample b are not attended
+    virtual void setPadding(const int *padLens, int size) = 0;
+
+    // Add samples to the running batch after the first step, like requests joining it at a step boundary.
+    // ids is [batchSize][seqLen] left padded by padLens, whose tokens are computed as the last seqLen ones before the
+    // next input (seqLen must not exceed the length computed so far), thus the next forward() takes one more token of
+    // each new sample. The new samples are padded to the length of the batch.
+    virtual void appendSamples(const int *ids, int batchSize, int seqLen, const int *padLens) = 0;
+
+    // Whether samples can be left padded (setPadding, appendSamples), not for models taking absolute positions or
+    // keeping positions of each sample
+    virtual bool supportsPadding() = 0;
 };
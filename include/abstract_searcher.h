@@ -14,9 +14,13 @@
 // ============================================================================
 #pragma once
 #include <cstdint>
+#include <memory>
 #include <tuple>
+#include <utility>
 #include <vector>
 
+#include "token_grammar.h"
+
 class AbstractSearcher {
 public:
     // First call to get NextToken, return {batchSize, numBeams}. For
@@ -31,6 +35,30 @@ public:
     virtual std::vector<int32_t> finalize() = 0;
 
     virtual bool setStopWords(std::vector<std::vector<int>> stopWordsList) = 0;
+
+    // Only keep samples in idx (ascending order) for subsequent calls, like when some samples are cancelled.
+    // Return false if the searcher cannot drop samples.
+    virtual bool squeeze(int *idx, int size) = 0;
+
+    // Log-probabilities of the tokens from last getNextToken(), when SearcherConfig::numLogprobs >= 0.
+    // Each sample has (1 + numLogprobs) pairs of (token id, logprob): the chosen token then the top alternatives.
+    // Return empty if not enabled or not supported.
+    virtual std::vector<std::pair<int, float>> getLogprobs() = 0;
+
+    // Constrain the tokens of each prompt by the grammar (nullptr to remove it) until the searcher is replaced.
+    // states are the grammar states of the prompts, like after tokens generated before; empty means the start state.
+    // Return false if the searcher cannot be constrained.
+    virtual bool setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states = {}) = 0;
+
+    // Prompts of next getNextToken(ids, ...) are left padded, the first padLens[b] tokens of prompt b are not attended
+    // (see AbstractDecoder::setPadding). Return false if the searcher cannot pad prompts.
+    virtual bool setPadding(const std::vector<int> &padLens) = 0;
+
+    // Add rows to the running batch at a step boundary, like requests joining it. ids is [rows][seqLen] left padded by
+    // padLens, and seqLen must not exceed the current length of the batch (prompt plus generated tokens), as the new
+    // rows are padded to it. states are the grammar states of the rows (empty for the start state). The rows get their
+    // first token from the next getNextToken(). Return false if the searcher cannot add rows.
+    virtual bool append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states) = 0;
 };
 
 struct SearcherConfig {
@@ -38,7 +66,7 @@ struct SearcherConfig {
     bool doSample = false;
     int maxLen = -1;
     int numBeams = 1;
-    int numBeamHypsToKeep = 1;
+    int numBeamHypsToKeep = 1; // Sequences returned for each prompt, sampled from one shared prefill when doSample
     int eosTokenId = -1;
     int padTokenId = -1;
     int topK = 50;
@@ -46,6 +74,12 @@ struct SearcherConfig {
     float temperature = 1.0;
     float topP = 1.0;
     float repetitionPenalty = 1.0;
+    float presencePenalty = 0; // Subtracted from logits of generated tokens
+    float frequencyPenalty = 0; // Subtracted from logits of generated tokens for each time generated
+    int minNewTokens = 0; // EOS is not allowed until this number of tokens is generated
+    int numLogprobs = -1; // >= 0 to get logprob of the chosen token plus this number of top alternatives each step
+    int promptLookupNum = 0; // > 0 to draft up to this number of tokens by prompt lookup in greedy search
+    int promptLookupNgram = 3; // Longest n-gram (ending with the last token) looked up in previous tokens
 
     SearcherConfig(int maxLen_ = -1, int numBeams_ = 1, int numBeamHypsToKeep_ = 1, float lenPenalty_ = 1.0,
             bool doEarlyStopping_ = false, int eosTokenId_ = -1, int padTokenId_ = -1, bool doSample_ = false,
@@ -14,7 +14,11 @@
 // ============================================================================
 #pragma once
 
+#include <chrono>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <vector>
 
 #include "abstract_decoder.h"
@@ -22,6 +26,9 @@
 #include "dtype.h"
 
 namespace xft {
+// Scheduling class of a request in the step-level API
+enum class RequestPriority { INTERACTIVE, BATCH };
+
 class Model {
 public:
     Model();
@@ -42,8 +49,27 @@ public:
 
     void createSearcher(SearcherConfig &config_);
 
+    // Log-probability of each token given the tokens before it, computed by one prefill without generation.
+    // inputIds_ is in shape of [batchSize_][seqLen], return [batchSize_][seqLen - 1] on master, where the i-th value of
+    // each row is for token i + 1. Slaves call it with dummy input, like generate().
+    std::vector<float> score(std::vector<int32_t> &inputIds_, int batchSize_);
+
+    // Hidden states after the final layer norm by one prefill without the LM head, for using the model as an embedding
+    // model. Return [batchSize_][hiddenSize] for LAST_TOKEN/MEAN pooling, [batchSize_][seqLen][hiddenSize] for NONE,
+    // on master only. Samples in a batch are expected to have the same length, as padding is not masked.
+    std::vector<float> embed(
+            std::vector<int32_t> &inputIds_, int batchSize_, PoolingMode pooling = PoolingMode::LAST_TOKEN);
+
     int getRank();
 
+    // Prompt lookup decoding needs to roll back rejected drafts, and is not supported with pipeline parallel.
+    // If not supported, promptLookupNum is ignored and greedy search is used.
+    bool supportsPromptLookup();
+
+    // Rows of different lengths are batched by left padding (and join a running batch) in the step-level API, if the
+    // model only depends on relative positions; not supported with pipeline parallel.
+    bool supportsPadding();
+
     int getBatchSize() { return batchSize; }
 
     int getSeqLen() { return seqLen; }
@@ -54,6 +80,10 @@ public:
 
     std::vector<int32_t> finalize() { return searcher->finalize(); }
 
+    // Log-probabilities of the tokens from last generate() when SearcherConfig::numLogprobs >= 0, see
+    // AbstractSearcher::getLogprobs()
+    std::vector<std::pair<int, float>> getLogprobs() { return searcher->getLogprobs(); }
+
     void exitSlaves();
 
     void setPrefix(std::vector<int32_t> &prefixIDs);
@@ -62,7 +92,102 @@ public:
 
     bool setStopWords(std::vector<std::vector<int>> stopWordsList);
 
+    // Constrain the output by a grammar (nullptr to remove it) after config(), as config() resets it. states are the
+    // grammar states of each row (empty for the start state), see TokenGrammar. Not supported by beam search.
+    // The grammar is only sent to slaves when it is not the one sent last time.
+    bool setGrammar(std::shared_ptr<const TokenGrammar> grammar_, const std::vector<int> &states = {});
+
+    // Step-level API, requests are queued by addRequest() and advanced by one token per step().
+    // Queued requests with the same config are batched together, finished rows are dropped from the batch at step
+    // boundaries. If supportsPadding() (greedy search or sampling), prompts of different lengths are left padded into
+    // one batch, and waiting requests join the running batch at step boundaries while rows are free: a joining prompt
+    // is computed at once and padded to the length of the batch, thus it must not be longer. Otherwise, requests of
+    // other prompt lengths or arriving while a batch runs wait for the whole batch.
+    // maxLen bounds the prompt plus generated tokens of each request, a request without maxLen stops when its batch
+    // reaches the maximum positions of the model.
+    // Only master's queue matters, slaves just call step() in a loop to follow master.
+    // With a session ID (>= 0), the KV cache of the request is kept for the session once done (numBeams == 1 only,
+    // the ID is ignored if !supportsSessions()),
+    // a later request of the session whose input starts with the kept tokens only prefills the rest of its input.
+    // inputIds_ is always the whole conversation, thus an evicted or mismatched session is just computed again.
+    // Interactive requests lead new batches before batch-class ones, which only fill the remaining rows. A waiting
+    // interactive request joins the running batch at next step boundary if it can (see above), batch-class rows
+    // are preempted only as many as needed to make room for it. Otherwise, a running batch with no interactive
+    // request left is preempted as a whole. Preempted requests are queued again and later recompute their prompt
+    // plus the tokens generated so far (beam search starts again from the prompt).
+    // A request with a grammar is constrained by it, only batched with requests of the same grammar object.
+    // Return the handle of the request
+    int addRequest(std::vector<int32_t> &inputIds_, SearcherConfig &config_,
+            const std::vector<std::vector<int>> &stopWordsList_ = {}, int sessionId = -1,
+            RequestPriority priority = RequestPriority::INTERACTIVE,
+            std::shared_ptr<const TokenGrammar> grammar_ = nullptr);
+
+    // Advance all running requests by one token, return false if there is nothing to do (master only)
+    bool step();
+
+    // Get tokens generated since last poll, the request is released once finished and all tokens are polled.
+    // If the request's numLogprobs >= 0, logprobs gets (1 + numLogprobs) pairs for each token.
+    std::vector<int32_t> poll(int handle, std::vector<std::pair<int, float>> *logprobs = nullptr);
+
+    bool isFinished(int handle);
+
+    // Stop and release a request, the batch (and its KV cache) is given up once no request in it is still running
+    void cancel(int handle);
+
+    void setMaxBatchSize(int maxBatchSize_) { maxBatchSize = maxBatchSize_; }
+
+    // Whether addRequest() keeps the KV cache of sessions
+    bool supportsSessions();
+
+    // Release the KV cache kept for a session
+    void closeSession(int sessionId);
+
+    // Kept sessions are released after being idle for ttlSeconds (<= 0 means never), or from the least recently used
+    // one when their total memory size on master exceeds maxBytes (0 means no limit); checked at each step().
+    // Sessions resume like a prefix, thus they cannot be used together with setPrefix().
+    void setSessionPolicy(int ttlSeconds, size_t maxBytes) {
+        sessionTTL = ttlSeconds;
+        maxSessionBytes = maxBytes;
+    }
+
 private:
+    struct Request {
+        std::vector<int32_t> inputIds;
+        SearcherConfig config;
+        std::vector<std::vector<int>> stopWordsList;
+        std::vector<int32_t> tokens; // Generated but not polled
+        std::vector<std::pair<int, float>> logprobs; // Of the tokens not polled
+        bool finished = false;
+        int sessionId = -1;
+        RequestPriority priority = RequestPriority::INTERACTIVE;
+        std::vector<int32_t> history; // Input and all generated tokens, to keep a session or recompute after preemption
+        std::shared_ptr<const TokenGrammar> grammar;
+        int grammarState = 0; // After the generated tokens
+    };
+
+    struct Session {
+        std::vector<int32_t> ids; // Tokens whose KV cache is kept
+        size_t bytes = 0;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    int selectBatch();
+    void startBatch();
+    void finishBatch();
+    bool canResume(const Request &req);
+    bool canPad(SearcherConfig config);
+    bool canBatch(const Request &req, const Request &leader, bool padding);
+    bool canJoin(const Request &req);
+    std::vector<int> selectJoins(int rows, std::vector<int> &message, int &joinLen);
+    void setPadding(std::vector<int> padLens);
+    bool shouldPreempt();
+    void requeue(int handle);
+    void preemptBatch();
+    void preemptRows(std::vector<int> &keepIdx);
+    void keepSession(int row, const Request &req);
+    void releaseSession(int sessionId);
+    void evictSessions();
+
     AbstractDecoder *decoder;
     AbstractSearcher *searcher;
     std::vector<int32_t> inputIds;
@@ -70,6 +195,21 @@ private:
     int seqLen;
     SearcherConfig configuration;
     bool isNewInput;
+    std::shared_ptr<const TokenGrammar> grammar; // Last one sent to slaves
+
+    std::map<int, Request> requests;
+    std::deque<int> waitingRequests;
+    std::vector<int> runningRequests; // Handles of rows in current batch
+    Request batchLeader; // Config, stop words and grammar of current batch, shared by requests joining it
+    int batchLen; // Length of the rows in current batch (prompt plus generated tokens), shorter rows are left padded
+    int nextHandle;
+    int maxBatchSize;
+
+    std::map<int, Session> sessions; // Kept sessions, only tracked by master
+    std::vector<int> pendingSaves; // (sessionId, row, seqLen) of sessions to keep at next step
+    std::vector<int> pendingDrops; // Sessions to release at next step
+    int sessionTTL;
+    size_t maxSessionBytes;
 };
 
 class AutoModel : public Model {
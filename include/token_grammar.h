@@ -0,0 +1,75 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Token level automaton for constrained decoding, compiled from a regular expression which the whole output must
+ * match (JSON schemas are converted to regular expressions by the caller).
+ * The expression is compiled into a DFA over bytes, then the tokens allowed in each state (the bytes of the token can
+ * be walked without leaving the expression) are precomputed as a bitmask of the vocabulary. Thus each step only masks
+ * the logits by the bitmask of the current state, and walks the bytes of the chosen token to get the next state.
+ * EOS is allowed when the output matches the expression, or when no token can continue it.
+ *
+ * Supported syntax: literals, escapes (\d \w \s \D \W \S \n \t \r \f \v \uXXXX, others are literals), classes like
+ * [a-z0-9] and [^"\\], '.', groups (...) and (?:...), alternation '|', quantifiers * + ? {n} {n,} {n,m}.
+ * Classes are over bytes, thus negated classes and '.' (any byte but \n) also match bytes of UTF-8 characters.
+ */
+class TokenGrammar {
+public:
+    // tokens[i] is the bytes of token i, special tokens are empty thus never allowed (except eosTokenId)
+    // On syntax errors or if nothing can match the expression, return nullptr with the message in error if given,
+    // otherwise exit
+    static std::shared_ptr<TokenGrammar> fromRegex(const std::string &pattern, const std::vector<std::string> &tokens,
+            int eosTokenId, std::string *error = nullptr);
+
+    // Flattened into int32 values, to be broadcast to other ranks
+    std::vector<int> serialize() const;
+    static std::shared_ptr<TokenGrammar> deserialize(const std::vector<int> &data);
+
+    int getStartState() const { return 0; }
+
+    // State after the token, or -1 if the token is not allowed in the state (EOS keeps the state)
+    int next(int state, int tokenId) const;
+
+    // Allowed tokens of a state, token i is bit (i % 32) of word (i / 32)
+    const uint32_t *getMask(int state) const { return masks.data() + (size_t)maskIds[state] * maskWords; }
+
+    // Set logits of the tokens not allowed in the state to -inf, logits is the split of a row (vocabulary is split
+    // among ranks), covering token IDs in [sampleOffset, sampleOffset + sampleSize)
+    void applyMask(int state, float *logits, int sampleOffset, int sampleSize) const;
+
+    int getVocabSize() const { return vocabSize; }
+
+    int getEosTokenId() const { return eosTokenId; }
+
+private:
+    TokenGrammar() {}
+
+    void compileMasks();
+
+    int vocabSize;
+    int eosTokenId;
+    int states;
+    int maskWords; // 32-bit words of a mask, with one more word for reading 64 bits at any position
+    std::vector<int> transitions; // [states][256], DFA over bytes, -1 if no match is possible any more
+    std::vector<int> accepting; // [states]
+    std::vector<int> maskIds; // [states], masks are shared by states allowing the same tokens
+    std::vector<uint32_t> masks; // [unique masks][maskWords]
+    std::vector<std::string> tokens;
+};
@@ -0,0 +1,253 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "http_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+namespace xft {
+static const char *statusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 413: return "Payload Too Large";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+bool HttpResponseWriter::writeAll(const char *data, size_t len) {
+    if (broken) { return false; }
+    while (len > 0) {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) {
+            broken = true;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool HttpResponseWriter::send(int status, const std::string &body, const std::string &contentType) {
+    std::string header = "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) + "\r\n"
+            + "Content-Type: " + contentType + "\r\n" + "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            + "Connection: close\r\n\r\n";
+    headerSent = true;
+    return writeAll(header.data(), header.size()) && writeAll(body.data(), body.size());
+}
+
+bool HttpResponseWriter::beginStream() {
+    const std::string header = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/event-stream\r\n"
+                               "Cache-Control: no-cache\r\n"
+                               "Connection: close\r\n\r\n";
+    headerSent = true;
+    return writeAll(header.data(), header.size());
+}
+
+bool HttpResponseWriter::sendEvent(const std::string &data) {
+    std::string frame = "data: " + data + "\n\n";
+    return writeAll(frame.data(), frame.size());
+}
+
+bool HttpResponseWriter::isClosed() {
+    if (broken) { return true; }
+    char c;
+    ssize_t n = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0) { broken = true; }
+    return broken;
+}
+
+HttpServer::HttpServer(const std::string &host, int port, int maxConnections)
+    : host(host), port(port), maxConnections(maxConnections), listenFd(-1), running(false), activeConnections(0) {}
+
+HttpServer::~HttpServer() {
+    stop();
+}
+
+void HttpServer::route(const std::string &method, const std::string &path, HttpHandler handler) {
+    handlers[method + " " + path] = std::move(handler);
+}
+
+void HttpServer::serve() {
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        printf("Failed to create socket: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    int opt = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        printf("Invalid listen address: %s\n", host.c_str());
+        exit(-1);
+    }
+
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 128) < 0) {
+        printf("Failed to listen on %s:%d: %s\n", host.c_str(), port, strerror(errno));
+        exit(-1);
+    }
+
+    running = true;
+    while (running) {
+        int connFd = accept(listenFd, nullptr, nullptr);
+        if (connFd < 0) {
+            if (errno == EINTR) { continue; }
+            if (!running) { break; }
+            printf("[Warning] accept failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        // A client not sending its request in time gives up its slot
+        timeval timeout = {30, 0};
+        setsockopt(connFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        if (activeConnections >= maxConnections) {
+            HttpResponseWriter(connFd).send(503, "{\"error\":\"too many connections\"}");
+            close(connFd);
+            continue;
+        }
+
+        activeConnections += 1;
+        std::thread([this, connFd]() {
+            handleConnection(connFd);
+            activeConnections -= 1;
+        }).detach();
+    }
+}
+
+void HttpServer::stop() {
+    running = false;
+    if (listenFd >= 0) {
+        shutdown(listenFd, SHUT_RDWR);
+        close(listenFd);
+        listenFd = -1;
+    }
+}
+
+int readHttpRequest(int connFd, HttpRequest &req) {
+    const size_t maxHeaderSize = 64 * 1024;
+    const size_t maxBodySize = 64 * 1024 * 1024;
+
+    std::string data;
+    size_t headerEnd = std::string::npos;
+    char buf[8192];
+
+    while (headerEnd == std::string::npos) {
+        ssize_t n = recv(connFd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 400; }
+        data.append(buf, n);
+        headerEnd = data.find("\r\n\r\n");
+        if (headerEnd == std::string::npos && data.size() > maxHeaderSize) { return 400; }
+    }
+
+    // Request line
+    size_t lineEnd = data.find("\r\n");
+    std::string requestLine = data.substr(0, lineEnd);
+    size_t sp1 = requestLine.find(' ');
+    size_t sp2 = requestLine.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) { return 400; }
+    req.method = requestLine.substr(0, sp1);
+    req.path = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+    size_t query = req.path.find('?');
+    if (query != std::string::npos) { req.path.resize(query); }
+
+    // Headers
+    size_t pos = lineEnd + 2;
+    while (pos < headerEnd) {
+        size_t eol = data.find("\r\n", pos);
+        std::string line = data.substr(pos, eol - pos);
+        size_t colon = line.find(':');
+        if (colon != std::string::npos) {
+            std::string key = line.substr(0, colon);
+            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+            size_t vstart = line.find_first_not_of(" \t", colon + 1);
+            size_t vend = line.find_last_not_of(" \t");
+            req.headers[key] = vstart == std::string::npos ? "" : line.substr(vstart, vend - vstart + 1);
+        }
+        pos = eol + 2;
+    }
+
+    // Body
+    size_t contentLength = 0;
+    auto it = req.headers.find("content-length");
+    if (it != req.headers.end()) {
+        const std::string &value = it->second;
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) { return 400; }
+        // Checked digit by digit, thus a huge length does not overflow
+        for (char c : value) {
+            contentLength = contentLength * 10 + (c - '0');
+            if (contentLength > maxBodySize) { return 413; }
+        }
+    }
+
+    req.body = data.substr(headerEnd + 4);
+    while (req.body.size() < contentLength) {
+        ssize_t n = recv(connFd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 400; }
+        req.body.append(buf, n);
+    }
+    req.body.resize(contentLength);
+
+    return 200;
+}
+
+void HttpServer::handleConnection(int connFd) {
+    HttpRequest req;
+    HttpResponseWriter writer(connFd);
+
+    int status = readHttpRequest(connFd, req);
+    if (status == 413) {
+        writer.send(413, "{\"error\":\"request body too large\"}");
+    } else if (status != 200) {
+        writer.send(400, "{\"error\":\"malformed request\"}");
+    } else {
+        auto it = handlers.find(req.method + " " + req.path);
+        if (it == handlers.end()) {
+            writer.send(404, "{\"error\":\"not found\"}");
+        } else {
+            it->second(req, writer);
+        }
+    }
+
+    shutdown(connFd, SHUT_WR);
+    close(connFd);
+}
+} // namespace xft
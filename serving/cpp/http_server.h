@@ -0,0 +1,88 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+
+namespace xft {
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> headers; // Keys are lower case
+    std::string body;
+};
+
+// Writes the response of one connection, either a whole body or a Server-Sent Events stream.
+class HttpResponseWriter {
+public:
+    explicit HttpResponseWriter(int fd) : fd(fd), headerSent(false), broken(false) {}
+
+    // Send a complete response
+    bool send(int status, const std::string &body, const std::string &contentType = "application/json");
+
+    // Start a "text/event-stream" response, followed by any number of sendEvent()
+    bool beginStream();
+
+    // Send one SSE "data:" frame, return false if the peer has gone
+    bool sendEvent(const std::string &data);
+
+    // Whether the client closed the connection (detected by a failed write or a peek on the socket)
+    bool isClosed();
+
+private:
+    bool writeAll(const char *data, size_t len);
+
+    int fd;
+    bool headerSent;
+    bool broken;
+};
+
+using HttpHandler = std::function<void(const HttpRequest &, HttpResponseWriter &)>;
+
+// Read one request from a connection, return 200 if read, otherwise the status to reply with (400 for a malformed
+// request or a peer gone/idle too long, 413 for a body over 64 MB)
+int readHttpRequest(int connFd, HttpRequest &req);
+
+// A minimal HTTP/1.1 server (one thread per connection, "Connection: close").
+// It only exists to avoid a Python hop in front of the model, no TLS/keep-alive/chunked request body.
+// At most maxConnections are served at the same time (streams last as long as the generation), further connections
+// get 503 at once instead of piling up threads.
+class HttpServer {
+public:
+    HttpServer(const std::string &host, int port, int maxConnections = 256);
+    ~HttpServer();
+
+    void route(const std::string &method, const std::string &path, HttpHandler handler);
+
+    // Block and serve until stop() is called
+    void serve();
+
+    void stop();
+
+private:
+    void handleConnection(int connFd);
+
+    std::string host;
+    int port;
+    int maxConnections;
+    int listenFd;
+    std::atomic<bool> running;
+    std::atomic<int> activeConnections;
+    std::map<std::string, HttpHandler> handlers; // key: "METHOD path"
+};
+} // namespace xft
@@ -0,0 +1,330 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace xft {
+// Minimal JSON value, only covers what the serving front end needs (request parsing and response building).
+class JsonValue {
+public:
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    JsonValue() : type(Type::Null), boolVal(false), numVal(0) {}
+    JsonValue(bool v) : type(Type::Bool), boolVal(v), numVal(0) {}
+    JsonValue(int v) : type(Type::Number), boolVal(false), numVal(v) {}
+    JsonValue(long v) : type(Type::Number), boolVal(false), numVal(v) {}
+    JsonValue(float v) : type(Type::Number), boolVal(false), numVal(v) {}
+    JsonValue(double v) : type(Type::Number), boolVal(false), numVal(v) {}
+    JsonValue(const char *v) : type(Type::String), boolVal(false), numVal(0), strVal(v) {}
+    JsonValue(const std::string &v) : type(Type::String), boolVal(false), numVal(0), strVal(v) {}
+
+    template <typename T>
+    JsonValue(const std::vector<T> &v) : type(Type::Array), boolVal(false), numVal(0) {
+        for (const auto &x : v) {
+            arrVal.emplace_back(x);
+        }
+    }
+
+    static JsonValue array() {
+        JsonValue v;
+        v.type = Type::Array;
+        return v;
+    }
+
+    static JsonValue object() {
+        JsonValue v;
+        v.type = Type::Object;
+        return v;
+    }
+
+    Type getType() const { return type; }
+    bool isNull() const { return type == Type::Null; }
+    bool isArray() const { return type == Type::Array; }
+    bool isObject() const { return type == Type::Object; }
+    bool isString() const { return type == Type::String; }
+    bool isNumber() const { return type == Type::Number; }
+
+    bool has(const std::string &key) const { return type == Type::Object && objVal.count(key) > 0; }
+
+    const JsonValue &operator[](const std::string &key) const {
+        static const JsonValue null;
+        if (type != Type::Object) { return null; }
+        auto it = objVal.find(key);
+        return it == objVal.end() ? null : it->second;
+    }
+
+    JsonValue &operator[](const std::string &key) {
+        if (type == Type::Null) { type = Type::Object; }
+        return objVal[key];
+    }
+
+    const JsonValue &operator[](size_t idx) const { return arrVal.at(idx); }
+
+    size_t size() const { return type == Type::Array ? arrVal.size() : objVal.size(); }
+
+    void push(const JsonValue &v) {
+        if (type == Type::Null) { type = Type::Array; }
+        arrVal.push_back(v);
+    }
+
+    const std::vector<JsonValue> &items() const { return arrVal; }
+    const std::map<std::string, JsonValue> &members() const { return objVal; }
+
+    bool asBool(bool def = false) const { return type == Type::Bool ? boolVal : def; }
+    double asNumber(double def = 0) const { return type == Type::Number ? numVal : def; }
+    int asInt(int def = 0) const { return type == Type::Number ? (int)numVal : def; }
+    float asFloat(float def = 0) const { return type == Type::Number ? (float)numVal : def; }
+    std::string asString(const std::string &def = "") const { return type == Type::String ? strVal : def; }
+
+    template <typename T>
+    std::vector<T> asVector() const {
+        std::vector<T> ret;
+        for (const auto &x : arrVal) {
+            ret.push_back((T)x.numVal);
+        }
+        return ret;
+    }
+
+    std::string dump() const {
+        std::string out;
+        dumpTo(out);
+        return out;
+    }
+
+    // Throws std::runtime_error on malformed input
+    static JsonValue parse(const std::string &text) {
+        size_t pos = 0;
+        JsonValue v = parseValue(text, pos);
+        skipSpace(text, pos);
+        if (pos != text.size()) { throw std::runtime_error("Unexpected trailing characters in JSON"); }
+        return v;
+    }
+
+    static void escapeTo(const std::string &s, std::string &out) {
+        out += '"';
+        for (unsigned char c : s) {
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                default:
+                    if (c < 0x20) {
+                        char buf[8];
+                        snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        out += buf;
+                    } else {
+                        out += (char)c;
+                    }
+            }
+        }
+        out += '"';
+    }
+
+private:
+    void dumpTo(std::string &out) const {
+        switch (type) {
+            case Type::Null: out += "null"; break;
+            case Type::Bool: out += boolVal ? "true" : "false"; break;
+            case Type::Number: {
+                char buf[32];
+                if (std::isfinite(numVal) && numVal == (double)(long long)numVal && std::fabs(numVal) < 1e15) {
+                    snprintf(buf, sizeof(buf), "%lld", (long long)numVal);
+                } else if (std::isfinite(numVal)) {
+                    snprintf(buf, sizeof(buf), "%.7g", numVal);
+                } else {
+                    snprintf(buf, sizeof(buf), "%s", numVal < 0 ? "-1e38" : "1e38");
+                }
+                out += buf;
+                break;
+            }
+            case Type::String: escapeTo(strVal, out); break;
+            case Type::Array:
+                out += '[';
+                for (size_t i = 0; i < arrVal.size(); ++i) {
+                    if (i > 0) { out += ','; }
+                    arrVal[i].dumpTo(out);
+                }
+                out += ']';
+                break;
+            case Type::Object: {
+                out += '{';
+                bool first = true;
+                for (const auto &kv : objVal) {
+                    if (!first) { out += ','; }
+                    first = false;
+                    escapeTo(kv.first, out);
+                    out += ':';
+                    kv.second.dumpTo(out);
+                }
+                out += '}';
+                break;
+            }
+        }
+    }
+
+    static void skipSpace(const std::string &s, size_t &pos) {
+        while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\n' || s[pos] == '\r' || s[pos] == '\t')) {
+            ++pos;
+        }
+    }
+
+    static void appendUtf8(std::string &out, unsigned int cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    static std::string parseString(const std::string &s, size_t &pos) {
+        std::string out;
+        ++pos; // opening quote
+        while (pos < s.size() && s[pos] != '"') {
+            char c = s[pos++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= s.size()) { break; }
+            char e = s[pos++];
+            switch (e) {
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (pos + 4 > s.size()) { throw std::runtime_error("Bad unicode escape in JSON"); }
+                    unsigned int cp = std::stoul(s.substr(pos, 4), nullptr, 16);
+                    pos += 4;
+                    // Surrogate pair
+                    if (cp >= 0xD800 && cp <= 0xDBFF && pos + 6 <= s.size() && s[pos] == '\\' && s[pos + 1] == 'u') {
+                        unsigned int lo = std::stoul(s.substr(pos + 2, 4), nullptr, 16);
+                        pos += 6;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default: out += e;
+            }
+        }
+        if (pos >= s.size()) { throw std::runtime_error("Unterminated string in JSON"); }
+        ++pos; // closing quote
+        return out;
+    }
+
+    static JsonValue parseValue(const std::string &s, size_t &pos) {
+        skipSpace(s, pos);
+        if (pos >= s.size()) { throw std::runtime_error("Unexpected end of JSON"); }
+
+        char c = s[pos];
+        if (c == '{') {
+            JsonValue v = object();
+            ++pos;
+            skipSpace(s, pos);
+            if (pos < s.size() && s[pos] == '}') {
+                ++pos;
+                return v;
+            }
+            while (true) {
+                skipSpace(s, pos);
+                if (pos >= s.size() || s[pos] != '"') { throw std::runtime_error("Expect key string in JSON"); }
+                std::string key = parseString(s, pos);
+                skipSpace(s, pos);
+                if (pos >= s.size() || s[pos] != ':') { throw std::runtime_error("Expect ':' in JSON"); }
+                ++pos;
+                v.objVal[key] = parseValue(s, pos);
+                skipSpace(s, pos);
+                if (pos < s.size() && s[pos] == ',') {
+                    ++pos;
+                } else if (pos < s.size() && s[pos] == '}') {
+                    ++pos;
+                    return v;
+                } else {
+                    throw std::runtime_error("Expect ',' or '}' in JSON");
+                }
+            }
+        } else if (c == '[') {
+            JsonValue v = array();
+            ++pos;
+            skipSpace(s, pos);
+            if (pos < s.size() && s[pos] == ']') {
+                ++pos;
+                return v;
+            }
+            while (true) {
+                v.arrVal.push_back(parseValue(s, pos));
+                skipSpace(s, pos);
+                if (pos < s.size() && s[pos] == ',') {
+                    ++pos;
+                } else if (pos < s.size() && s[pos] == ']') {
+                    ++pos;
+                    return v;
+                } else {
+                    throw std::runtime_error("Expect ',' or ']' in JSON");
+                }
+            }
+        } else if (c == '"') {
+            return JsonValue(parseString(s, pos));
+        } else if (s.compare(pos, 4, "true") == 0) {
+            pos += 4;
+            return JsonValue(true);
+        } else if (s.compare(pos, 5, "false") == 0) {
+            pos += 5;
+            return JsonValue(false);
+        } else if (s.compare(pos, 4, "null") == 0) {
+            pos += 4;
+            return JsonValue();
+        } else {
+            const char *start = s.c_str() + pos;
+            char *end = nullptr;
+            double d = strtod(start, &end);
+            if (end == start) { throw std::runtime_error("Invalid value in JSON"); }
+            pos += end - start;
+            return JsonValue(d);
+        }
+    }
+
+    Type type;
+    bool boolVal;
+    double numVal;
+    std::string strVal;
+    std::vector<JsonValue> arrVal;
+    std::map<std::string, JsonValue> objVal;
+};
+} // namespace xft
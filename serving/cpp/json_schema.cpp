@@ -0,0 +1,237 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "json_schema.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace xft {
+namespace {
+const char *kSpace = " ?";
+const char *kChar = "(?:[^\"\\\\\\u0000-\\u001f]|\\\\[\"\\\\/bfnrt]|\\\\u[0-9a-fA-F]{4})";
+const char *kInteger = "-?(?:0|[1-9][0-9]*)";
+const char *kNumber = "-?(?:0|[1-9][0-9]*)(?:\\.[0-9]+)?(?:[eE][+-]?[0-9]+)?";
+
+// Nesting levels of JSON values without a schema, and of the schema itself
+constexpr int kAnyValueDepth = 3;
+constexpr int kMaxSchemaDepth = 32;
+
+std::string escapeRegex(const std::string &text) {
+    std::string out;
+    for (char c : text) {
+        if (strchr("\\.^$|?*+()[]{}", c) != nullptr) { out += '\\'; }
+        out += c;
+    }
+    return out;
+}
+
+std::string stringRegex() {
+    return std::string("\"") + kChar + "*\"";
+}
+
+// Elements separated by ',', repeated [minTimes, maxTimes] (maxTimes < 0 means unbounded)
+std::string listRegex(const std::string &elem, int minTimes, int maxTimes) {
+    std::string more = std::string("(?:,") + kSpace + elem + ")";
+    std::string range = "{" + std::to_string(std::max(minTimes - 1, 0)) + ","
+            + (maxTimes < 0 ? "" : std::to_string(maxTimes - 1)) + "}";
+    std::string list = elem + more + range;
+    return minTimes > 0 ? list : "(?:" + list + ")?";
+}
+
+std::string objectRegex(const std::string &members) {
+    return std::string("\\{") + kSpace + members + kSpace + "\\}";
+}
+
+std::string arrayRegex(const std::string &items) {
+    return std::string("\\[") + kSpace + items + kSpace + "\\]";
+}
+
+std::string anyValueRegex(int depth) {
+    std::string value = stringRegex() + "|" + kNumber + "|true|false|null";
+    if (depth > 0) {
+        std::string inner = anyValueRegex(depth - 1);
+        std::string member = stringRegex() + kSpace + ":" + kSpace + inner;
+        value += "|" + objectRegex(listRegex(member, 0, -1)) + "|" + arrayRegex(listRegex(inner, 0, -1));
+    }
+    return "(?:" + value + ")";
+}
+
+class SchemaConverter {
+public:
+    explicit SchemaConverter(std::string &error) : error(error) {}
+
+    bool convert(const JsonValue &schema, std::string &regex, int depth) {
+        if (depth > kMaxSchemaDepth) { return fail("schema is nested too deep"); }
+        if (schema.isObject() && (schema.has("$ref") || schema.has("allOf"))) {
+            return fail("$ref and allOf are not supported");
+        }
+        if (!schema.isObject() || schema.size() == 0) {
+            regex = anyValueRegex(kAnyValueDepth);
+            return true;
+        }
+
+        if (schema.has("const")) {
+            regex = escapeRegex(schema["const"].dump());
+            return true;
+        }
+
+        if (schema.has("enum")) {
+            if (!schema["enum"].isArray() || schema["enum"].size() == 0) { return fail("enum must be a list"); }
+            std::vector<std::string> options;
+            for (const auto &v : schema["enum"].items()) {
+                options.push_back(escapeRegex(v.dump()));
+            }
+            regex = alternation(options);
+            return true;
+        }
+
+        for (const char *key : {"anyOf", "oneOf"}) {
+            if (!schema.has(key)) { continue; }
+            if (!schema[key].isArray() || schema[key].size() == 0) {
+                return fail(std::string(key) + " must be a list");
+            }
+            std::vector<std::string> options(schema[key].size());
+            for (int i = 0; i < (int)options.size(); ++i) {
+                if (!convert(schema[key][i], options[i], depth + 1)) { return false; }
+            }
+            regex = alternation(options);
+            return true;
+        }
+
+        const JsonValue &type = schema["type"];
+        if (type.isArray()) {
+            std::vector<std::string> options(type.size());
+            for (int i = 0; i < (int)options.size(); ++i) {
+                if (!convertType(schema, type[i].asString(), options[i], depth)) { return false; }
+            }
+            regex = alternation(options);
+            return true;
+        }
+        if (type.isNull()) {
+            // Infer the type from the keywords, otherwise any value
+            if (schema.has("properties")) { return convertType(schema, "object", regex, depth); }
+            if (schema.has("items")) { return convertType(schema, "array", regex, depth); }
+            regex = anyValueRegex(kAnyValueDepth);
+            return true;
+        }
+        return convertType(schema, type.asString(), regex, depth);
+    }
+
+private:
+    bool convertType(const JsonValue &schema, const std::string &type, std::string &regex, int depth) {
+        if (type == "string") {
+            if (schema.has("pattern")) {
+                regex = "\"(?:" + schema["pattern"].asString() + ")\"";
+            } else {
+                int minLen = schema["minLength"].asInt(0);
+                int maxLen = schema["maxLength"].asInt(-1);
+                if (minLen < 0 || (maxLen >= 0 && maxLen < minLen)) { return fail("bad minLength/maxLength"); }
+                std::string range = minLen == 0 && maxLen < 0
+                        ? "*"
+                        : "{" + std::to_string(minLen) + "," + (maxLen < 0 ? "" : std::to_string(maxLen)) + "}";
+                regex = std::string("\"") + kChar + range + "\"";
+            }
+        } else if (type == "integer") {
+            regex = kInteger;
+        } else if (type == "number") {
+            regex = kNumber;
+        } else if (type == "boolean") {
+            regex = "(?:true|false)";
+        } else if (type == "null") {
+            regex = "null";
+        } else if (type == "object") {
+            return convertObject(schema, regex, depth);
+        } else if (type == "array") {
+            std::string item;
+            if (!convert(schema["items"], item, depth + 1)) { return false; }
+            int minItems = schema["minItems"].asInt(0);
+            int maxItems = schema["maxItems"].asInt(-1);
+            if (minItems < 0 || (maxItems >= 0 && maxItems < minItems)) { return fail("bad minItems/maxItems"); }
+            regex = maxItems == 0 ? arrayRegex("") : arrayRegex(listRegex(item, minItems, maxItems));
+        } else {
+            return fail("unknown type \"" + type + "\"");
+        }
+        return true;
+    }
+
+    // Properties are generated in alphabetical order, optional ones may be skipped
+    bool convertObject(const JsonValue &schema, std::string &regex, int depth) {
+        const JsonValue &properties = schema["properties"];
+        if (!properties.isObject() || properties.size() == 0) {
+            regex = jsonObjectRegex();
+            return true;
+        }
+
+        std::vector<std::string> members;
+        std::vector<bool> required;
+        for (const auto &kv : properties.members()) {
+            std::string value;
+            if (!convert(kv.second, value, depth + 1)) { return false; }
+            members.push_back(escapeRegex(JsonValue(kv.first).dump()) + kSpace + ":" + kSpace + value);
+
+            bool isRequired = false;
+            for (const auto &name : schema["required"].items()) {
+                if (name.asString() == kv.first) { isRequired = true; }
+            }
+            required.push_back(isRequired);
+        }
+
+        regex = objectRegex(membersRegex(members, required, 0, false));
+        return true;
+    }
+
+    // Members from idx, with a leading comma if some member is already generated.
+    // Without one, the first generated member is chosen by alternation, thus the size is quadratic, not exponential.
+    std::string membersRegex(
+            const std::vector<std::string> &members, const std::vector<bool> &required, int idx, bool hasPrev) {
+        if (idx == (int)members.size()) { return ""; }
+        std::string sep = std::string(",") + kSpace;
+        if (hasPrev) {
+            std::string member = required[idx] ? sep + members[idx] : "(?:" + sep + members[idx] + ")?";
+            return member + membersRegex(members, required, idx + 1, true);
+        }
+
+        std::string first = members[idx] + membersRegex(members, required, idx + 1, true);
+        if (required[idx]) { return first; }
+        return "(?:" + first + "|" + membersRegex(members, required, idx + 1, false) + ")";
+    }
+
+    static std::string alternation(const std::vector<std::string> &options) {
+        std::string out = "(?:";
+        for (int i = 0; i < (int)options.size(); ++i) {
+            if (i > 0) { out += "|"; }
+            out += options[i];
+        }
+        return out + ")";
+    }
+
+    bool fail(const std::string &msg) {
+        error = msg;
+        return false;
+    }
+
+    std::string &error;
+};
+} // namespace
+
+bool jsonSchemaToRegex(const JsonValue &schema, std::string &regex, std::string &error) {
+    return SchemaConverter(error).convert(schema, regex, 0);
+}
+
+std::string jsonObjectRegex() {
+    return objectRegex(listRegex(stringRegex() + kSpace + ":" + kSpace + anyValueRegex(kAnyValueDepth - 1), 0, -1));
+}
+} // namespace xft
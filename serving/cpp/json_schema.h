@@ -0,0 +1,32 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <string>
+
+#include "json.h"
+
+namespace xft {
+// Convert a JSON schema into a regular expression (in the syntax of TokenGrammar) matching compact JSON documents of
+// the schema, with an optional space after ':' and ','. Return false with the reason in error if not supported.
+// Supported: type (or a list of types) string/integer/number/boolean/null/object/array, enum, const, properties with
+// required (properties are generated in alphabetical order, others are not allowed), items, minItems/maxItems,
+// minLength/maxLength (in bytes), pattern, anyOf/oneOf. A schema without type matches any JSON value nested up to a
+// few levels. $ref and allOf are not supported.
+bool jsonSchemaToRegex(const JsonValue &schema, std::string &regex, std::string &error);
+
+// Regular expression of any JSON object nested up to a few levels, for {"type": "json_object"} response format
+std::string jsonObjectRegex();
+} // namespace xft
@@ -0,0 +1,374 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "openai_api.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include "json_schema.h"
+
+namespace xft {
+// Compiled grammars kept by the server, all are dropped once the limit is reached
+static const int kMaxCachedGrammars = 32;
+
+static std::string openaiError(const std::string &msg) {
+    JsonValue err = JsonValue::object();
+    err["message"] = msg;
+    err["type"] = "invalid_request_error";
+    JsonValue resp = JsonValue::object();
+    resp["error"] = err;
+    return resp.dump();
+}
+
+OpenAIServer::OpenAIServer(Scheduler &scheduler, const Tokenizer &tokenizer, const SearcherConfig &defaults,
+        int defaultNewTokens, const std::string &modelName, const std::string &chatTemplate)
+    : scheduler(scheduler)
+    , tokenizer(tokenizer)
+    , defaults(defaults)
+    , defaultNewTokens(defaultNewTokens)
+    , modelName(modelName)
+    , chatTemplate(chatTemplate)
+    , nextId(0) {
+    for (const auto &token : chatStopTokens(chatTemplate)) {
+        int id = tokenizer.tokenId(token);
+        if (id >= 0) { chatStopIds.push_back(id); }
+    }
+
+    // Special tokens are empty, thus never allowed by grammars
+    tokenBytes.resize(tokenizer.vocabSize());
+    for (int id = 0; id < (int)tokenBytes.size(); ++id) {
+        tokenBytes[id] = tokenizer.tokenBytes(id);
+    }
+}
+
+std::shared_ptr<const TokenGrammar> OpenAIServer::getGrammar(const JsonValue &body, int eosId, std::string &error) {
+    std::string regex;
+    const JsonValue &format = body["response_format"];
+    std::string formatType = format["type"].asString("text");
+    if (body.has("guided_regex")) {
+        regex = body["guided_regex"].asString();
+        if (regex.empty()) {
+            error = "guided_regex must be a non-empty string";
+            return nullptr;
+        }
+    } else if (formatType == "json_object") {
+        regex = jsonObjectRegex();
+    } else if (formatType == "json_schema") {
+        if (!jsonSchemaToRegex(format["json_schema"]["schema"], regex, error)) {
+            error = "unsupported json_schema: " + error;
+            return nullptr;
+        }
+    } else if (formatType != "text") {
+        error = "response_format type must be \"text\", \"json_object\" or \"json_schema\"";
+        return nullptr;
+    } else {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(grammarMtx);
+    auto key = std::make_pair(eosId, regex);
+    auto it = grammars.find(key);
+    if (it != grammars.end()) { return it->second; }
+
+    std::shared_ptr<const TokenGrammar> grammar = TokenGrammar::fromRegex(regex, tokenBytes, eosId, &error);
+    if (grammar == nullptr) { return nullptr; }
+    if (grammars.size() >= kMaxCachedGrammars) { grammars.clear(); }
+    grammars[key] = grammar;
+    return grammar;
+}
+
+void OpenAIServer::registerRoutes(HttpServer &server) {
+    server.route("POST", "/v1/completions",
+            [this](const HttpRequest &req, HttpResponseWriter &writer) { handleCompletion(req, writer, false); });
+    server.route("POST", "/v1/chat/completions",
+            [this](const HttpRequest &req, HttpResponseWriter &writer) { handleCompletion(req, writer, true); });
+    server.route("GET", "/v1/models",
+            [this](const HttpRequest &, HttpResponseWriter &writer) { handleModels(writer); });
+}
+
+void OpenAIServer::handleModels(HttpResponseWriter &writer) {
+    JsonValue model = JsonValue::object();
+    model["id"] = modelName;
+    model["object"] = "model";
+    model["owned_by"] = "xfastertransformer";
+    JsonValue data = JsonValue::array();
+    data.push(model);
+    JsonValue resp = JsonValue::object();
+    resp["object"] = "list";
+    resp["data"] = data;
+    writer.send(200, resp.dump());
+}
+
+// Append the logprobs of tokens, (1 + numLogprobs) pairs each, in the layout of the completion or chat API
+//   completion: {"tokens": [...], "token_logprobs": [...], "top_logprobs": [{token: logprob}, ...]}
+//   chat:       {"content": [{"token", "logprob", "top_logprobs": [{"token", "logprob"}]}, ...]}
+static void appendLogprobs(const Tokenizer &tokenizer, const std::vector<std::pair<int, float>> &logprobs,
+        int numLogprobs, bool chat, JsonValue &out) {
+    int itemLen = numLogprobs + 1;
+    for (size_t i = 0; i + itemLen <= logprobs.size(); i += itemLen) {
+        std::string token = tokenizer.tokenBytes(logprobs[i].first, false);
+        if (chat) {
+            JsonValue item = JsonValue::object();
+            item["token"] = token;
+            item["logprob"] = logprobs[i].second;
+            JsonValue tops = JsonValue::array();
+            for (int k = 1; k < itemLen; ++k) {
+                JsonValue top = JsonValue::object();
+                top["token"] = tokenizer.tokenBytes(logprobs[i + k].first, false);
+                top["logprob"] = logprobs[i + k].second;
+                tops.push(top);
+            }
+            item["top_logprobs"] = tops;
+            out["content"].push(item);
+        } else {
+            JsonValue tops = JsonValue::object();
+            for (int k = 1; k < itemLen; ++k) {
+                tops[tokenizer.tokenBytes(logprobs[i + k].first, false)] = logprobs[i + k].second;
+            }
+            out["tokens"].push(token);
+            out["token_logprobs"].push(logprobs[i].second);
+            out["top_logprobs"].push(tops);
+        }
+    }
+}
+
+static JsonValue emptyLogprobs(bool chat) {
+    JsonValue lp = JsonValue::object();
+    if (chat) {
+        lp["content"] = JsonValue::array();
+    } else {
+        lp["tokens"] = JsonValue::array();
+        lp["token_logprobs"] = JsonValue::array();
+        lp["top_logprobs"] = JsonValue::array();
+    }
+    return lp;
+}
+
+void OpenAIServer::handleCompletion(const HttpRequest &httpReq, HttpResponseWriter &writer, bool chat) {
+    JsonValue body;
+    try {
+        body = JsonValue::parse(httpReq.body);
+    } catch (const std::exception &e) {
+        writer.send(400, openaiError(e.what()));
+        return;
+    }
+
+    std::vector<int> ids;
+    if (chat) {
+        std::vector<std::pair<std::string, std::string>> messages;
+        for (const auto &m : body["messages"].items()) {
+            messages.emplace_back(m["role"].asString("user"), m["content"].asString());
+        }
+        if (messages.empty()) {
+            writer.send(400, openaiError("messages is required"));
+            return;
+        }
+        // The llama2 template writes <s> itself
+        ids = tokenizer.encode(applyChatTemplate(chatTemplate, messages), chatTemplate != "llama2");
+    } else if (body["prompt"].isString()) {
+        ids = tokenizer.encode(body["prompt"].asString());
+    } else if (body["prompt"].isArray() && body["prompt"].size() > 0 && body["prompt"].items()[0].isNumber()) {
+        ids = body["prompt"].asVector<int>();
+    } else {
+        writer.send(400, openaiError("prompt must be a string or a list of token ids"));
+        return;
+    }
+    if (ids.empty()) {
+        writer.send(400, openaiError("prompt is empty"));
+        return;
+    }
+    if (body["n"].asInt(1) != 1) {
+        writer.send(400, openaiError("only n=1 is supported"));
+        return;
+    }
+
+    // Beam search has no counterpart in the OpenAI API
+    SearcherConfig config = defaults;
+    config.numBeams = 1;
+    if (body.has("temperature")) {
+        float temperature = body["temperature"].asFloat(defaults.temperature);
+        config.doSample = temperature > 0;
+        if (temperature > 0) { config.temperature = temperature; }
+    }
+    config.topP = body["top_p"].asFloat(defaults.topP);
+    config.presencePenalty = body["presence_penalty"].asFloat(defaults.presencePenalty);
+    config.frequencyPenalty = body["frequency_penalty"].asFloat(defaults.frequencyPenalty);
+    config.minNewTokens = body["min_tokens"].asInt(defaults.minNewTokens);
+    int maxNewTokens = body["max_tokens"].asInt(body["max_completion_tokens"].asInt(defaultNewTokens));
+    bool stream = body["stream"].asBool(false);
+    if (chat) {
+        config.numLogprobs = body["logprobs"].asBool(false) ? body["top_logprobs"].asInt(0) : -1;
+    } else {
+        config.numLogprobs = body["logprobs"].asInt(-1);
+    }
+
+    if (maxNewTokens < 1 || config.topP <= 0 || config.numLogprobs > 20 || std::fabs(config.presencePenalty) > 2
+            || std::fabs(config.frequencyPenalty) > 2 || config.minNewTokens < 0) {
+        writer.send(400, openaiError("invalid generation parameters"));
+        return;
+    }
+
+    // Not in the OpenAI API, lets offline jobs give way to chats on the same server
+    RequestPriority priority = RequestPriority::INTERACTIVE;
+    if (body.has("priority") && !parsePriority(body["priority"].asString(), priority)) {
+        writer.send(400, openaiError("priority must be \"interactive\" or \"batch\""));
+        return;
+    }
+
+    std::vector<std::string> stops;
+    if (body["stop"].isString() && !body["stop"].asString().empty()) {
+        stops.push_back(body["stop"].asString());
+    } else {
+        for (const auto &s : body["stop"].items()) {
+            if (!s.asString().empty()) { stops.push_back(s.asString()); }
+        }
+    }
+    size_t maxStopLen = 0;
+    for (const auto &s : stops) {
+        maxStopLen = std::max(maxStopLen, s.size());
+    }
+
+    std::vector<std::vector<int>> stopWords;
+    if (chat) {
+        for (int id : chatStopIds) {
+            stopWords.push_back({id});
+        }
+    }
+
+    // The grammar ends the output by the token ending the assistant turn in chats
+    int grammarEos = defaults.eosTokenId >= 0 ? defaults.eosTokenId : tokenizer.eosId();
+    if (chat && !chatStopIds.empty()) { grammarEos = chatStopIds[0]; }
+    std::string grammarError;
+    auto grammar = getGrammar(body, grammarEos, grammarError);
+    if (!grammarError.empty()) {
+        writer.send(400, openaiError(grammarError));
+        return;
+    }
+
+    auto req = scheduler.submit(ids, maxNewTokens, config, stopWords, -1, priority, grammar);
+
+    std::string id = (chat ? "chatcmpl-" : "cmpl-") + std::to_string(nextId++);
+    long created = (long)time(nullptr);
+    std::string object = chat ? (stream ? "chat.completion.chunk" : "chat.completion") : "text_completion";
+
+    auto makeChoice = [&](const std::string &text, const JsonValue &logprobs, const JsonValue &finishReason,
+                              bool withRole = false) {
+        JsonValue choice = JsonValue::object();
+        choice["index"] = 0;
+        if (!chat) {
+            choice["text"] = text;
+        } else {
+            JsonValue message = JsonValue::object();
+            if (!stream || withRole) { message["role"] = "assistant"; }
+            message["content"] = text;
+            choice[stream ? "delta" : "message"] = message;
+        }
+        choice["logprobs"] = logprobs;
+        choice["finish_reason"] = finishReason;
+
+        JsonValue resp = JsonValue::object();
+        resp["id"] = id;
+        resp["object"] = object;
+        resp["created"] = created;
+        resp["model"] = modelName;
+        resp["choices"].push(choice);
+        return resp;
+    };
+
+    if (stream && !writer.beginStream()) {
+        req->cancel();
+        return;
+    }
+    if (stream && chat && !writer.sendEvent(makeChoice("", JsonValue(), JsonValue(), true).dump())) {
+        req->cancel();
+        return;
+    }
+
+    StreamDecoder decoder(tokenizer);
+    std::string text; // Generated text so far, cut at the stop string if any
+    size_t sent = 0; // Bytes of text already streamed
+    bool stopped = false;
+    int completionTokens = 0;
+    JsonValue allLogprobs = config.numLogprobs >= 0 ? emptyLogprobs(chat) : JsonValue();
+
+    std::vector<int> tokens;
+    std::vector<std::pair<int, float>> logprobs;
+    std::vector<std::pair<int, float>> *logprobsOut = config.numLogprobs >= 0 ? &logprobs : nullptr;
+    while (req->pop(tokens, logprobsOut)) {
+        completionTokens += tokens.size();
+        for (int t : tokens) {
+            text += decoder.push(t);
+        }
+
+        // Search stop strings in the text not yet checked, the tail of an unfinished match is held back
+        size_t safe = text.size();
+        if (maxStopLen > 0) {
+            size_t from = sent > maxStopLen ? sent - maxStopLen : 0;
+            size_t found = std::string::npos;
+            for (const auto &s : stops) {
+                found = std::min(found, text.find(s, from));
+            }
+            if (found != std::string::npos) {
+                text.resize(found);
+                safe = found;
+                stopped = true;
+            } else {
+                safe = std::max(sent, text.size() > maxStopLen - 1 ? text.size() - (maxStopLen - 1) : 0);
+                while (safe > sent && safe < text.size() && (text[safe] & 0xC0) == 0x80) {
+                    --safe;
+                }
+            }
+        }
+
+        JsonValue chunkLogprobs;
+        if (logprobsOut != nullptr) {
+            chunkLogprobs = emptyLogprobs(chat);
+            appendLogprobs(tokenizer, logprobs, config.numLogprobs, chat, stream ? chunkLogprobs : allLogprobs);
+        }
+
+        if (stream && (safe > sent || logprobsOut != nullptr)) {
+            if (!writer.sendEvent(makeChoice(text.substr(sent, safe - sent), chunkLogprobs, JsonValue()).dump())) {
+                // Client has gone, stop delivering to it
+                req->cancel();
+                return;
+            }
+            sent = safe;
+        }
+
+        if (stopped) {
+            req->cancel();
+            break;
+        }
+    }
+    if (!stopped) { text += decoder.flush(); }
+
+    // Tokens ran out before max_tokens, so the model stopped by itself
+    std::string finishReason = (stopped || completionTokens < maxNewTokens) ? "stop" : "length";
+
+    if (stream) {
+        writer.sendEvent(makeChoice(text.substr(std::min(sent, text.size())), JsonValue(), finishReason).dump());
+        writer.sendEvent("[DONE]");
+    } else {
+        JsonValue resp = makeChoice(text, allLogprobs, finishReason);
+        JsonValue usage = JsonValue::object();
+        usage["prompt_tokens"] = (int)ids.size();
+        usage["completion_tokens"] = completionTokens;
+        usage["total_tokens"] = (int)ids.size() + completionTokens;
+        resp["usage"] = usage;
+        writer.send(200, resp.dump());
+    }
+}
+} // namespace xft
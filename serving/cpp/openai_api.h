@@ -0,0 +1,62 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "http_server.h"
+#include "json.h"
+#include "scheduler.h"
+#include "tokenizer.h"
+
+namespace xft {
+// OpenAI compatible endpoints, text goes in and out, tokenization is done here.
+//   POST /v1/completions       {"prompt": "...", "max_tokens", "temperature", "top_p", "stop", "stream", "logprobs"}
+//   POST /v1/chat/completions  {"messages": [{"role", "content"}], ... "logprobs": true, "top_logprobs": N}
+// Both accept "response_format" (json_object or json_schema) and "guided_regex" to constrain the output.
+//   GET  /v1/models
+class OpenAIServer {
+public:
+    OpenAIServer(Scheduler &scheduler, const Tokenizer &tokenizer, const SearcherConfig &defaults,
+            int defaultNewTokens, const std::string &modelName, const std::string &chatTemplate);
+
+    void registerRoutes(HttpServer &server);
+
+private:
+    void handleCompletion(const HttpRequest &httpReq, HttpResponseWriter &writer, bool chat);
+    void handleModels(HttpResponseWriter &writer);
+
+    // Grammar of "response_format"/"guided_regex" in the body, nullptr if none, or with error set if invalid
+    std::shared_ptr<const TokenGrammar> getGrammar(const JsonValue &body, int eosId, std::string &error);
+
+    Scheduler &scheduler;
+    const Tokenizer &tokenizer;
+    SearcherConfig defaults;
+    int defaultNewTokens;
+    std::string modelName;
+    std::string chatTemplate;
+    std::vector<int> chatStopIds; // Tokens ending an assistant turn in the chat template
+    std::atomic<long> nextId;
+
+    // Compiled grammars by (eos, regex), the same object lets requests be batched and is only sent to slaves once
+    std::vector<std::string> tokenBytes;
+    std::map<std::pair<int, std::string>, std::shared_ptr<const TokenGrammar>> grammars;
+    std::mutex grammarMtx;
+};
+} // namespace xft
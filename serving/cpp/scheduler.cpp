@@ -0,0 +1,139 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "scheduler.h"
+
+namespace xft {
+void GenerationRequest::push(const std::vector<int> &tokens, const std::vector<std::pair<int, float>> &logprobs) {
+    if (cancelled) { return; }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending.insert(pending.end(), tokens.begin(), tokens.end());
+        pendingLogprobs.insert(pendingLogprobs.end(), logprobs.begin(), logprobs.end());
+    }
+    cv.notify_one();
+}
+
+void GenerationRequest::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        finished = true;
+    }
+    cv.notify_one();
+}
+
+bool GenerationRequest::pop(std::vector<int> &tokens, std::vector<std::pair<int, float>> *logprobs) {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this] { return !pending.empty() || finished; });
+
+    tokens.assign(pending.begin(), pending.end());
+    pending.clear();
+    if (logprobs != nullptr) { logprobs->swap(pendingLogprobs); }
+    pendingLogprobs.clear();
+
+    return !tokens.empty() || !finished;
+}
+
+Scheduler::Scheduler(Model &model, int maxBatchSize) : model(model), running(false) {
+    model.setMaxBatchSize(maxBatchSize);
+}
+
+Scheduler::~Scheduler() {
+    stop();
+}
+
+std::shared_ptr<GenerationRequest> Scheduler::submit(std::vector<int> &ids, int maxNewTokens,
+        const SearcherConfig &config, const std::vector<std::vector<int>> &stopWords, int sessionId,
+        RequestPriority priority, std::shared_ptr<const TokenGrammar> grammar) {
+    auto req = std::make_shared<GenerationRequest>(ids, maxNewTokens, config, stopWords, sessionId, priority, grammar);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        incoming.push_back(req);
+    }
+    cv.notify_one();
+    return req;
+}
+
+void Scheduler::start() {
+    running = true;
+    worker = std::thread(&Scheduler::loop, this);
+}
+
+void Scheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!running) { return; }
+        running = false;
+    }
+    cv.notify_one();
+    if (worker.joinable()) { worker.join(); }
+}
+
+void Scheduler::loop() {
+    std::vector<std::shared_ptr<GenerationRequest>> active;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return !incoming.empty() || !active.empty() || !running; });
+            if (!running) { break; }
+
+            for (auto &req : incoming) {
+                req->handle = model.addRequest(
+                        req->inputIds, req->config, req->stopWords, req->sessionId, req->priority, req->grammar);
+                active.push_back(req);
+            }
+            incoming.clear();
+        }
+
+        // Requests abandoned by the client
+        for (auto it = active.begin(); it != active.end();) {
+            if ((*it)->isCancelled()) {
+                model.cancel((*it)->handle);
+                (*it)->finish();
+                it = active.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        model.step();
+
+        for (auto it = active.begin(); it != active.end();) {
+            auto &req = *it;
+            bool finished = model.isFinished(req->handle);
+            std::vector<std::pair<int, float>> logprobs;
+            std::vector<int> tokens = model.poll(req->handle, &logprobs);
+            if (!tokens.empty()) { req->push(tokens, logprobs); }
+            if (finished) {
+                req->finish();
+                it = active.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (auto &req : active) {
+        req->finish();
+    }
+}
+
+void Scheduler::serveSlave(Model &model) {
+    // Slaves follow master's step actions, Model::step exits on the exit flag
+    while (true) {
+        model.step();
+    }
+}
+} // namespace xft
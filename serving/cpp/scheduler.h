@@ -0,0 +1,120 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "models.h"
+
+namespace xft {
+// Priority class named in requests, "interactive" or "batch", return false for other names
+inline bool parsePriority(const std::string &name, RequestPriority &priority) {
+    if (name == "interactive") {
+        priority = RequestPriority::INTERACTIVE;
+    } else if (name == "batch") {
+        priority = RequestPriority::BATCH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One client request and the channel its tokens are streamed through.
+// Written by the scheduler thread, read by the connection thread.
+class GenerationRequest {
+public:
+    GenerationRequest(std::vector<int> &ids, int maxNewTokens, const SearcherConfig &config,
+            const std::vector<std::vector<int>> &stopWords, int sessionId, RequestPriority priority,
+            std::shared_ptr<const TokenGrammar> grammar)
+        : inputIds(ids)
+        , maxNewTokens(maxNewTokens)
+        , config(config)
+        , stopWords(stopWords)
+        , sessionId(sessionId)
+        , priority(priority)
+        , grammar(grammar)
+        , handle(-1)
+        , finished(false) {
+        this->config.maxLen = ids.size() + maxNewTokens;
+    }
+
+    // Called by the scheduler, logprobs has (1 + config.numLogprobs) pairs for each token if requested
+    void push(const std::vector<int> &tokens, const std::vector<std::pair<int, float>> &logprobs = {});
+    void finish();
+
+    // Called by the client side, wait until new tokens come or the request finishes.
+    // Return false when there is nothing more to read.
+    bool pop(std::vector<int> &tokens, std::vector<std::pair<int, float>> *logprobs = nullptr);
+
+    // Mark the request as abandoned by the client, outputs are dropped from now on
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled; }
+
+    std::vector<int> inputIds;
+    int maxNewTokens;
+    SearcherConfig config;
+    std::vector<std::vector<int>> stopWords;
+    int sessionId; // Session whose KV cache is kept between turns, -1 if none
+    RequestPriority priority;
+    std::shared_ptr<const TokenGrammar> grammar; // Constraint of the output, nullptr if none
+    int handle; // Handle in the model, assigned by the scheduler thread
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<int> pending;
+    std::vector<std::pair<int, float>> pendingLogprobs;
+    bool finished;
+    std::atomic<bool> cancelled {false};
+};
+
+// Owns the model on the master rank: hand incoming requests to the model's step-level API and drive generation.
+// Slave ranks run serveSlave(), which follows the master through the broadcasts inside Model::step.
+class Scheduler {
+public:
+    Scheduler(Model &model, int maxBatchSize);
+    ~Scheduler();
+
+    std::shared_ptr<GenerationRequest> submit(std::vector<int> &ids, int maxNewTokens, const SearcherConfig &config,
+            const std::vector<std::vector<int>> &stopWords = {}, int sessionId = -1,
+            RequestPriority priority = RequestPriority::INTERACTIVE,
+            std::shared_ptr<const TokenGrammar> grammar = nullptr);
+
+    // Start/stop the generation thread
+    void start();
+    void stop();
+
+    static void serveSlave(Model &model);
+
+private:
+    void loop();
+
+    Model &model;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<GenerationRequest>> incoming; // Submitted but not yet added to the model
+    bool running;
+    std::thread worker;
+};
+} // namespace xft
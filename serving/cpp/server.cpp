@@ -0,0 +1,254 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cmdline.h"
+#include "http_server.h"
+#include "json.h"
+#include "openai_api.h"
+#include "scheduler.h"
+#include "tokenizer.h"
+#include "xfastertransformer.h"
+
+std::map<std::string, xft::DataType> dataTypeMap = {{"fp16", xft::DataType::fp16}, {"bf16", xft::DataType::bf16},
+        {"int8", xft::DataType::int8}, {"w8a8", xft::DataType::w8a8}, {"int4", xft::DataType::int4},
+        {"nf4", xft::DataType::nf4}, {"bf16_fp16", xft::DataType::bf16_fp16}, {"bf16_int8", xft::DataType::bf16_int8},
+        {"bf16_w8a8", xft::DataType::bf16_w8a8}, {"bf16_int4", xft::DataType::bf16_int4},
+        {"bf16_nf4", xft::DataType::bf16_nf4}, {"w8a8_int8", xft::DataType::w8a8_int8},
+        {"w8a8_int4", xft::DataType::w8a8_int4}, {"w8a8_nf4", xft::DataType::w8a8_nf4}};
+
+static std::string errorJson(const std::string &msg) {
+    xft::JsonValue err = xft::JsonValue::object();
+    err["error"] = msg;
+    return err.dump();
+}
+
+// POST /generate
+// Request:  {"input_ids": [...], "max_new_tokens": 100, "stream": false, "num_beams": 1, "do_sample": false,
+//            "temperature": 1.0, "top_k": 50, "top_p": 1.0, "repetition_penalty": 1.0, "stop_words_ids": [[...]],
+//            "session_id": 1, "logprobs": 0, "priority": "interactive"}
+// Response: {"output_ids": [...]}, or SSE frames of {"ids": [...]} ended by "[DONE]" when streaming.
+//           With "logprobs", a "logprobs" list is added aside the ids, see logprobsJson().
+// One item per token: {"token": id, "logprob": x, "top_logprobs": [[id, logprob], ...]}
+static xft::JsonValue logprobsJson(const std::vector<std::pair<int, float>> &logprobs, int numLogprobs) {
+    xft::JsonValue items = xft::JsonValue::array();
+    int itemLen = numLogprobs + 1;
+    for (size_t i = 0; i + itemLen <= logprobs.size(); i += itemLen) {
+        xft::JsonValue item = xft::JsonValue::object();
+        item["token"] = logprobs[i].first;
+        item["logprob"] = logprobs[i].second;
+        xft::JsonValue tops = xft::JsonValue::array();
+        for (int k = 1; k < itemLen; ++k) {
+            xft::JsonValue pair = xft::JsonValue::array();
+            pair.push(logprobs[i + k].first);
+            pair.push(logprobs[i + k].second);
+            tops.push(pair);
+        }
+        item["top_logprobs"] = tops;
+        items.push(item);
+    }
+    return items;
+}
+
+void handleGenerate(xft::Scheduler &scheduler, const SearcherConfig &defaults, int defaultNewTokens, bool promptLookup,
+        bool sessions, const xft::HttpRequest &httpReq, xft::HttpResponseWriter &writer) {
+    xft::JsonValue body;
+    try {
+        body = xft::JsonValue::parse(httpReq.body);
+    } catch (const std::exception &e) {
+        writer.send(400, errorJson(e.what()));
+        return;
+    }
+
+    std::vector<int> ids = body["input_ids"].asVector<int>();
+    if (ids.empty()) {
+        writer.send(400, errorJson("input_ids is required"));
+        return;
+    }
+
+    SearcherConfig config = defaults;
+    config.numBeams = body["num_beams"].asInt(defaults.numBeams);
+    config.doSample = body["do_sample"].asBool(defaults.doSample);
+    config.temperature = body["temperature"].asFloat(defaults.temperature);
+    config.topK = body["top_k"].asInt(defaults.topK);
+    config.topP = body["top_p"].asFloat(defaults.topP);
+    config.repetitionPenalty = body["repetition_penalty"].asFloat(defaults.repetitionPenalty);
+    config.presencePenalty = body["presence_penalty"].asFloat(defaults.presencePenalty);
+    config.frequencyPenalty = body["frequency_penalty"].asFloat(defaults.frequencyPenalty);
+    config.minNewTokens = body["min_new_tokens"].asInt(defaults.minNewTokens);
+    int maxNewTokens = body["max_new_tokens"].asInt(defaultNewTokens);
+    bool stream = body["stream"].asBool(false);
+    int sessionId = body["session_id"].asInt(-1);
+    config.numLogprobs = body["logprobs"].asInt(-1);
+    config.promptLookupNum = body["prompt_lookup_num_tokens"].asInt(defaults.promptLookupNum);
+
+    if (config.numBeams < 1 || maxNewTokens < 1 || config.temperature <= 0 || config.repetitionPenalty <= 0
+            || config.promptLookupNum < 0 || config.minNewTokens < 0) {
+        writer.send(400, errorJson("invalid generation parameters"));
+        return;
+    }
+    if (config.promptLookupNum > 0 && !promptLookup) {
+        writer.send(400, errorJson("prompt_lookup_num_tokens is not supported by this model"));
+        return;
+    }
+    if (sessionId >= 0 && !sessions) {
+        writer.send(400, errorJson("session_id is not supported by this model"));
+        return;
+    }
+    if (stream && config.numBeams > 1) {
+        writer.send(400, errorJson("streaming is not supported with beam search"));
+        return;
+    }
+    if (config.numLogprobs > 20 || (config.numLogprobs >= 0 && config.numBeams > 1)) {
+        writer.send(400, errorJson("logprobs must be at most 20 and is not supported with beam search"));
+        return;
+    }
+
+    xft::RequestPriority priority = xft::RequestPriority::INTERACTIVE;
+    if (body.has("priority") && !xft::parsePriority(body["priority"].asString(), priority)) {
+        writer.send(400, errorJson("priority must be \"interactive\" or \"batch\""));
+        return;
+    }
+
+    std::vector<std::vector<int>> stopWords;
+    for (const auto &words : body["stop_words_ids"].items()) {
+        stopWords.push_back(words.asVector<int>());
+    }
+
+    auto req = scheduler.submit(ids, maxNewTokens, config, stopWords, sessionId, priority);
+
+    std::vector<int> tokens;
+    std::vector<std::pair<int, float>> logprobs;
+    std::vector<std::pair<int, float>> *logprobsOut = config.numLogprobs >= 0 ? &logprobs : nullptr;
+    if (stream) {
+        if (!writer.beginStream()) {
+            req->cancel();
+            return;
+        }
+        while (req->pop(tokens, logprobsOut)) {
+            if (tokens.empty()) { continue; }
+            xft::JsonValue chunk = xft::JsonValue::object();
+            chunk["ids"] = tokens;
+            if (logprobsOut != nullptr) { chunk["logprobs"] = logprobsJson(logprobs, config.numLogprobs); }
+            if (!writer.sendEvent(chunk.dump())) {
+                // Client has gone, stop delivering to it
+                req->cancel();
+                return;
+            }
+        }
+        writer.sendEvent("[DONE]");
+    } else {
+        std::vector<int> output;
+        std::vector<std::pair<int, float>> allLogprobs;
+        while (req->pop(tokens, logprobsOut)) {
+            output.insert(output.end(), tokens.begin(), tokens.end());
+            allLogprobs.insert(allLogprobs.end(), logprobs.begin(), logprobs.end());
+        }
+        xft::JsonValue resp = xft::JsonValue::object();
+        resp["output_ids"] = output;
+        if (logprobsOut != nullptr) { resp["logprobs"] = logprobsJson(allLogprobs, config.numLogprobs); }
+        writer.send(200, resp.dump());
+    }
+}
+
+int main(int argc, char **argv) {
+    cmdline::parser args;
+
+    args.add<std::string>("model", 'm', "path of xft format model", true);
+    args.add<std::string>("dtype", 'd', "weight data type", false, "fp16");
+    args.add<std::string>("host", '\0', "listen address.", false, "0.0.0.0");
+    args.add<int>("port", 'p', "listen port.", false, 8000);
+    args.add<int>("max_batch_size", 'b', "max number of requests batched together.", false, 8,
+            cmdline::range(1, 512));
+    args.add<int>("output_len", '\0', "default max tokens to generate excluded input.", false, 100,
+            cmdline::range(1, 8192));
+    args.add<int>("num_beams", 'n', "default number of beam size.", false, 1, cmdline::range(1, 32));
+    args.add<int>("topK", '\0', "default number of highest probability tokens to keep.", false, 50);
+    args.add<float>("temperature", '\0', "default value used to modulate the next token probabilities.", false, 1.0);
+    args.add<float>("topP", '\0', "default to retain minimal tokens above topP threshold.", false, 1.0);
+    args.add<float>("repetPen", '\0', "default repetition penalty.", false, 1.0);
+    args.add("do_sample", '\0', "use sampling by default");
+    args.add<int>("max_connections", '\0', "max number of connections served at the same time.", false, 256,
+            cmdline::range(1, 65536));
+    args.add<int>("session_ttl", '\0', "seconds to keep the KV cache of an idle session, 0 means forever.", false, 600);
+    args.add<int>("session_cache_mb", '\0', "max memory of kept sessions in MB, 0 means no limit.", false, 8192);
+    args.add<std::string>("tokenizer", '\0', "tokenizer.json or its directory, enables the OpenAI API.", false, "");
+    args.add<std::string>("chat_template", '\0', "prompt format of chat completions.", false, "chatml",
+            cmdline::oneof<std::string>("chatml", "llama2", "plain"));
+    args.add<std::string>("model_name", '\0', "model name reported by the OpenAI API.", false, "xft");
+    args.parse_check(argc, argv);
+
+    std::string modelPath = args.get<std::string>("model");
+    std::string dtypeName = args.get<std::string>("dtype");
+
+    auto it = dataTypeMap.find(dtypeName);
+    if (it == dataTypeMap.end()) {
+        std::cout << "[Error] Unsupport dtype index: " << dtypeName << std::endl;
+        return 0;
+    }
+
+    xft::AutoModel model(modelPath, it->second);
+
+    // Slaves follow master's broadcasts until it exits
+    if (model.getRank() != 0) {
+        xft::Scheduler::serveSlave(model);
+        return 0;
+    }
+
+    SearcherConfig defaults;
+    defaults.numBeams = args.get<int>("num_beams");
+    defaults.doSample = args.exist("do_sample");
+    defaults.temperature = args.get<float>("temperature");
+    defaults.topK = args.get<int>("topK");
+    defaults.topP = args.get<float>("topP");
+    defaults.repetitionPenalty = args.get<float>("repetPen");
+    int defaultNewTokens = args.get<int>("output_len");
+
+    model.setSessionPolicy(args.get<int>("session_ttl"), (size_t)args.get<int>("session_cache_mb") << 20);
+
+    bool promptLookup = model.supportsPromptLookup();
+    bool sessions = model.supportsSessions();
+
+    xft::Scheduler scheduler(model, args.get<int>("max_batch_size"));
+    scheduler.start();
+
+    xft::HttpServer server(args.get<std::string>("host"), args.get<int>("port"), args.get<int>("max_connections"));
+    server.route("GET", "/health", [](const xft::HttpRequest &, xft::HttpResponseWriter &writer) {
+        writer.send(200, "{\"status\":\"ok\"}");
+    });
+    server.route("POST", "/generate", [&](const xft::HttpRequest &req, xft::HttpResponseWriter &writer) {
+        handleGenerate(scheduler, defaults, defaultNewTokens, promptLookup, sessions, req, writer);
+    });
+
+    std::unique_ptr<xft::Tokenizer> tokenizer;
+    std::unique_ptr<xft::OpenAIServer> openai;
+    if (!args.get<std::string>("tokenizer").empty()) {
+        tokenizer.reset(new xft::Tokenizer(args.get<std::string>("tokenizer")));
+        openai.reset(new xft::OpenAIServer(scheduler, *tokenizer, defaults, defaultNewTokens,
+                args.get<std::string>("model_name"), args.get<std::string>("chat_template")));
+        openai->registerRoutes(server);
+    }
+
+    std::cout << "[INFO] Serving " << modelPath << " on " << args.get<std::string>("host") << ":"
+              << args.get<int>("port") << std::endl;
+    server.serve();
+
+    scheduler.stop();
+    return 0;
+}
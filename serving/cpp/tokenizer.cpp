@@ -0,0 +1,489 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "tokenizer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <sstream>
+#include <tuple>
+#include <sys/stat.h>
+
+#include "json.h"
+
+namespace xft {
+static const char *kSpaceMark = "\xe2\x96\x81"; // U+2581, the SentencePiece word boundary
+
+static std::string readFile(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) { return ""; }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static std::string toUtf8(unsigned int cp) {
+    std::string out;
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+// Byte length of the UTF-8 character led by c, 1 for stray continuation bytes
+static int utf8Len(unsigned char c) {
+    if (c < 0x80) { return 1; }
+    if ((c & 0xE0) == 0xC0) { return 2; }
+    if ((c & 0xF0) == 0xE0) { return 3; }
+    if ((c & 0xF8) == 0xF0) { return 4; }
+    return 1;
+}
+
+static unsigned int decodeUtf8(const std::string &s, size_t pos, int len) {
+    unsigned char c = s[pos];
+    if (len == 1) { return c; }
+    unsigned int cp = c & (0x7F >> len);
+    for (int i = 1; i < len && pos + i < s.size(); ++i) {
+        cp = (cp << 6) | (s[pos + i] & 0x3F);
+    }
+    return cp;
+}
+
+// Special token of tokenizer_config.json, either a plain string or {"content": ...}
+static std::string configToken(const JsonValue &v) {
+    return v.isObject() ? v["content"].asString() : v.asString();
+}
+
+Tokenizer::Tokenizer(const std::string &path) : bos(-1), eos(-1), unk(-1) {
+    struct stat st;
+    bool isDir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    std::string dir = isDir ? path : path.substr(0, path.find_last_of('/') + 1);
+    if (!dir.empty() && dir.back() != '/') { dir += '/'; }
+    std::string file = isDir ? dir + "tokenizer.json" : path;
+
+    std::string text = readFile(file);
+    if (text.empty()) {
+        printf("Cannot read tokenizer file %s\n", file.c_str());
+        exit(-1);
+    }
+
+    JsonValue root;
+    try {
+        root = JsonValue::parse(text);
+    } catch (const std::exception &e) {
+        printf("Failed to parse %s: %s\n", file.c_str(), e.what());
+        exit(-1);
+    }
+
+    const JsonValue &model = root["model"];
+    if (model["type"].asString() != "BPE") {
+        printf("Unsupported tokenizer model type \"%s\", only BPE is supported\n", model["type"].asString().c_str());
+        exit(-1);
+    }
+
+    byteLevel = root["pre_tokenizer"].dump().find("ByteLevel") != std::string::npos
+            || root["decoder"].dump().find("ByteLevel") != std::string::npos;
+    addPrefixSpace = !byteLevel && root["normalizer"].dump().find("Prepend") != std::string::npos;
+    byteFallback = model["byte_fallback"].asBool(false);
+
+    for (const auto &kv : model["vocab"].members()) {
+        int id = kv.second.asInt(-1);
+        if (id < 0) { continue; }
+        if (id >= (int)idToToken.size()) { idToToken.resize(id + 1); }
+        idToToken[id] = kv.first;
+        vocab[kv.first] = id;
+    }
+
+    int rank = 0;
+    for (const auto &m : model["merges"].items()) {
+        if (m.isString()) {
+            mergeRanks.emplace(m.asString(), rank++);
+        } else if (m.isArray() && m.size() == 2) {
+            mergeRanks.emplace(m[0].asString() + " " + m[1].asString(), rank++);
+        }
+    }
+
+    for (const auto &t : root["added_tokens"].items()) {
+        int id = t["id"].asInt(-1);
+        std::string content = t["content"].asString();
+        if (id < 0 || content.empty()) { continue; }
+        if (id >= (int)idToToken.size()) { idToToken.resize(id + 1); }
+        idToToken[id] = content;
+        vocab[content] = id;
+        addedTokens.emplace_back(content, id);
+        if (t["special"].asBool(false)) { specialIds.insert(id); }
+    }
+    std::sort(addedTokens.begin(), addedTokens.end(),
+            [](const std::pair<std::string, int> &a, const std::pair<std::string, int> &b) {
+                return a.first.size() > b.first.size();
+            });
+
+    // GPT-2 bytes_to_unicode(): printable bytes stand for themselves, the others are shifted above 255
+    int shift = 0;
+    for (int b = 0; b < 256; ++b) {
+        bool printable = (b >= 33 && b <= 126) || (b >= 161 && b <= 172) || (b >= 174 && b <= 255);
+        byteToUnicode[b] = toUtf8(printable ? b : 256 + shift++);
+        unicodeToByte[byteToUnicode[b]] = (unsigned char)b;
+    }
+
+    if (model.has("unk_token")) { unk = tokenId(model["unk_token"].asString()); }
+
+    // bos/eos come from tokenizer_config.json, otherwise guessed from the usual names
+    std::string bosToken, eosToken;
+    bool addBosToken = false;
+    std::string config = readFile(dir + "tokenizer_config.json");
+    if (!config.empty()) {
+        try {
+            JsonValue cfg = JsonValue::parse(config);
+            bosToken = configToken(cfg["bos_token"]);
+            eosToken = configToken(cfg["eos_token"]);
+            addBosToken = cfg["add_bos_token"].asBool(false);
+        } catch (const std::exception &e) {
+            printf("[Warning] Ignore malformed %stokenizer_config.json: %s\n", dir.c_str(), e.what());
+        }
+    }
+    for (const char *name : {"<s>", "<|begin_of_text|>"}) {
+        if (bosToken.empty() && tokenId(name) >= 0) { bosToken = name; }
+    }
+    for (const char *name : {"</s>", "<|end_of_text|>", "<|endoftext|>"}) {
+        if (eosToken.empty() && tokenId(name) >= 0) { eosToken = name; }
+    }
+    eos = tokenId(eosToken);
+
+    // Only prepend bos when the reference tokenizer does so
+    if (addBosToken || (!bosToken.empty() && root["post_processor"].dump().find(bosToken) != std::string::npos)) {
+        bos = tokenId(bosToken);
+    }
+}
+
+int Tokenizer::tokenId(const std::string &token) const {
+    auto it = vocab.find(token);
+    return it == vocab.end() ? -1 : it->second;
+}
+
+// Character classes of the GPT-2 split regex, non-ASCII is taken as letters except common punctuation/spaces
+enum class CharClass { Letter, Digit, Space, Other };
+
+static CharClass classify(unsigned int cp) {
+    if (cp < 0x80) {
+        if ((cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z')) { return CharClass::Letter; }
+        if (cp >= '0' && cp <= '9') { return CharClass::Digit; }
+        if (cp == ' ' || (cp >= '\t' && cp <= '\r')) { return CharClass::Space; }
+        return CharClass::Other;
+    }
+    if (cp == 0xA0 || cp == 0x3000 || (cp >= 0x2000 && cp <= 0x200A) || cp == 0x2028 || cp == 0x2029) {
+        return CharClass::Space;
+    }
+    if ((cp >= 0xFF10 && cp <= 0xFF19)) { return CharClass::Digit; }
+    if ((cp >= 0xA1 && cp <= 0xBF) || cp == 0xD7 || cp == 0xF7 || (cp >= 0x2010 && cp <= 0x206F)
+            || (cp >= 0x3001 && cp <= 0x303F) || (cp >= 0xFF01 && cp <= 0xFF0F) || (cp >= 0xFF1A && cp <= 0xFF20)
+            || (cp >= 0xFF3B && cp <= 0xFF40) || (cp >= 0xFF5B && cp <= 0xFF65)) {
+        return CharClass::Other;
+    }
+    return CharClass::Letter;
+}
+
+// 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+std::vector<std::string> Tokenizer::preTokenize(const std::string &text) const {
+    std::vector<size_t> starts; // Byte offset of each code point
+    std::vector<CharClass> classes;
+    for (size_t i = 0; i < text.size();) {
+        int len = utf8Len(text[i]);
+        starts.push_back(i);
+        classes.push_back(classify(decodeUtf8(text, i, len)));
+        i += len;
+    }
+    starts.push_back(text.size());
+
+    std::vector<std::string> words;
+    size_t n = classes.size();
+    size_t i = 0;
+    while (i < n) {
+        size_t j = i;
+        size_t b = starts[i];
+
+        if (text[b] == '\'' && i + 1 < n) {
+            static const char *suffixes[] = {"re", "ve", "ll", "s", "t", "m", "d"};
+            for (const char *suf : suffixes) {
+                size_t len = strlen(suf);
+                if (text.compare(b + 1, len, suf) == 0) {
+                    j = i + 1 + len;
+                    break;
+                }
+            }
+        }
+
+        if (j == i) {
+            size_t k = (text[b] == ' ' && i + 1 < n && classes[i + 1] != CharClass::Space) ? i + 1 : i;
+            CharClass c = classes[k];
+            if (c != CharClass::Space) {
+                j = k;
+                while (j < n && classes[j] == c) {
+                    ++j;
+                }
+            } else {
+                // Whitespace run, leave its last char to lead the next word
+                j = i;
+                while (j < n && classes[j] == CharClass::Space) {
+                    ++j;
+                }
+                if (j < n && j - i > 1) { --j; }
+            }
+        }
+
+        words.push_back(text.substr(b, starts[j] - b));
+        i = j;
+    }
+    return words;
+}
+
+// Merge the symbols of one word by rank, lowest rank first
+void Tokenizer::encodeWord(const std::string &word, std::vector<int> &ids) const {
+    auto it = vocab.find(word);
+    if (it != vocab.end()) {
+        ids.push_back(it->second);
+        return;
+    }
+
+    struct Symbol {
+        std::string text;
+        int prev;
+        int next;
+    };
+    std::vector<Symbol> syms;
+    for (size_t i = 0; i < word.size();) {
+        int len = std::min<int>(utf8Len(word[i]), word.size() - i);
+        syms.push_back({word.substr(i, len), (int)syms.size() - 1, (int)syms.size() + 1});
+        i += len;
+    }
+    syms.back().next = -1;
+
+    // (rank, left, right, left length, right length), a symbol only grows, so entries whose lengths changed are stale
+    using Candidate = std::tuple<int, int, int, size_t, size_t>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> heap;
+    auto addPair = [&](int left) {
+        if (left < 0 || syms[left].next < 0) { return; }
+        const Symbol &l = syms[left], &r = syms[l.next];
+        auto m = mergeRanks.find(l.text + " " + r.text);
+        if (m != mergeRanks.end()) { heap.emplace(m->second, left, l.next, l.text.size(), r.text.size()); }
+    };
+    for (int i = 0; i + 1 < (int)syms.size(); ++i) {
+        addPair(i);
+    }
+
+    while (!heap.empty()) {
+        int left, right;
+        size_t leftLen, rightLen;
+        std::tie(std::ignore, left, right, leftLen, rightLen) = heap.top();
+        heap.pop();
+
+        Symbol &l = syms[left];
+        if (l.next != right || l.text.size() != leftLen || syms[right].text.size() != rightLen) { continue; }
+
+        Symbol &r = syms[l.next];
+        l.text += r.text;
+        r.text.clear();
+        l.next = r.next;
+        if (l.next >= 0) { syms[l.next].prev = left; }
+
+        addPair(l.prev);
+        addPair(left);
+    }
+
+    for (int i = 0; i >= 0; i = syms[i].next) {
+        auto v = vocab.find(syms[i].text);
+        if (v != vocab.end()) {
+            ids.push_back(v->second);
+        } else if (byteFallback) {
+            for (unsigned char c : syms[i].text) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "<0x%02X>", c);
+                int id = tokenId(buf);
+                if (id >= 0) { ids.push_back(id); }
+            }
+        } else if (unk >= 0) {
+            ids.push_back(unk);
+        }
+    }
+}
+
+std::vector<int> Tokenizer::encode(const std::string &text, bool addBos) const {
+    std::vector<int> ids;
+    if (addBos && bos >= 0) { ids.push_back(bos); }
+
+    auto encodeSegment = [&](const std::string &seg) {
+        if (seg.empty()) { return; }
+        if (byteLevel) {
+            for (const auto &word : preTokenize(seg)) {
+                std::string mapped;
+                for (unsigned char c : word) {
+                    mapped += byteToUnicode[c];
+                }
+                encodeWord(mapped, ids);
+            }
+        } else {
+            std::string normalized = addPrefixSpace ? kSpaceMark : "";
+            for (char c : seg) {
+                if (c == ' ') {
+                    normalized += kSpaceMark;
+                } else {
+                    normalized += c;
+                }
+            }
+            encodeWord(normalized, ids);
+        }
+    };
+
+    // Added tokens are matched literally and never go through BPE
+    size_t segStart = 0;
+    for (size_t pos = 0; pos < text.size();) {
+        const std::pair<std::string, int> *match = nullptr;
+        for (const auto &t : addedTokens) {
+            if (text.compare(pos, t.first.size(), t.first) == 0) {
+                match = &t;
+                break;
+            }
+        }
+        if (match == nullptr) {
+            ++pos;
+            continue;
+        }
+        encodeSegment(text.substr(segStart, pos - segStart));
+        ids.push_back(match->second);
+        pos += match->first.size();
+        segStart = pos;
+    }
+    encodeSegment(text.substr(segStart));
+
+    return ids;
+}
+
+std::string Tokenizer::tokenBytes(int id, bool skipSpecial) const {
+    if (id < 0 || id >= (int)idToToken.size()) { return ""; }
+    if (specialIds.count(id)) { return skipSpecial ? "" : idToToken[id]; }
+
+    const std::string &token = idToToken[id];
+    std::string out;
+    if (byteLevel) {
+        for (size_t i = 0; i < token.size();) {
+            int len = utf8Len(token[i]);
+            auto it = unicodeToByte.find(token.substr(i, len));
+            if (it != unicodeToByte.end()) {
+                out += (char)it->second;
+            } else {
+                out += token.substr(i, len); // Non-special added token, kept as is
+            }
+            i += len;
+        }
+    } else if (token.size() == 6 && token.compare(0, 3, "<0x") == 0 && token[5] == '>') {
+        out += (char)std::stoi(token.substr(3, 2), nullptr, 16);
+    } else {
+        for (size_t i = 0; i < token.size();) {
+            if (token.compare(i, 3, kSpaceMark) == 0) {
+                out += ' ';
+                i += 3;
+            } else {
+                out += token[i++];
+            }
+        }
+    }
+    return out;
+}
+
+std::string Tokenizer::decode(const std::vector<int> &ids, bool skipSpecial) const {
+    std::string out;
+    for (int id : ids) {
+        out += tokenBytes(id, skipSpecial);
+    }
+    // The space prepended by the normalizer is not part of the text
+    if (addPrefixSpace && !out.empty() && out[0] == ' ') { out.erase(0, 1); }
+    return out;
+}
+
+std::string StreamDecoder::push(int id) {
+    pending += tokenizer.tokenBytes(id);
+
+    // Hold back a trailing UTF-8 character whose bytes have not all arrived
+    size_t cut = pending.size();
+    size_t lead = pending.size();
+    while (lead > 0 && pending.size() - lead < 4 && (pending[lead - 1] & 0xC0) == 0x80) {
+        --lead;
+    }
+    if (lead > 0) {
+        --lead;
+        if (lead + utf8Len(pending[lead]) > pending.size()) { cut = lead; }
+    }
+
+    std::string out = pending.substr(0, cut);
+    pending.erase(0, cut);
+    return out;
+}
+
+std::string StreamDecoder::flush() {
+    std::string out;
+    out.swap(pending);
+    return out;
+}
+
+std::string applyChatTemplate(
+        const std::string &name, const std::vector<std::pair<std::string, std::string>> &messages) {
+    std::string prompt;
+    if (name == "chatml") {
+        for (const auto &m : messages) {
+            prompt += "<|im_start|>" + m.first + "\n" + m.second + "<|im_end|>\n";
+        }
+        prompt += "<|im_start|>assistant\n";
+    } else if (name == "llama2") {
+        std::string system;
+        bool open = false;
+        for (const auto &m : messages) {
+            if (m.first == "system") {
+                system = "<<SYS>>\n" + m.second + "\n<</SYS>>\n\n";
+            } else if (m.first == "user") {
+                prompt += "<s>[INST] " + system + m.second + " [/INST]";
+                system.clear();
+                open = true;
+            } else {
+                prompt += " " + m.second + " </s>";
+                open = false;
+            }
+        }
+        if (!open) { prompt += "<s>[INST] " + system + " [/INST]"; }
+    } else {
+        for (const auto &m : messages) {
+            prompt += m.first + ": " + m.second + "\n";
+        }
+        prompt += "assistant:";
+    }
+    return prompt;
+}
+
+std::vector<std::string> chatStopTokens(const std::string &name) {
+    if (name == "chatml") { return {"<|im_end|>", "<|endoftext|>"}; }
+    if (name == "llama2") { return {"</s>"}; }
+    return {};
+}
+} // namespace xft
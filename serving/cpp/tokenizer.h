@@ -0,0 +1,91 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace xft {
+// BPE tokenizer loaded from a HuggingFace "tokenizer.json", covers the two flavours the supported models use:
+//   - Byte level (GPT-2, OPT, Qwen, Llama-3): bytes are mapped to printable code points before merging.
+//   - SentencePiece style (Llama-2, Baichuan, Mistral): spaces become U+2581, unknown bytes fall back to <0xNN>.
+// Pre-tokenization is a hand-written equivalent of the GPT-2 split regex (contractions, letters, digits,
+// punctuation, spaces), which matches the reference on ordinary text.
+class Tokenizer {
+public:
+    // Exit on failure, path is either the tokenizer.json file or the directory containing it
+    explicit Tokenizer(const std::string &path);
+
+    std::vector<int> encode(const std::string &text, bool addBos = true) const;
+
+    std::string decode(const std::vector<int> &ids, bool skipSpecial = true) const;
+
+    // Raw bytes of one token, special tokens give an empty string when skipped
+    std::string tokenBytes(int id, bool skipSpecial = true) const;
+
+    // Id of a token string, -1 if not in the vocabulary
+    int tokenId(const std::string &token) const;
+
+    int bosId() const { return bos; }
+    int eosId() const { return eos; }
+    int vocabSize() const { return (int)idToToken.size(); }
+
+private:
+    void encodeWord(const std::string &word, std::vector<int> &ids) const;
+    std::vector<std::string> preTokenize(const std::string &text) const;
+
+    bool byteLevel; // Otherwise SentencePiece style
+    bool addPrefixSpace; // SentencePiece: prepend U+2581 to the text
+    bool byteFallback;
+    int bos;
+    int eos;
+    int unk;
+
+    std::unordered_map<std::string, int> vocab;
+    std::vector<std::string> idToToken;
+    std::unordered_map<std::string, int> mergeRanks; // key: "left right"
+    std::vector<std::pair<std::string, int>> addedTokens; // Matched literally before BPE, longest first
+    std::unordered_set<int> specialIds;
+    std::string byteToUnicode[256];
+    std::unordered_map<std::string, unsigned char> unicodeToByte;
+};
+
+// Turn generated tokens into text as they come, without splitting a UTF-8 character across two chunks.
+class StreamDecoder {
+public:
+    explicit StreamDecoder(const Tokenizer &tokenizer) : tokenizer(tokenizer) {}
+
+    // Return the text which becomes complete after this token, may be empty
+    std::string push(int id);
+
+    // Whatever is left, invalid bytes included
+    std::string flush();
+
+private:
+    const Tokenizer &tokenizer;
+    std::string pending;
+};
+
+// Build a prompt from chat messages (role, content), ended by the opening of the assistant turn.
+// Supported templates: "chatml" (Qwen, Yi), "llama2", "plain" ("role: content" lines).
+std::string applyChatTemplate(
+        const std::string &name, const std::vector<std::pair<std::string, std::string>> &messages);
+
+// Token strings which end an assistant turn in the given template, besides eos
+std::vector<std::string> chatStopTokens(const std::string &name);
+} // namespace xft
@@ -18,6 +18,37 @@
 
 static ccl::communicator *pcomm;
 
+// For the hierarchical reduction when ranks are on multiple hosts, see initHierarchy
+static MPI_Comm rowComm = MPI_COMM_NULL;
+static MPI_Comm localComm = MPI_COMM_NULL;
+static ccl::communicator *pLeaderComm = nullptr;
+
+// All ranks in comm build a oneCCL communicator, the address of the main KVS is broadcasted by MPI
+static ccl::communicator *createCommunicator(MPI_Comm comm) {
+    int commSize, commRank;
+    MPI_Comm_size(comm, &commSize);
+    MPI_Comm_rank(comm, &commRank);
+
+    ccl::shared_ptr_class<ccl::kvs> kvs;
+    ccl::kvs::address_type mainAddr;
+
+    if (commRank == 0) {
+        kvs = ccl::create_main_kvs();
+        mainAddr = kvs->get_address();
+        MPI_Bcast((void *)mainAddr.data(), mainAddr.size(), MPI_BYTE, 0, comm);
+    } else {
+        MPI_Bcast((void *)mainAddr.data(), mainAddr.size(), MPI_BYTE, 0, comm);
+        kvs = ccl::create_kvs(mainAddr);
+    }
+
+    return new ccl::communicator(ccl::create_communicator(commSize, commRank, kvs));
+}
+
+static int hostRanks() {
+    const char *env = std::getenv("XFT_COMM_HOST_RANKS");
+    return env != nullptr ? atoi(env) : 0;
+}
+
 // world_color is initialized to pipeline_parallel_stages_num(pp_size)
 // and will be re-assign to world_color of MPI == ppRank
 extern "C" int init(int *world_size, int *world_rank, int *world_color) {
@@ -34,26 +65,9 @@ extern "C" int init(int *world_size, int *world_rank, int *world_color) {
     //                    4, 5,                             2, 2,               0, 1;
     //                    6, 7;                             3, 3;               0, 1;
     *world_color = *world_rank / (*world_size / *world_color);
-    MPI_Comm row_comm;
-    MPI_Comm_split(MPI_COMM_WORLD, *world_color, *world_rank, &row_comm);
-
-    int row_size, row_rank;
-    MPI_Comm_size(row_comm, &row_size);
-    MPI_Comm_rank(row_comm, &row_rank);
+    MPI_Comm_split(MPI_COMM_WORLD, *world_color, *world_rank, &rowComm);
 
-    ccl::shared_ptr_class<ccl::kvs> kvs;
-    ccl::kvs::address_type mainAddr;
-
-    if (row_rank == 0) {
-        kvs = ccl::create_main_kvs();
-        mainAddr = kvs->get_address();
-        MPI_Bcast((void *)mainAddr.data(), mainAddr.size(), MPI_BYTE, 0, row_comm);
-    } else {
-        MPI_Bcast((void *)mainAddr.data(), mainAddr.size(), MPI_BYTE, 0, row_comm);
-        kvs = ccl::create_kvs(mainAddr);
-    }
-
-    pcomm = new ccl::communicator(ccl::create_communicator(row_size, row_rank, kvs));
+    pcomm = createCommunicator(rowComm);
 
     *world_size = pcomm->size();
     *world_rank = pcomm->rank();
@@ -63,10 +77,10 @@ extern "C" int init(int *world_size, int *world_rank, int *world_color) {
     char all_hostnames[MPI_MAX_PROCESSOR_NAME * MPI_MAX_PROCESSOR_NAME];
     int hostnameLen;
 
-    // Check ranks are on the same physical machine
+    // Check ranks of the row are on the same physical machine
     MPI_Get_processor_name(myHostname, &hostnameLen);
     MPI_Allgather(myHostname, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, all_hostnames, MPI_MAX_PROCESSOR_NAME, MPI_CHAR,
-            MPI_COMM_WORLD);
+            rowComm);
 
     int sameHostnames = 1;
     for (int i = 1; i < *world_size; i++) {
@@ -75,6 +89,10 @@ extern "C" int init(int *world_size, int *world_rank, int *world_color) {
             break;
         }
     }
+
+    // Ranks taken as on hosts of XFT_COMM_HOST_RANKS ranks, to run the hierarchical reduction on one host (see
+    // initHierarchy), like for testing
+    if (hostRanks() > 0 && hostRanks() < *world_size) { sameHostnames = 0; }
     return sameHostnames;
 #endif
     return 0;
@@ -86,8 +104,39 @@ extern "C" void mpiFinalize() {
     if (!isFinalized) { MPI_Finalize(); }
 }
 
+// Split ranks of the row (tensor parallel ranks) by hosts. The last rank of each host is the leader, which joins the
+// communicator among leaders to reduce across hosts. Collective in the row.
+// blocked: whether ranks of each host are consecutive in the row and all hosts have the same number of ranks
+extern "C" void initHierarchy(int *local_rank, int *local_size, int *blocked) {
+    int rowRank;
+    MPI_Comm_rank(rowComm, &rowRank);
+    if (hostRanks() > 0) {
+        MPI_Comm_split(rowComm, rowRank / hostRanks(), rowRank, &localComm);
+    } else {
+        MPI_Comm_split_type(rowComm, MPI_COMM_TYPE_SHARED, rowRank, MPI_INFO_NULL, &localComm);
+    }
+    MPI_Comm_size(localComm, local_size);
+    MPI_Comm_rank(localComm, local_rank);
+
+    int hostFirst; // Ranks of the host are consecutive if each one is its local rank after the first one
+    MPI_Allreduce(&rowRank, &hostFirst, 1, MPI_INT, MPI_MIN, localComm);
+    int mine[3] = {rowRank - *local_rank == hostFirst, *local_size, -*local_size};
+    int mins[3];
+    MPI_Allreduce(mine, mins, 3, MPI_INT, MPI_MIN, rowComm);
+    *blocked = mins[0] && mins[1] == -mins[2];
+
+    bool isLeader = (*local_rank == *local_size - 1);
+    MPI_Comm leaderComm;
+    MPI_Comm_split(rowComm, isLeader ? 0 : MPI_UNDEFINED, rowRank, &leaderComm);
+    if (isLeader) {
+        pLeaderComm = createCommunicator(leaderComm);
+        MPI_Comm_free(&leaderComm);
+    }
+}
+
 extern "C" void freePCOMM() {
     delete pcomm;
+    delete pLeaderComm;
 }
 
 extern "C" void allreduce(float *sendBuf, float *recvBuf, size_t count) {
@@ -102,6 +151,30 @@ extern "C" void broadcast(int *buf, size_t count) {
     ccl::broadcast(buf, count, 0, *pcomm).wait(); // assume always broadcast from master (rank 0)
 }
 
+// Only called by leaders of hosts
+extern "C" void leaderAllreduce(float *sendBuf, float *recvBuf, size_t count) {
+    ccl::allreduce(sendBuf, recvBuf, count, ccl::reduction::sum, *pLeaderComm).wait();
+}
+
+extern "C" void leaderAllreduceBF16(void *sendBuf, void *recvBuf, size_t count) {
+    ccl::allreduce(sendBuf, recvBuf, count, ccl::datatype::bfloat16, ccl::reduction::sum, *pLeaderComm).wait();
+}
+
+// Leader of host h gets the sum of elements [h * recvCount, (h + 1) * recvCount) of all hosts
+extern "C" void leaderReduceScatter(float *sendBuf, float *recvBuf, size_t recvCount) {
+    ccl::reduce_scatter(sendBuf, recvBuf, recvCount, ccl::reduction::sum, *pLeaderComm).wait();
+}
+
+// Broadcast from the first rank of the host
+extern "C" void localBroadcast(int *buf, size_t count) {
+    MPI_Bcast(buf, count, MPI_INT, 0, localComm);
+}
+
+// recvBuf gets count elements of the sum, the slice of this rank
+extern "C" void reduceScatter(float *sendBuf, float *recvBuf, size_t count) {
+    ccl::reduce_scatter(sendBuf, recvBuf, count, ccl::reduction::sum, *pcomm).wait();
+}
+
 extern "C" void allgatherv(
         const float *sendBuf, size_t count, float *recvBuf, const std::vector<long unsigned int> &recvCounts) {
     ccl::allgatherv(sendBuf, count, recvBuf, recvCounts, *pcomm).wait();
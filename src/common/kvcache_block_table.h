@@ -0,0 +1,229 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * Block table of the KV cache, which lets beams share cached keys/values in a copy-on-write manner.
+ * The sequence dimension is divided into blocks of kBlockSize tokens. Block k of a sample (beam) is stored in the
+ * block k of a physical slot (sample position) of KVCacheTensor, several beams may refer to the same physical block.
+ *          block0  block1  block2
+ * beam0 -> slot0   slot0   slot0
+ * beam1 -> slot0   slot2   slot1
+ * beam2 -> slot0   slot2   slot2
+ * Thus the prompt is stored once for all the beams of a sample, and reordering beams only updates the table.
+ * Before appending to a shared block, the block is copied (only the newest block, see own()).
+ * The table is identity (beam b is stored in slot b) after reset, which is how the cache is used without beams.
+ */
+class KVBlockTable {
+public:
+    static constexpr int kBlockSize = 64;
+
+    KVBlockTable() : batchSize(0), blocks(0), identity(true) {}
+
+    void reset(int maxSeqLen, int batchSize) {
+        this->batchSize = batchSize;
+        this->blocks = (maxSeqLen + kBlockSize - 1) / kBlockSize;
+        this->identity = true;
+
+        slots.resize((size_t)batchSize * blocks);
+        refs.resize((size_t)blocks * batchSize);
+        for (int b = 0; b < batchSize; ++b) {
+            std::fill(slots.begin() + (size_t)b * blocks, slots.begin() + (size_t)(b + 1) * blocks, b);
+        }
+        std::fill(refs.begin(), refs.end(), 1);
+    }
+
+    bool isIdentity() const { return identity; }
+
+    // Physical slot storing the token seqIdx of sample batchIdx
+    int getSlot(int batchIdx, int seqIdx) const {
+        if (identity) { return batchIdx; }
+        return slots[(size_t)batchIdx * blocks + seqIdx / kBlockSize];
+    }
+
+    // How many tokens from seqIdx (until maxSeqLen) are stored in the same slot, thus can be accessed with one stride
+    int getRunLength(int batchIdx, int seqIdx, int maxSeqLen) const {
+        if (identity) { return maxSeqLen - seqIdx; }
+        const int *row = &slots[(size_t)batchIdx * blocks];
+        int k = seqIdx / kBlockSize;
+        int end = k + 1;
+        while (end < blocks && row[end] == row[k]) {
+            ++end;
+        }
+        return std::min(end * kBlockSize, maxSeqLen) - seqIdx;
+    }
+
+    /**
+     * Let beams of a sample refer to the first seqLen tokens of the sample, instead of copying them
+     * Only the unique samples are computed at the first step, sample i is stored in slot i
+     */
+    void share(int userSideBS, int beamSize, int seqLen) {
+        int usedBlocks = (seqLen + kBlockSize - 1) / kBlockSize;
+        for (int b = 0; b < batchSize; ++b) {
+            for (int k = 0; k < usedBlocks; ++k) {
+                slots[(size_t)b * blocks + k] = b / beamSize;
+            }
+        }
+        updateRefs(usedBlocks);
+    }
+
+    /**
+     * Beam b continues the history of beam idx[b], for the first seqLen tokens
+     * Blocks after seqLen are not touched, they are always owned by the beam itself (identity)
+     */
+    void reorder(const int *idx, int seqLen) {
+        int usedBlocks = (seqLen + kBlockSize - 1) / kBlockSize;
+        std::vector<int> oldSlots(slots.begin(), slots.end());
+        for (int b = 0; b < batchSize; ++b) {
+            auto src = oldSlots.begin() + (size_t)idx[b] * blocks;
+            std::copy(src, src + usedBlocks, slots.begin() + (size_t)b * blocks);
+        }
+        updateRefs(usedBlocks);
+    }
+
+    /**
+     * Make each beam the only owner of the block containing seqIdx, which is going to be appended
+     * Return the physical copies needed for the block, as (srcSlot, dstSlot)
+     * The beam already stored in its own slot keeps the shared block, others are moved into free slots
+     */
+    std::vector<std::pair<int, int>> own(int seqIdx) {
+        std::vector<std::pair<int, int>> copies;
+        int k = seqIdx / kBlockSize;
+        if (identity || k >= blocks) { return copies; }
+
+        std::vector<int> owner(batchSize, -1);
+        for (int b = 0; b < batchSize; ++b) {
+            if (slot(b, k) == b) { owner[b] = b; }
+        }
+        for (int b = 0; b < batchSize; ++b) {
+            if (owner[slot(b, k)] == -1) { owner[slot(b, k)] = b; }
+        }
+
+        // Free slots of the block, refs of all slots in a block sum to batchSize, thus always enough
+        std::vector<int> freeSlots;
+        for (int s = batchSize - 1; s >= 0; --s) {
+            if (ref(k, s) == 0) { freeSlots.push_back(s); }
+        }
+
+        for (int b = 0; b < batchSize; ++b) {
+            int src = slot(b, k);
+            if (owner[src] == b) { continue; }
+
+            // Prefer the beam's own slot, to keep the table close to identity
+            auto it = std::find(freeSlots.begin(), freeSlots.end(), b);
+            if (it == freeSlots.end()) { it = freeSlots.end() - 1; }
+            int dst = *it;
+            freeSlots.erase(it);
+
+            copies.push_back(std::make_pair(src, dst));
+            slot(b, k) = dst;
+            ref(k, src) -= 1;
+            ref(k, dst) = 1;
+        }
+
+        checkIdentity();
+        return copies;
+    }
+
+    /**
+     * Only keep the beams listed in idx (in ascending order), the table is updated for the new batch size
+     * Return the kept physical slots (in ascending order) of each block in [0, seqLen), which are to be squeezed to
+     * the front of the block, see KVCacheTensor::squeezeSequence
+     */
+    std::vector<std::vector<int>> squeeze(const int *idx, int size, int seqLen) {
+        int usedBlocks = (seqLen + kBlockSize - 1) / kBlockSize;
+        std::vector<std::vector<int>> kept(usedBlocks);
+        std::vector<int> newSlots((size_t)size * blocks);
+
+        for (int k = 0; k < usedBlocks; ++k) {
+            std::vector<int> pos(batchSize, -1);
+            for (int i = 0; i < size; ++i) {
+                int s = slot(idx[i], k);
+                if (pos[s] == -1) {
+                    pos[s] = 0;
+                    kept[k].push_back(s);
+                }
+            }
+            std::sort(kept[k].begin(), kept[k].end());
+            for (int j = 0; j < (int)kept[k].size(); ++j) {
+                pos[kept[k][j]] = j;
+            }
+            for (int i = 0; i < size; ++i) {
+                newSlots[(size_t)i * blocks + k] = pos[slot(idx[i], k)];
+            }
+        }
+        for (int i = 0; i < size; ++i) {
+            std::fill(newSlots.begin() + (size_t)i * blocks + usedBlocks, newSlots.begin() + (size_t)(i + 1) * blocks,
+                    i);
+        }
+
+        slots.swap(newSlots);
+        batchSize = size;
+        refs.resize((size_t)blocks * batchSize);
+        std::fill(refs.begin(), refs.end(), 1);
+        updateRefs(usedBlocks);
+
+        return kept;
+    }
+
+    /**
+     * Append samples after the existing ones, the new samples own all their blocks (stored in their own slots)
+     */
+    void grow(int size) {
+        slots.resize((size_t)size * blocks);
+        for (int b = batchSize; b < size; ++b) {
+            std::fill(slots.begin() + (size_t)b * blocks, slots.begin() + (size_t)(b + 1) * blocks, b);
+        }
+        batchSize = size;
+        refs.resize((size_t)blocks * batchSize);
+        updateRefs(blocks);
+    }
+
+private:
+    int &slot(int b, int k) { return slots[(size_t)b * blocks + k]; }
+    int &ref(int k, int s) { return refs[(size_t)k * batchSize + s]; }
+
+    void updateRefs(int usedBlocks) {
+        std::fill(refs.begin(), refs.begin() + (size_t)usedBlocks * batchSize, 0);
+        for (int b = 0; b < batchSize; ++b) {
+            for (int k = 0; k < usedBlocks; ++k) {
+                ref(k, slot(b, k)) += 1;
+            }
+        }
+        checkIdentity();
+    }
+
+    void checkIdentity() {
+        identity = true;
+        for (int b = 0; b < batchSize && identity; ++b) {
+            for (int k = 0; k < blocks; ++k) {
+                if (slot(b, k) != b) {
+                    identity = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    int batchSize;
+    int blocks;
+    bool identity;
+    std::vector<int> slots; // [batchSize][blocks], physical slot of each block of each beam
+    std::vector<int> refs; // [blocks][batchSize], how many beams refer to each physical block
+};
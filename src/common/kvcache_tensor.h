@@ -13,11 +13,58 @@
 // limitations under the License.
 // ============================================================================
 #pragma once
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <utility>
+#include <vector>
+#include "kvcache_block_table.h"
+
+// Layout policies of KVCacheTensor, offset of the vector of (seq, batch, head)
+// [seq_length][batch_size][head_num][head_size]: appending a token writes one contiguous row of all samples
+struct KVLayoutSeqMajor {
+    static constexpr bool headMajor = false;
+
+    static uint64_t offset(int seqIdx, int batchIdx, int headIdx, int maxSeqLen, int batchSize, int headNum,
+            int headSize) {
+        return ((uint64_t)seqIdx * batchSize + batchIdx) * (headNum * headSize) + headIdx * headSize;
+    }
+
+    // Distance between 2 adjacent sequences of a head
+    static int seqStride(int maxSeqLen, int batchSize, int headNum, int headSize) {
+        return batchSize * headNum * headSize;
+    }
+
+    // Distance between the same vector of 2 adjacent samples
+    static uint64_t batchStride(int maxSeqLen, int batchSize, int headNum, int headSize) {
+        return (uint64_t)headNum * headSize;
+    }
+};
+
+// [batch_size][head_num][seq_length][head_size]: a head is a contiguous stream, which is friendly to prefetch
+struct KVLayoutHeadMajor {
+    static constexpr bool headMajor = true;
+
+    static uint64_t offset(int seqIdx, int batchIdx, int headIdx, int maxSeqLen, int batchSize, int headNum,
+            int headSize) {
+        return (((uint64_t)batchIdx * headNum + headIdx) * maxSeqLen + seqIdx) * headSize;
+    }
+
+    static int seqStride(int maxSeqLen, int batchSize, int headNum, int headSize) { return headSize; }
+
+    static uint64_t batchStride(int maxSeqLen, int batchSize, int headNum, int headSize) {
+        return (uint64_t)headNum * maxSeqLen * headSize;
+    }
+};
+
+// Selected per deployment (cmake -DWITH_KV_HEAD_MAJOR=ON)
+#ifdef KV_CACHE_HEAD_MAJOR
+using KVLayoutDefault = KVLayoutHeadMajor;
+#else
+using KVLayoutDefault = KVLayoutSeqMajor;
+#endif
 
 /**
  * Tensor specially designed for KV Cache
@@ -30,7 +77,7 @@
  *  ...   |       |       |       |  ...  |       |       |       |
  *        |       |       |       |  ...  |       |       |       |
  *        `````````````````````````````````````````````````````````
- * For better performance, it can be represented as [batch_size][head_num][seq_length][head_size]
+ * For better performance, it can be represented as [batch_size][head_num][seq_length][head_size] (KVLayoutHeadMajor)
  *        __________________
  *        |       |       ^
  *        |       |       |
@@ -54,11 +101,21 @@
  * Note: The batch size in KVCache can be larger than the batch size in model inference (when beam size > 1)
  * The batch size of model inference is smaller to save the computing
  * The batch size of KV Cache is larger to make the KV cache expanding easier
+ * Note: for head major layout, the data is only valid for the maxSeqLen passed to resize
+ * Note: with a block table (beam search), sample b is not always stored in the position b, see KVBlockTable
 */
-template <typename T>
+template <typename T, typename Layout = KVLayoutDefault>
 class KVCacheTensor {
 public:
-    KVCacheTensor() : maxSeqLen(0), batchSize(0), headNum(0), headSize(0), data(nullptr), allocSize(0) {}
+    KVCacheTensor()
+        : maxSeqLen(0)
+        , batchSize(0)
+        , headNum(0)
+        , headSize(0)
+        , data(nullptr)
+        , allocSize(0)
+        , blockTable(nullptr)
+        , batchOffset(0) {}
 
     ~KVCacheTensor() {
         if (this->data) { free(this->data); }
@@ -82,21 +139,78 @@ public:
         }
     }
 
+    int getMaxSeqLen() const { return maxSeqLen; }
     int getBatchSize() const { return batchSize; }
     int getHeadNum() const { return headNum; }
     int getHeadSize() const { return headSize; }
 
     T *getData() { return data; }
 
+    // Block table shared by all the key/value tensors of a KVCacheManager, nullptr means sample b is in slot b
+    void setBlockTable(const KVBlockTable *table) { this->blockTable = table; }
+
+    // Samples from offset are seen as samples from 0, like when a micro-batch of pipeline parallel is computed
+    void setBatchOffset(int offset) { this->batchOffset = offset; }
+
     // Get a vector for a specified sequence
     T *getSequence(int seqIdx, int batchIdx, int headIdx) {
-        return data + (seqIdx * batchSize + batchIdx) * (headNum * headSize) + headIdx * headSize;
+        batchIdx += batchOffset;
+        if (blockTable && !blockTable->isIdentity()) { batchIdx = blockTable->getSlot(batchIdx, seqIdx); }
+        return getSlotSequence(seqIdx, batchIdx, headIdx);
+    }
+
+    // Get a vector by the physical slot, regardless of the block table
+    T *getSlotSequence(int seqIdx, int slotIdx, int headIdx) {
+        return data + Layout::offset(seqIdx, slotIdx, headIdx, maxSeqLen, batchSize, headNum, headSize);
     }
 
     // Get a head matrix, return the start address and the stride
+    // Only valid for the first getRunLength(batchIdx, 0) sequences when the table is not identity
     std::pair<T *, int> getHead(int batchIdx, int headIdx) {
-        T *addr = data + batchIdx * headNum * headSize + headIdx * headSize;
-        return std::make_pair(addr, batchSize * headNum * headSize);
+        T *addr = getSequence(0, batchIdx, headIdx);
+        return std::make_pair(addr, getSeqStride());
+    }
+
+    int getSeqStride() const { return Layout::seqStride(maxSeqLen, batchSize, headNum, headSize); }
+
+    // How many sequences from seqIdx are stored contiguously (with the stride of getSeqStride)
+    int getRunLength(int batchIdx, int seqIdx) const {
+        if (blockTable) { return blockTable->getRunLength(batchIdx + batchOffset, seqIdx, maxSeqLen); }
+        return maxSeqLen - seqIdx;
+    }
+
+    uint64_t getBatchStride() const { return Layout::batchStride(maxSeqLen, batchSize, headNum, headSize); }
+
+    // Copy all heads of sequence srcSeq of sample srcBatch in src to sequence seqIdx of sample batchIdx
+    void copySequence(int seqIdx, int batchIdx, KVCacheTensor &src, int srcSeq, int srcBatch) {
+        if constexpr (Layout::headMajor) {
+            for (int h = 0; h < headNum; ++h) {
+                memcpy(getSequence(seqIdx, batchIdx, h), src.getSequence(srcSeq, srcBatch, h), headSize * sizeof(T));
+            }
+        } else {
+            memcpy(getSequence(seqIdx, batchIdx, 0), src.getSequence(srcSeq, srcBatch, 0),
+                    headNum * headSize * sizeof(T));
+        }
+    }
+
+    // Copy sequences [startSeq, startSeq + seqLen) of a sample to a packed [seqLen][head_num][head_size] buffer, or
+    // sequences [0, seqLen) from it
+    void saveSample(int batchIdx, int startSeq, int seqLen, T *buf) {
+        for (int seq = 0; seq < seqLen; ++seq) {
+            for (int h = 0; h < headNum; ++h) {
+                memcpy(buf + ((uint64_t)seq * headNum + h) * headSize, getSequence(startSeq + seq, batchIdx, h),
+                        headSize * sizeof(T));
+            }
+        }
+    }
+
+    void loadSample(int batchIdx, int seqLen, const T *buf) {
+        for (int seq = 0; seq < seqLen; ++seq) {
+            for (int h = 0; h < headNum; ++h) {
+                memcpy(getSequence(seq, batchIdx, h), buf + ((uint64_t)seq * headNum + h) * headSize,
+                        headSize * sizeof(T));
+            }
+        }
     }
 
     /**
@@ -120,34 +234,129 @@ public:
 
 #pragma omp parallel for
         for (int seq = 0; seq < seqLen; ++seq) {
-            for (int b = batchSize - 1; b > 0; --b) {
-                T *dst = getSequence(seq, b, 0);
-                T *src = getSequence(seq, b / beamSize, 0);
-                memcpy(dst, src, headNum * headSize * sizeof(T));
-            }
+            expandOneSequence(userSideBS, beamSize, seq);
         }
     }
 
     void expandOneSequence(int userSideBS, int beamSize, int seq) {
         for (int b = batchSize - 1; b > 0; --b) {
-            T *dst = getSequence(seq, b, 0);
-            T *src = getSequence(seq, b / beamSize, 0);
-            memcpy(dst, src, headNum * headSize * sizeof(T));
+            copySequence(seq, b, *this, seq, b / beamSize);
+        }
+    }
+
+    /**
+     * Only keep the samples listed in idx (in ascending order), and squeeze them to the front.
+     * It is needed when some samples are finished or cancelled, to stop computing on them.
+     * For example, when idx = {0, 2}, it will squeeze:
+     *  _______________________________
+     * |  bs0  |  bs1  |  bs2  |  bs3  |
+     *  ```````````````````````````````
+     * to
+     *  _______________
+     * |  bs0  |  bs2  |
+     *  ```````````````
+     * Data is moved in place (destination is never after the source), thus must be done in order.
+    */
+    void squeezeSequence(const int *idx, int size, int seqLen) {
+        const int newBatchSize = size;
+        const int rowSize = headNum * headSize;
+
+        if constexpr (Layout::headMajor) {
+            // Samples do not depend on the batch size, thus move heads of kept samples forward
+            for (int b = 0; b < newBatchSize; ++b) {
+                if (idx[b] == b) { continue; }
+                for (int h = 0; h < headNum; ++h) {
+                    memmove(getSlotSequence(0, b, h), getSlotSequence(0, idx[b], h),
+                            (uint64_t)seqLen * headSize * sizeof(T));
+                }
+            }
+            this->batchSize = newBatchSize;
+            return;
+        }
+
+        for (int seq = 0; seq < seqLen; ++seq) {
+            for (int b = 0; b < newBatchSize; ++b) {
+                T *dst = data + ((uint64_t)seq * newBatchSize + b) * rowSize;
+                T *src = data + ((uint64_t)seq * batchSize + idx[b]) * rowSize;
+                if (dst != src) { memmove(dst, src, rowSize * sizeof(T)); }
+            }
+        }
+
+        this->batchSize = newBatchSize;
+    }
+
+    /**
+     * Like above, but the kept samples are different among the blocks of blockSize tokens (see KVBlockTable::squeeze)
+     * idx[k]: the kept slots of block k in ascending order, squeezed to the front of the block
+     * size: new batch size
+    */
+    void squeezeSequence(const std::vector<std::vector<int>> &idx, int blockSize, int size, int seqLen) {
+        const int newBatchSize = size;
+        const int rowSize = headNum * headSize;
+
+        for (int startSeq = 0; startSeq < seqLen; startSeq += blockSize) {
+            const int endSeq = std::min(startSeq + blockSize, seqLen);
+            const std::vector<int> &kept = idx[startSeq / blockSize];
+
+            if constexpr (Layout::headMajor) {
+                for (int j = 0; j < (int)kept.size(); ++j) {
+                    if (kept[j] == j) { continue; }
+                    for (int h = 0; h < headNum; ++h) {
+                        memmove(getSlotSequence(startSeq, j, h), getSlotSequence(startSeq, kept[j], h),
+                                (uint64_t)(endSeq - startSeq) * headSize * sizeof(T));
+                    }
+                }
+            } else {
+                for (int seq = startSeq; seq < endSeq; ++seq) {
+                    for (int j = 0; j < (int)kept.size(); ++j) {
+                        T *dst = data + ((uint64_t)seq * newBatchSize + j) * rowSize;
+                        T *src = data + ((uint64_t)seq * batchSize + kept[j]) * rowSize;
+                        if (dst != src) { memmove(dst, src, rowSize * sizeof(T)); }
+                    }
+                }
+            }
         }
+
+        this->batchSize = newBatchSize;
     }
 
-    // Below implementation could be a little faster (100.6 vs. 100.9), but also need to modify expand and reorder function
+    /**
+     * Append samples after the existing ones (like requests joining a running batch), sequences [0, seqLen) of the
+     * existing samples are kept, the new samples are not initialized.
+     * The buffer is reallocated if not big enough, otherwise the data is moved in place (for the sequence major layout,
+     * from the last sequence as the destination is never before the source).
+    */
+    void growBatch(int size, int seqLen) {
+        const int oldBatchSize = batchSize;
+        const uint64_t rowSize = (uint64_t)headNum * headSize;
+
+        T *src = data;
+        uint64_t requiredSize = (uint64_t)maxSeqLen * size * rowSize;
+        if (requiredSize > allocSize) {
+            data = (T *)aligned_alloc(1024, requiredSize * sizeof(T));
+            if (!data) {
+                printf("Failed to alloc mem for KV Cache [%d][%d][%d][%d].\n", maxSeqLen, size, headNum, headSize);
+                exit(-1);
+            }
+            allocSize = requiredSize;
+        }
 
-    // // Get a vector for a specified sequence
-    // T *getSequence(int seqIdx, int batchIdx, int headIdx) {
-    //     return data + batchIdx * headNum * maxSeqLen * headSize + headIdx * maxSeqLen * headSize + seqIdx * headSize;
-    // }
+        if constexpr (Layout::headMajor) {
+            // Samples do not depend on the batch size
+            if (src != data) { memcpy(data, src, oldBatchSize * maxSeqLen * rowSize * sizeof(T)); }
+        } else {
+            for (int seq = seqLen - 1; seq >= 0; --seq) {
+                for (int b = oldBatchSize - 1; b >= 0; --b) {
+                    T *dst = data + ((uint64_t)seq * size + b) * rowSize;
+                    T *from = src + ((uint64_t)seq * oldBatchSize + b) * rowSize;
+                    if (dst != from) { memmove(dst, from, rowSize * sizeof(T)); }
+                }
+            }
+        }
 
-    // // Get a head matrix, return the start address and the stride
-    // std::pair<T *, int> getHead(int batchIdx, int headIdx) {
-    //     T *addr = data + batchIdx * headNum * maxSeqLen * headSize + headIdx * maxSeqLen * headSize;
-    //     return std::make_pair(addr, headSize);
-    // }
+        if (src != data) { free(src); }
+        this->batchSize = size;
+    }
 
 private:
     int maxSeqLen;
@@ -157,4 +366,7 @@ private:
 
     T *data;
     uint64_t allocSize;
+
+    const KVBlockTable *blockTable;
+    int batchOffset;
 };
\ No newline at end of file
@@ -46,6 +46,36 @@ public:
         , betaSlow(vbetaSlow) {}
 };
 
+// Describes the attention mask, so that attention kernels can generate it on the fly instead of reading a
+// (bs, 1, queryLen, keyLen) float mask. Only models needing arbitrary patterns materialize a dense mask.
+struct AttnMaskDesc {
+    enum Type { DENSE, CAUSAL, PREFIX_LM };
+    Type type = DENSE;
+    // PREFIX_LM only: the first prefixLens[b] tokens of sample b attend to each other bidirectionally
+    const int *prefixLens = nullptr;
+    // ALiBi slopes of the responsible heads, if not nullptr, slope[h] * (j - i) is added to the score of query i
+    // (absolute position) and key j
+    const float *alibiSlopes = nullptr;
+    // Left padding, if not nullptr, the first padLens[b] tokens of sample b are hidden from the others, a padding token
+    // only sees itself (to keep its output finite). Keys of the padding may be never computed, thus never read
+    const int *padLens = nullptr;
+
+    // How many keys (counted from the first one) query qIdx of the current input can see, non-decreasing in qIdx
+    int visibleKeys(int b, int qIdx, int pastSeqLen) const {
+        if (type == PREFIX_LM && prefixLens[b] > qIdx + 1) { return pastSeqLen + prefixLens[b]; }
+        return pastSeqLen + qIdx + 1;
+    }
+
+    // The first key query qIdx of the current input can see, non-decreasing in qIdx
+    int firstKey(int b, int qIdx, int pastSeqLen) const {
+        if (padLens == nullptr) { return 0; }
+        return padLens[b] < pastSeqLen + qIdx ? padLens[b] : pastSeqLen + qIdx;
+    }
+
+    // Kernels only knowing the causal mask (e.g. selfAttentionBF16) are valid just for this
+    bool isPlainCausal() const { return type == CAUSAL && alibiSlopes == nullptr && padLens == nullptr; }
+};
+
 class MMHelper;
 
 struct DecoderContext {
@@ -93,6 +123,9 @@ struct DecoderContext {
     int tpSize = 1; // tensor parallel size
     int tpRank = 0; // tensor parallel rank
 
+    // Sequence parallel: layers get the normalized input and skip the residual, both done by the caller on its rows
+    bool seqParallel = false;
+
     enum ActivationType { RELU, GELU, SWIGLU, SILU };
     ActivationType actType;
 
@@ -101,6 +134,9 @@ struct DecoderContext {
 
     float *qkScores; // attention score
 
+    // Used by attention when no dense mask is passed, set by the model in prepareAttnMask
+    AttnMaskDesc maskDesc;
+
     // Please look into the comments in resize function to see how buffers are arranged
     hpj::Matrix<float> normBuf; // buf for the first layer norm
     hpj::Matrix<float> tmpBuf; // tmp buffer, same size as output
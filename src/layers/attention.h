@@ -190,6 +190,7 @@ public:
      * - imBuf: (bs * seq_len) x hidden_size (intermediate buffer)
      * - output: (bs * seq_len) x hidden_size (output buffer)
      * - attnMask: (bs, 1, tgt_len, src_len) (tgt_len is the length of query, src_len is the length of key)
+     *             nullptr means the mask is generated on the fly as described by ctx->maskDesc
      * - presentKeys, presentValues: past key/values concats current key/values
      * - pastSeqLen: the sequence length in pastKeys and pastValues
      * - useSelfAttn: use self attention or not, self attention is used to gen first token
@@ -228,7 +229,15 @@ public:
         dbg.dumpMatrix(inputBuffer);
 #endif
 
-        if (doLnBefore) {
+        if (ctx->seqParallel) {
+            // Input is already normalized, read by QKV linear from where the attention result is later put
+            if constexpr (std::is_same_v<InT, ImT>) {
+                imBuffer.Assign(inputBuffer.Data(), inputBuffer.Rows(), inputBuffer.Cols(), inputBuffer.Stride());
+            } else {
+                printf("Error: sequence parallel needs the same input and intermediate type in attention.\n");
+                exit(-1);
+            }
+        } else if (doLnBefore) {
             TimeLine t1("input.layer_norm");
             norm.forward(inputBuffer.Data(), imBuffer.Data(), inputBuffer.Rows(), inputBuffer.Stride(),
                     imBuffer.Stride(), epsilon);
@@ -312,7 +321,12 @@ public:
             if (ctx->inputSeqLen > getFlashThresh()) {
                 flashAttention(ctx, query, key, value, attnSplit, presentKey, presentValue, attnMask, pastSeqLen);
             } else if constexpr (std::is_same_v<InT, bfloat16_t> && std::is_same_v<OutT, bfloat16_t>) {
-                selfAttentionBF16(ctx, query, key, value, attnSplit, presentKey, presentValue);
+                // A dense mask, a prefix-LM or padded descriptor would be taken as causal by the BF16 kernel
+                if (attnMask == nullptr && ctx->maskDesc.isPlainCausal()) {
+                    selfAttentionBF16(ctx, query, key, value, attnSplit, presentKey, presentValue);
+                } else {
+                    fusedAttention(ctx, query, key, value, attnSplit, presentKey, presentValue, attnMask, pastSeqLen);
+                }
             } else {
                 fusedAttention(ctx, query, key, value, attnSplit, presentKey, presentValue, attnMask, pastSeqLen);
             }
@@ -329,7 +343,7 @@ public:
 
         TimeLine t5("Output");
         // Output/projection in attention, only add the input in the first split
-        if (ctx->splitIdx == 0) {
+        if (ctx->splitIdx == 0 && !ctx->seqParallel) {
             float gamma = getResidentialScale();
 
             // denseWithScaledSum should be enough, but as the performance of denseWithScaledSum is not verified,
@@ -380,6 +394,12 @@ public:
         }
     }
 
+    // The input norm alone, used by sequence parallel on the rows owned by this rank
+    void forwardNorm(DecoderContext *ctx, const InT *input, InT *output, int rows) {
+        TimeLine t("input.layer_norm");
+        norm.forward(input, output, rows, ctx->hiddenSize, ctx->hiddenSize, ctx->epsilon);
+    }
+
 protected:
     template <typename KVCacheT>
     void selfAttentionBF16(DecoderContext *ctx, hpj::Matrix<bfloat16_t> &query, hpj::Matrix<bfloat16_t> &key,
@@ -494,6 +514,23 @@ protected:
         }
     }
 
+    // Softmax between 2 BMM, masked (and ALiBi biased) on the fly according to ctx->maskDesc
+    // The scores are of the keys [nOff, nOff + cols), nOff is not after the first key visible to any row
+    template <typename T1>
+    void softmax(DecoderContext *ctx, T1 *score, int bId, int hId, int rows, int nOff, int cols, int lds,
+            int startSeq, int pastSeqLen) {
+        const float slope = ctx->maskDesc.alibiSlopes ? ctx->maskDesc.alibiSlopes[hId] : 0;
+        for (int seq = 0; seq < rows; ++seq) {
+            const int qIdx = startSeq + seq;
+            int first = ctx->maskDesc.firstKey(bId, qIdx, pastSeqLen) - nOff;
+            int visible = std::min(cols, ctx->maskDesc.visibleKeys(bId, qIdx, pastSeqLen) - nOff);
+            T1 *row = score + seq * lds;
+            if (first > 0) { memset(row, 0, first * sizeof(T1)); }
+            DecoderUtil::softmaxVisible(
+                    ctx, row + first, visible - first, cols - first, slope, nOff + first - (pastSeqLen + qIdx));
+        }
+    }
+
     // score: M * K(keyLen), value: K * headSize, output: M * headSize
     template <typename T1, typename T2, typename T3>
     void gemm2(T1 *score, T2 *value, T3 *output, int M, int headSize, int K, int lds, int ldv, int ldo) {
@@ -504,6 +541,52 @@ protected:
         xft::small_gemm(A, B, C, M, N, K, lds, ldv, ldo);        
     }
 
+    // Q * K with the cached keys [nOff, nOff + N) of a head, which may be stored in several runs when beams share
+    // KV blocks (see KVBlockTable), each run is a strided matrix
+    template <typename T1, typename KVCacheT, typename T3>
+    void gemm1Cached(T1 *query, KVCacheTensor<KVCacheT> &keys, int bId, int hId, T3 *score, int M, int nOff, int N,
+            int headSize, int ldq, int lds) {
+        for (int off = 0, len = 0; off < N; off += len) {
+            len = std::min(N - off, keys.getRunLength(bId, nOff + off));
+            gemm1(query, keys.getSequence(nOff + off, bId, hId), score + off, M, len, headSize, ldq,
+                    keys.getSeqStride(), lds);
+        }
+    }
+
+    // Softmax * V with the cached values [nOff, nOff + K) of a head, partial results of runs are accumulated in float
+    // scratch (2 * M * headSize floats of the calling thread, see cachedScratch)
+    template <typename T1, typename KVCacheT, typename T3>
+    void gemm2Cached(T1 *score, KVCacheTensor<KVCacheT> &values, int bId, int hId, T3 *output, int M, int headSize,
+            int nOff, int K, int lds, int ldo, float *scratch) {
+        const int ldv = values.getSeqStride();
+        int len = std::min(K, values.getRunLength(bId, nOff));
+        if (len == K) {
+            gemm2(score, values.getSequence(nOff, bId, hId), output, M, headSize, K, lds, ldv, ldo);
+            return;
+        }
+
+        float *acc = scratch;
+        float *part = scratch + M * headSize;
+        memset(acc, 0, M * headSize * sizeof(float));
+        for (int off = 0; off < K; off += len) {
+            len = std::min(K - off, values.getRunLength(bId, nOff + off));
+            xft::small_gemm(score + off, values.getSequence(nOff + off, bId, hId), part, M, headSize, len, lds, ldv,
+                    headSize);
+            for (int i = 0; i < M * headSize; ++i) {
+                acc[i] += part[i];
+            }
+        }
+        for (int m = 0; m < M; ++m) {
+            xft::copy(output + m * ldo, acc + m * headSize, headSize);
+        }
+    }
+
+    // Per-thread scratch of gemm2Cached for up to M rows, index it by omp_get_thread_num() * 2 * M * headSize
+    float *cachedScratch(DecoderContext *ctx, int M) {
+        size_t size = (size_t)ctx->numThreads * 2 * M * ctx->attHeadSize * sizeof(float);
+        return (float *)SimpleMemPool::instance().getBuffer("gemm2Scratch", size);
+    }
+
     // Note: the result here is still the intermediate result from the whole attention scope
     template <typename KVCacheT>
     void fusedAttention(DecoderContext *ctx, hpj::Matrix<ImT> &query, hpj::Matrix<ImT> &key, hpj::Matrix<ImT> &value,
@@ -529,8 +612,12 @@ protected:
             }
         }
 
+        // When decoding with group attention, query heads sharing a KV head are done in one task
+        bool groupDecode = (ctx->inputSeqLen == 1) && (groupNum > 1);
+        int decodeTasks = batchSize * (groupDecode ? this->endKVHead - this->startKVHead : responsibleHeads);
+
         // If total tasks are too small (compared to total thread number), need to shard the head
-        bool shardHead = (ctx->inputSeqLen == 1) && (ctx->numThreads >= batchSize * responsibleHeads * 2);
+        bool shardHead = (ctx->inputSeqLen == 1) && (ctx->numThreads >= decodeTasks * 2);
 
         // Need to copy current key/values to cache seperately if:
         // (1) For group attention (#kvHeads != #qHeads)
@@ -542,7 +629,9 @@ protected:
             kvCopied = true;
         }
 
-        if (!shardHead) {
+        if (groupDecode && !shardHead) {
+            return groupDecodeAttention(ctx, query, result, presentKey, presentValue, attnMask, pastSeqLen);
+        } else if (!shardHead) {
             return slimAttention(ctx, query, key, value, result, presentKey, presentValue, attnMask, pastSeqLen, mBlockSize, kvCopied);
         } else { // Seperate impl. when head is sharded
             return crossAttnShardHead(ctx, query, key, value, result, presentKey, presentValue, attnMask, pastSeqLen);
@@ -569,6 +658,7 @@ protected:
         if (bufSizeRequired > ctx->getScoreCapacity()) {
             scoreBuf = (float *)SimpleMemPool::instance().getBuffer("scoreBuf", bufSizeRequired * sizeof(float));
         }
+        float *scratchBuf = cachedScratch(ctx, mBlockSize);
 
 #pragma omp parallel for collapse(3)
         for (int b = 0; b < batchSize; ++b) {
@@ -582,21 +672,26 @@ protected:
                     if (!kvCopied) { copyKVCache(ctx, key, presentKey, pastSeqLen, b, i); }
 
                     // Q * K
-                    auto keyMatInfo = presentKey.getHead(b, i / groupNum);
                     int m = endSeq - startSeq;
                     int k = ctx->attHeadSize;
-                    int n = pastSeqLen + ctx->inputSeqLen;
                     int lda = query.Stride();
-                    int ldb = keyMatInfo.second;
                     int ldc = scoreStride;
                     auto A = query.Row(b * ctx->inputSeqLen + startSeq) + i * ctx->attHeadSize; // updated
-                    auto B = keyMatInfo.first;
                     auto C = scoreBuf + omp_get_thread_num() * mBlockSize * scoreStride;
 
                     const int queryLen = ctx->inputSeqLen;
                     const int keyLen = pastSeqLen + ctx->inputSeqLen;
 
-                    this->gemm1(A, B, C, m, n, headSize, lda, ldb, ldc);
+                    // Keys invisible to the whole block (e.g. the future ones for causal mask, or the left padding)
+                    // are skipped by both BMMs
+                    int nOff = 0;
+                    int n = keyLen;
+                    if (attnMask == nullptr) {
+                        nOff = ctx->maskDesc.firstKey(b, startSeq, pastSeqLen);
+                        n = std::min(keyLen, ctx->maskDesc.visibleKeys(b, endSeq - 1, pastSeqLen));
+                    }
+
+                    this->gemm1Cached(A, presentKey, b, i / groupNum, C, m, nOff, n - nOff, headSize, lda, ldc);
 
 #ifdef DEBUG
                     if (b == 0 && i == 0) {
@@ -609,7 +704,11 @@ protected:
 #endif
 
                     // Softmax(Q * K)
-                    this->softmax(ctx, C, getMask(attnMask, b, i, queryLen, keyLen), m, n, ldc, startSeq);
+                    if (attnMask) {
+                        this->softmax(ctx, C, getMask(attnMask, b, i, queryLen, keyLen), m, n, ldc, startSeq);
+                    } else {
+                        this->softmax(ctx, C, b, i, m, nOff, n - nOff, ldc, startSeq, pastSeqLen);
+                    }
 
 #ifdef DEBUG
                     if (b == 0 && i == 0) {
@@ -631,10 +730,10 @@ protected:
                     }
 
                     // Softmax * V
-                    auto valueMat = presentValue.getHead(b, i / groupNum);
                     auto output = result.Row(b * ctx->inputSeqLen + startSeq) + i * ctx->attHeadSize;
-                    this->gemm2(
-                            C, valueMat.first, output, m, headSize, keyLen, scoreStride, valueMat.second, result.Stride());
+                    auto scratch = scratchBuf + omp_get_thread_num() * 2 * mBlockSize * headSize;
+                    this->gemm2Cached(C, presentValue, b, i / groupNum, output, m, headSize, nOff, n - nOff,
+                            scoreStride, result.Stride(), scratch);
 
 #ifdef DEBUG
                     if (b == 0 && i == 0) {
@@ -649,27 +748,91 @@ protected:
         } // end for b
     }
 
+    // Query heads (local index range) sharing the local KV head kvIdx, they are adjacent in a query row
+    std::pair<int, int> groupQHeads(int kvIdx, int groupNum) {
+        int first = std::max(this->startQHead, (this->startKVHead + kvIdx) * groupNum);
+        int last = std::min(this->endQHead, (this->startKVHead + kvIdx + 1) * groupNum);
+        return std::make_pair(first - this->startQHead, last - this->startQHead);
+    }
+
+    // Decode (1 token per sample) for group attention: the query heads sharing a KV head are stacked into a
+    // (groupNum x headSize) matrix, thus each KV head is read once instead of groupNum times
+    // Current key/values must be already in the cache
+    template <typename KVCacheT>
+    void groupDecodeAttention(DecoderContext *ctx, hpj::Matrix<ImT> &query, hpj::Matrix<ImT> &result,
+            KVCacheTensor<KVCacheT> &presentKey, KVCacheTensor<KVCacheT> &presentValue, const float *attnMask,
+            int pastSeqLen) {
+        const int respKVHeads = this->endKVHead - this->startKVHead;
+        const int batchSize = ctx->batchSize;
+        const int groupNum = ctx->attHeadNum / ctx->kvHeadNum;
+        const int headSize = ctx->attHeadSize;
+        const int keyLen = pastSeqLen + 1;
+
+        float *scoreBuf = ctx->qkScores;
+        int scoreStride = (keyLen + 15) / 16 * 16;
+        size_t bufSizeRequired = (size_t)ctx->numThreads * groupNum * scoreStride;
+        if (bufSizeRequired > ctx->getScoreCapacity()) {
+            scoreBuf = (float *)SimpleMemPool::instance().getBuffer("scoreBuf", bufSizeRequired * sizeof(float));
+        }
+        float *scratchBuf = cachedScratch(ctx, groupNum);
+
+#pragma omp parallel for collapse(2)
+        for (int b = 0; b < batchSize; ++b) {
+            for (int g = 0; g < respKVHeads; ++g) {
+                auto heads = groupQHeads(g, groupNum);
+                int rows = heads.second - heads.first;
+
+                // Q * K, all query heads of the group at once, the left padding is skipped
+                const int nOff = attnMask ? 0 : ctx->maskDesc.firstKey(b, 0, pastSeqLen);
+                auto A = query.Row(b) + heads.first * headSize;
+                auto C = scoreBuf + omp_get_thread_num() * groupNum * scoreStride;
+                this->gemm1Cached(A, presentKey, b, g, C, rows, nOff, keyLen - nOff, headSize, headSize, scoreStride);
+
+                // Softmax(Q * K)
+                for (int r = 0; r < rows; ++r) {
+                    int h = heads.first + r;
+                    if (attnMask) {
+                        DecoderUtil::computeSoftmax(
+                                ctx, C + r * scoreStride, getMask(attnMask, b, h, 1, keyLen), keyLen);
+                    } else {
+                        this->softmax(ctx, C + r * scoreStride, b, h, 1, nOff, keyLen - nOff, scoreStride, 0,
+                                pastSeqLen);
+                    }
+                }
+
+                // Softmax * V, output of the heads is also adjacent
+                auto output = result.Row(b) + heads.first * headSize;
+                auto scratch = scratchBuf + omp_get_thread_num() * 2 * groupNum * headSize;
+                this->gemm2Cached(C, presentValue, b, g, output, rows, headSize, nOff, keyLen - nOff, scoreStride,
+                        headSize, scratch);
+            }
+        }
+    }
+
     // When #heads is very few, need to shard each head to use more resources
+    // For group attention, a task does all the query heads sharing one KV head, thus keys/values are read once
     template <typename KVCacheT>
     void crossAttnShardHead(DecoderContext *ctx, hpj::Matrix<ImT> &query, hpj::Matrix<ImT> &key,
             hpj::Matrix<ImT> &value, hpj::Matrix<ImT> &result, KVCacheTensor<KVCacheT> &presentKey,
             KVCacheTensor<KVCacheT> &presentValue, const float *attnMask, int pastSeqLen) {
         const int responsibleHeads = this->endQHead - this->startQHead;
+        const int respKVHeads = this->endKVHead - this->startKVHead;
         const int batchSize = ctx->batchSize;
         const int groupNum = ctx->attHeadNum / ctx->kvHeadNum;
+        const int headSize = ctx->attHeadSize;
 
         int N = pastSeqLen + ctx->inputSeqLen;
-        int splits = ctx->numThreads / (batchSize * responsibleHeads);
-        int nb = (N + splits - 1) / splits; // block size for each thread
+        int splits = ctx->numThreads / (batchSize * respKVHeads);
 
         REQUIRES(splits > 1, "Do not call me when splits=%d", splits);
 
         // AVX512 is used and the case where head_size is not multiple of 16 hasn't been taken into account
         REQUIRES(ctx->attHeadSize % 16 == 0, "Head size (%d) is not supported.", ctx->attHeadSize);
 
-        // max(xi), sum(exp(xi)), finish_tag for each split
+        // max(xi), sum(exp(xi)), finish_tag for each split of each query head
         int totalTasks = batchSize * responsibleHeads * splits;
-        AlignedType<std::tuple<float, float, float>, 32> splitInfo[totalTasks];
+        auto splitInfo = (AlignedType<std::tuple<float, float, float>, 32> *)SimpleMemPool::instance().getBuffer(
+                "splitInfo", totalTasks * sizeof(AlignedType<std::tuple<float, float, float>, 32>));
         for (int i = 0; i < totalTasks; ++i) {
             std::get<1>(splitInfo[i].data) = 0;
             std::get<2>(splitInfo[i].data) = 0;
@@ -677,35 +840,46 @@ protected:
 
         float *shardedOut = (float *)SimpleMemPool::instance().getBuffer(
                 "shardedOutput", totalTasks * ctx->attHeadSize * sizeof(float));
+        float *scratchBuf = cachedScratch(ctx, groupNum);
 
 #pragma omp parallel for collapse(3)
         for (int b = 0; b < batchSize; ++b) {
-            for (int i = 0; i < responsibleHeads; ++i) {
+            for (int g = 0; g < respKVHeads; ++g) {
                 for (int s = 0; s < splits; ++s) {
-                    int headStartIdx = b * responsibleHeads * splits + i * splits;
-                    int threadIdx = b * responsibleHeads * splits + i * splits + s;
-
-                    // Q * K
-                    int nOff = s * nb;
-                    auto keyMatInfo = presentKey.getHead(b, i / groupNum);
-                    int m = 1;
-                    int k = ctx->attHeadSize;
-                    int n = (s < splits - 1 ? nb : N - nOff);
-                    int lda = query.Stride();
-                    int ldb = keyMatInfo.second;
+                    auto heads = groupQHeads(g, groupNum);
+                    int rows = heads.second - heads.first;
+
+                    // Q * K, query heads of the group are stacked as rows
+                    // Keys of the left padding (if any) are not split among the threads
+                    int nStart = attnMask ? 0 : ctx->maskDesc.firstKey(b, 0, pastSeqLen);
+                    int nb = (N - nStart + splits - 1) / splits; // block size for each thread
+                    int nOff = nStart + s * nb;
+                    int k = headSize;
+                    int n = std::min(nb, N - nOff);
                     int strideC = pastSeqLen > 0 ? (N + 15) / 16 * 16 : ctx->inputSeqLen;
-                    int ldc = strideC;
-                    auto A = query.Row(b * ctx->inputSeqLen) + i * ctx->attHeadSize;
-                    auto B = keyMatInfo.first + nOff * ldb;
-                    auto C = ctx->qkScores + (b * responsibleHeads + i) * ctx->inputSeqLen * strideC + nOff;
+
+                    // Nothing left for the split (fewer keys than splits), it is merged as an empty softmax
+                    if (n <= 0) {
+                        for (int h = heads.first; h < heads.second; ++h) {
+                            int infoIdx = (b * responsibleHeads + h) * splits + s;
+                            std::get<0>(splitInfo[infoIdx].data) = std::numeric_limits<float>::lowest();
+                            std::get<1>(splitInfo[infoIdx].data) = 0;
+                            memset(&shardedOut[infoIdx * headSize], 0, headSize * sizeof(float));
+                            std::get<2>(splitInfo[infoIdx].data) = 1;
+                        }
+                        continue;
+                    }
+                    auto A = query.Row(b * ctx->inputSeqLen) + heads.first * headSize;
+                    auto C = ctx->qkScores + (b * responsibleHeads + heads.first) * ctx->inputSeqLen * strideC + nOff;
 
                     const int queryLen = ctx->inputSeqLen;
                     const int keyLen = N;
 
-                    small_gemm_transb(getMask(attnMask, b, i, queryLen, keyLen), A, B, C, m, n, k, lda, ldb, ldc);
+                    // The dense mask (if any) is added in softmax, the masked gemm only skips computation
+                    this->gemm1Cached(A, presentKey, b, g, C, rows, nOff, n, k, headSize, strideC);
 
 #ifdef DEBUG
-                    if (b == 0 && i == 0 && s == splits - 1) {
+                    if (b == 0 && g == 0 && s == splits - 1) {
                         dbg.debugPrint("Q * K, first head (some value may not be ready):\n");
                         auto p = ctx->qkScores;
                         dbg.debugPrint("%f, %f, %f ... %f %f %f\n", p[0] * ctx->attFactor, p[1] * ctx->attFactor,
@@ -715,13 +889,20 @@ protected:
 #endif
 
                     // Softmax and the stats info
-                    auto info = DecoderUtil::softmaxWithStats(
-                            ctx, C, getMask(attnMask, b, i, queryLen, keyLen) + nOff, n);
-                    std::get<0>(splitInfo[threadIdx].data) = info.first;
-                    std::get<1>(splitInfo[threadIdx].data) = info.second;
+                    // Without a dense mask, the only query token (the newest one) sees all the keys
+                    for (int r = 0; r < rows; ++r) {
+                        int h = heads.first + r;
+                        const float *mask = attnMask ? getMask(attnMask, b, h, queryLen, keyLen) : nullptr;
+                        float slope = (!mask && ctx->maskDesc.alibiSlopes) ? ctx->maskDesc.alibiSlopes[h] : 0;
+                        auto info = DecoderUtil::softmaxWithStats(
+                                ctx, C + r * strideC, mask ? mask + nOff : nullptr, n, slope, nOff - (N - 1));
+                        int infoIdx = (b * responsibleHeads + h) * splits + s;
+                        std::get<0>(splitInfo[infoIdx].data) = info.first;
+                        std::get<1>(splitInfo[infoIdx].data) = info.second;
+                    }
 
 #ifdef DEBUG
-                    if (b == 0 && i == 0 && s == splits - 1) {
+                    if (b == 0 && g == 0 && s == splits - 1) {
                         dbg.debugPrint("Softmax(Q * K), first head (some value may not be ready):\n");
                         auto p = ctx->qkScores;
                         dbg.debugPrint("%f, %f, %f ... %f %f %f\n", p[0], p[1], p[2], p[keyLen - 3], p[keyLen - 2],
@@ -729,84 +910,87 @@ protected:
                     }
 #endif
 
-                    // Softmax * V
-                    auto valueMatInfo = presentValue.getHead(b, i / groupNum);
-                    std::swap(k, n);
-                    lda = strideC;
-                    ldb = valueMatInfo.second;
-                    ldc = result.Stride();
+                    // Softmax * V, output of the query heads is strided by splits
                     {
                         float *A = C;
-                        KVCacheT *B = valueMatInfo.first + nOff * ldb;
-                        auto C = &shardedOut[threadIdx * ctx->attHeadSize];
-                        xft::small_gemm(A, B, C, m, n, k, lda, ldb, ldc);
+                        auto C = &shardedOut[((b * responsibleHeads + heads.first) * splits + s) * headSize];
+                        auto scratch = scratchBuf + omp_get_thread_num() * 2 * groupNum * headSize;
+                        this->gemm2Cached(A, presentValue, b, g, C, rows, headSize, nOff, n, strideC,
+                                splits * headSize, scratch);
                     }
 
-                    std::get<2>(splitInfo[threadIdx].data) = 1; // set finished flag
+                    for (int h = heads.first; h < heads.second; ++h) {
+                        std::get<2>(splitInfo[(b * responsibleHeads + h) * splits + s].data) = 1; // set finished flag
+                    }
 
                     // Wait for all threads to finish and reduce the result
                     // Firstly get the max value, and then revise the value by considering the factor on numerator and denominator
                     if (s == 0) {
-                        float realMax = std::get<0>(splitInfo[threadIdx].data);
-                        for (int idx = headStartIdx + 1; idx < headStartIdx + splits; ++idx) {
-                            while (std::get<2>(splitInfo[idx].data) == 0) {
-                                _mm_pause();
-                            }
-                            if (std::get<0>(splitInfo[idx].data) > realMax) {
-                                realMax = std::get<0>(splitInfo[idx].data);
-                            }
-                        }
-
-                        float realSum = 0;
-                        for (int idx = headStartIdx; idx < headStartIdx + splits; ++idx) {
-                            float splitMax = std::get<0>(splitInfo[idx].data);
-                            float splitSum = std::get<1>(splitInfo[idx].data);
-                            float revFactor = std::exp(splitMax - realMax); // revise factor
-                            std::get<2>(splitInfo[idx].data) = revFactor; // borrow finish flag for revise factor
-                            realSum += splitSum * revFactor;
-                        }
-
-                        // Accumulate in float
-                        float acc[ctx->attHeadSize];
-                        memset(acc, 0, ctx->attHeadSize * sizeof(float));
-
-                        for (int idx = headStartIdx; idx < headStartIdx + splits; ++idx) {
-                            float splitMax = std::get<0>(splitInfo[idx].data);
-                            float splitSum = std::get<1>(splitInfo[idx].data);
-                            float revFactor = std::get<2>(splitInfo[idx].data);
-
-                            float factor = revFactor * (splitSum / realSum);
-                            auto vfactor = xft::set_avx512(factor);
-
-                            float *p = &shardedOut[idx * ctx->attHeadSize];
-                            for (int off = 0; off < ctx->attHeadSize; off += 16) {
-                                auto vacc = xft::load_avx512(acc + off);
-                                vacc = vacc + xft::load_avx512(p + off) * vfactor;
-                                xft::store_avx512(acc + off, 0xffff, vacc);
-                            }
-                        }
-
-                        // Store the result (acc -> result)
-                        ImT *pResult = result.Row(b * ctx->inputSeqLen) + i * ctx->attHeadSize;
-                        for (int off = 0; off < ctx->attHeadSize; off += 16) {
-                            auto vacc = xft::load_avx512(acc + off);
-                            xft::store_avx512(pResult + off, 0xffff, vacc);
+                        for (int h = heads.first; h < heads.second; ++h) {
+                            int headStartIdx = (b * responsibleHeads + h) * splits;
+                            reduceSplits(ctx, splitInfo + headStartIdx, shardedOut + headStartIdx * headSize, splits,
+                                    result.Row(b * ctx->inputSeqLen) + h * headSize);
                         }
                     }
 
 #ifdef DEBUG
-                    if (b == 0 && i == 0 && s == 0) {
+                    if (b == 0 && g == 0 && s == 0) {
                         dbg.debugPrint("Softmax(Q * K) * V, first head:\n");
-                        auto p = C;
+                        auto p = result.Row(0);
                         dbg.debugPrint("%f, %f, %f ... %f %f %f\n", p[0], p[1], p[2], p[ctx->attHeadSize - 3],
                                 p[ctx->attHeadSize - 2], p[ctx->attHeadSize - 1]);
                     }
 #endif
                 } // end for s
-            } // end for i
+            } // end for g
         } // end for b
     }
 
+    // Wait for the splits of a head and merge their outputs by the softmax stats into pResult
+    // The output of the first split (owned by the caller) is overwritten as the accumulator
+    void reduceSplits(DecoderContext *ctx, AlignedType<std::tuple<float, float, float>, 32> *splitInfo,
+            float *splitOut, int splits, ImT *pResult) {
+        float realMax = std::get<0>(splitInfo[0].data);
+        for (int idx = 1; idx < splits; ++idx) {
+            while (std::get<2>(splitInfo[idx].data) == 0) {
+                _mm_pause();
+            }
+            if (std::get<0>(splitInfo[idx].data) > realMax) { realMax = std::get<0>(splitInfo[idx].data); }
+        }
+
+        float realSum = 0;
+        for (int idx = 0; idx < splits; ++idx) {
+            float splitMax = std::get<0>(splitInfo[idx].data);
+            float splitSum = std::get<1>(splitInfo[idx].data);
+            float revFactor = std::exp(splitMax - realMax); // revise factor
+            std::get<2>(splitInfo[idx].data) = revFactor; // borrow finish flag for revise factor
+            realSum += splitSum * revFactor;
+        }
+
+        // Accumulate in float
+        float *acc = splitOut;
+        for (int idx = 0; idx < splits; ++idx) {
+            float splitSum = std::get<1>(splitInfo[idx].data);
+            float revFactor = std::get<2>(splitInfo[idx].data);
+
+            float factor = revFactor * (splitSum / realSum);
+            auto vfactor = xft::set_avx512(factor);
+
+            const float *p = &splitOut[idx * ctx->attHeadSize];
+            for (int off = 0; off < ctx->attHeadSize; off += 16) {
+                auto vacc = idx == 0 ? xft::set_avx512(0.0f) : xft::load_avx512(acc + off);
+                vacc = vacc + xft::load_avx512(p + off) * vfactor;
+                xft::store_avx512(acc + off, 0xffff, vacc);
+            }
+        }
+
+        // Store the result (acc -> result)
+        for (int off = 0; off < ctx->attHeadSize; off += 16) {
+            auto vacc = xft::load_avx512(acc + off);
+            xft::store_avx512(pResult + off, 0xffff, vacc);
+        }
+    }
+
     template <typename KVCacheT>
     void flashAttention(DecoderContext *ctx, hpj::Matrix<ImT> &query, hpj::Matrix<ImT> &key,
             hpj::Matrix<ImT> &value, hpj::Matrix<ImT> &result, KVCacheTensor<KVCacheT> &presentKey,
@@ -862,8 +1046,8 @@ protected:
         }
 
         // [batch, src, head, headsize]
-        scaledDpAttention<AttnT>(query.Data(), k, v, attnMask, scale, batchSize, srcLen, tgtLen, respQHeads, respKVHeads,
-                headSize, result.Data(), qkvCols, kvStride, result.Stride());
+        scaledDpAttention<AttnT>(query.Data(), k, v, attnMask, ctx->maskDesc, scale, batchSize, srcLen, tgtLen,
+                respQHeads, respKVHeads, headSize, result.Data(), qkvCols, kvStride, result.Stride());
 
         // For group attention, as #kvHeads != #qHeads, need to copy current key/values to cache seperately
         // When M dimension is split, also multiple tasks per copy, so do copy seperately
@@ -888,10 +1072,11 @@ protected:
     }
 
     // scaled dot-product attention: bmm1 + softmax + bmm2
+    // If attnMask is nullptr, the mask is generated from maskDesc and the invisible key tiles are skipped
     template <typename AttnT>
-    void scaledDpAttention(const ImT *query, const AttnT *key, const AttnT *value, const float *attnMask, float scale,
-            int batchSize, int srcLen, int tgtLen, int numQHead, int numKVHead, int headSize, ImT *output,
-            int qStride, int kvStride, int stride) {
+    void scaledDpAttention(const ImT *query, const AttnT *key, const AttnT *value, const float *attnMask,
+            const AttnMaskDesc &maskDesc, float scale, int batchSize, int srcLen, int tgtLen, int numQHead,
+            int numKVHead, int headSize, ImT *output, int qStride, int kvStride, int stride) {
         // output = trans(softmax(query * trans(key)) * value)
         int nth = omp_get_max_threads();
         // closest value of power of 2
@@ -906,6 +1091,10 @@ protected:
         int numArr = 7;
         int arrStride = (4 + tgtBlk + 2 * headSize) * srcBlk;
         float *thrBuf = (float *)SimpleMemPool::instance().getBuffer("threadBuffers", nth * arrStride * sizeof(float));
+        // Visible lengths then first visible keys of the query rows, for each thread
+        int *thrVisible = attnMask ? nullptr
+                                   : (int *)SimpleMemPool::instance().getBuffer(
+                                           "threadVisibleLens", nth * 2 * srcBlk * sizeof(int));
         float **thrPtrBuf
                 = (float **)SimpleMemPool::instance().getBuffer("threadPtrBuffers", nth * numArr * sizeof(float *));
 
@@ -958,19 +1147,46 @@ protected:
                     }
 
                     uint64_t tgtOff = i * tgtLen * kvStride + (j / numGroup) * headSize;
-                    const float *attnMsk = getMask(attnMask, i, j, srcLen, tgtLen) + m * tgtLen;
+                    const float *attnMsk = attnMask ? getMask(attnMask, i, j, srcLen, tgtLen) + m * tgtLen : nullptr;
                     const AttnT *k = key + tgtOff;
                     const AttnT *v = value + tgtOff;
+
+                    // Keys after the last one visible to this query block (or before the first one, like the left
+                    // padding) are never computed
+                    float slope = (attnMsk == nullptr && maskDesc.alibiSlopes) ? maskDesc.alibiSlopes[j] : 0;
+                    int tgtStart = 0;
+                    int tgtEnd = tgtLen;
+                    if (attnMsk == nullptr) {
+                        tgtStart = maskDesc.firstKey(i, m, tgtLen - srcLen);
+                        tgtEnd = std::min(tgtLen, maskDesc.visibleKeys(i, m + qRealBlk - 1, tgtLen - srcLen));
+                    }
+
                     // split the target len dimension
-                    for (int b = 0; b < tgtLen; b += tgtBlk) {
-                        int kvRealBlk = std::min(tgtBlk, tgtLen - b);
-                        // TODO: mask out
+                    for (int b = tgtStart; b < tgtEnd; b += tgtBlk) {
+                        int kvRealBlk = std::min(tgtBlk, tgtEnd - b);
                         const AttnT *kBlk = k + b * kvStride;
                         const AttnT *vBlk = v + b * kvStride;
 
-                        DecoderUtil::incrementalTileAttention(q, kBlk, vBlk, attnMsk + b, qRealBlk, headSize, kvRealBlk,
-                                tgtLen, preSum[tid], sum[tid], preMax[tid], max[tid], refac, qkArr[tid], expQkvArr[tid],
-                                out, headSize, kvStride, kvStride, stride);
+                        // Visible keys of each query row inside this tile
+                        int *visibleLens = nullptr;
+                        int *firstKeys = nullptr;
+                        if (attnMsk == nullptr) {
+                            visibleLens = thrVisible + tid * 2 * srcBlk;
+                            for (int ii = 0; ii < qRealBlk; ++ii) {
+                                visibleLens[ii] = maskDesc.visibleKeys(i, m + ii, tgtLen - srcLen) - b;
+                            }
+                            if (maskDesc.padLens != nullptr) {
+                                firstKeys = visibleLens + srcBlk;
+                                for (int ii = 0; ii < qRealBlk; ++ii) {
+                                    firstKeys[ii] = maskDesc.firstKey(i, m + ii, tgtLen - srcLen) - b;
+                                }
+                            }
+                        }
+
+                        DecoderUtil::incrementalTileAttention(q, kBlk, vBlk, attnMsk ? attnMsk + b : nullptr, qRealBlk,
+                                headSize, kvRealBlk, tgtLen, preSum[tid], sum[tid], preMax[tid], max[tid], refac,
+                                qkArr[tid], expQkvArr[tid], out, headSize, kvStride, kvStride, stride, visibleLens,
+                                slope, b - (tgtLen - srcLen + m), firstKeys);
                     }
                 }
             }
@@ -56,13 +56,5 @@ public:
         }
     }
 
-protected:
-    const float *getMask(const float *attnMask, int bId, int hId, int srcLen, int tgtLen) override {
-        if (alibiSlopes != nullptr)
-            return attnMask + hId * srcLen * tgtLen;
-        else
-            return attnMask + bId * srcLen * tgtLen;
-    }
-
 private:
 };
@@ -111,6 +111,17 @@ public:
         mlp.forward(ctx, input, output, iStride, oStride, doLnBefore);
     }
 
+    // Norms alone for sequence parallel, only for layers supporting ctx->seqParallel
+    template <typename T>
+    void forwardAttnNorm(DecoderContext *ctx, const T *input, T *output, int rows) {
+        attn.forwardNorm(ctx, input, output, rows);
+    }
+
+    template <typename T>
+    void forwardFFNNorm(DecoderContext *ctx, const T *input, T *output, int rows) {
+        mlp.forwardNorm(ctx, input, output, rows);
+    }
+
 private:
     void copyWeights(hpj::Matrix<float> &w, int start_col, int end_col, const float *data) {
         hpj::Matrix<float> subW(w, 0, w.Rows(), start_col, end_col - start_col);
@@ -118,7 +118,11 @@ public:
         hpj::Matrix<ImT> normBuffer(
                 (ImT *)ctx->normBuf.Data(), ctx->normBuf.Rows(), ctx->normBuf.Cols(), ctx->normBuf.Stride());
 
-        if (doLnBefore == true) {
+        // In sequence parallel, the input is normalized and the residual is added by the caller
+        const bool doNorm = doLnBefore && !ctx->seqParallel;
+        const bool addResidual = ctx->splitIdx == 0 && !ctx->seqParallel;
+
+        if (doNorm) {
             xft::rmsNorm(normBuffer.Data(), inBuffer.Data(), normWeight.Data(), M, hiddenSize, inBuffer.Stride(),
                     normBuffer.Stride(), 1e-6);
         }
@@ -131,7 +135,7 @@ public:
         if (!enableCATMLP()) {
             hpj::Matrix<ImT> imBuffer(
                     (ImT *)ctx->imOut.Data(), ctx->imOut.Rows(), ctx->imOut.Cols(), ctx->imOut.Stride());
-            gateProj(ctx, doLnBefore ? normBuffer : inBuffer, imBuffer);
+            gateProj(ctx, doNorm ? normBuffer : inBuffer, imBuffer);
 
 #ifdef DEBUG
             dbg.debugPrint("gateWeight:\n");
@@ -140,7 +144,7 @@ public:
             dbg.dumpMatrix(imBuffer);
 #endif
 
-            upProj(ctx, doLnBefore ? normBuffer : inBuffer, imBuffer);
+            upProj(ctx, doNorm ? normBuffer : inBuffer, imBuffer);
 
 #ifdef DEBUG
             dbg.debugPrint("upWeight:\n");
@@ -148,7 +152,7 @@ public:
             dbg.debugPrint("up output:\n");
             dbg.dumpMatrix(imBuffer);
 #endif
-            downProj(ctx, imBuffer, outBuffer, inBuffer, ctx->splitIdx == 0);
+            downProj(ctx, imBuffer, outBuffer, inBuffer, addResidual);
 
         } else {
             int M = normBuffer.Rows();
@@ -161,14 +165,14 @@ public:
             ImT *t = (ImT *)SimpleMemPool::instance().getBuffer("mlp_silu", bufSize);
             hpj::Matrix<ImT> siluBuf(t, M, cols, cols);
 
-            catGateUpProj(ctx, doLnBefore ? normBuffer : inBuffer, imBuffer, siluBuf);
+            catGateUpProj(ctx, doNorm ? normBuffer : inBuffer, imBuffer, siluBuf);
 #ifdef DEBUG
             dbg.debugPrint("catWeights:\n");
             dbg.dumpMatrix(catWeights);
             dbg.debugPrint("gateUp output:\n");
             dbg.dumpMatrix(siluBuf);
 #endif
-            downProj(ctx, siluBuf, outBuffer, inBuffer, ctx->splitIdx == 0);
+            downProj(ctx, siluBuf, outBuffer, inBuffer, addResidual);
         }
 
 #ifdef DEBUG
@@ -181,6 +185,12 @@ public:
 #endif
     }
 
+    // The norm alone, used by sequence parallel on the rows owned by this rank
+    void forwardNorm(DecoderContext *ctx, const InT *input, InT *output, int rows) {
+        TimeLine t("LlamaMLP.norm");
+        xft::rmsNorm(output, input, normWeight.Data(), rows, ctx->hiddenSize, ctx->hiddenSize, ctx->hiddenSize, 1e-6);
+    }
+
 private:
     void gateProj(DecoderContext *ctx, hpj::Matrix<InT> &input, hpj::Matrix<ImT> &output) {
         TimeLine t("GateProj");
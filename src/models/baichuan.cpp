@@ -73,36 +73,8 @@ void Baichuan<WeiT>::setFinalLnWeight(const std::string &modelPath) {
 
 template <typename WeiT>
 void Baichuan<WeiT>::prepareAttnMaskBase(int *ids, int step) {
-    DecoderContext *ctx = this->getContext();
-    int seqLen = ctx->inputSeqLen;
-
-    if (step == 0) {
-        int sizeRequired = ctx->batchSize * seqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int b = 0; b < ctx->batchSize; ++b) {
-            auto pmask = mask + b * seqLen * seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * seqLen, 0, (i + 1) * sizeof(float)); // bottom left are 0
-                std::fill_n(pmask + i * seqLen + i + 1, seqLen - i - 1, std::numeric_limits<float>::lowest());
-            }
-        }
-    } else if (seqLen > 1) {
-        int sizeRequired = ctx->batchSize * this->accSeqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int b = 0; b < ctx->batchSize; ++b) {
-            auto pmask = mask + b * this->accSeqLen * seqLen;
-            int pastLen = this->accSeqLen - seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * this->accSeqLen, 0, (pastLen + i + 1) * sizeof(float));
-                std::fill_n(pmask + i * this->accSeqLen + pastLen + i + 1, seqLen - i - 1,
-                        std::numeric_limits<float>::lowest());
-            }
-        }
-    } else {
-        int sizeRequired = ctx->batchSize * this->accSeqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        memset(mask, 0, ctx->batchSize * this->accSeqLen * sizeof(float)); // all elements are 0
-    }
+    // Causal mask (with the offset of past tokens) is generated on the fly inside attention
+    this->getContext()->maskDesc.type = AttnMaskDesc::CAUSAL;
 }
 
 template <typename WeiT>
@@ -111,57 +83,13 @@ void Baichuan<WeiT>::prepareAttnMask(int *ids, int step) {
     if (ctx->maxPosEmbed > 0) {
         // Base Mask for CausalLM
         prepareAttnMaskBase(ids, step);
+        ctx->maskDesc.alibiSlopes = nullptr;
         return;
     }
 
-    // Alibi Mask
-    int seqLen = ctx->inputSeqLen;
-
-    int responsibleHeads = BaichuanAttention<WeiT>::getResponsibleHeads();
-    // alibi mask slope for each head
-    const float *slopes = BaichuanAttention<WeiT>::getAlibiSlopes();
-
-    if (step == 0) {
-        int sizeRequired = responsibleHeads * seqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int h = 0; h < responsibleHeads; ++h) {
-            auto pmask = mask + h * seqLen * seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * seqLen, 0, (i + 1) * sizeof(float)); // bottom left are 0
-                // attention mask added with alibi mask
-                for (int j = 0; j < i + 1; ++j) {
-                    pmask[i * seqLen + j] += j * slopes[h];
-                }
-                std::fill_n(pmask + i * seqLen + i + 1, seqLen - i - 1, std::numeric_limits<float>::lowest());
-            }
-        }
-    } else if (seqLen > 1) {
-        int sizeRequired = responsibleHeads * this->accSeqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int h = 0; h < responsibleHeads; ++h) {
-            auto pmask = mask + h * this->accSeqLen * seqLen;
-            int pastLen = this->accSeqLen - seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * this->accSeqLen, 0, (pastLen + i + 1) * sizeof(float));
-                // attention mask added with alibi mask
-                for (int j = 0; j < pastLen + i + 1; ++j) {
-                    pmask[i * this->accSeqLen + j] += j * slopes[h];
-                }
-                std::fill_n(pmask + i * this->accSeqLen + pastLen + i + 1, seqLen - i - 1,
-                        std::numeric_limits<float>::lowest());
-            }
-        }
-    } else {
-        int sizeRequired = responsibleHeads * this->accSeqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int h = 0; h < responsibleHeads; ++h) {
-            auto pmask = mask + h * this->accSeqLen;
-            // attention mask added with alibi mask
-            for (int j = 0; j < this->accSeqLen; ++j) {
-                pmask[j] = j * slopes[h];
-            }
-        }
-    }
+    // Alibi Mask: causal mask plus slope * (j - i), both generated inside attention from the slopes of each head
+    ctx->maskDesc.type = AttnMaskDesc::CAUSAL;
+    ctx->maskDesc.alibiSlopes = BaichuanAttention<WeiT>::getAlibiSlopes();
 }
 
 template <typename WeiT>
@@ -29,6 +29,9 @@ public:
 
     void prepareAttnMaskBase(int *ids, int step);
     void prepareAttnMask(int *ids, int step);
+
+    // Both ALiBi (13B) and rotary embedding (7B) are relative
+    bool supportsPadding() override { return true; }
     void embeddingForward(int *ids, float *output, int batchSize, int seqLen);
     void lastLayerNormForward(float *input, float *output, int rows);
 
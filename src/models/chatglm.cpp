@@ -78,26 +78,17 @@ void ChatGLM<WeiT>::prepareAttnMask(int *ids, int step) {
     int seqLen = ctx->inputSeqLen;
 
     if (step == 0) {
-        int sizeRequired = ctx->batchSize * seqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
+        // Tokens before the start ID (the context) see each other, generated on the fly inside attention
         int startId = this->getStartId();
-
+        contextLens.resize(ctx->batchSize);
         for (int b = 0; b < ctx->batchSize; ++b) {
-            int contextLen = -1;
             auto it = std::find(ids + b * seqLen, ids + (b + 1) * seqLen, startId);
-            if (it != ids + (b + 1) * seqLen) { contextLen = std::distance(ids + b * seqLen, it); }
-
-            auto pmask = mask + b * seqLen * seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                int zeroLen = contextLen > (i + 1) ? contextLen : (i + 1);
-                memset(pmask + i * seqLen, 0, zeroLen * sizeof(float)); // bottom left or 0:contextLen are 0
-                std::fill_n(pmask + i * seqLen + zeroLen, seqLen - zeroLen, std::numeric_limits<float>::lowest());
-            }
+            contextLens[b] = (it != ids + (b + 1) * seqLen) ? std::distance(ids + b * seqLen, it) : -1;
         }
+        ctx->maskDesc.type = AttnMaskDesc::PREFIX_LM;
+        ctx->maskDesc.prefixLens = contextLens.data();
     } else {
-        int sizeRequired = ctx->batchSize * this->accSeqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        memset(mask, 0, ctx->batchSize * this->accSeqLen * sizeof(float)); // all elements are 0
+        ctx->maskDesc.type = AttnMaskDesc::CAUSAL;
     }
 }
 
@@ -209,12 +200,44 @@ int *ChatGLM<WeiT>::getPositionIds(int *ids, int batchSize, int seqLen, int step
     return positionIds;
 }
 
+// Each sample has position_ids and block_position_ids
+template <typename WeiT>
+int *ChatGLM<WeiT>::getSamplePositionIds(int *positionIds, int sampleIdx, int seqLen) {
+    return positionIds + sampleIdx * seqLen * 2;
+}
+
+template <typename WeiT>
+void ChatGLM<WeiT>::squeezeSampleStates(int *idx, int size) {
+    // Not prepared yet (like the next token model in HybridModel before step 1)
+    if (size == 0 || idx[size - 1] >= (int)maskPositions.size()) { return; }
+
+    for (int i = 0; i < size; ++i) {
+        maskPositions[i] = maskPositions[idx[i]];
+        lastBlockPositions[i] = lastBlockPositions[idx[i]];
+    }
+    maskPositions.resize(size);
+    lastBlockPositions.resize(size);
+}
+
+// Position IDs after the first step are only prepared for one token
+template <typename WeiT>
+void ChatGLM<WeiT>::rollbackSampleStates(int tokens) {
+    printf("[ERROR] ChatGLM doesn't support rolling back tokens.\n");
+    exit(-1);
+}
+
 template <typename WeiT>
 void ChatGLM<WeiT>::setPrefix(int *ids, int seqLen) {
     printf("[ERROR] ChatGLM doesn't support prefix sharing.\n");
     exit(-1);
 }
 
+// Sessions are resumed like prefix sharing, thus not kept
+template <typename WeiT>
+size_t ChatGLM<WeiT>::saveSession(int sessionId, int sampleIdx, int seqLen) {
+    return 0;
+}
+
 template class ChatGLM<float>;
 template class ChatGLM<float16_t>;
 template class ChatGLM<bfloat16_t>;
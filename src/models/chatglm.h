@@ -32,7 +32,13 @@ public:
     void embeddingForward(int *ids, float *output, int batchSize, int seqLen);
     void lastLayerNormForward(float *input, float *output, int rows);
     int *getPositionIds(int *ids, int batchSize, int seqLen, int step) override;
+    int *getSamplePositionIds(int *positionIds, int sampleIdx, int seqLen) override;
+    void squeezeSampleStates(int *idx, int size) override;
+    void rollbackSampleStates(int tokens) override;
+    bool supportsRollback() override { return false; }
     void setPrefix(int *ids, int seqLen) override;
+    size_t saveSession(int sessionId, int sampleIdx, int seqLen) override;
+    bool supportsSessions() override { return false; }
 
 private:
     void setEmbeddingWeights(const std::string &modelPath);
@@ -58,6 +64,9 @@ private:
     // Record last block positions
     std::vector<int> lastBlockPositions;
 
+    // Context length (position of the start ID) of each sample, for the prefix-LM attention mask
+    std::vector<int> contextLens;
+
     // position_ids + block_position_ids
     // For input_ids [ 74747,  83400,  66846, 130001, 130004], position_ids is:
     // [0, 1, 2, 3, 3] + [0, 0, 0, 0, 1], as gmask_token_id = 130001
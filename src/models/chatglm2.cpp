@@ -68,44 +68,8 @@ void ChatGLM2<WeiT>::setFinalLnWeight(const std::string &modelPath) {
 //     return attention_mask
 template <typename WeiT>
 void ChatGLM2<WeiT>::prepareAttnMask(int *ids, int step) {
-    DecoderContext *ctx = this->getContext();
-    int seqLen = ctx->inputSeqLen;
-    int sizeRequired = ctx->batchSize * seqLen * seqLen;
-
-    if (step == 0) {
-        float *mask = this->getAttnMask(sizeRequired);
-        // int startId = this->getStartId();
-
-        for (int b = 0; b < ctx->batchSize; ++b) {
-            // int contextLen = -1;
-            // auto it = std::find(ids + b * seqLen, ids + (b + 1) * seqLen, startId);
-            // if (it != ids + (b + 1) * seqLen) { contextLen = std::distance(ids + b * seqLen, it); }
-
-            auto pmask = mask + b * seqLen * seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                // int zeroLen = contextLen > (i + 1) ? contextLen : (i + 1);
-                int zeroLen = i + 1;
-                memset(pmask + i * seqLen, 0, zeroLen * sizeof(float)); // bottom left or 0:contextLen are 0
-                std::fill_n(pmask + i * seqLen + zeroLen, seqLen - zeroLen, std::numeric_limits<float>::lowest());
-            }
-        }
-    } else if (seqLen > 1) {
-        int sizeRequired = ctx->batchSize * this->accSeqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int b = 0; b < ctx->batchSize; ++b) {
-            auto pmask = mask + b * this->accSeqLen * seqLen;
-            int pastLen = this->accSeqLen - seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * this->accSeqLen, 0, (pastLen + i + 1) * sizeof(float));
-                std::fill_n(pmask + i * this->accSeqLen + pastLen + i + 1, seqLen - i - 1,
-                        std::numeric_limits<float>::lowest());
-            }
-        }
-    } else {
-        int sizeRequired = ctx->batchSize * this->accSeqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        memset(mask, 0, ctx->batchSize * this->accSeqLen * sizeof(float)); // all elements are 0
-    }
+    // Causal mask (with the offset of past tokens) is generated on the fly inside attention
+    this->getContext()->maskDesc.type = AttnMaskDesc::CAUSAL;
 }
 
 template <typename WeiT>
@@ -168,6 +132,24 @@ int *ChatGLM2<WeiT>::getPositionIds(int *ids, int batchSize, int seqLen, int ste
     return positionIds;
 }
 
+template <typename WeiT>
+void ChatGLM2<WeiT>::squeezeSampleStates(int *idx, int size) {
+    // Not prepared yet (like the next token model in HybridModel before step 1)
+    if (size == 0 || idx[size - 1] >= (int)lastBlockPositions.size()) { return; }
+
+    for (int i = 0; i < size; ++i) {
+        lastBlockPositions[i] = lastBlockPositions[idx[i]];
+    }
+    lastBlockPositions.resize(size);
+}
+
+template <typename WeiT>
+void ChatGLM2<WeiT>::rollbackSampleStates(int tokens) {
+    for (int &pos : lastBlockPositions) {
+        pos -= tokens;
+    }
+}
+
 template class ChatGLM2<float>;
 template class ChatGLM2<float16_t>;
 template class ChatGLM2<bfloat16_t>;
@@ -33,6 +33,8 @@ public:
     virtual void embeddingForward(int *ids, float *output, int batchSize, int seqLen);
     virtual void lastLayerNormForward(float *input, float *output, int rows);
     virtual int *getPositionIds(int *ids, int batchSize, int seqLen, int step) override;
+    virtual void squeezeSampleStates(int *idx, int size) override;
+    virtual void rollbackSampleStates(int tokens) override;
 
 private:
     virtual void setEmbeddingWeights(const std::string &modelPath);
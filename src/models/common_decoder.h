@@ -14,6 +14,9 @@
 // ============================================================================
 #pragma once
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <fstream>
 #include <string>
 #include <tuple>
@@ -22,6 +25,7 @@
 #include "INIReader.h"
 #include "abstract_decoder.h"
 #include "attention.h"
+#include "copy_util.h"
 #include "debugger.h"
 #include "decoder_layer.h"
 #include "dist_linear.h"
@@ -29,7 +33,9 @@
 #include "kvcache_manager.h"
 #include "messenger.h"
 #include "mlp_chatglm2.h"
+#include "mlp_llama.h"
 #include "mlp_standard.h"
+#include "simple_mem_pool.h"
 #include "timeline.h"
 #include "transformer_ctx.h"
 #include "transpose_util.h"
@@ -64,6 +70,12 @@ struct MlpTypeExtractor<ChatGLM2MLP<WeiT, InT, ImT, OutT, NORM_CLS, true>> {
     using Tout = OutT;
 };
 
+// MLP classes supporting sequence parallel (DecoderContext::seqParallel)
+template <typename T>
+struct MlpSeqParallel : std::false_type {};
+template <typename WeiT, typename InT, typename ImT, typename OutT>
+struct MlpSeqParallel<LlamaMLP<WeiT, InT, ImT, OutT>> : std::true_type {};
+
 /*
 Pipeline parallel and tensor parallel introduction:
 
@@ -196,6 +208,11 @@ public:
 
         this->prefixSeqLen = 0;
         this->prefixSharing = false;
+        this->scoreTargets = nullptr;
+        this->scoreOut = nullptr;
+        this->embedding = false;
+        this->embedPooling = PoolingMode::LAST_TOKEN;
+        this->embedOut = nullptr;
 
         // Quantization config
         const bool quantDecoderWeights = reader.GetBoolean(modelType, "quant_decoder_weights", false);
@@ -247,6 +264,11 @@ public:
 
         // KVCache Manager
         this->kvCacheMgr.reset(new KVCacheManager<KVCacheT>(layers));
+
+        if (!seqParallelSupported && Env::getSequenceParallel() > 0 && workers > 1 && rank == 0) {
+            printf("[Warning] XFT_SEQUENCE_PARALLEL is ignored, sequence parallel only supports float activations "
+                   "with LlamaMLP.\n");
+        }
     }
 
     virtual ~CommonDecoder() {
@@ -299,8 +321,15 @@ public:
                 ctx->resize(batchSize, inputSeqLen, pastSeqLen);
             }
 
-            // Enlarge buffer if needed
-            prepareBuffers(ctx, userSideBS, beamSize, logitsAll);
+            // Enlarge buffer if needed, logits of all positions are not kept when scoring or embedding
+            prepareBuffers(ctx, userSideBS, beamSize, logitsAll && !this->isPrefillOnly());
+
+            // Padding of the prompts is kept with the KV cache, as it is squeezed and grown with the samples
+            this->kvCacheMgr->setPadding(this->nextPadLens.empty() ? nullptr : this->nextPadLens.data(), batchSize);
+            this->nextPadLens.clear();
+        } else if (seqLen > 1) {
+            // Multiple tokens after the first step (like verifying draft tokens), KV cache is already there
+            prepareActBuffers(ctx, userSideBS, beamSize, logitsAll);
         }
 
         AttnInT *embBuf = (AttnInT *)actBuffers->Data();
@@ -321,90 +350,44 @@ public:
 
         // Prepare attention mask
         this->prepareAttnMask(ids, step + this->prefixSharing);
+        this->getContext()->maskDesc.padLens = this->kvCacheMgr->getPadLens();
 
         // Token position ids, note: different models may have different impl.
         int *positionIds = this->getPositionIds(ids, batchSize, inputSeqLen, step + this->prefixSharing);
         t1.release();
 
-#ifdef PIPELINE_PARALLEL
-        // if current pipeline parallel stage rank isn't the first stage, should receive previous stage data
-        if (ctx->ppSize > 1 && ctx->ppRank > 0) {
-            int curr_world_rank = ctx->ppRank * ctx->tpSize + ctx->tpRank;
-            int prev_world_rank = (ctx->ppRank - 1) * ctx->tpSize + ctx->tpRank;
-            int count = batchSize * inputSeqLen * ctx->hiddenSize;
-            MPI_Recv(embBuf, count, MPI_FLOAT, prev_world_rank, curr_world_rank, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            // TODO: Error: different scope when dynamic loading so file
-            // this->messenger.worldRecvFP32(embBuf, count, prev_world_rank, curr_world_rank);
-        }
-#endif
-
-        // Decoder: forward
-        int hiddenSize = ctx->hiddenSize;
-        int layers_per_pp_stage = this->decoders.size();
-        for (int i = 0; i < layers_per_pp_stage; ++i) {
-            int workers = this->messenger.getSize();
-            if (step == 0 && this->prefixSharing) {
-                // Expand the prefix KV cache for each batch
+        if (step == 0 && this->prefixSharing) {
+            // Expand the prefix KV cache for each batch
+            for (int i = 0; i < (int)this->decoders.size(); ++i) {
                 this->kvCacheMgr->expandPrefixCache(i, userSideBS, this->prefixSeqLen);
             }
-            KVCacheTensor<KVCacheT> &presentKey = this->kvCacheMgr->getKey(i);
-            KVCacheTensor<KVCacheT> &presentValue = this->kvCacheMgr->getValue(i);
-
-            // Pls be noted: in attention, 'outBuf' is used as imtermediate buffer, 'tmpBuf' is used as output
-            AttnOutT *attnOut = (AttnOutT *)(this->getContext()->tmpBuf.Data());
-            this->decoders[i]->forwardAttention(getContext(), embBuf, outBuf, attnOut, attnMask,
-                    presentKey, // presentKey,
-                    presentValue, // presentValue,
-                    inputSeqLen, // inputSeqLen,
-                    pastSeqLen, // pastSeqLen
-                    step == 0, // useSelfAttn,
-                    true, // doLnBefore,
-                    positionIds);
-
-            // Expand the KV cache as it only has values for beam 0
-            if (step == 0 && beamSize > 1) { this->kvCacheMgr->expandCache(i, userSideBS, beamSize, seqLen); }
-
-            // Merge the result of attention
-            // When attention and FFN/MLP are in parallel, do not need to reduce after attention
-            if constexpr (!ATTN_MLP_PARALLEL) {
-                if (this->messenger.getSize() > 1) {
-                    this->messenger.reduceAdd(attnOut, attnOut, batchSize * inputSeqLen * hiddenSize);
-                }
-            }
+        }
 
-            // When attention and FFN/MLP are in parallel, use the initial embedding as input
-            if constexpr (ATTN_MLP_PARALLEL) {
-                if (this->messenger.getSize() > 1) {
-                    this->decoders[i]->forwardFFN(getContext(), embBuf, outBuf, hiddenSize, hiddenSize, true);
-                    this->messenger.reduceAdd(outBuf, embBuf, batchSize * inputSeqLen * hiddenSize);
-                } else {
-                    this->decoders[i]->forwardFFN(getContext(), embBuf, embBuf, hiddenSize, hiddenSize, true);
-                }
-            } else {
-                // FFN (for multiple workers, output into outBuf and then reduce add to embBuf)
-                if (this->messenger.getSize() > 1) {
-                    this->decoders[i]->forwardFFN(getContext(), attnOut, outBuf, hiddenSize, hiddenSize, true);
-                    this->messenger.reduceAdd(outBuf, embBuf, batchSize * inputSeqLen * hiddenSize);
-                } else {
-                    this->decoders[i]->forwardFFN(getContext(), attnOut, embBuf, hiddenSize, hiddenSize, true);
-                }
-            }
+        // Decoder: forward
+#ifdef PIPELINE_PARALLEL
+        if (ctx->ppSize > 1) {
+            pipelineLayersForward(ctx, embBuf, outBuf, inputSeqLen, pastSeqLen, step == 0, positionIds);
+        } else {
+            layersForward(ctx, embBuf, outBuf, inputSeqLen, pastSeqLen, step == 0, positionIds);
         }
+#else
+        layersForward(ctx, embBuf, outBuf, inputSeqLen, pastSeqLen, step == 0, positionIds);
+#endif
+
+        // Expand the KV cache as it only has values for beam 0, the beams share the blocks of the prompt
+        if (step == 0 && beamSize > 1) { this->kvCacheMgr->expandCache(userSideBS, beamSize, seqLen); }
 
 #ifdef PIPELINE_PARALLEL
-        // If current pipeline stage isn't the end of stage, should send data to next stage and return nullptr
+        // If current pipeline stage isn't the end of stage, data is sent to next stage, thus return nullptr
         if (ctx->ppSize > 1 && ctx->ppRank < ctx->ppSize - 1) {
-            int next_world_rank = (ctx->ppRank + 1) * ctx->tpSize + ctx->tpRank;
-            int count = batchSize * inputSeqLen * ctx->hiddenSize;
-            MPI_Send(embBuf, count, MPI_FLOAT, next_world_rank, next_world_rank, MPI_COMM_WORLD);
-            // TODO: Error: different scope when dynamic loading so file
-            // this->messenger.worldSendFP32(embBuf, count, next_world_rank, next_world_rank);
+            if (step == 0 && this->prefixSharing) { free(ids); }
             return std::tuple<float *, int, int>(nullptr, 0, 0);
         }
 #endif
 
         // Prepare input for final Layer Norm (only care about the last row of the result)
         // Shape of embBuf: (bs, seqLen, hiddenSize)
+        int hiddenSize = ctx->hiddenSize;
         MlpOutT *lnIn = embBuf;
         if (inputSeqLen > 1 && !logitsAll) { // copy is not needed when seqLen = 1 or logitsAll is true
             lnIn = outBuf;
@@ -432,6 +415,20 @@ public:
         dbg.dumpMatrix(lnOut, batchSize, hiddenSize, hiddenSize);
 #endif
 
+        // Embedding: hidden states are the output, the predictor is skipped
+        if (this->embedding) {
+            if (this->embedOut != nullptr) { poolHiddenStates(lnOut, batchSize, logitsAll ? inputSeqLen : 1, hiddenSize); }
+            if (step == 0 && this->prefixSharing) { free(ids); }
+            return std::tuple<float *, int, int>(nullptr, 0, 0);
+        }
+
+        // Scoring: logits are reduced chunk by chunk into log-probabilities of the targets
+        if (logitsAll && this->scoreTargets != nullptr) {
+            scoreLogits(ctx, lnOut, (float *)outBuf, batchSize * seqLen, (size_t)batchSize * seqLen * hiddenSize);
+            if (step == 0 && this->prefixSharing) { free(ids); }
+            return std::tuple<float *, int, int>(nullptr, 0, 0);
+        }
+
         // Predictor
         float *finalOut = (float *)outBuf;
         if (!logitsAll)
@@ -466,6 +463,30 @@ public:
                 finalOut, this->predictor->getSplitOffset(), this->predictor->getSplitSize());
     }
 
+    // Log-probabilities of target tokens at all positions by one prefill, logits of all positions are never kept.
+    // ids and targets are in shape of [batchSize][seqLen], a negative target gets -inf.
+    // logprobs (same shape as targets) is only filled on master, other ranks can pass nullptr.
+    void score(int *ids, int64_t *dims, const int *targets, float *logprobs) {
+        this->scoreTargets = targets;
+        this->scoreOut = logprobs;
+        forward(ids, dims, 0, true);
+        this->scoreTargets = nullptr;
+        this->scoreOut = nullptr;
+    }
+
+    // Hidden states after the final layer norm by one prefill, the predictor (LM head) is skipped.
+    // ids is in shape of [batchSize][seqLen], output is [batchSize][hiddenSize] for LAST_TOKEN and MEAN pooling,
+    // or [batchSize][seqLen][hiddenSize] for NONE; output is only filled on master, other ranks can pass nullptr.
+    void embed(int *ids, int64_t *dims, PoolingMode pooling, float *output) {
+        this->embedding = true;
+        this->embedPooling = pooling;
+        this->embedOut = output;
+        // Only the last row goes through the final layer norm if not needing all positions
+        forward(ids, dims, 0, pooling != PoolingMode::LAST_TOKEN);
+        this->embedding = false;
+        this->embedOut = nullptr;
+    }
+
     void setPrefix(int *ids, int seqLen) {
         this->prefixSharing = true;
         this->prefixSeqLen = seqLen;
@@ -474,6 +495,72 @@ public:
 
     void unsetPrefix() { this->prefixSharing = false; }
 
+    size_t saveSession(int sessionId, int sampleIdx, int seqLen) {
+        return kvCacheMgr->saveSession(sessionId, sampleIdx, seqLen);
+    }
+
+    // The kept KV cache works like a computed prefix, thus only tokens after it are prefilled in next forward
+    bool loadSession(int sessionId) {
+        int seqLen = kvCacheMgr->loadSession(sessionId);
+        if (seqLen == 0) { return false; }
+
+        this->prefixSharing = true;
+        this->prefixSeqLen = seqLen;
+        return true;
+    }
+
+    void dropSession(int sessionId) { kvCacheMgr->dropSession(sessionId); }
+
+    virtual bool supportsSessions() { return true; }
+
+    void setPadding(const int *padLens, int size) {
+        if (padLens == nullptr) {
+            this->nextPadLens.clear();
+        } else {
+            this->nextPadLens.assign(padLens, padLens + size);
+        }
+    }
+
+    void appendSamples(const int *ids, int batchSize, int seqLen, const int *padLens) {
+        TimeLine t("Decoder.appendSamples");
+        DecoderContext *ctx = this->getContext();
+        int oldBatchSize = this->kvCacheMgr->getKey(0).getBatchSize();
+        int pastSeqLen = this->accSeqLen - seqLen;
+
+        // The new samples are cached from their first token, which is padLens[b] tokens after pastSeqLen
+        std::vector<int> cachePadLens(batchSize);
+        for (int b = 0; b < batchSize; ++b) {
+            cachePadLens[b] = pastSeqLen + padLens[b];
+        }
+        this->kvCacheMgr->growCache(oldBatchSize + batchSize, this->accSeqLen, cachePadLens.data());
+
+        if (seqLen > 0) {
+            ctx->resize(batchSize, seqLen, pastSeqLen);
+            prepareActBuffers(ctx, batchSize, 1, false);
+
+            AttnInT *embBuf = (AttnInT *)actBuffers->Data();
+            MlpOutT *outBuf = (MlpOutT *)(embBuf + batchSize * seqLen * ctx->hiddenSize);
+
+            std::vector<int> inputIds(ids, ids + batchSize * seqLen);
+            this->embeddingForward(inputIds.data(), embBuf, batchSize, seqLen);
+            this->prepareAttnMask(inputIds.data(), 1);
+            const int *allPadLens = this->kvCacheMgr->getPadLens();
+            ctx->maskDesc.padLens = allPadLens == nullptr ? nullptr : allPadLens + oldBatchSize;
+
+            // Layers see only the new samples, models supporting padding take positions from pastSeqLen
+            this->kvCacheMgr->setBatchOffset(oldBatchSize);
+            layersForward(ctx, embBuf, outBuf, seqLen, pastSeqLen, pastSeqLen == 0, nullptr);
+            this->kvCacheMgr->setBatchOffset(0);
+        }
+
+        // Buffers for the next steps of the whole batch
+        ctx->resize(oldBatchSize + batchSize, 1, this->accSeqLen);
+        prepareActBuffers(ctx, oldBatchSize + batchSize, 1, false);
+    }
+
+    // Models whose positions are absolute, or kept for each sample, cannot shift a sample by padding
+    virtual bool supportsPadding() { return false; }
+
     void prefixForward(int *ids, int seqLen) {
         // Assume input has been synced with master in higher level.
         // Assume the prefix token's shape is [1][1][seqLen].
@@ -494,58 +581,47 @@ public:
 
         // Prepare attention mask
         this->prepareAttnMask(ids, 0);
+        ctx->maskDesc.padLens = nullptr;
 
         // Token position ids, note: different models may have different impl.
         int *positionIds = this->getPositionIds(ids, 1, seqLen, 0);
         t1.release();
 
-        // Decoder: forward
-        // TODO: Add PIPELINE_PARALLEL feature
-        int hiddenSize = ctx->hiddenSize;
-        for (int i = 0; i < this->decoders.size(); ++i) {
-            int workers = this->messenger.getSize();
-            KVCacheTensor<KVCacheT> &presentKey = this->kvCacheMgr->getPrefixKey(i);
-            KVCacheTensor<KVCacheT> &presentValue = this->kvCacheMgr->getPrefixValue(i);
+        // Decoder: forward, the prefix flows through pipeline stages like a batch of one sample
+#ifdef PIPELINE_PARALLEL
+        if (ctx->ppSize > 1) {
+            pipelineLayersForward(ctx, embBuf, outBuf, seqLen, 0, true, positionIds, true);
+        } else {
+            layersForward(ctx, embBuf, outBuf, seqLen, 0, true, positionIds, true);
+        }
+#else
+        layersForward(ctx, embBuf, outBuf, seqLen, 0, true, positionIds, true);
+#endif
+    }
 
-            // Pls be noted: in attention, 'outBuf' is used as imtermediate buffer, 'tmpBuf' is used as output
-            AttnOutT *attnOut = (AttnOutT *)(this->getContext()->tmpBuf.Data());
-            this->decoders[i]->forwardAttention(getContext(), embBuf, outBuf, attnOut, attnMask,
-                    presentKey, // presentKey,
-                    presentValue, // presentValue,
-                    seqLen, // inputSeqLen,
-                    0, // pastSeqLen
-                    true, // useSelfAttn,
-                    true, // doLnBefore,
-                    positionIds);
+    // Reorder cached keys and values, size=batchSize*beamSize
+    void reorderCache(int *idx, int size) { kvCacheMgr->reorderCache(idx, size, accSeqLen); }
 
-            // Merge the result of attention
-            // When attention and FFN/MLP are in parallel, do not need to reduce after attention
-            if constexpr (!ATTN_MLP_PARALLEL) {
-                if (this->messenger.getSize() > 1) { this->messenger.reduceAdd(attnOut, attnOut, seqLen * hiddenSize); }
-            }
+    // Drop finished/cancelled samples from KV cache and sample related states
+    void squeezeCache(int *idx, int size) {
+        kvCacheMgr->squeezeCache(idx, size, accSeqLen);
+        this->squeezeSampleStates(idx, size);
+    }
 
-            // When attention and FFN/MLP are in parallel, use the initial embedding as input
-            if constexpr (ATTN_MLP_PARALLEL) {
-                if (this->messenger.getSize() > 1) {
-                    this->decoders[i]->forwardFFN(getContext(), embBuf, outBuf, hiddenSize, hiddenSize, true);
-                    this->messenger.reduceAdd(outBuf, embBuf, seqLen * hiddenSize);
-                } else {
-                    this->decoders[i]->forwardFFN(getContext(), embBuf, embBuf, hiddenSize, hiddenSize, true);
-                }
-            } else {
-                // FFN (for multiple workers, output into outBuf and then reduce add to embBuf)
-                if (this->messenger.getSize() > 1) {
-                    this->decoders[i]->forwardFFN(getContext(), attnOut, outBuf, hiddenSize, hiddenSize, true);
-                    this->messenger.reduceAdd(outBuf, embBuf, seqLen * hiddenSize);
-                } else {
-                    this->decoders[i]->forwardFFN(getContext(), attnOut, embBuf, hiddenSize, hiddenSize, true);
-                }
-            }
-        }
+    // Models keeping states for each sample (like position info.) need to squeeze them
+    virtual void squeezeSampleStates(int *idx, int size) {}
+
+    // Cached keys/values of dropped tokens are simply overwritten, as the cache is written at accSeqLen
+    void rollbackCache(int tokens) {
+        this->accSeqLen -= tokens;
+        this->rollbackSampleStates(tokens);
     }
 
-    // Reorder cached keys and values, size=batchSize*beamSize
-    void reorderCache(int *idx, int size) { kvCacheMgr->reorderCache(idx, size, initSeqLen, accSeqLen); }
+    // Models keeping states for each sample need to roll them back as well
+    virtual void rollbackSampleStates(int tokens) {}
+
+    // Models not able to roll back their sample states override it to return false
+    virtual bool supportsRollback() { return true; }
 
     // Get decoder context
     DecoderContext *getContext() { return context.get(); }
@@ -843,15 +919,33 @@ protected:
 
     virtual void prepareBuffers(
             DecoderContext *ctx, int userSideBS, int beamSize, bool logitsAll = false, bool prefix = false) {
-        int batchSize = ctx->batchSize;
-        int hiddenSize = ctx->hiddenSize;
         int seqLen = ctx->inputSeqLen;
-        int vocabSize = ctx->vocabSize;
         int maxPositions = ctx->maxPositions;
-        int layers = this->decoders.size();
         int workers = this->messenger.getSize();
 
         // Prepare buffers
+        prepareActBuffers(ctx, userSideBS, beamSize, logitsAll);
+
+        // Cached keys/values
+        // The maximum sequence length is to be the same as maxPositions, at most
+        // And the cache always needs to account for beam size
+        // Prefill only forward (scoring/embedding) does not generate, thus only needs cache for the input
+        int headsPerSplit = (ctx->kvHeadNum + workers - 1) / workers;
+        int cacheSeqLen = maxPositions;
+        if (prefix) {
+            cacheSeqLen = this->prefixSeqLen;
+        } else if (isPrefillOnly()) {
+            cacheSeqLen = seqLen + (this->prefixSharing ? this->prefixSeqLen : 0);
+        }
+        this->kvCacheMgr->resize(cacheSeqLen, userSideBS * beamSize, headsPerSplit, ctx->attHeadSize, prefix);
+    }
+
+    void prepareActBuffers(DecoderContext *ctx, int userSideBS, int beamSize, bool logitsAll) {
+        int batchSize = ctx->batchSize;
+        int hiddenSize = ctx->hiddenSize;
+        int seqLen = ctx->inputSeqLen;
+        int vocabSize = ctx->vocabSize;
+
         int logitsLen = logitsAll ? batchSize * seqLen : userSideBS * beamSize;
         int actRows = batchSize * seqLen; // rows for activation
 
@@ -859,18 +953,15 @@ protected:
         int outRows = actRows;
         if (logitsLen * vocabSize > outRows * hiddenSize) { outRows = logitsLen * vocabSize / hiddenSize + 1; }
 
-        this->actBuffers->Resize(actRows + outRows, hiddenSize);
+        // Sequence parallel pads the rows of the activations to a multiple of ranks (see seqParallelLayersForward)
+        int spareRows = this->messenger.getSize() - 1;
 
-        // Attention mask
-        int sizeRequired = batchSize * seqLen * seqLen;
-        getAttnMask(sizeRequired);
+        this->actBuffers->Resize(actRows + outRows + spareRows, hiddenSize);
+    }
 
-        // Cached keys/values
-        // The maximum sequence length is to be the same as maxPositions, at most
-        // And the cache always needs to account for beam size
-        int headsPerSplit = (ctx->kvHeadNum + workers - 1) / workers;
-        this->kvCacheMgr->resize(prefix ? this->prefixSeqLen : maxPositions, userSideBS * beamSize, headsPerSplit,
-                ctx->attHeadSize, prefix);
+    // Dense attention mask, or nullptr if the mask is described by ctx->maskDesc and generated inside attention
+    const float *getDenseMask() {
+        return getContext()->maskDesc.type == AttnMaskDesc::DENSE ? this->attnMask : nullptr;
     }
 
     float *getAttnMask(int sizeRequired) {
@@ -884,6 +975,107 @@ protected:
 
     int getStartId() { return startId; }
 
+    bool isPrefillOnly() { return this->scoreTargets != nullptr || this->embedding; }
+
+    // rows: rows of each sample in lnOut, which is 1 if only the last position is normalized
+    template <typename T>
+    void poolHiddenStates(const T *lnOut, int batchSize, int rows, int hiddenSize) {
+        if (this->embedPooling == PoolingMode::NONE) {
+#pragma omp parallel for
+            for (int r = 0; r < batchSize * rows; ++r) {
+                for (int i = 0; i < hiddenSize; ++i) {
+                    this->embedOut[(size_t)r * hiddenSize + i] = (float)lnOut[(size_t)r * hiddenSize + i];
+                }
+            }
+            return;
+        }
+
+        // For LAST_TOKEN, only the last position was normalized
+        int first = this->embedPooling == PoolingMode::MEAN ? 0 : rows - 1;
+        float scale = 1.0f / (rows - first);
+#pragma omp parallel for
+        for (int b = 0; b < batchSize; ++b) {
+            float *dst = this->embedOut + (size_t)b * hiddenSize;
+            std::fill(dst, dst + hiddenSize, 0.0f);
+            for (int s = first; s < rows; ++s) {
+                const T *src = lnOut + ((size_t)b * rows + s) * hiddenSize;
+                for (int i = 0; i < hiddenSize; ++i) {
+                    dst[i] += (float)src[i];
+                }
+            }
+            for (int i = 0; i < hiddenSize; ++i) {
+                dst[i] *= scale;
+            }
+        }
+    }
+
+    // Each rank computes (max, sum of exp, target logit) of its vocabulary split for each row in chunks,
+    // thus only 3 floats per row are gathered to get the log-probability.
+    // buf: buffer for logits of a chunk, which can hold bufSize floats
+    template <typename T>
+    void scoreLogits(DecoderContext *ctx, T *lnOut, float *buf, int rows, size_t bufSize) {
+        TimeLine t("Decoder.scoreLogits");
+        const int splitSize = this->predictor->getSplitSize();
+        const int splitOffset = this->predictor->getSplitOffset();
+        const int chunkRows = std::max((size_t)1, bufSize / splitSize);
+
+        std::vector<float> stats(rows * 3);
+        for (int start = 0; start < rows; start += chunkRows) {
+            int n = std::min(chunkRows, rows - start);
+            this->predictor->forward(ctx, lnOut + (size_t)start * ctx->hiddenSize, buf, n);
+
+#pragma omp parallel for
+            for (int r = 0; r < n; ++r) {
+                const float *logits = buf + (size_t)r * splitSize;
+                float maxVal = logits[0];
+                for (int i = 1; i < splitSize; ++i) {
+                    maxVal = std::max(maxVal, logits[i]);
+                }
+                float sum = 0;
+                for (int i = 0; i < splitSize; ++i) {
+                    sum += std::exp(logits[i] - maxVal);
+                }
+
+                int target = this->scoreTargets[start + r] - splitOffset;
+                float *rowStats = stats.data() + (start + r) * 3;
+                rowStats[0] = maxVal;
+                rowStats[1] = sum;
+                rowStats[2] = (this->scoreTargets[start + r] >= 0 && target >= 0 && target < splitSize)
+                        ? logits[target]
+                        : -INFINITY;
+            }
+        }
+
+        int workers = this->messenger.getSize();
+        std::vector<float> allStats;
+        if (workers > 1) {
+            allStats.resize(workers * rows * 3);
+            std::vector<long unsigned int> recvCounts(workers, rows * 3);
+            this->messenger.allgatherv(stats.data(), rows * 3, allStats.data(), recvCounts);
+        } else {
+            allStats.swap(stats);
+        }
+
+        if (this->scoreOut == nullptr) { return; }
+
+#pragma omp parallel for
+        for (int r = 0; r < rows; ++r) {
+            float maxVal = -INFINITY;
+            float target = -INFINITY;
+            for (int w = 0; w < workers; ++w) {
+                const float *rowStats = allStats.data() + (w * rows + r) * 3;
+                maxVal = std::max(maxVal, rowStats[0]);
+                target = std::max(target, rowStats[2]);
+            }
+            float sum = 0;
+            for (int w = 0; w < workers; ++w) {
+                const float *rowStats = allStats.data() + (w * rows + r) * 3;
+                sum += rowStats[1] * std::exp(rowStats[0] - maxVal);
+            }
+            this->scoreOut[r] = target - maxVal - std::log(sum);
+        }
+    }
+
     virtual void embeddingForward(int *ids, float *output, int batchSize, int seqLen) {
         printf("embeddingForward(float) must be implemented.\n");
         exit(-1);
@@ -907,6 +1099,11 @@ protected:
 public:
     virtual int *getPositionIds(int *ids, int batchSize, int seqLen, int step) { return nullptr; }
 
+    // Position IDs from sample sampleIdx, in the buffer returned by getPositionIds
+    virtual int *getSamplePositionIds(int *positionIds, int sampleIdx, int seqLen) {
+        return positionIds == nullptr ? nullptr : positionIds + sampleIdx * seqLen;
+    }
+
 protected:
     // For communication
     Messenger &messenger;
@@ -923,6 +1120,18 @@ protected:
 
     bool prefixSharing;
 
+    // Left padding of the prompts at next first step, see setPadding
+    std::vector<int> nextPadLens;
+
+    // Targets and output of score(), nullptr if not scoring
+    const int *scoreTargets;
+    float *scoreOut;
+
+    // Pooling and output of embed()
+    bool embedding;
+    PoolingMode embedPooling;
+    float *embedOut;
+
     // If not the master, need to receive token IDs from the master
     int *inputTokens;
 
@@ -944,6 +1153,268 @@ protected:
     using LinearWeiT = typename std::conditional<std::is_same_v<MlpOutT, bfloat16_t>, bfloat16_t, float16_t>::type;
     DistLinear<LinearWeiT> *predictor;
 
+    // Forward all decoder layers of this stage for ctx->batchSize samples, the result is in embBuf
+    // prefix: computing the shared prefix, whose keys/values go to the prefix cache
+    void layersForward(DecoderContext *ctx, AttnInT *embBuf, MlpOutT *outBuf, int inputSeqLen, int pastSeqLen,
+            bool useSelfAttn, int *positionIds, bool prefix = false) {
+        if constexpr (seqParallelSupported) {
+            if (useSeqParallel(ctx->batchSize * inputSeqLen)) {
+                seqParallelLayersForward(
+                        ctx, embBuf, outBuf, inputSeqLen, pastSeqLen, useSelfAttn, positionIds, prefix);
+                return;
+            }
+        }
+
+        int hiddenSize = ctx->hiddenSize;
+        int count = ctx->batchSize * inputSeqLen * hiddenSize;
+        for (int i = 0; i < (int)this->decoders.size(); ++i) {
+            KVCacheTensor<KVCacheT> &presentKey
+                    = prefix ? this->kvCacheMgr->getPrefixKey(i) : this->kvCacheMgr->getKey(i);
+            KVCacheTensor<KVCacheT> &presentValue
+                    = prefix ? this->kvCacheMgr->getPrefixValue(i) : this->kvCacheMgr->getValue(i);
+
+            // Pls be noted: in attention, 'outBuf' is used as imtermediate buffer, 'tmpBuf' is used as output
+            AttnOutT *attnOut = (AttnOutT *)(ctx->tmpBuf.Data());
+            this->decoders[i]->forwardAttention(ctx, embBuf, outBuf, attnOut, getDenseMask(),
+                    presentKey, // presentKey,
+                    presentValue, // presentValue,
+                    inputSeqLen, // inputSeqLen,
+                    pastSeqLen, // pastSeqLen
+                    useSelfAttn, // useSelfAttn,
+                    true, // doLnBefore,
+                    positionIds);
+
+            // Merge the result of attention
+            // When attention and FFN/MLP are in parallel, do not need to reduce after attention
+            if constexpr (!ATTN_MLP_PARALLEL) {
+                if (this->messenger.getSize() > 1) { this->messenger.reduceAdd(attnOut, attnOut, count); }
+            }
+
+            // When attention and FFN/MLP are in parallel, use the initial embedding as input
+            if constexpr (ATTN_MLP_PARALLEL) {
+                if (this->messenger.getSize() > 1) {
+                    this->decoders[i]->forwardFFN(ctx, embBuf, outBuf, hiddenSize, hiddenSize, true);
+                    this->messenger.reduceAdd(outBuf, embBuf, count);
+                } else {
+                    this->decoders[i]->forwardFFN(ctx, embBuf, embBuf, hiddenSize, hiddenSize, true);
+                }
+            } else {
+                // FFN (for multiple workers, output into outBuf and then reduce add to embBuf)
+                if (this->messenger.getSize() > 1) {
+                    this->decoders[i]->forwardFFN(ctx, attnOut, outBuf, hiddenSize, hiddenSize, true);
+                    this->messenger.reduceAdd(outBuf, embBuf, count);
+                } else {
+                    this->decoders[i]->forwardFFN(ctx, attnOut, embBuf, hiddenSize, hiddenSize, true);
+                }
+            }
+        }
+    }
+
+    // Whether layersForward goes sequence parallel for the rows (tokens)
+    bool useSeqParallel(int rows) {
+        int minTokens = Env::getSequenceParallel();
+        return seqParallelSupported && this->messenger.getSize() > 1 && minTokens > 0 && rows >= minTokens;
+    }
+
+    // Pre-norm layers with all activations in float, attention and MLP in sequence
+    static constexpr bool seqParallelSupported = MlpSeqParallel<MLP_CLS>::value && !ATTN_MLP_PARALLEL
+            && std::is_same_v<AttnInT, float> && std::is_same_v<typename AttnTypeExtractor<ATTN_CLS>::Tim, float>
+            && std::is_same_v<AttnOutT, float> && std::is_same_v<MlpInT, float> && std::is_same_v<MlpOutT, float>;
+
+    // Sequence parallel: each rank owns a slice of rows (tokens) of the residual. The partial outputs of attention
+    // and MLP are reduce-scattered into the slices instead of allreduced, the residual add and the norm are done on
+    // the slice, then normalized slices are allgathered as the input of the next column parallel GEMM.
+    // Bytes moved are the same as allreduce, while the residual add and norm are divided among ranks.
+    // Slices are gathered straight into embBuf and reduced out of outBuf, the padding rows past embBuf (next
+    // micro-batch or outBuf) are kept aside and restored, those past outBuf are scratch or the spare rows.
+    void seqParallelLayersForward(DecoderContext *ctx, AttnInT *embBuf, MlpOutT *outBuf, int inputSeqLen,
+            int pastSeqLen, bool useSelfAttn, int *positionIds, bool prefix) {
+        if constexpr (seqParallelSupported) {
+            const int hiddenSize = ctx->hiddenSize;
+            const int rows = ctx->batchSize * inputSeqLen;
+            const int ranks = this->messenger.getSize();
+            const int rank = this->messenger.getRank();
+
+            // Slices are padded to the same size as needed by the collectives
+            const int sliceRows = (rows + ranks - 1) / ranks;
+            const int myRows = std::max(std::min(rows - rank * sliceRows, sliceRows), 0);
+            const size_t sliceSize = (size_t)sliceRows * hiddenSize;
+            const size_t mySize = (size_t)myRows * hiddenSize;
+
+            const size_t padSize = sliceSize * ranks - (size_t)rows * hiddenSize;
+
+            auto &pool = SimpleMemPool::instance();
+            float *resid = (float *)pool.getBuffer("sp_resid", sizeof(float) * sliceSize);
+            float *normed = (float *)pool.getBuffer("sp_normed", sizeof(float) * sliceSize);
+            float *spill = (float *)pool.getBuffer("sp_spill", sizeof(float) * std::max(padSize, (size_t)1));
+
+            memcpy(resid, embBuf + rank * sliceSize, sizeof(float) * mySize);
+            memset(resid + mySize, 0, sizeof(float) * (sliceSize - mySize));
+            memcpy(spill, embBuf + (size_t)rows * hiddenSize, sizeof(float) * padSize);
+
+            // Reduce-scatter the partial output and add it into the residual slice
+            auto reduceIntoResid = [&]() {
+                this->messenger.reduceScatter(outBuf, normed, sliceSize);
+#pragma omp parallel for
+                for (size_t i = 0; i < mySize; ++i) {
+                    resid[i] += normed[i];
+                }
+            };
+
+            ctx->seqParallel = true;
+            for (int i = 0; i < (int)this->decoders.size(); ++i) {
+                KVCacheTensor<KVCacheT> &presentKey
+                        = prefix ? this->kvCacheMgr->getPrefixKey(i) : this->kvCacheMgr->getKey(i);
+                KVCacheTensor<KVCacheT> &presentValue
+                        = prefix ? this->kvCacheMgr->getPrefixValue(i) : this->kvCacheMgr->getValue(i);
+
+                // Padding rows of the slice are zero after the norm, never read by the layers
+                // Attention reads the gathered input and puts its intermediate result there as well
+                this->decoders[i]->forwardAttnNorm(ctx, resid, normed, sliceRows);
+                this->messenger.allgather(normed, sliceSize, embBuf);
+                this->decoders[i]->forwardAttention(ctx, embBuf, outBuf, outBuf, getDenseMask(), presentKey,
+                        presentValue, inputSeqLen, pastSeqLen, useSelfAttn, true, positionIds);
+                reduceIntoResid();
+
+                this->decoders[i]->forwardFFNNorm(ctx, resid, normed, sliceRows);
+                this->messenger.allgather(normed, sliceSize, embBuf);
+                this->decoders[i]->forwardFFN(ctx, embBuf, outBuf, hiddenSize, hiddenSize, true);
+                reduceIntoResid();
+            }
+            ctx->seqParallel = false;
+
+            // The full residual for the final norm and the next stage
+            this->messenger.allgather(resid, sliceSize, embBuf);
+            memcpy(embBuf + (size_t)rows * hiddenSize, spill, sizeof(float) * padSize);
+        }
+    }
+
+#ifdef PIPELINE_PARALLEL
+    // Samples are split into micro-batches flowing through the stages one after another, thus a stage computes
+    // micro-batch i+1 while the next stage computes micro-batch i. Activations are received and sent without blocking
+    // the computing: all receives are posted at first, and the send of a micro-batch overlaps with the next one.
+    void pipelineLayersForward(DecoderContext *ctx, AttnInT *embBuf, MlpOutT *outBuf, int inputSeqLen, int pastSeqLen,
+            bool useSelfAttn, int *positionIds, bool prefix = false) {
+        TimeLine t("Decoder.pipelineForward");
+        const int batchSize = ctx->batchSize;
+        const int hiddenSize = ctx->hiddenSize;
+        const int microBatches = getMicroBatches(ctx, batchSize, inputSeqLen);
+        const bool isFirstStage = ctx->ppRank == 0;
+        const bool isLastStage = ctx->ppRank == ctx->ppSize - 1;
+        int currWorldRank = ctx->ppRank * ctx->tpSize + ctx->tpRank;
+        int prevWorldRank = (ctx->ppRank - 1) * ctx->tpSize + ctx->tpRank;
+        int nextWorldRank = (ctx->ppRank + 1) * ctx->tpSize + ctx->tpRank;
+
+        // Samples of micro-batch m are [starts[m], starts[m + 1])
+        std::vector<int> starts(microBatches + 1);
+        for (int m = 0; m <= microBatches; ++m) {
+            starts[m] = batchSize * m / microBatches;
+        }
+        auto rowOffset = [&](int m) { return (size_t)starts[m] * inputSeqLen * hiddenSize; };
+        auto rowCount = [&](int m) { return (size_t)(starts[m + 1] - starts[m]) * inputSeqLen * hiddenSize; };
+
+        // MPI counts (and copy_MT sizes) are int, thus rows of a micro-batch are handled in pieces of INT_MAX at most,
+        // fn(offset, count) is called for each piece
+        auto forEachPiece = [&](int m, auto fn) {
+            for (size_t off = 0; off < rowCount(m); off += INT_MAX) {
+                fn(rowOffset(m) + off, (int)std::min(rowCount(m) - off, (size_t)INT_MAX));
+            }
+        };
+
+        // Activations are transferred in BF16 by default to halve the traffic, converted in the staging buffers once
+        // received and before sent (each micro-batch has its own region as sends are in flight together)
+        const bool bf16Transfer = Env::getPipelineBF16Transfer();
+        bfloat16_t *recvBuf = nullptr;
+        bfloat16_t *sendBuf = nullptr;
+        if (bf16Transfer) {
+            size_t size = sizeof(bfloat16_t) * rowOffset(microBatches);
+            if (!isFirstStage) { recvBuf = (bfloat16_t *)SimpleMemPool::instance().getBuffer("pp_recv", size); }
+            if (!isLastStage) { sendBuf = (bfloat16_t *)SimpleMemPool::instance().getBuffer("pp_send", size); }
+        }
+
+        // Messages of the same source and tag are matched in order, thus micro-batches share the tag
+        std::vector<std::vector<MPI_Request>> recvRequests(microBatches);
+        std::vector<MPI_Request> sendRequests;
+        if (!isFirstStage) {
+            for (int m = 0; m < microBatches; ++m) {
+                forEachPiece(m, [&](size_t off, int count) {
+                    recvRequests[m].emplace_back();
+                    if (bf16Transfer) {
+                        MPI_Irecv(recvBuf + off, count, MPI_UNSIGNED_SHORT, prevWorldRank, currWorldRank,
+                                MPI_COMM_WORLD, &recvRequests[m].back());
+                    } else {
+                        MPI_Irecv(embBuf + off, count, MPI_FLOAT, prevWorldRank, currWorldRank, MPI_COMM_WORLD,
+                                &recvRequests[m].back());
+                    }
+                });
+            }
+        }
+
+        const int *prefixLens = ctx->maskDesc.prefixLens;
+        const int *padLens = ctx->maskDesc.padLens;
+        for (int m = 0; m < microBatches; ++m) {
+            if (!isFirstStage) {
+                MPI_Waitall(recvRequests[m].size(), recvRequests[m].data(), MPI_STATUSES_IGNORE);
+
+                // Sequence parallel borrows the rows after the micro-batch, which must not be received meanwhile
+                int rows = (starts[m + 1] - starts[m]) * inputSeqLen;
+                if (!bf16Transfer && m + 1 < microBatches && useSeqParallel(rows)) {
+                    MPI_Waitall(recvRequests[m + 1].size(), recvRequests[m + 1].data(), MPI_STATUSES_IGNORE);
+                }
+                if (bf16Transfer) {
+                    forEachPiece(m, [&](size_t off, int count) { xft::copy_MT(embBuf + off, recvBuf + off, count); });
+                }
+            }
+
+            // Let the layers see the micro-batch as the whole batch
+            int start = starts[m];
+            ctx->resize(starts[m + 1] - start, inputSeqLen, pastSeqLen);
+            this->kvCacheMgr->setBatchOffset(start);
+            if (prefixLens != nullptr) { ctx->maskDesc.prefixLens = prefixLens + start; }
+            if (padLens != nullptr) { ctx->maskDesc.padLens = padLens + start; }
+
+            layersForward(ctx, embBuf + rowOffset(m), outBuf + rowOffset(m), inputSeqLen, pastSeqLen, useSelfAttn,
+                    getSamplePositionIds(positionIds, start, inputSeqLen), prefix);
+
+            if (!isLastStage) {
+                forEachPiece(m, [&](size_t off, int count) {
+                    sendRequests.emplace_back();
+                    if (bf16Transfer) {
+                        xft::copy_MT(sendBuf + off, embBuf + off, count);
+                        MPI_Isend(sendBuf + off, count, MPI_UNSIGNED_SHORT, nextWorldRank, nextWorldRank,
+                                MPI_COMM_WORLD, &sendRequests.back());
+                    } else {
+                        MPI_Isend(embBuf + off, count, MPI_FLOAT, nextWorldRank, nextWorldRank, MPI_COMM_WORLD,
+                                &sendRequests.back());
+                    }
+                });
+            }
+        }
+
+        ctx->resize(batchSize, inputSeqLen, pastSeqLen);
+        this->kvCacheMgr->setBatchOffset(0);
+        ctx->maskDesc.prefixLens = prefixLens;
+        ctx->maskDesc.padLens = padLens;
+
+        MPI_Waitall(sendRequests.size(), sendRequests.data(), MPI_STATUSES_IGNORE);
+    }
+
+    // Micro-batch number, by default the same as stages. But tiny prefill micro-batches are not worth it: the stage is
+    // bound by reading weights, which is repeated for each micro-batch. Decoding splits the samples anyway, as without
+    // micro-batches all stages but one are idle during a step.
+    int getMicroBatches(DecoderContext *ctx, int batchSize, int inputSeqLen) {
+        constexpr int minTokens = 64; // Tokens of each prefill micro-batch, when the number is not specified
+        if (getDenseMask() != nullptr) { return 1; } // Dense mask is not split into micro-batches
+        int num = Env::getPipelineMicroBatch();
+        if (num == 0 && inputSeqLen == 1) {
+            num = batchSize >= ctx->ppSize ? ctx->ppSize : 1;
+        } else if (num == 0) {
+            num = std::min(ctx->ppSize, batchSize * inputSeqLen / minTokens);
+        }
+        return std::max(1, std::min(num, batchSize));
+    }
+#endif
+
 private:
     int maskSize; // size of allocated attnMask
     float *attnMask; // attention mask, set as private as may need to enlarge
@@ -48,6 +48,7 @@ public:
             this->firstStepSeqLen = dims[2];
             promptIds.resize(dims[0] * dims[2]);
             std::copy(ids, ids + dims[0] * dims[2], promptIds.begin());
+            this->decoding = false;
 
             return firstModel->forward(ids, dims, step, logitsAll);
         } else {
@@ -63,13 +64,55 @@ public:
 
                 int initSeqLen = firstModel->getInitSeqLen();
                 nextModel->skipFirstStep(initSeqLen);
+                promptIds.clear();
+                this->decoding = true;
             }
 
             return nextModel->forward(ids, dims, step, logitsAll);
         }
     }
 
-    void reorderCache(int *idx, int size) { return firstModel->reorderCache(idx, size); }
+    // Scoring is prefill only
+    void score(int *ids, int64_t *dims, const int *targets, float *logprobs) {
+        firstModel->score(ids, dims, targets, logprobs);
+    }
+
+    void embed(int *ids, int64_t *dims, PoolingMode pooling, float *output) {
+        firstModel->embed(ids, dims, pooling, output);
+    }
+
+    // The KV cache is shared, but only the model of the last forward knows its length
+    void reorderCache(int *idx, int size) {
+        if (decoding) {
+            nextModel->reorderCache(idx, size);
+        } else {
+            firstModel->reorderCache(idx, size);
+        }
+    }
+
+    void squeezeCache(int *idx, int size) {
+        // KV cache is shared, only squeeze sample states for the other model
+        if (decoding) {
+            nextModel->squeezeCache(idx, size);
+            firstModel->squeezeSampleStates(idx, size);
+            return;
+        }
+        firstModel->squeezeCache(idx, size);
+        nextModel->squeezeSampleStates(idx, size);
+
+        // Prompt information is used at step 1
+        for (int b = 0; b < size; ++b) {
+            std::copy(promptIds.begin() + idx[b] * firstStepSeqLen, promptIds.begin() + (idx[b] + 1) * firstStepSeqLen,
+                    promptIds.begin() + b * firstStepSeqLen);
+        }
+        promptIds.resize(size * firstStepSeqLen);
+        firstStepBS = size;
+    }
+
+    // Tokens after the first step are only forwarded by the other model
+    void rollbackCache(int tokens) { nextModel->rollbackCache(tokens); }
+
+    bool supportsRollback() { return nextModel->supportsRollback(); }
 
     DecoderContext *getContext() { return firstModel->getContext(); }
 
@@ -83,6 +126,34 @@ public:
 
     void unsetPrefix() { firstModel->unsetPrefix(); }
 
+    // KV cache is shared, and the prefix is only used at the first step
+    size_t saveSession(int sessionId, int sampleIdx, int seqLen) {
+        return firstModel->saveSession(sessionId, sampleIdx, seqLen);
+    }
+
+    bool loadSession(int sessionId) { return firstModel->loadSession(sessionId); }
+
+    void dropSession(int sessionId) { firstModel->dropSession(sessionId); }
+
+    bool supportsSessions() { return firstModel->supportsSessions(); }
+
+    void setPadding(const int *padLens, int size) { firstModel->setPadding(padLens, size); }
+
+    void appendSamples(const int *ids, int batchSize, int seqLen, const int *padLens) {
+        if (decoding) {
+            nextModel->appendSamples(ids, batchSize, seqLen, padLens);
+            return;
+        }
+        firstModel->appendSamples(ids, batchSize, seqLen, padLens);
+
+        // Models supporting padding do not take positions from the prompt, the rows only keep the prompt information
+        // aligned with the samples till step 1
+        promptIds.resize((firstStepBS + batchSize) * firstStepSeqLen, 0);
+        firstStepBS += batchSize;
+    }
+
+    bool supportsPadding() { return firstModel->supportsPadding(); }
+
 private:
     Model<FirstTokenDtype> *firstModel;
     Model<NextTokenDtype> *nextModel;
@@ -90,4 +161,5 @@ private:
     std::vector<int> promptIds;
     int firstStepBS;
     int firstStepSeqLen;
+    bool decoding = false; // Whether the next model has taken over, after step 0
 };
\ No newline at end of file
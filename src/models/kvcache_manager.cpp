@@ -14,93 +14,17 @@
 // ============================================================================
 #include "kvcache_manager.h"
 #include <algorithm>
-#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include "bfloat16.h"
 #include "float16.h"
 
-/******************** Start functions used by reorderCache *******************/
-template <typename T>
-void swapValues32(T *p1, T *p2, int size) {
-    static_assert(sizeof(T) == 4, "swapValues32 is designed for data types with 4 bytes.");
-
-    int i = 0;
-    for (; i + 15 < size; i += 16) {
-        __m512 v1 = _mm512_loadu_ps(p1 + i);
-        __m512 v2 = _mm512_loadu_ps(p2 + i);
-        _mm512_storeu_ps(p1 + i, v2);
-        _mm512_storeu_ps(p2 + i, v1);
-    }
-
-    if (i < size) {
-        int remain = size - i;
-        __mmask16 mask = (1 << remain) - 1;
-
-        __m512 v1 = _mm512_maskz_loadu_ps(mask, p1 + i);
-        __m512 v2 = _mm512_maskz_loadu_ps(mask, p2 + i);
-        _mm512_mask_storeu_ps(p1 + i, mask, v2);
-        _mm512_mask_storeu_ps(p2 + i, mask, v1);
-    }
-}
-
-template <typename T>
-void swapValues16(T *p1, T *p2, int size) {
-    static_assert(sizeof(T) == 2, "swapValues16 is designed for data types with 2 bytes.");
-
-    int i = 0;
-    for (; i + 31 < size; i += 32) {
-        __m512i v1 = _mm512_loadu_si512((__m512i *)(p1 + i));
-        __m512i v2 = _mm512_loadu_si512((__m512i *)(p2 + i));
-        _mm512_storeu_si512(p1 + i, v2);
-        _mm512_storeu_si512(p2 + i, v1);
-    }
-
-    if (i < size) {
-        int remain = size - i;
-        __mmask32 mask = (1 << remain) - 1;
-
-        __m512i v1 = _mm512_maskz_loadu_epi16(mask, (__m512i *)(p1 + i));
-        __m512i v2 = _mm512_maskz_loadu_epi16(mask, (__m512i *)(p2 + i));
-        _mm512_mask_storeu_epi16(p1 + i, mask, v2);
-        _mm512_mask_storeu_epi16(p2 + i, mask, v1);
-    }
-}
-
-static void swapValues(float *p1, float *p2, int size) {
-    swapValues32(p1, p2, size);
-}
-
-static void swapValues(float16_t *p1, float16_t *p2, int size) {
-    swapValues16(p1, p2, size);
-}
-
-static void swapValues(bfloat16_t *p1, bfloat16_t *p2, int size) {
-    swapValues16(p1, p2, size);
-}
-
-template <typename T>
-static void skippableCopy(T *dst, T *src, int size) {
-    // Copy only when different
-    // TODO: check if there are any risks
-    if (*(uint64_t *)dst != *(uint64_t *)src) { memcpy(dst, src, size * sizeof(T)); }
-}
-
-template <typename T>
-static bool valueExist(T *arr, int size, T val) {
-    for (int i = 0; i < size; ++i) {
-        if (arr[i] == val) { return true; }
-    }
-    return false;
-}
-
-/******************** end functions used by reorderCache *******************/
-
-template <typename KVCacheT>
-void KVCacheManager<KVCacheT>::resize(int maxSeqLen, int batchSize, int headsPerSplit, int headSize, bool prefix) {
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::resize(
+        int maxSeqLen, int batchSize, int headsPerSplit, int headSize, bool prefix) {
     if (prefix && this->cachedPrefixKeys == nullptr) {
-        this->cachedPrefixKeys = new KVCacheTensor<KVCacheT>[layers];
-        this->cachedPrefixValues = new KVCacheTensor<KVCacheT>[layers];
+        this->cachedPrefixKeys = new KVCacheTensor<KVCacheT, Layout>[layers];
+        this->cachedPrefixValues = new KVCacheTensor<KVCacheT, Layout>[layers];
     }
     for (int i = 0; i < this->layers; ++i) {
         if (prefix) {
@@ -109,145 +33,169 @@ void KVCacheManager<KVCacheT>::resize(int maxSeqLen, int batchSize, int headsPer
         } else {
             this->cachedKeys[i].resize(maxSeqLen, batchSize, headsPerSplit, headSize);
             this->cachedValues[i].resize(maxSeqLen, batchSize, headsPerSplit, headSize);
+            this->cachedKeys[i].setBlockTable(&this->blockTable);
+            this->cachedValues[i].setBlockTable(&this->blockTable);
         }
     }
+    if (!prefix) {
+        this->blockTable.reset(maxSeqLen, batchSize);
+        this->padLens.clear();
+    }
 }
 
-template <typename KVCacheT>
-void KVCacheManager<KVCacheT>::expandCache(int layerId, int userSideBS, int beamSize, int seqLen) {
-    KVCacheTensor<KVCacheT> *pTensors[2];
-    pTensors[0] = &this->cachedKeys[layerId];
-    pTensors[1] = &this->cachedValues[layerId];
-
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < 2; ++i) {
-        for (int seq = 0; seq < seqLen; ++seq) {
-            pTensors[i]->expandOneSequence(userSideBS, beamSize, seq);
-        }
-    }
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::expandCache(int userSideBS, int beamSize, int seqLen) {
+    this->blockTable.share(userSideBS, beamSize, seqLen);
+    ownBlock(seqLen);
 }
 
-template <typename KVCacheT>
-void KVCacheManager<KVCacheT>::expandPrefixCache(int layerId, int userSideBS, int seqLen) {
-    KVCacheTensor<KVCacheT> *dstTensors[2];
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::expandPrefixCache(int layerId, int userSideBS, int seqLen) {
+    KVCacheTensor<KVCacheT, Layout> *dstTensors[2];
     dstTensors[0] = &this->cachedKeys[layerId];
     dstTensors[1] = &this->cachedValues[layerId];
 
-    KVCacheTensor<KVCacheT> *srcTensors[2];
+    KVCacheTensor<KVCacheT, Layout> *srcTensors[2];
     srcTensors[0] = &this->cachedPrefixKeys[layerId];
     srcTensors[1] = &this->cachedPrefixValues[layerId];
 
-    int headNum = dstTensors[0]->getHeadNum();
-    int headSize = dstTensors[0]->getHeadSize();
-
 #pragma omp parallel for collapse(2)
     for (int i = 0; i < 2; ++i) {
         for (int seq = 0; seq < seqLen; ++seq) {
-            auto *src = srcTensors[i]->getSequence(seq, 0, 0);
             for (int b = userSideBS - 1; b >= 0; --b) {
-                auto *dst = dstTensors[i]->getSequence(seq, b, 0);
-                memcpy(dst, src, headNum * headSize * sizeof(KVCacheT));
+                dstTensors[i]->copySequence(seq, b, *srcTensors[i], seq, 0);
             }
         }
     }
 }
 
-// Reorder cached keys and values
-// TODO: move to KVCacheTensor is better
-template <typename KVCacheT>
-void KVCacheManager<KVCacheT>::reorderCache(int *idx, int size, int initSeqLen, int accSeqLen) {
-    // Reorder for all the layers
-#pragma omp parallel for
-    for (int layer = 0; layer < this->layers; ++layer) {
-        KVCacheTensor<KVCacheT> &keyTensor = this->getKey(layer);
-        KVCacheTensor<KVCacheT> &valueTensor = this->getValue(layer);
-
-        const int cols = keyTensor.getHeadNum() * keyTensor.getHeadSize();
-        const int batchSize = keyTensor.getBatchSize();
-
-        KVCacheT *keys = keyTensor.getData() + initSeqLen * batchSize * cols;
-        KVCacheT *values = valueTensor.getData() + initSeqLen * batchSize * cols;
-
-        // Temporary buffer used for reorder
-        KVCacheT *extraKeyBuf = (KVCacheT *)aligned_alloc(64, 2 * (batchSize - 1) * cols * sizeof(KVCacheT));
-        KVCacheT *extraValBuf = extraKeyBuf + (batchSize - 1) * cols;
-
-        for (int seq = initSeqLen; seq < accSeqLen; ++seq) { // Reorder is not needed for the first few lines
-            int extraBufIdx = 0;
-            int remapped[batchSize];
-            memcpy(remapped, idx, batchSize * sizeof(int));
-
-            for (int i = 0; i < batchSize; ++i) {
-                int from = remapped[i];
-                if (from < i) { // The source line already reordered
-                    // Current line will be used in future, thus save to extra buffer
-                    if (valueExist(remapped + i + 1, batchSize - i - 1, i)) {
-                        memcpy(extraKeyBuf + extraBufIdx * cols, keys + i * cols, cols * sizeof(KVCacheT));
-                        memcpy(extraValBuf + extraBufIdx * cols, values + i * cols, cols * sizeof(KVCacheT));
-
-                        // When need line i, should look into temporary buffer, (extraBufIdx - batchSize) < 0, always
-                        std::replace(remapped + i + 1, remapped + batchSize, i, extraBufIdx - batchSize);
-                        extraBufIdx += 1;
-                    }
-
-                    if (from < 0) { // copy from extraBuf
-                        skippableCopy(keys + i * cols, extraKeyBuf + (from + batchSize) * cols, cols);
-                        skippableCopy(values + i * cols, extraValBuf + (from + batchSize) * cols, cols);
-                    } else {
-                        skippableCopy(keys + i * cols, keys + from * cols, cols);
-                        skippableCopy(values + i * cols, values + from * cols, cols);
-                    }
-                } else if (from > i) {
-                    // Just need to swap
-                    if (remapped[from] == i) {
-                        swapValues(keys + i * cols, keys + from * cols, cols);
-                        swapValues(values + i * cols, values + from * cols, cols);
-
-                        // Update the map information
-                        std::transform(remapped + i + 1, remapped + batchSize, remapped + i + 1, [&](int num) {
-                            if (num == i) {
-                                return from;
-                            } else if (num == from) {
-                                return i;
-                            }
-                            return num;
-                        });
-                    }
-                    // Current line will be used in future, thus save to extra buffer
-                    else if (valueExist(remapped + i + 1, batchSize - i - 1, i)) {
-                        memcpy(extraKeyBuf + extraBufIdx * cols, keys + i * cols, cols * sizeof(KVCacheT));
-                        memcpy(extraValBuf + extraBufIdx * cols, values + i * cols, cols * sizeof(KVCacheT));
-
-                        // When need line i, should look into temporary buffer, (extraBufIdx - batchSize) < 0, always
-                        std::replace(remapped + i + 1, remapped + batchSize, i, extraBufIdx - batchSize);
-                        extraBufIdx += 1;
-
-                        skippableCopy(keys + i * cols, keys + from * cols, cols);
-                        skippableCopy(values + i * cols, values + from * cols, cols);
-
-                        // When need line 'from', should look into line i
-                        std::replace(remapped + i + 1, remapped + batchSize, from, i);
-                    }
-                    // Current line will never be used in futre, just overwrite it
-                    else {
-                        skippableCopy(keys + i * cols, keys + from * cols, cols);
-                        skippableCopy(values + i * cols, values + from * cols, cols);
-
-                        // When need line 'from', should look into line i
-                        std::replace(remapped + i + 1, remapped + batchSize, from, i);
-                    }
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::reorderCache(int *idx, int size, int accSeqLen) {
+    this->blockTable.reorder(idx, accSeqLen);
+    ownBlock(accSeqLen);
+}
+
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::ownBlock(int accSeqLen) {
+    // Copy on write: beams sharing the newest block need their own copy before appending to it
+    auto copies = this->blockTable.own(accSeqLen);
+    if (copies.empty()) { return; }
+
+    const int startSeq = accSeqLen / KVBlockTable::kBlockSize * KVBlockTable::kBlockSize;
+    const int copyNum = copies.size();
+
+#pragma omp parallel for collapse(2)
+    for (int i = 0; i < 2 * this->layers; ++i) {
+        for (int c = 0; c < copyNum; ++c) {
+            KVCacheTensor<KVCacheT, Layout> &tensor
+                    = (i % 2 == 0) ? this->cachedKeys[i / 2] : this->cachedValues[i / 2];
+            const int headNum = tensor.getHeadNum();
+            const int headSize = tensor.getHeadSize();
+            for (int seq = startSeq; seq < accSeqLen; ++seq) {
+                for (int h = 0; h < headNum; ++h) {
+                    memcpy(tensor.getSlotSequence(seq, copies[c].second, h),
+                            tensor.getSlotSequence(seq, copies[c].first, h), headSize * sizeof(KVCacheT));
                 }
             }
+        }
+    }
+}
+
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::squeezeCache(const int *idx, int size, int accSeqLen) {
+    // Blocks shared by the kept samples stay shared, each block only keeps the slots still referred
+    auto kept = this->blockTable.squeeze(idx, size, accSeqLen);
+
+    // Each tensor must be squeezed in order, thus parallel among tensors
+#pragma omp parallel for
+    for (int i = 0; i < 2 * this->layers; ++i) {
+        KVCacheTensor<KVCacheT, Layout> &tensor = (i % 2 == 0) ? this->cachedKeys[i / 2] : this->cachedValues[i / 2];
+        tensor.squeezeSequence(kept, KVBlockTable::kBlockSize, size, accSeqLen);
+    }
 
-            keys += batchSize * cols;
-            values += batchSize * cols;
+    if (!this->padLens.empty()) {
+        std::vector<int> keptPadLens(size);
+        for (int i = 0; i < size; ++i) {
+            keptPadLens[i] = this->padLens[idx[i]];
         }
+        setPadding(keptPadLens.data(), size);
+    }
+}
+
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::growCache(int size, int accSeqLen, const int *padLens) {
+    const int oldSize = this->cachedKeys[0].getBatchSize();
+    this->blockTable.grow(size);
 
-        // Clean up
-        free(extraKeyBuf);
+#pragma omp parallel for
+    for (int i = 0; i < 2 * this->layers; ++i) {
+        KVCacheTensor<KVCacheT, Layout> &tensor = (i % 2 == 0) ? this->cachedKeys[i / 2] : this->cachedValues[i / 2];
+        tensor.growBatch(size, accSeqLen);
     }
+
+    std::vector<int> allPadLens(this->padLens);
+    allPadLens.resize(oldSize, 0);
+    allPadLens.insert(allPadLens.end(), padLens, padLens + size - oldSize);
+    setPadding(allPadLens.data(), size);
+}
+
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::setPadding(const int *padLens, int size) {
+    this->padLens.clear();
+    if (padLens != nullptr && std::any_of(padLens, padLens + size, [](int len) { return len > 0; })) {
+        this->padLens.assign(padLens, padLens + size);
+    }
+}
+
+template <typename KVCacheT, typename Layout>
+size_t KVCacheManager<KVCacheT, Layout>::saveSession(int sessionId, int sampleIdx, int seqLen) {
+    const int startSeq = this->padLens.empty() ? 0 : this->padLens[sampleIdx];
+    SessionCache &session = this->sessions[sessionId];
+    session.seqLen = seqLen;
+    session.headNum = this->cachedKeys[0].getHeadNum();
+    session.headSize = this->cachedKeys[0].getHeadSize();
+
+    const int cols = session.headNum * session.headSize;
+    session.data.resize((size_t)2 * this->layers * seqLen * cols);
+    session.data.shrink_to_fit();
+
+#pragma omp parallel for
+    for (int i = 0; i < 2 * this->layers; ++i) {
+        KVCacheTensor<KVCacheT, Layout> &tensor = (i % 2 == 0) ? this->cachedKeys[i / 2] : this->cachedValues[i / 2];
+        tensor.saveSample(sampleIdx, startSeq, seqLen, session.data.data() + (size_t)i * seqLen * cols);
+    }
+
+    return session.data.size() * sizeof(KVCacheT);
+}
+
+template <typename KVCacheT, typename Layout>
+int KVCacheManager<KVCacheT, Layout>::loadSession(int sessionId) {
+    auto it = this->sessions.find(sessionId);
+    if (it == this->sessions.end()) { return 0; }
+
+    const SessionCache &session = it->second;
+    const int seqLen = session.seqLen;
+    const int cols = session.headNum * session.headSize;
+    this->resize(seqLen, 1, session.headNum, session.headSize, true);
+
+#pragma omp parallel for
+    for (int i = 0; i < 2 * this->layers; ++i) {
+        KVCacheTensor<KVCacheT, Layout> &tensor
+                = (i % 2 == 0) ? this->cachedPrefixKeys[i / 2] : this->cachedPrefixValues[i / 2];
+        tensor.loadSample(0, seqLen, session.data.data() + (size_t)i * seqLen * cols);
+    }
+
+    return seqLen;
+}
+
+template <typename KVCacheT, typename Layout>
+void KVCacheManager<KVCacheT, Layout>::dropSession(int sessionId) {
+    this->sessions.erase(sessionId);
 }
 
-template class KVCacheManager<float16_t>;
-template class KVCacheManager<bfloat16_t>;
-template class KVCacheManager<float>;
\ No newline at end of file
+template class KVCacheManager<float16_t, KVLayoutSeqMajor>;
+template class KVCacheManager<bfloat16_t, KVLayoutSeqMajor>;
+template class KVCacheManager<float, KVLayoutSeqMajor>;
+template class KVCacheManager<float16_t, KVLayoutHeadMajor>;
+template class KVCacheManager<bfloat16_t, KVLayoutHeadMajor>;
+template class KVCacheManager<float, KVLayoutHeadMajor>;
\ No newline at end of file
@@ -14,16 +14,19 @@
 // ============================================================================
 #pragma once
 #include <cstdlib>
+#include <unordered_map>
+#include <vector>
 #include "kvcache_tensor.h"
 
 // KVCacheT: data type of the key/value buffer
-template <typename KVCacheT>
+// Layout: memory layout of the key/value tensors, see KVLayoutSeqMajor and KVLayoutHeadMajor
+template <typename KVCacheT, typename Layout = KVLayoutDefault>
 class KVCacheManager {
 public:
     KVCacheManager(int layers) {
         this->layers = layers;
-        this->cachedKeys = new KVCacheTensor<KVCacheT>[layers];
-        this->cachedValues = new KVCacheTensor<KVCacheT>[layers];
+        this->cachedKeys = new KVCacheTensor<KVCacheT, Layout>[layers];
+        this->cachedValues = new KVCacheTensor<KVCacheT, Layout>[layers];
         this->cachedPrefixKeys = nullptr;
         this->cachedPrefixValues = nullptr;
     }
@@ -38,20 +41,29 @@ public:
     // Resize, enlarge key/value buffers if not big enough
     void resize(int maxSeqLen, int batchSize, int headsPerSplit, int headSize, bool prefix = false);
 
-    KVCacheTensor<KVCacheT> &getKey(int layerId) { return cachedKeys[layerId]; }
+    KVCacheTensor<KVCacheT, Layout> &getKey(int layerId) { return cachedKeys[layerId]; }
 
-    KVCacheTensor<KVCacheT> &getValue(int layerId) { return cachedValues[layerId]; }
+    KVCacheTensor<KVCacheT, Layout> &getValue(int layerId) { return cachedValues[layerId]; }
 
-    KVCacheTensor<KVCacheT> &getPrefixKey(int layerId) { return cachedPrefixKeys[layerId]; }
+    KVCacheTensor<KVCacheT, Layout> &getPrefixKey(int layerId) { return cachedPrefixKeys[layerId]; }
 
-    KVCacheTensor<KVCacheT> &getPrefixValue(int layerId) { return cachedPrefixValues[layerId]; }
+    KVCacheTensor<KVCacheT, Layout> &getPrefixValue(int layerId) { return cachedPrefixValues[layerId]; }
+
+    // Let samples [offset, offset + micro-batch size) be accessed as [0, micro-batch size) in all layers
+    void setBatchOffset(int offset) {
+        for (int i = 0; i < layers; ++i) {
+            cachedKeys[i].setBatchOffset(offset);
+            cachedValues[i].setBatchOffset(offset);
+        }
+    }
 
     /**
-     * Expand both key and value cache for a specified layer
+     * Expand key and value cache of all layers, after the first step (all layers) is done
      * Needed when beam size > 1, while only unique samples are sent to do inference
-     * See more in KVCacheTensor::expandAllSequence
+     * Beams of a sample share the seqLen cached tokens through the block table, only the last partial block is
+     * copied, so that each beam can append to it. It is also how parallel sampling forks a prompt into samples
     */
-    void expandCache(int layerId, int userSideBS, int beamSize, int seqLen);
+    void expandCache(int userSideBS, int beamSize, int seqLen);
 
     /**
      * Fill both key and value prefix cache for a specified layer
@@ -61,17 +73,75 @@ public:
 
     /**
      * Reorder cached keys/values, needed by beam search
+     * Beam i continues the history of beam idx[i] by updating the block table, only the block to be appended
+     * (which contains accSeqLen) is copied if it is shared by several beams
      * idx: reorder index which has 'size' elements
      * size: user_side_bs * beamSize
-     * initSeqLen: initial sequence length, which is the prompt token size
      * accSeqLen: accumulated sequence length
     */
-    void reorderCache(int *idx, int size, int initSeqLen, int accSeqLen);
+    void reorderCache(int *idx, int size, int accSeqLen);
+
+    /**
+     * Only keep some samples in cached keys/values, see more in KVCacheTensor::squeezeSequence
+     * Blocks shared by kept samples (like the prompt of parallel sampling) are kept shared
+     * idx: index of samples to keep, in ascending order
+     * size: new batch size
+     * accSeqLen: accumulated sequence length
+    */
+    void squeezeCache(const int *idx, int size, int accSeqLen);
+
+    /**
+     * Append samples to the batch (requests joining at a step boundary), the first accSeqLen tokens of the existing
+     * samples are kept, the new samples are left padded until they are computed
+     * size: new batch size
+     * padLens: padding of the new samples, see setPadding
+    */
+    void growCache(int size, int accSeqLen, const int *padLens);
+
+    /**
+     * Left padding of the samples: the first padLens[b] tokens of sample b are not attended (see AttnMaskDesc), their
+     * keys/values may be never computed. Cleared when the cache is resized for a new batch
+    */
+    void setPadding(const int *padLens, int size);
+
+    // nullptr if no sample is padded
+    const int *getPadLens() const { return padLens.empty() ? nullptr : padLens.data(); }
+
+    /**
+     * Keep cached keys/values of a sample as a session, which survives following batches
+     * sessionId: user defined session ID, the old copy of the session is replaced
+     * sampleIdx: which sample in the batch
+     * seqLen: how many tokens (from the beginning, after the padding) to keep
+     * Return the memory size of the session in bytes
+    */
+    size_t saveSession(int sessionId, int sampleIdx, int seqLen);
+
+    /**
+     * Copy keys/values of a session into the prefix cache, so that it can be expanded as the prefix of next batch
+     * Return the sequence length of the session, 0 if the session does not exist
+    */
+    int loadSession(int sessionId);
+
+    void dropSession(int sessionId);
 
 private:
+    // Make each sample the only owner of the block containing accSeqLen (to be appended), see KVBlockTable::own
+    void ownBlock(int accSeqLen);
+
+    struct SessionCache {
+        int seqLen;
+        int headNum;
+        int headSize;
+        std::vector<KVCacheT> data; // [layers][2][seqLen][headNum * headSize]
+    };
+
+
     int layers; // how many layers
-    KVCacheTensor<KVCacheT> *cachedKeys; // all accumulated keys
-    KVCacheTensor<KVCacheT> *cachedValues; // all accumulated values
-    KVCacheTensor<KVCacheT> *cachedPrefixKeys; // all accumulated prefix keys
-    KVCacheTensor<KVCacheT> *cachedPrefixValues; // all accumulated prefix values
+    KVCacheTensor<KVCacheT, Layout> *cachedKeys; // all accumulated keys
+    KVCacheTensor<KVCacheT, Layout> *cachedValues; // all accumulated values
+    KVCacheTensor<KVCacheT, Layout> *cachedPrefixKeys; // all accumulated prefix keys
+    KVCacheTensor<KVCacheT, Layout> *cachedPrefixValues; // all accumulated prefix values
+    std::unordered_map<int, SessionCache> sessions; // kept keys/values of sessions
+    KVBlockTable blockTable; // shared by keys/values of all layers, as all of them are reordered in the same way
+    std::vector<int> padLens; // left padding of each sample, empty if none
 };
\ No newline at end of file
@@ -34,6 +34,9 @@ public:
 
     void prepareAttnMask(int *ids, int step);
 
+    // Rotary embedding only depends on relative positions, thus samples can be shifted by left padding
+    bool supportsPadding() override { return true; }
+
     void embeddingForward(int *ids, float *output, int batchSize, int seqLen);
     void embeddingForward(int *ids, bfloat16_t *output, int batchSize, int seqLen);
 
@@ -16,6 +16,8 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <stdexcept>
 
 #include "INIReader.h"
@@ -32,12 +34,17 @@
 #include "yarn_llama.h"
 
 namespace xft {
-enum class GenerationMode { GREEDY_SEARCH, BEAM_SEARCH, SAMPLE };
+enum class GenerationMode { GREEDY_SEARCH, BEAM_SEARCH, SAMPLE, PROMPT_LOOKUP };
 
-GenerationMode getGenerationMode(SearcherConfig &config_) {
+// Prompt lookup falls back to greedy search if not supported by the model (see Model::supportsPromptLookup)
+GenerationMode getGenerationMode(SearcherConfig &config_, bool promptLookup) {
     if (config_.numBeams == 1) {
         if (config_.doSample) {
             return GenerationMode::SAMPLE;
+        } else if (promptLookup && config_.promptLookupNum > 0 && config_.repetitionPenalty == 1.0
+                && config_.presencePenalty == 0 && config_.frequencyPenalty == 0 && config_.minNewTokens == 0) {
+            // Drafts are verified together, thus penalties depending on previous tokens are not supported
+            return GenerationMode::PROMPT_LOOKUP;
         } else {
             return GenerationMode::GREEDY_SEARCH;
         }
@@ -49,7 +56,50 @@ GenerationMode getGenerationMode(SearcherConfig &config_) {
     }
 }
 
-Model::Model() : decoder(nullptr), searcher(nullptr), isNewInput(true) {
+// Control message broadcast by master at the beginning of each step().
+// It is laid out like SearcherConfig, so that the exit flag from exitSlaves() is understood by slaves in step().
+struct StepControl {
+    int reserved0;
+    int reserved1;
+    int action; // Aliases SearcherConfig::numBeams, 0 means exit
+    int keepSize; // If > 0, samples are dropped from the running batch, followed by a broadcast of kept indices
+    int loadSession; // Session resumed by the new batch, -1 if none
+    int dropCount; // Sessions to release, then sessions to keep, followed by a broadcast of them
+    int saveCount;
+    int joinCount; // Requests joining the running batch, followed by a broadcast of them (see selectJoins)
+    int joinLen; // Length of the joining rows, left padded to the longest one
+    int reserved[sizeof(SearcherConfig) / sizeof(int) - 9];
+};
+static_assert(sizeof(StepControl) == sizeof(SearcherConfig), "StepControl must match SearcherConfig in size");
+static_assert(offsetof(StepControl, action) == offsetof(SearcherConfig, numBeams), "Exit flag position mismatch");
+
+enum StepAction { STEP_EXIT = 0, STEP_NEW_BATCH = 1, STEP_NEXT_TOKEN = 2 };
+
+static bool sameConfig(const SearcherConfig &a, const SearcherConfig &b) {
+    return a.maxLen == b.maxLen && a.numBeams == b.numBeams && a.numBeamHypsToKeep == b.numBeamHypsToKeep
+            && a.lenPenalty == b.lenPenalty && a.doEarlyStopping == b.doEarlyStopping && a.eosTokenId == b.eosTokenId
+            && a.padTokenId == b.padTokenId && a.doSample == b.doSample && a.temperature == b.temperature
+            && a.topK == b.topK && a.topP == b.topP && a.repetitionPenalty == b.repetitionPenalty
+            && a.presencePenalty == b.presencePenalty && a.frequencyPenalty == b.frequencyPenalty
+            && a.minNewTokens == b.minNewTokens && a.numLogprobs == b.numLogprobs
+            && a.promptLookupNum == b.promptLookupNum && a.promptLookupNgram == b.promptLookupNgram;
+}
+
+// Token filling the left padding, never attended
+static int padToken(const SearcherConfig &config, int endId) {
+    if (config.padTokenId != -1) { return config.padTokenId; }
+    return config.eosTokenId != -1 ? config.eosTokenId : endId;
+}
+
+Model::Model()
+    : decoder(nullptr)
+    , searcher(nullptr)
+    , isNewInput(true)
+    , nextHandle(0)
+    , maxBatchSize(16)
+    , batchLen(0)
+    , sessionTTL(600)
+    , maxSessionBytes((size_t)8 << 30) {
     Env::initEnvValue();
     TimeLine::init();
 }
@@ -143,16 +193,65 @@ std::vector<int32_t> Model::generate() {
     }
 }
 
+std::vector<float> Model::score(std::vector<int32_t> &inputIds_, int batchSize_) {
+    this->input(inputIds_, batchSize_);
+
+    // The target of each position is the next token
+    std::vector<int32_t> targets(inputIds.size());
+    for (int b = 0; b < batchSize; ++b) {
+        for (int i = 0; i < seqLen; ++i) {
+            targets[b * seqLen + i] = (i + 1 < seqLen) ? inputIds[b * seqLen + i + 1] : -1;
+        }
+    }
+
+    std::vector<float> logprobs;
+    if (decoder->getRank() == 0) { logprobs.resize(inputIds.size()); }
+
+    int64_t dims[3] = {batchSize, 1, seqLen};
+    decoder->score(inputIds.data(), dims, targets.data(), logprobs.data());
+
+    // Drop the last position of each row, which has no target
+    std::vector<float> ret;
+    if (decoder->getRank() == 0) {
+        ret.reserve(batchSize * (seqLen - 1));
+        for (int b = 0; b < batchSize; ++b) {
+            ret.insert(ret.end(), logprobs.begin() + b * seqLen, logprobs.begin() + (b + 1) * seqLen - 1);
+        }
+    }
+    return ret;
+}
+
+std::vector<float> Model::embed(std::vector<int32_t> &inputIds_, int batchSize_, PoolingMode pooling) {
+    int poolingMode = (int)pooling;
+    decoder->getMessenger().broadcast(&poolingMode, 1);
+    pooling = (PoolingMode)poolingMode;
+
+    this->input(inputIds_, batchSize_);
+
+    std::vector<float> ret;
+    if (decoder->getRank() == 0) {
+        int rows = pooling == PoolingMode::NONE ? batchSize * seqLen : batchSize;
+        ret.resize((size_t)rows * decoder->getContext()->hiddenSize);
+    }
+
+    int64_t dims[3] = {batchSize, 1, seqLen};
+    decoder->embed(inputIds.data(), dims, pooling, ret.empty() ? nullptr : ret.data());
+
+    return ret;
+}
+
 void Model::createSearcher(SearcherConfig &config_) {
     if (searcher != nullptr) { delete searcher; }
 
-    GenerationMode genMode = getGenerationMode(config_);
+    GenerationMode genMode = getGenerationMode(config_, supportsPromptLookup());
     if (genMode == GenerationMode::GREEDY_SEARCH) {
         searcher = new GreedySearch(*decoder, config_);
     } else if (genMode == GenerationMode::BEAM_SEARCH) {
         searcher = new BeamSearch(*decoder, config_);
     } else if (genMode == GenerationMode::SAMPLE) {
         searcher = new SampleSearch(*decoder, config_);
+    } else if (genMode == GenerationMode::PROMPT_LOOKUP) {
+        searcher = new PromptLookupSearch(*decoder, config_);
     }
 }
 
@@ -160,6 +259,47 @@ int Model::getRank() {
     return decoder->getRank();
 }
 
+bool Model::supportsSessions() {
+    return decoder->supportsSessions();
+}
+
+bool Model::supportsPromptLookup() {
+    if (!decoder->supportsRollback()) { return false; }
+#ifdef PIPELINE_PARALLEL
+    if (decoder->getContext()->ppSize > 1) { return false; }
+#endif
+    return true;
+}
+
+bool Model::supportsPadding() {
+    if (!decoder->supportsPadding()) { return false; }
+#ifdef PIPELINE_PARALLEL
+    if (decoder->getContext()->ppSize > 1) { return false; }
+#endif
+    return true;
+}
+
+// Rows are only padded by greedy search and sampling of one sample per prompt, as beams and samples are expanded
+// from the prompts
+bool Model::canPad(SearcherConfig config) {
+    GenerationMode mode = getGenerationMode(config, supportsPromptLookup());
+    return supportsPadding()
+            && (mode == GenerationMode::GREEDY_SEARCH
+                    || (mode == GenerationMode::SAMPLE && config.numBeamHypsToKeep <= 1));
+}
+
+// Send the padding of the prompts to slaves and the searcher (empty if not padded), after input()
+void Model::setPadding(std::vector<int> padLens) {
+    Messenger &messenger = decoder->getMessenger();
+    int size = padLens.size();
+    messenger.broadcast(&size, 1);
+    if (size == 0) { return; }
+
+    padLens.resize(size);
+    messenger.broadcast(padLens.data(), size);
+    searcher->setPadding(padLens);
+}
+
 void Model::setDecoder(AbstractDecoder *dec) {
     decoder = dec;
 }
@@ -248,6 +388,544 @@ bool Model::setStopWords(std::vector<std::vector<int>> stopWordsList) {
     }
 }
 
+bool Model::setGrammar(std::shared_ptr<const TokenGrammar> grammar_, const std::vector<int> &states) {
+    if (searcher == nullptr) {
+        printf("[Warning] Fails to set grammar. Please config model first.");
+        return false;
+    }
+    Messenger &messenger = decoder->getMessenger();
+
+    // Header: 0 for no grammar, 1 for the one sent last time, 2 for a new one; then sizes of grammar data and states
+    int header[3] = {0, 0, 0};
+    std::vector<int> data;
+    if (decoder->getRank() == 0 && grammar_ != nullptr) {
+        header[0] = grammar_ == this->grammar ? 1 : 2;
+        if (header[0] == 2) { data = grammar_->serialize(); }
+        header[1] = data.size();
+        header[2] = states.size();
+    }
+    messenger.broadcast(header, 3);
+
+    if (header[0] == 2) {
+        data.resize(header[1]);
+        messenger.broadcast(data.data(), header[1]);
+        this->grammar = decoder->getRank() == 0 ? grammar_ : TokenGrammar::deserialize(data);
+    }
+
+    std::vector<int> rowStates(states);
+    rowStates.resize(header[2]);
+    if (header[2] > 0) { messenger.broadcast(rowStates.data(), header[2]); }
+
+    if (!searcher->setGrammar(header[0] == 0 ? nullptr : this->grammar, rowStates)) {
+        printf("[Warning] Grammar is not supported by the searcher, output is not constrained.\n");
+        return false;
+    }
+    return header[0] != 0;
+}
+
+int Model::addRequest(std::vector<int32_t> &inputIds_, SearcherConfig &config_,
+        const std::vector<std::vector<int>> &stopWordsList_, int sessionId, RequestPriority priority,
+        std::shared_ptr<const TokenGrammar> grammar_) {
+    if (inputIds_.empty()) {
+        printf("Input ids of a request cannot be empty.\n");
+        exit(-1);
+    }
+
+    int handle = nextHandle++;
+    Request &req = requests[handle];
+    req.inputIds = inputIds_;
+    req.config = config_;
+    req.stopWordsList = stopWordsList_;
+    req.sessionId = decoder->supportsSessions() ? sessionId : -1;
+    req.priority = priority;
+    req.history = inputIds_;
+    req.grammar = grammar_;
+    req.grammarState = grammar_ ? grammar_->getStartState() : 0;
+    waitingRequests.push_back(handle);
+
+    return handle;
+}
+
+// Whether a request can run in the batch led by leader, a different prompt length needs padding
+bool Model::canBatch(const Request &req, const Request &leader, bool padding) {
+    return (padding || req.inputIds.size() == leader.inputIds.size()) && sameConfig(req.config, leader.config)
+            && req.stopWordsList == leader.stopWordsList && req.grammar == leader.grammar && !canResume(req);
+}
+
+// Pick requests of next batch, return the session to resume (-1 if none).
+// The oldest interactive request leads the batch, the oldest batch-class one only when no interactive one waits.
+// A request resuming its session runs alone, as the kept KV cache is used as the prefix of the whole batch.
+// Others join the leader if sharing its config and grammar, interactive ones first. Without padding, a different
+// prompt length (including a preempted request with its generated tokens) waits for a later batch.
+int Model::selectBatch() {
+    auto leader = std::find_if(waitingRequests.begin(), waitingRequests.end(),
+            [this](int handle) { return requests[handle].priority == RequestPriority::INTERACTIVE; });
+    if (leader == waitingRequests.end()) { leader = waitingRequests.begin(); }
+
+    runningRequests.clear();
+    runningRequests.push_back(*leader);
+    waitingRequests.erase(leader);
+
+    const Request &first = requests[runningRequests[0]];
+    if (canResume(first)) {
+        sessions[first.sessionId].lastUsed = std::chrono::steady_clock::now();
+        return first.sessionId;
+    }
+
+    bool padding = canPad(first.config);
+    for (RequestPriority priority : {RequestPriority::INTERACTIVE, RequestPriority::BATCH}) {
+        for (auto it = waitingRequests.begin();
+                it != waitingRequests.end() && (int)runningRequests.size() < maxBatchSize;) {
+            const Request &req = requests[*it];
+            if (req.priority == priority && canBatch(req, first, padding)) {
+                runningRequests.push_back(*it);
+                it = waitingRequests.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Whether a waiting request can join the running batch at a step boundary. Its prompt is padded to the length of
+// the batch thus cannot be longer, and its maxLen must fit in the positions left.
+bool Model::canJoin(const Request &req) {
+    int len = req.inputIds.size();
+    int maxPositions = decoder->getContext()->maxPositions;
+    return canPad(batchLeader.config) && canBatch(req, batchLeader, true) && len <= batchLen
+            && (req.config.maxLen <= 0 || batchLen - len + req.config.maxLen <= maxPositions);
+}
+
+// Pick waiting requests joining the running batch for at most `rows` rows, interactive ones first.
+// message gets the padding, grammar states and left padded IDs ([joined][joinLen]) of the rows.
+std::vector<int> Model::selectJoins(int rows, std::vector<int> &message, int &joinLen) {
+    std::vector<int> joins;
+    joinLen = 0;
+    if (rows <= 0) { return joins; }
+
+    for (RequestPriority priority : {RequestPriority::INTERACTIVE, RequestPriority::BATCH}) {
+        for (auto it = waitingRequests.begin(); it != waitingRequests.end() && (int)joins.size() < rows;) {
+            const Request &req = requests[*it];
+            if (req.priority == priority && canJoin(req)) {
+                joins.push_back(*it);
+                joinLen = std::max(joinLen, (int)req.inputIds.size());
+                it = waitingRequests.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    int count = joins.size();
+    int padId = padToken(batchLeader.config, decoder->getEndId());
+    message.assign(count * (2 + joinLen), padId);
+    for (int b = 0; b < count; ++b) {
+        const Request &req = requests[joins[b]];
+        int padLen = joinLen - req.inputIds.size();
+        message[b] = padLen;
+        message[count + b] = req.grammarState;
+        std::copy(req.inputIds.begin(), req.inputIds.end(), message.begin() + 2 * count + b * joinLen + padLen);
+    }
+
+    return joins;
+}
+
+// A running batch without interactive requests gives way to a waiting interactive request unable to join it (like
+// one of another config, or when the batch is beam search).
+bool Model::shouldPreempt() {
+    for (int handle : runningRequests) {
+        auto it = requests.find(handle);
+        if (it != requests.end() && !it->second.finished && it->second.priority == RequestPriority::INTERACTIVE) {
+            return false;
+        }
+    }
+
+    return std::any_of(waitingRequests.begin(), waitingRequests.end(), [this](int handle) {
+        const Request &req = requests[handle];
+        return req.priority == RequestPriority::INTERACTIVE && !canJoin(req);
+    });
+}
+
+// Queue a running request again ahead of other waiting ones, its KV cache is given up and recomputed from the history
+// (prompt plus generated tokens) when it is scheduled, maxLen still bounds the total length. Beam search has not
+// dispatched any token, thus starts again from the prompt.
+void Model::requeue(int handle) {
+    auto it = requests.find(handle);
+    if (it == requests.end() || it->second.finished) { return; }
+    it->second.inputIds = it->second.history;
+    waitingRequests.push_front(handle);
+}
+
+void Model::preemptBatch() {
+    for (auto it = runningRequests.rbegin(); it != runningRequests.rend(); ++it) {
+        requeue(*it);
+    }
+    runningRequests.clear();
+}
+
+// Make room for the waiting interactive requests able to join the running batch, by requeueing just enough
+// batch-class rows (the last ones first) out of the kept rows (keepIdx).
+void Model::preemptRows(std::vector<int> &keepIdx) {
+    int interactive = std::count_if(waitingRequests.begin(), waitingRequests.end(), [this](int handle) {
+        const Request &req = requests[handle];
+        return req.priority == RequestPriority::INTERACTIVE && canJoin(req);
+    });
+
+    int needed = interactive - (maxBatchSize - (int)keepIdx.size());
+    for (int i = keepIdx.size() - 1; i >= 0 && needed > 0; --i) {
+        int handle = runningRequests[keepIdx[i]];
+        if (requests[handle].priority != RequestPriority::BATCH) { continue; }
+        requeue(handle);
+        keepIdx.erase(keepIdx.begin() + i);
+        needed -= 1;
+    }
+
+    // No row left, the interactive requests start a new batch
+    if (keepIdx.empty()) { runningRequests.clear(); }
+}
+
+void Model::startBatch() {
+    const Request &first = requests[runningRequests[0]];
+    batchLeader.config = first.config;
+    batchLeader.stopWordsList = first.stopWordsList;
+    batchLeader.grammar = first.grammar;
+
+    // Shorter prompts are left padded to the longest one
+    batchLen = 0;
+    for (int handle : runningRequests) {
+        batchLen = std::max(batchLen, (int)requests[handle].inputIds.size());
+    }
+    int padId = padToken(first.config, decoder->getEndId());
+    std::vector<int32_t> ids;
+    std::vector<int> padLens;
+    ids.reserve(runningRequests.size() * batchLen);
+    for (int handle : runningRequests) {
+        const Request &req = requests[handle];
+        int padLen = batchLen - req.inputIds.size();
+        padLens.push_back(padLen);
+        ids.insert(ids.end(), padLen, padId);
+        ids.insert(ids.end(), req.inputIds.begin(), req.inputIds.end());
+    }
+    if (std::all_of(padLens.begin(), padLens.end(), [](int len) { return len == 0; })) { padLens.clear(); }
+
+    // Beam search stops at maxLen by itself, other rows are stopped at their own maxLen when the tokens are dispatched
+    SearcherConfig batchConfig = first.config;
+    int maxPositions = decoder->getContext()->maxPositions;
+    batchConfig.maxLen = first.config.maxLen > 0 && first.config.numBeams > 1 ? first.config.maxLen : maxPositions;
+    // Each row of the running batch is a request, thus a sampled request gets one sequence
+    if (batchConfig.numBeams == 1) { batchConfig.numBeamHypsToKeep = 1; }
+    this->config(batchConfig, first.stopWordsList);
+
+    // Preempted requests continue from their grammar states
+    std::vector<int> grammarStates;
+    if (first.grammar) {
+        for (int handle : runningRequests) {
+            grammarStates.push_back(requests[handle].grammarState);
+        }
+    }
+    this->setGrammar(first.grammar, grammarStates);
+    this->input(ids, runningRequests.size());
+    this->setPadding(padLens);
+}
+
+void Model::finishBatch() {
+    // Beam search only knows the sequences after finalize(), return the best hypothesis of each row
+    if (configuration.numBeams > 1) {
+        std::vector<int32_t> result = searcher->finalize();
+        int eosId = configuration.eosTokenId == -1 ? decoder->getEndId() : configuration.eosTokenId;
+        int rows = runningRequests.size();
+        int rowLen = result.size() / (rows * configuration.numBeamHypsToKeep);
+        for (int b = 0; b < rows; ++b) {
+            auto it = requests.find(runningRequests[b]);
+            if (it == requests.end() || it->second.finished) { continue; }
+            const int32_t *hyp = result.data() + b * configuration.numBeamHypsToKeep * rowLen;
+            for (int i = seqLen; i < rowLen && hyp[i] != eosId; ++i) {
+                it->second.tokens.push_back(hyp[i]);
+            }
+        }
+    }
+
+    for (int b = 0; b < (int)runningRequests.size(); ++b) {
+        auto it = requests.find(runningRequests[b]);
+        if (it == requests.end() || it->second.finished) { continue; }
+        keepSession(b, it->second);
+        it->second.finished = true;
+    }
+    runningRequests.clear();
+}
+
+bool Model::canResume(const Request &req) {
+    if (req.sessionId < 0 || req.config.numBeams != 1) { return false; }
+
+    auto it = sessions.find(req.sessionId);
+    if (it == sessions.end()) { return false; }
+
+    // At least one new token is needed to predict the next one
+    const std::vector<int32_t> &kept = it->second.ids;
+    return kept.size() < req.inputIds.size() && std::equal(kept.begin(), kept.end(), req.inputIds.begin());
+}
+
+// Record the session of a finished row, its KV cache is copied out at next step before the batch changes
+void Model::keepSession(int row, const Request &req) {
+    if (req.sessionId < 0 || configuration.numBeams != 1) { return; }
+
+    // The last generated token is not fed to the model, thus has no KV cache
+    int seqLen = req.history.size() - 1;
+
+    Session &session = sessions[req.sessionId];
+    session.ids.assign(req.history.begin(), req.history.begin() + seqLen);
+    session.lastUsed = std::chrono::steady_clock::now();
+
+    pendingSaves.insert(pendingSaves.end(), {req.sessionId, row, seqLen});
+}
+
+void Model::releaseSession(int sessionId) {
+    sessions.erase(sessionId);
+
+    for (int i = 0; i < (int)pendingSaves.size();) {
+        if (pendingSaves[i] == sessionId) {
+            pendingSaves.erase(pendingSaves.begin() + i, pendingSaves.begin() + i + 3);
+        } else {
+            i += 3;
+        }
+    }
+
+    pendingDrops.push_back(sessionId);
+}
+
+void Model::closeSession(int sessionId) {
+    if (sessions.count(sessionId) > 0) { releaseSession(sessionId); }
+}
+
+void Model::evictSessions() {
+    auto now = std::chrono::steady_clock::now();
+    size_t totalBytes = 0;
+
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        int sessionId = it->first;
+        if (sessionTTL > 0 && now - it->second.lastUsed > std::chrono::seconds(sessionTTL)) {
+            ++it;
+            releaseSession(sessionId);
+        } else {
+            totalBytes += it->second.bytes;
+            ++it;
+        }
+    }
+
+    while (maxSessionBytes > 0 && totalBytes > maxSessionBytes) {
+        auto lru = std::min_element(sessions.begin(), sessions.end(),
+                [](const auto &a, const auto &b) { return a.second.lastUsed < b.second.lastUsed; });
+        totalBytes -= lru->second.bytes;
+        releaseSession(lru->first);
+    }
+}
+
+bool Model::step() {
+    Messenger &messenger = decoder->getMessenger();
+    StepControl ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.loadSession = -1;
+
+    std::vector<int> keepIdx;
+    std::vector<int> joins;
+    std::vector<int> joinMessage;
+    std::vector<int> sessionOps;
+    if (decoder->getRank() == 0) {
+        evictSessions();
+
+        if (!runningRequests.empty() && shouldPreempt()) { preemptBatch(); }
+
+        // Drop finished/cancelled rows at the step boundary, so that they stop consuming compute and KV cache
+        if (!runningRequests.empty() && configuration.numBeams == 1) {
+            for (int b = 0; b < (int)runningRequests.size(); ++b) {
+                auto it = requests.find(runningRequests[b]);
+                if (it != requests.end() && !it->second.finished) { keepIdx.push_back(b); }
+            }
+            preemptRows(keepIdx);
+        }
+
+        if (!runningRequests.empty()) {
+            ctrl.action = STEP_NEXT_TOKEN;
+
+            if (configuration.numBeams == 1) {
+                if (keepIdx.size() < runningRequests.size()) { ctrl.keepSize = keepIdx.size(); }
+
+                // Free rows are taken by waiting requests, interactive ones first
+                joins = selectJoins(maxBatchSize - (int)keepIdx.size(), joinMessage, ctrl.joinLen);
+                ctrl.joinCount = joins.size();
+            }
+        } else if (!waitingRequests.empty()) {
+            ctrl.action = STEP_NEW_BATCH;
+            ctrl.loadSession = selectBatch();
+        } else {
+            // Kept sessions are not touched until next batch, thus pending session operations can wait
+            return false;
+        }
+
+        ctrl.dropCount = pendingDrops.size();
+        ctrl.saveCount = pendingSaves.size() / 3;
+        sessionOps.insert(sessionOps.end(), pendingDrops.begin(), pendingDrops.end());
+        sessionOps.insert(sessionOps.end(), pendingSaves.begin(), pendingSaves.end());
+        pendingDrops.clear();
+        pendingSaves.clear();
+    }
+
+    messenger.broadcast((int *)&ctrl, sizeof(StepControl) / sizeof(int));
+
+    // Slaves get exit flags and exit directly
+    if (ctrl.action == STEP_EXIT) { exit(0); }
+
+    // Sessions are saved before the finished rows are squeezed or the batch is replaced
+    if (ctrl.dropCount + ctrl.saveCount > 0) {
+        sessionOps.resize(ctrl.dropCount + 3 * ctrl.saveCount);
+        messenger.broadcast(sessionOps.data(), sessionOps.size());
+
+        for (int i = 0; i < ctrl.dropCount; ++i) {
+            decoder->dropSession(sessionOps[i]);
+        }
+        for (int i = 0; i < ctrl.saveCount; ++i) {
+            const int *op = sessionOps.data() + ctrl.dropCount + 3 * i;
+            size_t bytes = decoder->saveSession(op[0], op[1], op[2]);
+            if (decoder->getRank() == 0) {
+                if (bytes > 0) {
+                    sessions[op[0]].bytes = bytes;
+                } else {
+                    sessions.erase(op[0]);
+                }
+            }
+        }
+    }
+
+    if (ctrl.action == STEP_NEW_BATCH) {
+        if (ctrl.loadSession >= 0) { decoder->loadSession(ctrl.loadSession); }
+
+        if (decoder->getRank() == 0) {
+            startBatch();
+        } else {
+            std::vector<int32_t> dummyIds;
+            SearcherConfig dummyConfig;
+            this->config(dummyConfig);
+            this->setGrammar(nullptr);
+            this->input(dummyIds, 0);
+            this->setPadding({});
+        }
+    }
+
+    if (ctrl.action == STEP_NEXT_TOKEN && ctrl.keepSize > 0) {
+        keepIdx.resize(ctrl.keepSize);
+        messenger.broadcast(keepIdx.data(), ctrl.keepSize);
+
+        if (searcher->squeeze(keepIdx.data(), ctrl.keepSize) && decoder->getRank() == 0) {
+            std::vector<int> kept;
+            for (int idx : keepIdx) {
+                kept.push_back(runningRequests[idx]);
+            }
+            runningRequests.swap(kept);
+        }
+    }
+
+    if (ctrl.action == STEP_NEXT_TOKEN && ctrl.joinCount > 0) {
+        int count = ctrl.joinCount;
+        joinMessage.resize(count * (2 + ctrl.joinLen));
+        messenger.broadcast(joinMessage.data(), joinMessage.size());
+
+        std::vector<int> states(joinMessage.begin() + count, joinMessage.begin() + 2 * count);
+        searcher->append(joinMessage.data() + 2 * count, count, ctrl.joinLen, joinMessage.data(), states);
+        if (decoder->getRank() == 0) { runningRequests.insert(runningRequests.end(), joins.begin(), joins.end()); }
+    }
+
+    std::vector<int32_t> nextIds = generate();
+
+    // The session is only used as prefix at the first step
+    if (ctrl.loadSession >= 0) { decoder->unsetPrefix(); }
+
+    if (decoder->getRank() != 0) { return true; }
+    batchLen += 1;
+
+    // Dispatch the tokens, rows are done at EOS or maxLen (beam search is dispatched in finishBatch)
+    bool allFinished = true;
+    if (configuration.numBeams == 1) {
+        int eosId = configuration.eosTokenId == -1 ? decoder->getEndId() : configuration.eosTokenId;
+        std::vector<std::pair<int, float>> logprobs = searcher->getLogprobs();
+        int logprobsLen = configuration.numLogprobs + 1;
+        for (int b = 0; b < (int)runningRequests.size(); ++b) {
+            auto it = requests.find(runningRequests[b]);
+            if (it == requests.end() || it->second.finished) { continue; }
+            it->second.history.push_back(nextIds[b]);
+            if (it->second.grammar) {
+                int next = it->second.grammar->next(it->second.grammarState, nextIds[b]);
+                if (next >= 0) { it->second.grammarState = next; }
+            }
+            if (nextIds[b] == eosId) {
+                keepSession(b, it->second);
+                it->second.finished = true;
+                continue;
+            }
+
+            it->second.tokens.push_back(nextIds[b]);
+            if (!logprobs.empty()) {
+                it->second.logprobs.insert(it->second.logprobs.end(), logprobs.begin() + b * logprobsLen,
+                        logprobs.begin() + (b + 1) * logprobsLen);
+            }
+            int maxLen = it->second.config.maxLen;
+            if (maxLen > 0 && (int)it->second.history.size() >= maxLen) {
+                keepSession(b, it->second);
+                it->second.finished = true;
+            } else {
+                allFinished = false;
+            }
+        }
+    } else {
+        allFinished = false;
+    }
+
+    if (allFinished || searcher->isDone()) { finishBatch(); }
+
+    return !runningRequests.empty() || !waitingRequests.empty();
+}
+
+std::vector<int32_t> Model::poll(int handle, std::vector<std::pair<int, float>> *logprobs) {
+    std::vector<int32_t> ret;
+    auto it = requests.find(handle);
+    if (it == requests.end()) { return ret; }
+
+    ret.swap(it->second.tokens);
+    if (logprobs != nullptr) {
+        logprobs->swap(it->second.logprobs);
+        it->second.logprobs.clear();
+    }
+    if (it->second.finished) { requests.erase(it); }
+
+    return ret;
+}
+
+bool Model::isFinished(int handle) {
+    auto it = requests.find(handle);
+    return it == requests.end() || it->second.finished;
+}
+
+void Model::cancel(int handle) {
+    auto it = requests.find(handle);
+    if (it == requests.end()) { return; }
+
+    auto waitIt = std::find(waitingRequests.begin(), waitingRequests.end(), handle);
+    if (waitIt != waitingRequests.end()) { waitingRequests.erase(waitIt); }
+
+    requests.erase(it);
+
+    // Give up the batch if nobody is waiting for it
+    if (!runningRequests.empty()) {
+        bool allFinished = true;
+        for (int h : runningRequests) {
+            auto reqIt = requests.find(h);
+            if (reqIt != requests.end() && !reqIt->second.finished) { allFinished = false; }
+        }
+        if (allFinished) { runningRequests.clear(); }
+    }
+}
+
 AutoModel::AutoModel(std::string modelPath, xft::DataType datatype) : Model() {
     std::string configPath = modelPath + "/config.ini";
     INIReader reader = INIReader(configPath);
@@ -70,36 +70,8 @@ void OptDecoder<WeiT>::setFinalLnWeight(const std::string &modelPath) {
 
 template <typename WeiT>
 void OptDecoder<WeiT>::prepareAttnMask(int *ids, int step) {
-    DecoderContext *ctx = this->getContext();
-    int seqLen = ctx->inputSeqLen;
-
-    if (step == 0) {
-        int sizeRequired = ctx->batchSize * seqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int b = 0; b < ctx->batchSize; ++b) {
-            auto pmask = mask + b * seqLen * seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * seqLen, 0, (i + 1) * sizeof(float)); // bottom left are 0
-                std::fill_n(pmask + i * seqLen + i + 1, seqLen - i - 1, std::numeric_limits<float>::lowest());
-            }
-        }
-    } else if (seqLen > 1) {
-        int sizeRequired = ctx->batchSize * this->accSeqLen * seqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        for (int b = 0; b < ctx->batchSize; ++b) {
-            auto pmask = mask + b * this->accSeqLen * seqLen;
-            int pastLen = this->accSeqLen - seqLen;
-            for (int i = 0; i < seqLen; ++i) {
-                memset(pmask + i * this->accSeqLen, 0, (pastLen + i + 1) * sizeof(float));
-                std::fill_n(pmask + i * this->accSeqLen + pastLen + i + 1, seqLen - i - 1,
-                        std::numeric_limits<float>::lowest());
-            }
-        }
-    } else {
-        int sizeRequired = ctx->batchSize * this->accSeqLen;
-        float *mask = this->getAttnMask(sizeRequired);
-        memset(mask, 0, sizeRequired * sizeof(float)); // all elements are 0
-    }
+    // Causal mask (with the offset of past tokens) is generated on the fly inside attention
+    this->getContext()->maskDesc.type = AttnMaskDesc::CAUSAL;
 }
 
 template <typename WeiT>
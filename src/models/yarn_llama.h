@@ -29,6 +29,9 @@ public:
     ~YaRNLlama();
 
     void prepareAttnMask(int *ids, int step);
+
+    // YaRN scales the rotary frequencies statically, attention still depends on relative positions only
+    bool supportsPadding() override { return true; }
     void embeddingForward(int *ids, float *output, int batchSize, int seqLen);
     void lastLayerNormForward(float *input, float *output, int rows);
 
@@ -17,9 +17,12 @@
 #include <torch/custom_class.h>
 #include <torch/script.h>
 
+#include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
+#include "generation_engine.h"
 #include "xfastertransformer.h"
 
 struct TorchAutoModel : torch::CustomClassHolder {
@@ -61,6 +64,7 @@ public:
     };
 
     ~TorchAutoModel() {
+        engine.reset();
         if (model != nullptr) { delete model; }
     }
 
@@ -132,10 +136,11 @@ public:
     torch::Tensor generate() {
         auto nextTokens = model->generate();
 
+        // Rows of a prompt are beams, or sequences sampled from the prompt
         int batchSize = model->getBatchSize();
-        int numBeams = model->getConfig().numBeams;
+        int rowsPerPrompt = nextTokens.size() / batchSize;
 
-        torch::Tensor ret = torch::empty({batchSize, numBeams}, torch::kInt64);
+        torch::Tensor ret = torch::empty({batchSize, rowsPerPrompt}, torch::kInt64);
         int64_t *p = ret.data_ptr<int64_t>();
         for (int i = 0; i < nextTokens.size(); ++i) {
             p[i] = nextTokens[i];
@@ -158,6 +163,73 @@ public:
         return ret;
     }
 
+    // Return log-probabilities in shape of [batchSize, seqLen - 1] on master, an empty tensor on others
+    torch::Tensor score(torch::optional<torch::Tensor> inputIds) {
+        int batchSize = 0;
+        if (model->getRank() == 0) {
+            TORCH_CHECK(inputIds.has_value(), "Make sure master's input is not None.")
+
+            batchSize = inputIds.value().size(0);
+            int seqLen = inputIds.value().size(1);
+            TORCH_CHECK(seqLen > 1, "Scoring needs at least 2 tokens but input has ", seqLen);
+
+            tokenIds.resize(batchSize * seqLen);
+            int64_t *p = inputIds.value().data_ptr<int64_t>();
+            for (int i = 0; i < batchSize * seqLen; ++i) {
+                tokenIds[i] = static_cast<int>(p[i]);
+            }
+        }
+
+        std::vector<float> logprobs = model->score(tokenIds, batchSize);
+        if (model->getRank() != 0) { return torch::empty({0}, torch::kFloat32); }
+
+        torch::Tensor ret = torch::empty({batchSize, (int64_t)logprobs.size() / batchSize}, torch::kFloat32);
+        std::copy(logprobs.begin(), logprobs.end(), ret.data_ptr<float>());
+        return ret;
+    }
+
+    // pooling: "last", "mean" or "none". Return [batchSize, hiddenSize] ([batchSize, seqLen, hiddenSize] for "none")
+    // on master, an empty tensor on others
+    torch::Tensor embed(torch::optional<torch::Tensor> inputIds, std::string pooling) {
+        PoolingMode mode;
+        if (pooling == "last") {
+            mode = PoolingMode::LAST_TOKEN;
+        } else if (pooling == "mean") {
+            mode = PoolingMode::MEAN;
+        } else if (pooling == "none") {
+            mode = PoolingMode::NONE;
+        } else {
+            throw std::invalid_argument("Invalid pooling mode");
+        }
+
+        int batchSize = 0;
+        int seqLen = 0;
+        if (model->getRank() == 0) {
+            TORCH_CHECK(inputIds.has_value(), "Make sure master's input is not None.")
+
+            batchSize = inputIds.value().size(0);
+            seqLen = inputIds.value().size(1);
+
+            tokenIds.resize(batchSize * seqLen);
+            int64_t *p = inputIds.value().data_ptr<int64_t>();
+            for (int i = 0; i < batchSize * seqLen; ++i) {
+                tokenIds[i] = static_cast<int>(p[i]);
+            }
+        }
+
+        std::vector<float> hidden = model->embed(tokenIds, batchSize, mode);
+        if (model->getRank() != 0) { return torch::empty({0}, torch::kFloat32); }
+
+        torch::Tensor ret;
+        if (mode == PoolingMode::NONE) {
+            ret = torch::empty({batchSize, seqLen, (int64_t)hidden.size() / (batchSize * seqLen)}, torch::kFloat32);
+        } else {
+            ret = torch::empty({batchSize, (int64_t)hidden.size() / batchSize}, torch::kFloat32);
+        }
+        std::copy(hidden.begin(), hidden.end(), ret.data_ptr<float>());
+        return ret;
+    }
+
     void setPrefix(torch::optional<torch::Tensor> inputIds) {
         std::vector<int> prefixIds;
         if (model->getRank() == 0) {
@@ -183,7 +255,78 @@ public:
 
     void unsetPrefix() { model->unsetPrefix(); };
 
+    // Start generating on a C++ thread, see GenerationEngine. Return the fd to watch for new tokens on master.
+    // Slaves follow master's steps in this call and never return (they exit when master's model is released).
+    int64_t startEngine(int64_t maxBatchSize) {
+        if (model->getRank() != 0) {
+            while (true) {
+                model->step();
+            }
+        }
+        if (engine == nullptr) { engine.reset(new GenerationEngine(*model, maxBatchSize)); }
+        return engine->notifyFd();
+    }
+
+    // Queue one prompt (1-D token ids) to the engine, return the request ID. maxLength includes the prompt.
+    int64_t submit(torch::Tensor inputIds, int64_t maxLength, bool doSample, double temperature, int64_t topK,
+            double topP, double repetitionPenalty, int64_t eosTokenId,
+            torch::optional<std::vector<std::vector<int64_t>>> stopWordsListOpt, int64_t sessionId,
+            std::string priority) {
+        TORCH_CHECK(engine != nullptr, "Call start_engine() before submitting requests.")
+
+        xft::RequestPriority requestPriority;
+        if (priority == "interactive") {
+            requestPriority = xft::RequestPriority::INTERACTIVE;
+        } else if (priority == "batch") {
+            requestPriority = xft::RequestPriority::BATCH;
+        } else {
+            throw std::invalid_argument("Invalid priority");
+        }
+
+        torch::Tensor flat = inputIds.reshape({-1}).to(torch::kInt64).contiguous();
+        int64_t *p = flat.data_ptr<int64_t>();
+        std::vector<int> ids(p, p + flat.numel());
+        TORCH_CHECK(!ids.empty(), "Input ids cannot be empty.")
+
+        SearcherConfig config;
+        config.maxLen = static_cast<int>(maxLength);
+        config.doSample = doSample;
+        config.temperature = static_cast<float>(temperature);
+        config.topK = static_cast<int>(topK);
+        config.topP = static_cast<float>(topP);
+        config.repetitionPenalty = static_cast<float>(repetitionPenalty);
+        config.eosTokenId = static_cast<int>(eosTokenId);
+
+        std::vector<std::vector<int>> stopWords;
+        if (stopWordsListOpt.has_value()) {
+            for (const auto &words : stopWordsListOpt.value()) {
+                stopWords.emplace_back(words.begin(), words.end());
+            }
+        }
+
+        return engine->submit(ids, config, stopWords, static_cast<int>(sessionId), requestPriority);
+    }
+
+    // Tokens generated since last fetch and whether the request is finished, never blocks
+    std::tuple<torch::Tensor, bool> fetch(int64_t requestId) {
+        TORCH_CHECK(engine != nullptr, "Call start_engine() before fetching.")
+
+        std::vector<int> tokens;
+        bool finished = engine->fetch(requestId, tokens);
+
+        torch::Tensor ret = torch::empty({(int64_t)tokens.size()}, torch::kInt64);
+        std::copy(tokens.begin(), tokens.end(), ret.data_ptr<int64_t>());
+        return std::make_tuple(ret, finished);
+    }
+
+    void cancelRequest(int64_t requestId) {
+        if (engine != nullptr) { engine->cancel(requestId); }
+    }
+
+    void stopEngine() { engine.reset(); }
+
 private:
     xft::Model *model;
     std::vector<int> tokenIds;
+    std::unique_ptr<GenerationEngine> engine;
 };
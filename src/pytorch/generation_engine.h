@@ -0,0 +1,203 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "models.h"
+
+// Drives the step-level API of the model on a C++ thread, so generation never holds the Python GIL.
+// Callers submit requests and fetch their new tokens without blocking. After each step a byte is written to
+// notifyFd(), which an event loop (e.g. asyncio's add_reader) can watch to know when to fetch.
+// Master rank only, slaves follow it by calling Model::step() in a loop.
+class GenerationEngine {
+public:
+    GenerationEngine(xft::Model &model, int maxBatchSize) : model(model), running(true), nextId(0) {
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+            printf("Failed to create the notification pipe of the generation engine.\n");
+            exit(-1);
+        }
+        model.setMaxBatchSize(maxBatchSize);
+        worker = std::thread(&GenerationEngine::loop, this);
+    }
+
+    ~GenerationEngine() {
+        stop();
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    // Read end of the notification pipe, readers should drain it before fetching
+    int notifyFd() const { return fds[0]; }
+
+    // Return the ID of the request, used to fetch or cancel it
+    int64_t submit(const std::vector<int> &ids, const SearcherConfig &config,
+            const std::vector<std::vector<int>> &stopWords, int sessionId, xft::RequestPriority priority) {
+        std::lock_guard<std::mutex> lock(mtx);
+        int64_t id = nextId++;
+        incoming.push_back({id, ids, config, stopWords, sessionId, priority});
+        entries[id];
+        cv.notify_one();
+        return id;
+    }
+
+    // Move out the tokens generated since last fetch, return true once the request is finished and all tokens are
+    // fetched, after which the ID is released
+    bool fetch(int64_t id, std::vector<int> &tokens) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(id);
+        if (it == entries.end()) { return true; }
+
+        tokens.swap(it->second.tokens);
+        it->second.tokens.clear();
+        bool finished = it->second.finished;
+        if (finished) { entries.erase(it); }
+        return finished;
+    }
+
+    // Stop generating for the request, it is released as well
+    void cancel(int64_t id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(id);
+        if (it == entries.end()) { return; }
+        if (it->second.finished) {
+            entries.erase(it);
+            return;
+        }
+        it->second.cancelled = true;
+        cv.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!running) { return; }
+            running = false;
+        }
+        cv.notify_one();
+        if (worker.joinable()) { worker.join(); }
+    }
+
+private:
+    struct Submission {
+        int64_t id;
+        std::vector<int> ids;
+        SearcherConfig config;
+        std::vector<std::vector<int>> stopWords;
+        int sessionId;
+        xft::RequestPriority priority;
+    };
+
+    struct Entry {
+        int handle = -1; // Handle in the model
+        std::vector<int> tokens; // Not fetched yet
+        bool finished = false;
+        bool cancelled = false;
+    };
+
+    // The model is only touched by this thread, the lock just guards the queues and entries
+    void loop() {
+        std::vector<int64_t> active;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&] { return !incoming.empty() || !active.empty() || !running; });
+                if (!running) { break; }
+
+                for (auto &sub : incoming) {
+                    auto it = entries.find(sub.id);
+                    if (it == entries.end() || it->second.cancelled) {
+                        entries.erase(sub.id);
+                        continue;
+                    }
+                    it->second.handle
+                            = model.addRequest(sub.ids, sub.config, sub.stopWords, sub.sessionId, sub.priority);
+                    active.push_back(sub.id);
+                }
+                incoming.clear();
+
+                for (auto it = active.begin(); it != active.end();) {
+                    auto entryIt = entries.find(*it);
+                    if (entryIt->second.cancelled) {
+                        model.cancel(entryIt->second.handle);
+                        entries.erase(entryIt);
+                        it = active.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                if (active.empty()) { continue; }
+            }
+
+            model.step();
+
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                for (auto it = active.begin(); it != active.end();) {
+                    Entry &entry = entries[*it];
+                    bool finished = model.isFinished(entry.handle);
+                    std::vector<int> tokens = model.poll(entry.handle);
+                    entry.tokens.insert(entry.tokens.end(), tokens.begin(), tokens.end());
+                    if (finished) {
+                        entry.finished = true;
+                        it = active.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            notify();
+        }
+
+        // Nothing more will come for the requests still running
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto &kv : entries) {
+                kv.second.finished = true;
+            }
+        }
+        notify();
+    }
+
+    // A full pipe already guarantees a pending wake-up, thus a failed write is fine
+    void notify() {
+        char c = 1;
+        ssize_t ret = write(fds[1], &c, 1);
+        (void)ret;
+    }
+
+    xft::Model &model;
+    int fds[2];
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Submission> incoming;
+    std::map<int64_t, Entry> entries;
+    bool running;
+    int64_t nextId;
+    std::thread worker;
+};
@@ -24,6 +24,13 @@ TORCH_LIBRARY(xfastertransformer, m) {
             .def("is_done", &TorchAutoModel::isDone)
             .def("generate", &TorchAutoModel::generate)
             .def("finalize", &TorchAutoModel::finalize)
+            .def("score", &TorchAutoModel::score)
+            .def("embed", &TorchAutoModel::embed)
             .def("set_prefix", &TorchAutoModel::setPrefix)
-            .def("unset_prefix", &TorchAutoModel::unsetPrefix);
+            .def("unset_prefix", &TorchAutoModel::unsetPrefix)
+            .def("start_engine", &TorchAutoModel::startEngine)
+            .def("submit", &TorchAutoModel::submit)
+            .def("fetch", &TorchAutoModel::fetch)
+            .def("cancel_request", &TorchAutoModel::cancelRequest)
+            .def("stop_engine", &TorchAutoModel::stopEngine);
 }
@@ -23,6 +23,7 @@
 #include <stdexcept>
 
 #include "bert_util.h"
+#include "search_utils.h"
 
 static void computeLogSoftmax(float *input, int size) {
     // Get max valute
@@ -273,15 +274,12 @@ BeamSearch::BeamSearch(AbstractDecoder &dec, const SearcherConfig &config)
     , numBeams(config.numBeams)
     , numBeamHypsToKeep(config.numBeamHypsToKeep)
     , lenPenalty(config.lenPenalty)
-    , doEarlyStopping(config.doEarlyStopping) {
+    , doEarlyStopping(config.doEarlyStopping)
+    , processor(config, config.eosTokenId == -1 ? dec.getEndId() : config.eosTokenId) {
     vocabSize = decoder.getContext()->vocabSize;
     eosTokenId = config.eosTokenId == -1 ? decoder.getEndId() : config.eosTokenId;
     padTokenId = config.padTokenId == -1 ? eosTokenId : config.padTokenId;
     kVal = 2 * numBeams;
-    if (config.repetitionPenalty != 1.0) {
-        printf("[Warning] BeamSearch doesn't support repetition penalty now and repetition penalty is %f.\n",
-                config.repetitionPenalty);
-    }
 }
 
 // The first setp to get next tokens accoring to the prompt IDs
@@ -305,6 +303,8 @@ std::vector<int> BeamSearch::getNextToken(int *ids, int batchSize, int seqLen) {
         }
     }
 
+    processor.begin(ids, batchSize, seqLen, numBeams);
+
     int64_t dims[3] = {batchSize, numBeams, seqLen};
 
     // 1st token's input shape is [userSideBS][1][seqLen].
@@ -353,6 +353,11 @@ bool BeamSearch::setStopWords(std::vector<std::vector<int>> stopWordsList) {
     return false;
 }
 
+bool BeamSearch::squeeze(int *idx, int size) {
+    // Beams of one sample are scored together by BeamSearchScorer, cannot drop samples in the middle for now
+    return false;
+}
+
 void BeamSearch::searchTopK(std::tuple<float *, int, int> &result) {
     TimeLine t("BeamSearch.searchTopK");
     float *outBuf = std::get<0>(result);
@@ -368,8 +373,7 @@ void BeamSearch::searchTopK(std::tuple<float *, int, int> &result) {
     // `nn.functional.log_softmax` operation.
     // 2. nn.functional.log_softmax(next_token_logits, dim=-1)
     //    (batch_size * num_beams, vocab_size)
-    // 3. use logits_processor(input_ids, next_token_scores)
-    // TODO: support logits_processor
+    // 3. use logits_processor(input_ids, next_token_scores), see below
     // 4. add beam socre. Initialize -1e9 to all beams except the first one
     if (msgerSize > 1) {
         // Get the maximum value of each beam through all instance
@@ -457,6 +461,8 @@ void BeamSearch::searchTopK(std::tuple<float *, int, int> &result) {
         }
     }
 
+    if (processor.enabled()) { processor.process(outBuf, sampleOffset, sampleSize, batchSize * numBeams); }
+
     // Get top K candidates for beam search, use 2 * numBeams for K
     // topK ids and vals for each sample
     int topKIds[batchSize * numBeams * kVal];
@@ -542,7 +548,17 @@ void BeamSearch::searchTopK(std::tuple<float *, int, int> &result) {
 void BeamSearch::beam_search(std::tuple<float *, int, int> &result) {
     TimeLine t("BeamSearch");
     // Get candidates
+#ifdef PIPELINE_PARALLEL
+    // Only the last pipeline stage has the logits, other stages get the candidates and process them the same way,
+    // thus the beams (the tokens, the indices to reorder the cache and the finished hypotheses) are the same
+    DecoderContext *ctx = decoder.getContext();
+    if (std::get<0>(result) != nullptr) { searchTopK(result); }
+    syncPipelineStages(ctx, nextScores.data(), nextScores.size());
+    syncPipelineStages(ctx, nextTokens.data(), nextTokens.size());
+    syncPipelineStages(ctx, nextIndices.data(), nextIndices.size());
+#else
     searchTopK(result);
+#endif
 
     // Process the beams
     auto beamOutputs = beamScorer.process(inputIds, nextScores, nextTokens, nextIndices, padTokenId, eosTokenId);
@@ -551,6 +567,9 @@ void BeamSearch::beam_search(std::tuple<float *, int, int> &result) {
     beamNextTokens = std::get<1>(beamOutputs);
     beamNextIndices = std::get<2>(beamOutputs);
 
+    processor.reorder(beamNextIndices.data(), batchSize * numBeams);
+    processor.update(beamNextTokens);
+
     std::vector<int32_t> newInputIds(batchSize * numBeams * curLen);
     for (int batchIdx = 0; batchIdx < batchSize; ++batchIdx) {
         for (int beamIdx = 0; beamIdx < numBeams; ++beamIdx) {
@@ -32,6 +32,7 @@
 
 #include "abstract_decoder.h"
 #include "abstract_searcher.h"
+#include "logits_processor.h"
 #include "timeline.h"
 
 class BeamHypotheses {
@@ -104,6 +105,23 @@ public:
 
     bool setStopWords(std::vector<std::vector<int>> stopWordsList);
 
+    bool squeeze(int *idx, int size);
+
+    // Scores of beams are not log-probabilities of single tokens
+    std::vector<std::pair<int, float>> getLogprobs() { return {}; }
+
+    // Beams cannot be constrained yet
+    bool setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states = {}) {
+        return grammar == nullptr;
+    }
+
+    // Beams are expanded from the prompts and reordered together, thus rows are neither padded nor added
+    bool setPadding(const std::vector<int> &padLens) { return padLens.empty(); }
+
+    bool append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states) {
+        return false;
+    }
+
 private:
     void searchTopK(std::tuple<float *, int, int> &result);
 
@@ -132,4 +150,5 @@ private:
     int padTokenId;
     int eosTokenId;
     float lenPenalty;
+    LogitsProcessor processor; // Applied to log-probabilities, like HuggingFace
 };
\ No newline at end of file
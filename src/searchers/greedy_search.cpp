@@ -17,42 +17,31 @@
 #include "search_utils.h"
 
 GreedySearch::GreedySearch(AbstractDecoder &dec, const SearcherConfig &config)
-    : decoder(dec), maxLen(config.maxLen), step(0), repetitionPenalty(config.repetitionPenalty) {
-    eosTokenId = config.eosTokenId == -1 ? decoder.getEndId() : config.eosTokenId;
+    : decoder(dec)
+    , maxLen(config.maxLen)
+    , step(0)
+    , eosTokenId(config.eosTokenId == -1 ? dec.getEndId() : config.eosTokenId)
+    , numLogprobs(config.numLogprobs)
+    , processor(config, eosTokenId) {
     padTokenId = config.padTokenId == -1 ? eosTokenId : config.padTokenId;
-    if (repetitionPenalty <= 0) {
-        printf("`repetitionPenalty` has to be a strictly positive float, but is %f.\n", repetitionPenalty);
-        exit(-1);
-    }
     stopWordsList = {};
     stopWordsIndex = {};
 }
 
 std::vector<int> GreedySearch::syncToken(std::tuple<float *, int, int> &result) {
-    // send data from last predictor stage to first embedding stage in pipeline parallel
 #ifdef PIPELINE_PARALLEL
+    // Only the last pipeline stage has the logits, other stages get the tokens and states of the step from it
     DecoderContext *ctx = decoder.getContext();
-    // Messenger &messenger = decoder.getMessenger();
-
-    if (std::get<0>(result) == nullptr) { // The first embedding pipeline parallel stage
-        this->nextTokens = std::vector<int>(batchSize, 0);
-        if (ctx->ppSize > 1 && ctx->ppRank == 0) {
-            int predictor_world_rank = (ctx->ppSize - 1) * ctx->tpSize + ctx->tpRank;
-            MPI_Recv(this->nextTokens.data(), batchSize, MPI_INT32_T, predictor_world_rank, predictor_world_rank,
-                    MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            // TODO: Error: different scope when dynamic loading so file
-            // messenger.worldRecvINT32(this->nextTokens.data(), batchSize, predictor_world_rank, predictor_world_rank);
-        }
-    } else { // The last predictor pipeline parallel stage
+    if (std::get<0>(result) != nullptr) {
         this->nextTokens = this->search(result);
-        if (ctx->ppSize > 1 && ctx->ppRank == ctx->ppSize - 1) {
-            int embedding_world_rank = 0 * ctx->tpSize + ctx->tpRank;
-            int predictor_world_rank = (ctx->ppSize - 1) * ctx->tpSize + ctx->tpRank;
-            MPI_Send(this->nextTokens.data(), batchSize, MPI_INT32_T, embedding_world_rank, predictor_world_rank,
-                    MPI_COMM_WORLD);
-            // TODO: Error: different scope when dynamic loading so file
-            // messenger.worldSendINT32(this->nextTokens.data(), batchSize, embedding_world_rank, predictor_world_rank);
-        }
+    } else {
+        this->nextTokens.resize(batchSize);
+    }
+    syncPipelineStages(ctx, this->nextTokens.data(), batchSize);
+    syncPipelineStages(ctx, this->doneBatch.data(), batchSize);
+    if (this->numLogprobs >= 0) {
+        this->logprobs.resize(batchSize * (this->numLogprobs + 1));
+        syncPipelineStages(ctx, this->logprobs.data(), this->logprobs.size());
     }
 #else
     this->nextTokens = this->search(result);
@@ -78,6 +67,9 @@ std::vector<int> GreedySearch::getNextToken(int *ids, int batchSize, int seqLen)
         stopWordsIndex = std::vector<std::vector<int>>(stopWordsList.size(), std::vector<int>(batchSize, 0));
     }
 
+    if (!padLens.empty()) { decoder.setPadding(padLens.data(), batchSize); }
+    processor.begin(ids, batchSize, seqLen, 1, padLens.empty() ? nullptr : padLens.data());
+
     this->output.resize(batchSize * seqLen);
     std::copy(ids, ids + batchSize * seqLen, output.begin());
 
@@ -117,6 +109,55 @@ std::vector<int32_t> GreedySearch::finalize() {
     return output;
 }
 
+bool GreedySearch::squeeze(int *idx, int size) {
+    if (step == 0 || size == batchSize) { return true; }
+
+    decoder.squeezeCache(idx, size);
+
+    squeezeRows(nextTokens, idx, size, 1);
+    squeezeRows(output, idx, size, curLen);
+    squeezeRows(doneBatch, idx, size, 1);
+    processor.squeeze(idx, size);
+    squeezeRows(logprobs, idx, size, numLogprobs + 1);
+    for (auto &stopIndex : stopWordsIndex) {
+        squeezeRows(stopIndex, idx, size, 1);
+    }
+    batchSize = size;
+
+    return true;
+}
+
+bool GreedySearch::setPadding(const std::vector<int> &padLens) {
+    this->padLens = padLens;
+    return true;
+}
+
+// All but the last token of the rows are computed now, the last one is fed with the tokens generated by other rows
+bool GreedySearch::append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states) {
+    if (step == 0 || seqLen > curLen) { return false; }
+
+    std::vector<int> prefix(rows * (seqLen - 1));
+    for (int b = 0; b < rows; ++b) {
+        std::copy(ids + b * seqLen, ids + (b + 1) * seqLen - 1, prefix.begin() + b * (seqLen - 1));
+    }
+    decoder.appendSamples(prefix.data(), rows, seqLen - 1, padLens);
+
+    // Output rows are padded to the current length
+    for (int b = 0; b < rows; ++b) {
+        nextTokens.push_back(ids[(b + 1) * seqLen - 1]);
+        output.insert(output.end(), curLen - seqLen + padLens[b], padTokenId);
+        output.insert(output.end(), ids + b * seqLen + padLens[b], ids + (b + 1) * seqLen);
+        doneBatch.push_back(0);
+    }
+    for (auto &stopIndex : stopWordsIndex) {
+        stopIndex.resize(batchSize + rows, 0);
+    }
+    processor.append(ids, rows, seqLen, padLens, states);
+    batchSize += rows;
+
+    return true;
+}
+
 bool GreedySearch::setStopWords(std::vector<std::vector<int>> stopWordsList) {
     this->stopWordsList = stopWordsList;
     for (auto it = this->stopWordsList.rbegin(); it != this->stopWordsList.rend(); ++it) {
@@ -125,6 +166,11 @@ bool GreedySearch::setStopWords(std::vector<std::vector<int>> stopWordsList) {
     return !this->stopWordsList.empty();
 }
 
+bool GreedySearch::setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states) {
+    processor.setGrammar(grammar, states);
+    return true;
+}
+
 std::vector<int> GreedySearch::search(std::tuple<float *, int, int> &result) {
     TimeLine t("GreedySearch");
     DecoderContext *ctx = decoder.getContext();
@@ -136,115 +182,15 @@ std::vector<int> GreedySearch::search(std::tuple<float *, int, int> &result) {
     Messenger &messenger = decoder.getMessenger();
     auto msgerSize = messenger.getSize();
 
-    // Repetition penalty logits processor
-    if (this->repetitionPenalty != 1.0) {
-        TimeLine t("GreedySearch.repetitionPenalty");
-        // step has already been incremented by 1
-        if (this->step == 1) {
-            this->cachedRepetVec.clear();
-            this->cachedRepetVec.resize(batchSize, std::vector<int>());
-
-            repetitionPenaltyLogitsProcess(this->repetitionPenalty, outBuf, sampleOffset, sampleSize, this->output,
-                    batchSize, this->cachedRepetVec, this->step, msgerSize > 1);
-        } else {
-            repetitionPenaltyLogitsProcess(this->repetitionPenalty, outBuf, sampleOffset, sampleSize, this->nextTokens,
-                    batchSize, this->cachedRepetVec, this->step, msgerSize > 1);
-        }
-    }
+    if (processor.enabled()) { processor.process(outBuf, sampleOffset, sampleSize, batchSize); }
 
-    // Max ID and value for each sample
+    // Max ID of each sample
     int maxIds[batchSize];
-    float maxVals[batchSize];
-
-    // Small batch size (each sample can have at least 2 threads)
-    if (ctx->numThreads / batchSize >= 2) {
-        int thrPerSample = ctx->numThreads / batchSize;
-        int sizePerThr = (sampleSize + thrPerSample - 1) / thrPerSample;
-        int maxIndices[batchSize * thrPerSample];
-        float maxValues[batchSize * thrPerSample];
-
-        // TODO: if sampleSize is small, possible to cause out of boundary
-#pragma omp parallel for collapse(2)
-        for (int b = 0; b < batchSize; ++b) {
-            for (int t = 0; t < thrPerSample; ++t) { // thread index inside the sample
-                int start = t * sizePerThr;
-                int end = (start + sizePerThr) > sampleSize ? sampleSize : (start + sizePerThr);
-                float *p = outBuf + b * sampleSize;
-
-                int maxIdx = start;
-                float maxVal = p[start];
-                for (int off = start + 1; off < end; ++off) {
-                    if (p[off] > maxVal) {
-                        maxVal = p[off];
-                        maxIdx = off;
-                    }
-                }
-
-                // False sharing happens, but since only one time, not avoided
-                maxIndices[b * thrPerSample + t] = maxIdx;
-                maxValues[b * thrPerSample + t] = maxVal;
-            }
-        }
-
-        // Local reduction
-        for (int i = 0; i < batchSize; ++i) {
-            int *pIndices = maxIndices + i * thrPerSample;
-            float *pValues = maxValues + i * thrPerSample;
-            int maxIdx = pIndices[0];
-            float maxVal = pValues[0];
-            for (int j = 1; j < thrPerSample; ++j) {
-                if (pValues[j] > maxVal) {
-                    maxVal = pValues[j];
-                    maxIdx = pIndices[j];
-                }
-            }
-            maxIds[i] = maxIdx;
-            maxVals[i] = maxVal;
-        }
-    }
+    argmaxProcess(messenger, outBuf, sampleOffset, sampleSize, batchSize, ctx->numThreads, maxIds);
 
-    // Each thread handle one sample (one row)
-    else {
-#pragma omp parallel for
-        for (int i = 0; i < batchSize; ++i) {
-            int maxId = 0;
-            float *p = outBuf + i * sampleSize;
-            float maxVal = p[0];
-            for (int j = 1; j < sampleSize; ++j) {
-                if (p[j] > maxVal) {
-                    maxVal = p[j];
-                    maxId = j;
-                }
-            }
-            maxIds[i] = maxId;
-            maxVals[i] = maxVal;
-        }
-    }
-
-    // Reduce to get the max index (any better method??)
-    if (msgerSize > 1) {
-        float sendBuf[2 * batchSize];
-        float recvBuf[2 * batchSize * msgerSize];
-
-        for (int i = 0; i < batchSize; ++i) {
-            sendBuf[2 * i] = (float)(maxIds[i] + sampleOffset);
-            sendBuf[2 * i + 1] = maxVals[i];
-        }
-
-        std::vector<long unsigned int> recvCount(msgerSize, static_cast<long unsigned int>(2 * batchSize));
-        messenger.allgatherv(sendBuf, 2 * batchSize, recvBuf, recvCount);
-
-        for (int i = 0; i < batchSize; ++i) {
-            int maxId = (int)(recvBuf[2 * i] + 0.5f);
-            float maxVal = recvBuf[2 * i + 1];
-            for (int j = 1; j < msgerSize; ++j) {
-                if (recvBuf[2 * j * batchSize + 2 * i + 1] > maxVal) {
-                    maxVal = recvBuf[2 * j * batchSize + 2 * i + 1];
-                    maxId = (int)(recvBuf[2 * j * batchSize + 2 * i] + 0.5f);
-                }
-            }
-            maxIds[i] = maxId;
-        }
+    if (this->numLogprobs >= 0) {
+        logprobsProcess(
+                messenger, outBuf, sampleOffset, sampleSize, batchSize, maxIds, this->numLogprobs, this->logprobs);
     }
 
     if (eosTokenId != -1) {
@@ -267,5 +213,7 @@ std::vector<int> GreedySearch::search(std::tuple<float *, int, int> &result) {
         stopWordsCheck(nextTokenIds_, this->stopWordsList, this->stopWordsIndex, this->doneBatch);
     }
 
+    processor.update(nextTokenIds_);
+
     return nextTokenIds_;
 }
\ No newline at end of file
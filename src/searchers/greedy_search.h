@@ -15,6 +15,7 @@
 #pragma once
 #include "abstract_decoder.h"
 #include "abstract_searcher.h"
+#include "logits_processor.h"
 #include "timeline.h"
 
 class GreedySearch : public AbstractSearcher {
@@ -33,6 +34,16 @@ public:
 
     bool setStopWords(std::vector<std::vector<int>> stopWordsList);
 
+    bool squeeze(int *idx, int size);
+
+    std::vector<std::pair<int, float>> getLogprobs() { return logprobs; }
+
+    bool setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states = {});
+
+    bool setPadding(const std::vector<int> &padLens);
+
+    bool append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states);
+
 private:
     std::vector<int> syncToken(std::tuple<float *, int, int> &result);
     std::vector<int> search(std::tuple<float *, int, int> &result);
@@ -42,8 +53,8 @@ private:
     // Predicted token IDs
     std::vector<int> nextTokens;
     std::vector<int> output;
-    std::vector<std::vector<int>> cachedRepetVec;
     std::vector<int> doneBatch;
+    std::vector<std::pair<int, float>> logprobs;
 
     int batchSize;
     int step;
@@ -51,7 +62,9 @@ private:
     int maxLen;
     int eosTokenId;
     int padTokenId;
-    float repetitionPenalty;
+    int numLogprobs;
     std::vector<std::vector<int>> stopWordsList;
     std::vector<std::vector<int>> stopWordsIndex;
+    std::vector<int> padLens; // Of the prompts, empty if not padded
+    LogitsProcessor processor;
 };
\ No newline at end of file
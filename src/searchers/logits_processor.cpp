@@ -0,0 +1,152 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "logits_processor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "timeline.h"
+
+static bool lessId(const std::pair<int, int> &a, int id) {
+    return a.first < id;
+}
+
+LogitsProcessor::LogitsProcessor(const SearcherConfig &config, int eosTokenId)
+    : repetitionPenalty(config.repetitionPenalty)
+    , presencePenalty(config.presencePenalty)
+    , frequencyPenalty(config.frequencyPenalty)
+    , minNewTokens(config.minNewTokens)
+    , eosTokenId(eosTokenId) {
+    if (repetitionPenalty <= 0) {
+        printf("`repetitionPenalty` has to be a strictly positive float, but is %f.\n", repetitionPenalty);
+        exit(-1);
+    }
+    trackTokens = repetitionPenalty != 1.0f || presencePenalty != 0 || frequencyPenalty != 0;
+}
+
+void LogitsProcessor::setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states) {
+    this->grammar = grammar;
+    this->grammarStates = states;
+}
+
+void LogitsProcessor::startRow(Row &row, const int *prompt, int len, int grammarState) const {
+    if (trackTokens) {
+        std::vector<int> ids(prompt, prompt + len);
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        row.seen.reserve(ids.size());
+        for (int id : ids) {
+            row.seen.emplace_back(id, 0);
+        }
+    }
+    if (grammar != nullptr) { row.grammarState = grammarState; }
+}
+
+void LogitsProcessor::begin(const int *ids, int batchSize, int seqLen, int repeat, const int *padLens) {
+    rows.assign(batchSize * repeat, Row());
+    if (!enabled()) { return; }
+
+    bool givenStates = grammar != nullptr && (int)grammarStates.size() == batchSize;
+#pragma omp parallel for
+    for (int b = 0; b < batchSize; ++b) {
+        Row &first = rows[b * repeat];
+        int pad = padLens == nullptr ? 0 : padLens[b];
+        int state = givenStates ? grammarStates[b] : (grammar != nullptr ? grammar->getStartState() : 0);
+        startRow(first, ids + b * seqLen + pad, seqLen - pad, state);
+        for (int i = 1; i < repeat; ++i) {
+            rows[b * repeat + i] = first;
+        }
+    }
+}
+
+void LogitsProcessor::append(
+        const int *ids, int batchSize, int seqLen, const int *padLens, const std::vector<int> &states) {
+    int oldSize = rows.size();
+    rows.resize(oldSize + batchSize);
+    if (!enabled()) { return; }
+
+    bool givenStates = grammar != nullptr && (int)states.size() == batchSize;
+    for (int b = 0; b < batchSize; ++b) {
+        int state = givenStates ? states[b] : (grammar != nullptr ? grammar->getStartState() : 0);
+        startRow(rows[oldSize + b], ids + b * seqLen + padLens[b], seqLen - padLens[b], state);
+    }
+}
+
+void LogitsProcessor::process(float *logits, int sampleOffset, int sampleSize, int rows) {
+    TimeLine t("LogitsProcessor");
+    bool eosInSplit = eosTokenId >= sampleOffset && eosTokenId < sampleOffset + sampleSize;
+
+#pragma omp parallel for
+    for (int r = 0; r < rows; ++r) {
+        float *p = logits + (size_t)r * sampleSize;
+        const Row &row = this->rows[r];
+
+        // Sparse: only seen tokens in this split
+        if (trackTokens) {
+            auto it = std::lower_bound(row.seen.begin(), row.seen.end(), sampleOffset, lessId);
+            auto end = std::lower_bound(it, row.seen.end(), sampleOffset + sampleSize, lessId);
+            for (; it != end; ++it) {
+                float &logit = p[it->first - sampleOffset];
+                if (repetitionPenalty != 1.0f) {
+                    logit = logit < 0 ? logit * repetitionPenalty : logit / repetitionPenalty;
+                }
+                if (it->second > 0) { logit -= presencePenalty + frequencyPenalty * it->second; }
+            }
+        }
+        if (eosInSplit && row.generated < minNewTokens) { p[eosTokenId - sampleOffset] = -INFINITY; }
+
+        // Dense: one masked sweep over the row
+        if (grammar != nullptr) { grammar->applyMask(row.grammarState, p, sampleOffset, sampleSize); }
+    }
+}
+
+void LogitsProcessor::update(const std::vector<int> &tokens) {
+    if (!enabled()) { return; }
+
+#pragma omp parallel for
+    for (int r = 0; r < (int)rows.size(); ++r) {
+        Row &row = rows[r];
+        int id = tokens[r];
+        row.generated += 1;
+        if (trackTokens) {
+            auto it = std::lower_bound(row.seen.begin(), row.seen.end(), id, lessId);
+            if (it == row.seen.end() || it->first != id) { it = row.seen.emplace(it, id, 0); }
+            it->second += 1;
+        }
+        if (grammar != nullptr) {
+            // Not allowed tokens are padding of finished rows
+            int next = grammar->next(row.grammarState, id);
+            if (next >= 0) { row.grammarState = next; }
+        }
+    }
+}
+
+void LogitsProcessor::squeeze(const int *idx, int size) {
+    for (int i = 0; i < size; ++i) {
+        if (idx[i] != i) { rows[i] = std::move(rows[idx[i]]); }
+    }
+    rows.resize(size);
+}
+
+void LogitsProcessor::reorder(const int *idx, int size) {
+    if (!enabled()) { return; }
+
+    std::vector<Row> oldRows(rows.begin(), rows.end());
+    for (int i = 0; i < size; ++i) {
+        rows[i] = oldRows[idx[i]];
+    }
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "abstract_searcher.h"
+#include "token_grammar.h"
+
+/**
+ * Logits processors enabled by SearcherConfig (and the grammar), shared by searchers and applied to the split logits
+ * of each row in one go: sparse processors only touch the tokens the row has seen (penalties) or single tokens (min
+ * length), then dense ones (grammar mask) sweep the row once with AVX-512.
+ * Per-row states (seen tokens, grammar states) are kept here and follow the rows by update(), squeeze() and reorder().
+ * To add a processor, put its parameters in SearcherConfig, its per-row state in Row, and its work in process().
+ *
+ * Order of processors, as in HuggingFace:
+ *   repetition penalty: logit / penalty (logit * penalty if negative) for tokens in the prompt or generated
+ *   presence/frequency penalty: logit - presence - frequency * count for generated tokens, like the OpenAI API
+ *   min new tokens: EOS is not allowed until this number of tokens is generated
+ *   grammar: tokens not allowed by the grammar state are masked
+ */
+class LogitsProcessor {
+public:
+    LogitsProcessor(const SearcherConfig &config, int eosTokenId);
+
+    // Whether any processor is enabled, otherwise process() and update() can be skipped
+    bool enabled() const { return trackTokens || minNewTokens > 0 || grammar != nullptr; }
+
+    // Grammar states are for each prompt (empty for the start state), expanded like prompts at begin()
+    void setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states = {});
+
+    // Start with prompts (batchSize x seqLen), each prompt is repeated for `repeat` rows (samples or beams)
+    // The first padLens[b] tokens of prompt b are padding, not seen (nullptr if not padded)
+    void begin(const int *ids, int batchSize, int seqLen, int repeat = 1, const int *padLens = nullptr);
+
+    // Add a row for each prompt joining after begin(), like begin() without repeating; states are the grammar states of
+    // the new rows (empty for the start state)
+    void append(const int *ids, int batchSize, int seqLen, const int *padLens, const std::vector<int> &states = {});
+
+    // Apply all enabled processors to each row, logits are split among ranks (the split starts at sampleOffset)
+    void process(float *logits, int sampleOffset, int sampleSize, int rows);
+
+    // Record the token chosen by each row
+    void update(const std::vector<int> &tokens);
+
+    // Only keep rows in idx (ascending order)
+    void squeeze(const int *idx, int size);
+
+    // Row i continues the history of row idx[i], like beams being reordered
+    void reorder(const int *idx, int size);
+
+private:
+    struct Row {
+        std::vector<std::pair<int, int>> seen; // (token ID, times generated) sorted by ID, prompt tokens count 0
+        int generated = 0;
+        int grammarState = 0;
+    };
+
+    // State of a row starting with the prompt
+    void startRow(Row &row, const int *prompt, int len, int grammarState) const;
+
+    std::vector<Row> rows;
+    bool trackTokens; // Any penalty depending on seen tokens
+    float repetitionPenalty;
+    float presencePenalty;
+    float frequencyPenalty;
+    int minNewTokens;
+    int eosTokenId;
+    std::shared_ptr<const TokenGrammar> grammar;
+    std::vector<int> grammarStates; // Given by setGrammar() for each prompt
+};
@@ -0,0 +1,302 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "prompt_lookup_search.h"
+#include "messenger.h"
+#include "search_utils.h"
+
+PromptLookupSearch::PromptLookupSearch(AbstractDecoder &dec, const SearcherConfig &config)
+    : decoder(dec)
+    , pendingLen(0)
+    , pendingIdx(0)
+    , step(0)
+    , maxLen(config.maxLen)
+    , numLogprobs(config.numLogprobs)
+    , numDrafts(config.promptLookupNum)
+    , ngramSize(config.promptLookupNgram) {
+    eosTokenId = config.eosTokenId == -1 ? decoder.getEndId() : config.eosTokenId;
+    padTokenId = config.padTokenId == -1 ? eosTokenId : config.padTokenId;
+    if (numDrafts <= 0 || ngramSize <= 0) {
+        printf("`promptLookupNum` and `promptLookupNgram` have to be positive, but are %d and %d.\n", numDrafts,
+                ngramSize);
+        exit(-1);
+    }
+#ifdef PIPELINE_PARALLEL
+    if (decoder.getContext()->ppSize > 1) {
+        printf("Prompt lookup decoding is not supported with pipeline parallel.\n");
+        exit(-1);
+    }
+#endif
+    stopWordsList = {};
+    stopWordsIndex = {};
+}
+
+// Get next tokens accoring to the prompt IDs for first token
+std::vector<int> PromptLookupSearch::getNextToken(int *ids, int batchSize, int seqLen) {
+    TimeLine t("1st Token");
+    this->step = 0;
+    this->batchSize = batchSize;
+    this->curLen = seqLen;
+    this->doneBatch = std::vector<int>(batchSize, 0);
+
+    if (!this->stopWordsList.empty()) {
+        stopWordsIndex = std::vector<std::vector<int>>(stopWordsList.size(), std::vector<int>(batchSize, 0));
+    }
+
+    if (this->grammar && (int)this->grammarStates.size() != batchSize) {
+        this->grammarStates.assign(batchSize, grammar->getStartState());
+    }
+
+    this->output.resize(batchSize * seqLen);
+    std::copy(ids, ids + batchSize * seqLen, output.begin());
+
+    int64_t dims[3] = {batchSize, 1, seqLen};
+
+    std::tuple<float *, int, int> result = decoder.forward(ids, dims, this->step++);
+    this->accept(result, {}, 0);
+
+    return this->popTokens();
+}
+
+// Get next tokens according to previous predicted ID and drafts for next tokens
+std::vector<int> PromptLookupSearch::getNextToken() {
+    if (pendingIdx < pendingLen) { return this->popTokens(); }
+
+    TimeLine t("Next Token");
+
+    // The last token is not in KV cache yet, and the sequence cannot exceed maxLen after accepting all drafts
+    std::vector<int> drafts;
+    int draftLen = 0;
+    int maxDraft = std::min(numDrafts, maxLen - curLen - 1);
+    if (maxDraft > 0) { draftLen = this->lookup(drafts, maxDraft); }
+
+    if (draftLen == 0) {
+        int64_t dims[3] = {batchSize, 1, 1};
+        std::tuple<float *, int, int> result = decoder.forward(nextTokens.data(), dims, this->step++);
+        this->accept(result, drafts, 0);
+    } else {
+        int inputLen = draftLen + 1;
+        std::vector<int> ids(batchSize * inputLen);
+        for (int b = 0; b < batchSize; ++b) {
+            ids[b * inputLen] = nextTokens[b];
+            std::copy(drafts.begin() + b * maxDraft, drafts.begin() + b * maxDraft + draftLen,
+                    ids.begin() + b * inputLen + 1);
+        }
+
+        int64_t dims[3] = {batchSize, 1, inputLen};
+        std::tuple<float *, int, int> result = decoder.forward(ids.data(), dims, this->step++, true);
+        this->accept(result, ids, draftLen);
+    }
+
+    return this->popTokens();
+}
+
+int PromptLookupSearch::lookup(std::vector<int> &drafts, int maxDraft) {
+    TimeLine t("PromptLookupSearch.lookup");
+    drafts.resize(batchSize * maxDraft);
+    int draftLen = 0;
+
+    for (int b = 0; b < batchSize; ++b) {
+        const int *seq = output.data() + b * curLen;
+        int *draft = drafts.data() + b * maxDraft;
+        int len = 0;
+
+        // Look up the longest n-gram first, and prefer the latest match
+        if (doneBatch[b] <= 0) {
+            for (int n = std::min(ngramSize, curLen - 1); n > 0 && len == 0; --n) {
+                const int *ngram = seq + curLen - n;
+                for (int i = curLen - n - 1; i >= 0; --i) {
+                    if (std::equal(ngram, ngram + n, seq + i)) {
+                        len = std::min(maxDraft, curLen - (i + n));
+                        std::copy(seq + i + n, seq + i + n + len, draft);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Any token is OK to fill the draft, as verified tokens are correct anyway
+        std::fill(draft + len, draft + maxDraft, seq[curLen - 1]);
+        draftLen = std::max(draftLen, len);
+    }
+
+    return draftLen;
+}
+
+void PromptLookupSearch::accept(std::tuple<float *, int, int> &result, const std::vector<int> &ids, int draftLen) {
+    TimeLine t("PromptLookupSearch");
+    DecoderContext *ctx = decoder.getContext();
+    Messenger &messenger = decoder.getMessenger();
+
+    float *outBuf = std::get<0>(result);
+    int sampleOffset = std::get<1>(result);
+    int sampleSize = std::get<2>(result);
+
+    // Greedy result of each position, for draftLen + 1 positions of each sample
+    int inputLen = draftLen + 1;
+    int rows = batchSize * inputLen;
+    std::vector<int> maxIds(rows);
+
+    // Grammar state of each position, a draft not allowed keeps the state as it cannot be accepted anyway
+    if (this->grammar) {
+        std::vector<int> states(rows);
+        for (int b = 0; b < batchSize; ++b) {
+            int s = grammarStates[b];
+            states[b * inputLen] = s;
+            for (int j = 1; j < inputLen; ++j) {
+                int ns = grammar->next(s, ids[b * inputLen + j]);
+                if (ns >= 0) { s = ns; }
+                states[b * inputLen + j] = s;
+            }
+        }
+        grammarLogitsProcess(*this->grammar, states, outBuf, sampleOffset, sampleSize, rows);
+    }
+
+    argmaxProcess(messenger, outBuf, sampleOffset, sampleSize, rows, ctx->numThreads, maxIds.data());
+
+    // Position j predicts the token after ids[j], which is to be compared with the draft ids[j + 1]
+    int accepted = draftLen;
+    for (int b = 0; b < batchSize; ++b) {
+        if (doneBatch[b] > 0) { continue; }
+        int j = 0;
+        while (j < accepted && maxIds[b * inputLen + j] == ids[b * inputLen + j + 1]) {
+            ++j;
+        }
+        accepted = j;
+    }
+
+    // Rejected drafts are dropped from KV cache
+    if (draftLen > 0) { decoder.rollbackCache(draftLen - accepted); }
+
+    pendingLen = accepted + 1;
+    pendingIdx = 0;
+    pending.resize(batchSize * pendingLen);
+    for (int b = 0; b < batchSize; ++b) {
+        std::copy(maxIds.begin() + b * inputLen, maxIds.begin() + b * inputLen + pendingLen,
+                pending.begin() + b * pendingLen);
+    }
+
+    if (this->numLogprobs >= 0) {
+        int logprobsLen = this->numLogprobs + 1;
+        std::vector<std::pair<int, float>> allLogprobs;
+        logprobsProcess(messenger, outBuf, sampleOffset, sampleSize, rows, maxIds.data(), this->numLogprobs,
+                allLogprobs);
+
+        pendingLogprobs.resize(batchSize * pendingLen * logprobsLen);
+        for (int b = 0; b < batchSize; ++b) {
+            std::copy(allLogprobs.begin() + b * inputLen * logprobsLen,
+                    allLogprobs.begin() + (b * inputLen + pendingLen) * logprobsLen,
+                    pendingLogprobs.begin() + b * pendingLen * logprobsLen);
+        }
+    }
+}
+
+std::vector<int> PromptLookupSearch::popTokens() {
+    std::vector<int> nextTokenIds_(batchSize);
+    for (int b = 0; b < batchSize; ++b) {
+        nextTokenIds_[b] = pending[b * pendingLen + pendingIdx];
+    }
+
+    if (this->numLogprobs >= 0) {
+        int logprobsLen = this->numLogprobs + 1;
+        logprobs.resize(batchSize * logprobsLen);
+        for (int b = 0; b < batchSize; ++b) {
+            auto src = pendingLogprobs.begin() + (b * pendingLen + pendingIdx) * logprobsLen;
+            std::copy(src, src + logprobsLen, logprobs.begin() + b * logprobsLen);
+        }
+    }
+    pendingIdx++;
+
+    if (eosTokenId != -1) {
+        for (int batchId = 0; batchId < batchSize; ++batchId) {
+            if (doneBatch[batchId] == 0) {
+                if (nextTokenIds_[batchId] == eosTokenId) { doneBatch[batchId] = 1; }
+            } else if (doneBatch[batchId] > 0) {
+                // Padding finished seq with padTokenId;
+                nextTokenIds_[batchId] = padTokenId;
+            } else if (doneBatch[batchId] < 0) {
+                // Set to eosTokenId as really done;
+                nextTokenIds_[batchId] = eosTokenId;
+                doneBatch[batchId] = 1;
+            }
+        }
+    }
+
+    if (!this->stopWordsList.empty() && !this->stopWordsIndex.empty()) {
+        stopWordsCheck(nextTokenIds_, this->stopWordsList, this->stopWordsIndex, this->doneBatch);
+    }
+
+    if (this->grammar) { grammarStatesUpdate(*this->grammar, this->grammarStates, nextTokenIds_); }
+
+    this->nextTokens = nextTokenIds_;
+    this->curLen++;
+    for (int batchId = 0; batchId < batchSize; ++batchId) {
+        output.insert(output.begin() + (batchId + 1) * curLen - 1, nextTokens[batchId]);
+    }
+
+    return this->nextTokens;
+}
+
+bool PromptLookupSearch::isDone() {
+    if (step == 0) {
+        return false;
+    } else if (curLen >= maxLen) {
+        return true;
+    } else {
+        for (auto flag : doneBatch) {
+            if (flag <= 0) { return false; }
+        }
+    }
+    return true;
+}
+
+std::vector<int32_t> PromptLookupSearch::finalize() {
+    TimeLine t("dumpFile");
+    t.dumpFile("timeline.json");
+    return output;
+}
+
+bool PromptLookupSearch::squeeze(int *idx, int size) {
+    if (step == 0 || size == batchSize) { return true; }
+
+    decoder.squeezeCache(idx, size);
+
+    squeezeRows(nextTokens, idx, size, 1);
+    squeezeRows(output, idx, size, curLen);
+    squeezeRows(doneBatch, idx, size, 1);
+    squeezeRows(grammarStates, idx, size, 1);
+    squeezeRows(logprobs, idx, size, numLogprobs + 1);
+    squeezeRows(pending, idx, size, pendingLen);
+    squeezeRows(pendingLogprobs, idx, size, pendingLen * (numLogprobs + 1));
+    for (auto &stopIndex : stopWordsIndex) {
+        squeezeRows(stopIndex, idx, size, 1);
+    }
+    batchSize = size;
+
+    return true;
+}
+
+bool PromptLookupSearch::setStopWords(std::vector<std::vector<int>> stopWordsList) {
+    this->stopWordsList = stopWordsList;
+    for (auto it = this->stopWordsList.rbegin(); it != this->stopWordsList.rend(); ++it) {
+        if ((*it).size() == 1 && (*it)[0] == this->eosTokenId) { this->stopWordsList.erase(std::next(it).base()); }
+    }
+    return !this->stopWordsList.empty();
+}
+
+bool PromptLookupSearch::setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states) {
+    this->grammar = grammar;
+    this->grammarStates = states;
+    return true;
+}
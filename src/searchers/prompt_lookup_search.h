@@ -0,0 +1,93 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#pragma once
+#include "abstract_decoder.h"
+#include "abstract_searcher.h"
+#include "timeline.h"
+
+/**
+ * Greedy search with prompt lookup decoding, no draft model is needed.
+ * The last n-gram of each sample is looked up in its previous tokens (prompt and generated ones), and the tokens
+ * following the match are drafted. Drafts are verified in one forward with logits of all positions, the longest
+ * prefix matching the greedy result is accepted, together with the token predicted after it.
+ * Samples are forwarded together, thus the accepted length is the minimum of all unfinished samples.
+ * The output is exactly the same as GreedySearch, and accepted tokens are returned one by one by getNextToken().
+ */
+class PromptLookupSearch : public AbstractSearcher {
+public:
+    PromptLookupSearch(AbstractDecoder &dec, const SearcherConfig &config);
+
+    // Get next tokens accoring to the prompt IDs
+    std::vector<int> getNextToken(int *ids, int batchSize, int seqLen);
+
+    // Get next tokens from accepted ones, or verify new drafts if all are returned
+    std::vector<int> getNextToken();
+
+    bool isDone();
+
+    std::vector<int32_t> finalize();
+
+    bool setStopWords(std::vector<std::vector<int>> stopWordsList);
+
+    bool squeeze(int *idx, int size);
+
+    std::vector<std::pair<int, float>> getLogprobs() { return logprobs; }
+
+    bool setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states = {});
+
+    // Drafts are verified with the same length for all rows, padding is not supported yet
+    bool setPadding(const std::vector<int> &padLens) { return padLens.empty(); }
+
+    bool append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states) {
+        return false;
+    }
+
+private:
+    // Draft tokens of each sample into drafts (batchSize x maxDraft), return the longest draft length
+    int lookup(std::vector<int> &drafts, int maxDraft);
+
+    // Accept tokens from the result of the input ids (the last token then draftLen drafts of each sample)
+    void accept(std::tuple<float *, int, int> &result, const std::vector<int> &ids, int draftLen);
+
+    // Return the next accepted token of each sample
+    std::vector<int> popTokens();
+
+    AbstractDecoder &decoder;
+
+    std::vector<int> nextTokens;
+    std::vector<int> output;
+    std::vector<int> doneBatch;
+    std::vector<std::pair<int, float>> logprobs;
+
+    // Accepted but not returned tokens (and logprobs) of each sample, the same count for all samples
+    std::vector<int> pending;
+    std::vector<std::pair<int, float>> pendingLogprobs;
+    int pendingLen;
+    int pendingIdx;
+
+    int batchSize;
+    int step;
+    int curLen;
+    int maxLen;
+    int eosTokenId;
+    int padTokenId;
+    int numLogprobs;
+    int numDrafts;
+    int ngramSize;
+    std::vector<std::vector<int>> stopWordsList;
+    std::vector<std::vector<int>> stopWordsIndex;
+    std::shared_ptr<const TokenGrammar> grammar;
+    std::vector<int> grammarStates; // one for each row
+};
@@ -18,11 +18,13 @@
 SampleSearch::SampleSearch(AbstractDecoder &dec, const SearcherConfig &config)
     : decoder(dec)
     , maxLen(config.maxLen)
+    , eosTokenId(config.eosTokenId == -1 ? dec.getEndId() : config.eosTokenId)
     , topK(config.topK)
     , topP(config.topP)
-    , repetitionPenalty(config.repetitionPenalty) {
+    , numLogprobs(config.numLogprobs)
+    , numSamples(config.numBeamHypsToKeep)
+    , processor(config, eosTokenId) {
     vocabSize = decoder.getContext()->vocabSize;
-    eosTokenId = config.eosTokenId == -1 ? decoder.getEndId() : config.eosTokenId;
     padTokenId = config.padTokenId == -1 ? eosTokenId : config.padTokenId;
     if (config.temperature <= 0) {
         printf("Temperature should greater than 0.\n");
@@ -30,20 +32,17 @@ SampleSearch::SampleSearch(AbstractDecoder &dec, const SearcherConfig &config)
     }
     temperatureInv = 1 / config.temperature;
     if (topK < 2) { topK = 2; }
-
-    if (repetitionPenalty <= 0) {
-        printf("`repetitionPenalty` has to be a strictly positive float, but is %f.\n", repetitionPenalty);
-        exit(-1);
-    }
+    if (numSamples < 1) { numSamples = 1; }
     stopWordsList = {};
     stopWordsIndex = {};
 }
 
 // Get next tokens accoring to the prompt IDs
-std::vector<int> SampleSearch::getNextToken(int *ids, int batchSize, int seqLen) {
+// Each prompt is forked into numSamples rows after the prefill, rows of a prompt share the KV cache of the prompt
+std::vector<int> SampleSearch::getNextToken(int *ids, int userSideBS, int seqLen) {
     TimeLine t("1st Token");
     this->step = 0;
-    this->batchSize = batchSize;
+    this->batchSize = userSideBS * numSamples;
     this->curLen = seqLen;
     this->doneBatch = std::vector<int>(batchSize, 0);
 
@@ -51,16 +50,29 @@ std::vector<int> SampleSearch::getNextToken(int *ids, int batchSize, int seqLen)
         stopWordsIndex = std::vector<std::vector<int>>(stopWordsList.size(), std::vector<int>(batchSize, 0));
     }
 
+    if (!padLens.empty()) { decoder.setPadding(padLens.data(), userSideBS); }
+    processor.begin(ids, userSideBS, seqLen, numSamples, padLens.empty() ? nullptr : padLens.data());
+
     this->output.resize(batchSize * seqLen);
-    std::copy(ids, ids + batchSize * seqLen, output.begin());
+    for (int i = 0; i < batchSize; ++i) {
+        int *prompt = ids + (i / numSamples) * seqLen;
+        std::copy(prompt, prompt + seqLen, output.begin() + i * seqLen);
+    }
 
-    int64_t dims[3] = {batchSize, 1, seqLen};
+    // Independent random stream for each row
+    std::random_device rd;
+    generators.clear();
+    for (int i = 0; i < batchSize; ++i) {
+        generators.emplace_back(rd());
+    }
+
+    // The prompts are computed once, and expanded to numSamples rows (like beams) by the decoder
+    int64_t dims[3] = {userSideBS, numSamples, seqLen};
 
     std::tuple<float *, int, int> result = decoder.forward(ids, dims, this->step++);
 
     nextTokens.resize(batchSize);
-    // TODO: Add PIPELINE_PARALLEL feature
-    sample(result);
+    syncSample(result);
 
     this->curLen++;
     for (int batchId = 0; batchId < batchSize; ++batchId) {
@@ -76,8 +88,7 @@ std::vector<int> SampleSearch::getNextToken() {
     int64_t dims[3] = {batchSize, 1, 1};
     std::tuple<float *, int, int> result = decoder.forward(nextTokens.data(), dims, this->step++);
 
-    // TODO: Add PIPELINE_PARALLEL feature
-    sample(result);
+    syncSample(result);
 
     this->curLen++;
     for (int batchId = 0; batchId < batchSize; ++batchId) {
@@ -106,6 +117,59 @@ std::vector<int32_t> SampleSearch::finalize() {
     return output;
 }
 
+bool SampleSearch::squeeze(int *idx, int size) {
+    if (step == 0 || size == batchSize) { return true; }
+
+    decoder.squeezeCache(idx, size);
+
+    squeezeRows(nextTokens, idx, size, 1);
+    squeezeRows(output, idx, size, curLen);
+    squeezeRows(doneBatch, idx, size, 1);
+    processor.squeeze(idx, size);
+    squeezeRows(logprobs, idx, size, numLogprobs + 1);
+    squeezeRows(generators, idx, size, 1);
+    for (auto &stopIndex : stopWordsIndex) {
+        squeezeRows(stopIndex, idx, size, 1);
+    }
+    batchSize = size;
+
+    return true;
+}
+
+// Samples forked from a prompt share its KV cache, whose padding is only kept for each row
+bool SampleSearch::setPadding(const std::vector<int> &padLens) {
+    if (numSamples > 1 && !padLens.empty()) { return false; }
+    this->padLens = padLens;
+    return true;
+}
+
+// Like GreedySearch::append, each new row samples from its own random stream
+bool SampleSearch::append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states) {
+    if (step == 0 || numSamples > 1 || seqLen > curLen) { return false; }
+
+    std::vector<int> prefix(rows * (seqLen - 1));
+    for (int b = 0; b < rows; ++b) {
+        std::copy(ids + b * seqLen, ids + (b + 1) * seqLen - 1, prefix.begin() + b * (seqLen - 1));
+    }
+    decoder.appendSamples(prefix.data(), rows, seqLen - 1, padLens);
+
+    std::random_device rd;
+    for (int b = 0; b < rows; ++b) {
+        nextTokens.push_back(ids[(b + 1) * seqLen - 1]);
+        output.insert(output.end(), curLen - seqLen + padLens[b], padTokenId);
+        output.insert(output.end(), ids + b * seqLen + padLens[b], ids + (b + 1) * seqLen);
+        doneBatch.push_back(0);
+        generators.emplace_back(rd());
+    }
+    for (auto &stopIndex : stopWordsIndex) {
+        stopIndex.resize(batchSize + rows, 0);
+    }
+    processor.append(ids, rows, seqLen, padLens, states);
+    batchSize += rows;
+
+    return true;
+}
+
 bool SampleSearch::setStopWords(std::vector<std::vector<int>> stopWordsList) {
     this->stopWordsList = stopWordsList;
     for (auto it = this->stopWordsList.rbegin(); it != this->stopWordsList.rend(); ++it) {
@@ -114,6 +178,27 @@ bool SampleSearch::setStopWords(std::vector<std::vector<int>> stopWordsList) {
     return !this->stopWordsList.empty();
 }
 
+bool SampleSearch::setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states) {
+    processor.setGrammar(grammar, states);
+    return true;
+}
+
+void SampleSearch::syncSample(std::tuple<float *, int, int> &result) {
+#ifdef PIPELINE_PARALLEL
+    // Only the last pipeline stage has the logits, other stages get the tokens and states of the step from it
+    DecoderContext *ctx = decoder.getContext();
+    if (std::get<0>(result) != nullptr) { sample(result); }
+    syncPipelineStages(ctx, nextTokens.data(), batchSize);
+    syncPipelineStages(ctx, doneBatch.data(), batchSize);
+    if (numLogprobs >= 0) {
+        logprobs.resize(batchSize * (numLogprobs + 1));
+        syncPipelineStages(ctx, logprobs.data(), logprobs.size());
+    }
+#else
+    sample(result);
+#endif
+}
+
 void SampleSearch::sample(std::tuple<float *, int, int> &result) {
     TimeLine t("Sample.searchTop");
     float *outBuf = std::get<0>(result);
@@ -123,21 +208,7 @@ void SampleSearch::sample(std::tuple<float *, int, int> &result) {
     Messenger &messenger = decoder.getMessenger();
     auto msgerSize = messenger.getSize();
 
-    // Repetition penalty logits processor
-    if (this->repetitionPenalty != 1.0) {
-        TimeLine t("GreedySearch.repetitionPenalty");
-        // step has already been incremented by 1
-        if (this->step == 1) {
-            this->cachedRepetVec.clear();
-            this->cachedRepetVec.resize(batchSize, std::vector<int>());
-
-            repetitionPenaltyLogitsProcess(this->repetitionPenalty, outBuf, sampleOffset, sampleSize, this->output,
-                    batchSize, this->cachedRepetVec, this->step, msgerSize > 1);
-        } else {
-            repetitionPenaltyLogitsProcess(this->repetitionPenalty, outBuf, sampleOffset, sampleSize, this->nextTokens,
-                    batchSize, this->cachedRepetVec, this->step, msgerSize > 1);
-        }
-    }
+    if (processor.enabled()) { processor.process(outBuf, sampleOffset, sampleSize, batchSize); }
 
     // 1. Get top K candidates for each sample, inculde topK ids and vals
     int topKIds[batchSize * topK];
@@ -224,16 +295,14 @@ void SampleSearch::sample(std::tuple<float *, int, int> &result) {
         }
     }
 
-    // 4. Sample.
-    std::random_device rd;
-    std::default_random_engine generator(rd());
-    std::uniform_real_distribution<float> distribution(0.0, 1.0);
+    // 4. Sample, each row draws from its own random stream.
 #pragma omp parallel for
     for (int batchIdx = 0; batchIdx < batchSize; batchIdx++) {
+        std::uniform_real_distribution<float> distribution(0.0, 1.0);
         float probs[topPNums[batchIdx]];
         float probs_sum = 0;
         float cursum = 0;
-        float randomValue = distribution(generator);
+        float randomValue = distribution(generators[batchIdx]);
 
         for (int i = 0; i < topPNums[batchIdx]; i++) {
             probs[i] = exp(topKVals[batchIdx * topK + i]);
@@ -252,6 +321,12 @@ void SampleSearch::sample(std::tuple<float *, int, int> &result) {
 
     if (msgerSize > 1) { messenger.broadcast(nextTokens.data(), nextTokens.size()); }
 
+    // Logprobs are of the distribution before temperature, like the model itself predicts
+    if (this->numLogprobs >= 0) {
+        logprobsProcess(messenger, outBuf, sampleOffset, sampleSize, batchSize, nextTokens.data(), this->numLogprobs,
+                this->logprobs);
+    }
+
     if (eosTokenId != -1) {
         for (int batchId = 0; batchId < batchSize; ++batchId) {
             if (doneBatch[batchId] == 0) {
@@ -270,4 +345,6 @@ void SampleSearch::sample(std::tuple<float *, int, int> &result) {
     if (!this->stopWordsList.empty() && !this->stopWordsIndex.empty()) {
         stopWordsCheck(nextTokens, this->stopWordsList, this->stopWordsIndex, this->doneBatch);
     }
+
+    processor.update(nextTokens);
 };
@@ -18,14 +18,15 @@
 #include <random>
 #include "abstract_decoder.h"
 #include "abstract_searcher.h"
+#include "logits_processor.h"
 #include "timeline.h"
 
 class SampleSearch : public AbstractSearcher {
 public:
     SampleSearch(AbstractDecoder &dec, const SearcherConfig &config);
 
-    // Get next tokens accoring to the prompt IDs
-    std::vector<int> getNextToken(int *ids, int batchSize, int seqLen);
+    // Get next tokens accoring to the prompt IDs, there are userSideBS * numSamples rows from now on
+    std::vector<int> getNextToken(int *ids, int userSideBS, int seqLen);
 
     // Get next tokens according to previous predicted ID
     std::vector<int> getNextToken();
@@ -36,7 +37,20 @@ public:
 
     bool setStopWords(std::vector<std::vector<int>> stopWordsList);
 
+    bool squeeze(int *idx, int size);
+
+    std::vector<std::pair<int, float>> getLogprobs() { return logprobs; }
+
+    bool setGrammar(std::shared_ptr<const TokenGrammar> grammar, const std::vector<int> &states = {});
+
+    bool setPadding(const std::vector<int> &padLens);
+
+    bool append(const int *ids, int rows, int seqLen, const int *padLens, const std::vector<int> &states);
+
 private:
+    // Sample the next tokens, or get them from the last pipeline stage
+    void syncSample(std::tuple<float *, int, int> &result);
+
     void sample(std::tuple<float *, int, int> &result);
 
     AbstractDecoder &decoder;
@@ -44,8 +58,9 @@ private:
     // Predicted token IDs
     std::vector<int> nextTokens;
     std::vector<int> output;
-    std::vector<std::vector<int>> cachedRepetVec;
     std::vector<int> doneBatch;
+    std::vector<std::pair<int, float>> logprobs;
+    std::vector<std::default_random_engine> generators; // one for each row
 
     int batchSize;
     int step;
@@ -57,7 +72,10 @@ private:
     int topK;
     float topP;
     float temperatureInv;
-    float repetitionPenalty;
+    int numLogprobs;
+    int numSamples; // completions sampled for each prompt
     std::vector<std::vector<int>> stopWordsList;
     std::vector<std::vector<int>> stopWordsIndex;
+    std::vector<int> padLens; // Of the prompts, empty if not padded
+    LogitsProcessor processor;
 };
\ No newline at end of file
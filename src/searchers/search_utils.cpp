@@ -14,63 +14,11 @@
 // ============================================================================
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <functional>
 #include <vector>
 #include "search_utils.h"
-
-// Insert an element into a sorted vector while maintaining the order
-void insertAndSort(std::vector<int> &targetVector, int num) {
-    auto it = std::lower_bound(targetVector.begin(), targetVector.end(), num);
-    if (it == targetVector.end() || *it != num) { targetVector.insert(it, num); }
-}
-
-void repetitionPenaltyLogitsProcess(float penalty, float *logits, int sampleOffset, int sampleSize,
-        std::vector<int> &inputIds, int batchSize, std::vector<std::vector<int>> &cachedVec, int step, bool multiRank) {
-    int seqLen = inputIds.size() / batchSize;
-    if (step != 1) { assert(seqLen == 1); }
-
-    if (step == 1) {
-#pragma omp parallel for
-        for (int b = 0; b < batchSize; b++) {
-            cachedVec[b].clear();
-            cachedVec[b].insert(cachedVec[b].end(), inputIds.begin() + b * seqLen, inputIds.begin() + (b + 1) * seqLen);
-            std::sort(cachedVec[b].begin(), cachedVec[b].end());
-            cachedVec[b].erase(std::unique(cachedVec[b].begin(), cachedVec[b].end()), cachedVec[b].end());
-
-            if (multiRank) {
-                // Get (sampleOffset, sampleOffset + sampleSize)
-                auto boundBegin = std::upper_bound(cachedVec[b].begin(), cachedVec[b].end(), sampleOffset);
-                auto boundEnd = std::lower_bound(cachedVec[b].begin(), cachedVec[b].end(), sampleOffset + sampleSize);
-
-                cachedVec[b].erase(boundEnd, cachedVec[b].end());
-                cachedVec[b].erase(cachedVec[b].begin(), boundBegin);
-
-                std::transform(cachedVec[b].begin(), cachedVec[b].end(), cachedVec[b].begin(),
-                        [sampleOffset](int num) { return num - sampleOffset; });
-            }
-        }
-    } else {
-        if (multiRank) {
-            for (int b = 0; b < batchSize; b++) {
-                if (inputIds[b] >= sampleOffset && inputIds[b] < sampleOffset + sampleSize) {
-                    insertAndSort(cachedVec[b], inputIds[b] - sampleOffset);
-                }
-            }
-        } else {
-            for (int b = 0; b < batchSize; b++) {
-                insertAndSort(cachedVec[b], inputIds[b]);
-            }
-        }
-    }
-
-#pragma omp parallel for
-    for (int b = 0; b < batchSize; b++) {
-        int startLogits = b * sampleSize;
-        for (int index : cachedVec[b]) {
-            float &logit = logits[startLogits + index];
-            logit = logit < 0 ? logit * penalty : logit / penalty;
-        }
-    }
-}
+#include "timeline.h"
 
 void stopWordsCheck(std::vector<int> &nextTokenIds, std::vector<std::vector<int>> &stopWordsList,
         std::vector<std::vector<int>> &stopWordsIndex, std::vector<int> &doneBatch) {
@@ -94,4 +42,209 @@ void stopWordsCheck(std::vector<int> &nextTokenIds, std::vector<std::vector<int>
             }
         }
     }
-}
\ No newline at end of file
+}
+void logprobsProcess(Messenger &messenger, const float *logits, int sampleOffset, int sampleSize, int batchSize,
+        const int *chosen, int topN, std::vector<std::pair<int, float>> &result) {
+    TimeLine t("logprobsProcess");
+    // Rows of all ranks have the same length for allgatherv, thus a split smaller than topN (uneven vocabulary split)
+    // pads its candidates with -inf entries instead of clipping topN on its own
+    const int localN = std::min(topN, sampleSize);
+
+    // Each sample: max, sum of exp, chosen logit (-inf if not in this split), then topN of (id, logit)
+    const int rowLen = 3 + 2 * topN;
+    std::vector<float> local(batchSize * rowLen);
+
+#pragma omp parallel for
+    for (int b = 0; b < batchSize; ++b) {
+        const float *p = logits + b * sampleSize;
+        float *row = local.data() + b * rowLen;
+
+        float maxVal = *std::max_element(p, p + sampleSize);
+        float sum = 0;
+        for (int i = 0; i < sampleSize; ++i) {
+            sum += std::exp(p[i] - maxVal);
+        }
+        int chosenIdx = chosen[b] - sampleOffset;
+        row[0] = maxVal;
+        row[1] = sum;
+        row[2] = (chosenIdx >= 0 && chosenIdx < sampleSize) ? p[chosenIdx] : -INFINITY;
+
+        if (topN > 0) {
+            std::vector<std::pair<float, int>> elements(sampleSize);
+            for (int i = 0; i < sampleSize; ++i) {
+                elements[i] = std::make_pair(p[i], i);
+            }
+            std::partial_sort(
+                    elements.begin(), elements.begin() + localN, elements.end(), std::greater<std::pair<float, int>>());
+            for (int k = 0; k < localN; ++k) {
+                row[3 + 2 * k] = (float)(elements[k].second + sampleOffset);
+                row[4 + 2 * k] = elements[k].first;
+            }
+            for (int k = localN; k < topN; ++k) {
+                row[3 + 2 * k] = -1;
+                row[4 + 2 * k] = -INFINITY;
+            }
+        }
+    }
+
+    int ranks = messenger.getSize();
+    std::vector<float> all;
+    if (ranks > 1) {
+        all.resize(ranks * batchSize * rowLen);
+        std::vector<long unsigned int> recvCount(ranks, static_cast<long unsigned int>(batchSize * rowLen));
+        messenger.allgatherv(local.data(), batchSize * rowLen, all.data(), recvCount);
+    } else {
+        all.swap(local);
+    }
+
+    result.resize(batchSize * (1 + topN));
+
+#pragma omp parallel for
+    for (int b = 0; b < batchSize; ++b) {
+        float maxVal = -INFINITY;
+        float chosenVal = -INFINITY;
+        for (int r = 0; r < ranks; ++r) {
+            const float *row = all.data() + (r * batchSize + b) * rowLen;
+            maxVal = std::max(maxVal, row[0]);
+            chosenVal = std::max(chosenVal, row[2]);
+        }
+        float sum = 0;
+        for (int r = 0; r < ranks; ++r) {
+            const float *row = all.data() + (r * batchSize + b) * rowLen;
+            sum += row[1] * std::exp(row[0] - maxVal);
+        }
+        float logZ = maxVal + std::log(sum);
+
+        std::pair<int, float> *out = result.data() + b * (1 + topN);
+        out[0] = std::make_pair(chosen[b], chosenVal - logZ);
+
+        if (topN > 0) {
+            std::vector<std::pair<float, int>> elements(ranks * topN);
+            for (int r = 0; r < ranks; ++r) {
+                const float *row = all.data() + (r * batchSize + b) * rowLen;
+                for (int k = 0; k < topN; ++k) {
+                    elements[r * topN + k] = std::make_pair(row[4 + 2 * k], (int)(row[3 + 2 * k] + 0.5f));
+                }
+            }
+            std::partial_sort(
+                    elements.begin(), elements.begin() + topN, elements.end(), std::greater<std::pair<float, int>>());
+            for (int k = 0; k < topN; ++k) {
+                out[1 + k] = std::make_pair(elements[k].second, elements[k].first - logZ);
+            }
+        }
+    }
+}
+
+void argmaxProcess(Messenger &messenger, const float *logits, int sampleOffset, int sampleSize, int batchSize,
+        int numThreads, int *maxIds) {
+    TimeLine t("argmaxProcess");
+    std::vector<float> maxVals(batchSize);
+
+    // Small batch size (each sample can have at least 2 threads)
+    if (numThreads / batchSize >= 2) {
+        int thrPerSample = numThreads / batchSize;
+        int sizePerThr = (sampleSize + thrPerSample - 1) / thrPerSample;
+        std::vector<int> maxIndices(batchSize * thrPerSample);
+        std::vector<float> maxValues(batchSize * thrPerSample);
+
+        // TODO: if sampleSize is small, possible to cause out of boundary
+#pragma omp parallel for collapse(2)
+        for (int b = 0; b < batchSize; ++b) {
+            for (int t = 0; t < thrPerSample; ++t) { // thread index inside the sample
+                int start = t * sizePerThr;
+                int end = (start + sizePerThr) > sampleSize ? sampleSize : (start + sizePerThr);
+                const float *p = logits + b * sampleSize;
+
+                int maxIdx = start;
+                float maxVal = p[start];
+                for (int off = start + 1; off < end; ++off) {
+                    if (p[off] > maxVal) {
+                        maxVal = p[off];
+                        maxIdx = off;
+                    }
+                }
+
+                // False sharing happens, but since only one time, not avoided
+                maxIndices[b * thrPerSample + t] = maxIdx;
+                maxValues[b * thrPerSample + t] = maxVal;
+            }
+        }
+
+        // Local reduction
+        for (int i = 0; i < batchSize; ++i) {
+            int *pIndices = maxIndices.data() + i * thrPerSample;
+            float *pValues = maxValues.data() + i * thrPerSample;
+            int maxIdx = pIndices[0];
+            float maxVal = pValues[0];
+            for (int j = 1; j < thrPerSample; ++j) {
+                if (pValues[j] > maxVal) {
+                    maxVal = pValues[j];
+                    maxIdx = pIndices[j];
+                }
+            }
+            maxIds[i] = maxIdx;
+            maxVals[i] = maxVal;
+        }
+    }
+
+    // Each thread handle one sample (one row)
+    else {
+#pragma omp parallel for
+        for (int i = 0; i < batchSize; ++i) {
+            int maxId = 0;
+            const float *p = logits + i * sampleSize;
+            float maxVal = p[0];
+            for (int j = 1; j < sampleSize; ++j) {
+                if (p[j] > maxVal) {
+                    maxVal = p[j];
+                    maxId = j;
+                }
+            }
+            maxIds[i] = maxId;
+            maxVals[i] = maxVal;
+        }
+    }
+
+    // Reduce to get the max index (any better method??)
+    int msgerSize = messenger.getSize();
+    if (msgerSize > 1) {
+        std::vector<float> sendBuf(2 * batchSize);
+        std::vector<float> recvBuf(2 * batchSize * msgerSize);
+
+        for (int i = 0; i < batchSize; ++i) {
+            sendBuf[2 * i] = (float)(maxIds[i] + sampleOffset);
+            sendBuf[2 * i + 1] = maxVals[i];
+        }
+
+        std::vector<long unsigned int> recvCount(msgerSize, static_cast<long unsigned int>(2 * batchSize));
+        messenger.allgatherv(sendBuf.data(), 2 * batchSize, recvBuf.data(), recvCount);
+
+        for (int i = 0; i < batchSize; ++i) {
+            int maxId = (int)(recvBuf[2 * i] + 0.5f);
+            float maxVal = recvBuf[2 * i + 1];
+            for (int j = 1; j < msgerSize; ++j) {
+                if (recvBuf[2 * j * batchSize + 2 * i + 1] > maxVal) {
+                    maxVal = recvBuf[2 * j * batchSize + 2 * i + 1];
+                    maxId = (int)(recvBuf[2 * j * batchSize + 2 * i] + 0.5f);
+                }
+            }
+            maxIds[i] = maxId;
+        }
+    }
+}
+
+void grammarLogitsProcess(const TokenGrammar &grammar, const std::vector<int> &states, float *logits, int sampleOffset,
+        int sampleSize, int batchSize) {
+    TimeLine t("grammarLogitsProcess");
+#pragma omp parallel for
+    for (int b = 0; b < batchSize; ++b) {
+        grammar.applyMask(states[b], logits + (size_t)b * sampleSize, sampleOffset, sampleSize);
+    }
+}
+
+void grammarStatesUpdate(const TokenGrammar &grammar, std::vector<int> &states, const std::vector<int> &tokens) {
+    for (int b = 0; b < (int)states.size(); ++b) {
+        int next = grammar.next(states[b], tokens[b]);
+        if (next >= 0) { states[b] = next; }
+    }
+}
@@ -13,12 +13,61 @@
 // limitations under the License.
 // ============================================================================
 #pragma once
+#include <algorithm>
+#include <utility>
+#include <vector>
 
-// Insert an element into a sorted vector while maintaining the order
-void insertAndSort(std::vector<int> &targetVector, int num);
-
-void repetitionPenaltyLogitsProcess(float penalty, float *logits, int sampleOffset, int sampleSize,
-        std::vector<int> &inputIds, int batchSize, std::vector<std::vector<int>> &cachedVec, int step, bool multiRank);
+#include "messenger.h"
+#include "token_grammar.h"
+#include "transformer_ctx.h"
 
 void stopWordsCheck(std::vector<int> &nextTokenIds, std::vector<std::vector<int>> &stopWordsList,
         std::vector<std::vector<int>> &stopWordsIndex, std::vector<int> &doneBatch);
+
+// Log-probabilities of the chosen token and the top N tokens of each sample, while logits are split among ranks.
+// Each rank only contributes (max, sum of exp, chosen logit) and its top N candidates of each sample.
+// result: batchSize * (1 + topN) pairs of (token id, logprob), the chosen token is the first one of each sample
+void logprobsProcess(Messenger &messenger, const float *logits, int sampleOffset, int sampleSize, int batchSize,
+        const int *chosen, int topN, std::vector<std::pair<int, float>> &result);
+
+// Token id of the max logit of each sample, while logits are split among ranks (the split starts at sampleOffset)
+// maxIds: batchSize token ids, same on all ranks
+void argmaxProcess(Messenger &messenger, const float *logits, int sampleOffset, int sampleSize, int batchSize,
+        int numThreads, int *maxIds);
+
+// Mask logits of each sample by its state of the grammar, logits are split among ranks like other processors
+void grammarLogitsProcess(const TokenGrammar &grammar, const std::vector<int> &states, float *logits, int sampleOffset,
+        int sampleSize, int batchSize);
+
+// Move the grammar state of each sample by the chosen token, the state is kept if the token is not allowed (padding)
+void grammarStatesUpdate(const TokenGrammar &grammar, std::vector<int> &states, const std::vector<int> &tokens);
+
+// Only keep rows in idx (ascending order) of a row-major buffer, rows are moved to the front
+template <typename T>
+void squeezeRows(std::vector<T> &buf, const int *idx, int size, int rowLen) {
+    if (buf.empty()) { return; }
+    for (int i = 0; i < size; ++i) {
+        if (idx[i] != i) {
+            std::move(buf.begin() + idx[i] * rowLen, buf.begin() + (idx[i] + 1) * rowLen, buf.begin() + i * rowLen);
+        }
+    }
+    buf.resize(size * rowLen);
+}
+
+#ifdef PIPELINE_PARALLEL
+// Results searched by the last pipeline stage are sent to other stages (of the same TP rank) after each step, as the
+// first stage needs the tokens as the next input, and all stages need the same states to finish or squeeze together
+template <typename T>
+void syncPipelineStages(DecoderContext *ctx, T *data, int count) {
+    if (ctx->ppSize <= 1 || count == 0) { return; }
+    int lastWorldRank = (ctx->ppSize - 1) * ctx->tpSize + ctx->tpRank;
+    if (ctx->ppRank == ctx->ppSize - 1) {
+        for (int ppRank = 0; ppRank < ctx->ppSize - 1; ++ppRank) {
+            int worldRank = ppRank * ctx->tpSize + ctx->tpRank;
+            MPI_Send(data, count * sizeof(T), MPI_BYTE, worldRank, lastWorldRank, MPI_COMM_WORLD);
+        }
+    } else {
+        MPI_Recv(data, count * sizeof(T), MPI_BYTE, lastWorldRank, lastWorldRank, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+#endif
@@ -17,4 +17,5 @@
 #include "abstract_searcher.h"
 #include "beam_search.h"
 #include "greedy_search.h"
+#include "prompt_lookup_search.h"
 #include "sample_search.h"
\ No newline at end of file
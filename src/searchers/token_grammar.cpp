@@ -0,0 +1,654 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "token_grammar.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+#include "timeline.h"
+
+namespace {
+using ByteSet = std::bitset<256>;
+
+// Limits to keep the compilation bounded
+constexpr int kMaxRepeat = 1000;
+constexpr int kMaxDfaStates = 100000;
+
+struct RegexNode {
+    enum Type { BYTES, CONCAT, ALTER, REPEAT };
+
+    Type type = CONCAT;
+    ByteSet bytes;
+    std::vector<RegexNode> children;
+    int minTimes = 0;
+    int maxTimes = 0; // -1 means unbounded
+};
+
+// Recursive descent parser of the regular expression
+class RegexParser {
+public:
+    explicit RegexParser(const std::string &pattern) : s(pattern), pos(0) {}
+
+    RegexNode parse() {
+        RegexNode node = parseAlter();
+        if (pos < s.size()) { error("unmatched ')'"); }
+        return node;
+    }
+
+private:
+    RegexNode parseAlter() {
+        RegexNode node = parseConcat();
+        if (pos >= s.size() || s[pos] != '|') { return node; }
+
+        RegexNode alter;
+        alter.type = RegexNode::ALTER;
+        alter.children.push_back(std::move(node));
+        while (pos < s.size() && s[pos] == '|') {
+            ++pos;
+            alter.children.push_back(parseConcat());
+        }
+        return alter;
+    }
+
+    RegexNode parseConcat() {
+        RegexNode node;
+        node.type = RegexNode::CONCAT;
+        while (pos < s.size() && s[pos] != '|' && s[pos] != ')') {
+            RegexNode atom = parseAtom();
+            parseQuantifiers(atom);
+            node.children.push_back(std::move(atom));
+        }
+        return node;
+    }
+
+    RegexNode parseAtom() {
+        unsigned char c = s[pos++];
+        if (c == '(') {
+            if (s.compare(pos, 2, "?:") == 0) { pos += 2; }
+            RegexNode node = parseAlter();
+            if (pos >= s.size() || s[pos] != ')') { error("missing ')'"); }
+            ++pos;
+            return node;
+        } else if (c == '[') {
+            return bytesNode(parseClass());
+        } else if (c == '.') {
+            ByteSet any;
+            any.set();
+            any.reset('\n');
+            return bytesNode(any);
+        } else if (c == '\\') {
+            ByteSet set;
+            std::string literal;
+            if (parseEscape(set, literal)) { return bytesNode(set); }
+            RegexNode node;
+            node.type = RegexNode::CONCAT;
+            for (unsigned char b : literal) {
+                node.children.push_back(byteNode(b));
+            }
+            return node;
+        } else if (c == '^' || c == '$') {
+            // The whole output always matches the whole expression
+            return RegexNode();
+        } else if (c == '*' || c == '+' || c == '?' || c == '{') {
+            error("nothing to repeat");
+        }
+        return byteNode(c);
+    }
+
+    void parseQuantifiers(RegexNode &atom) {
+        while (pos < s.size()) {
+            int minTimes, maxTimes;
+            char c = s[pos];
+            if (c == '*') {
+                minTimes = 0;
+                maxTimes = -1;
+            } else if (c == '+') {
+                minTimes = 1;
+                maxTimes = -1;
+            } else if (c == '?') {
+                minTimes = 0;
+                maxTimes = 1;
+            } else if (c == '{') {
+                ++pos;
+                minTimes = parseNumber();
+                maxTimes = minTimes;
+                if (pos < s.size() && s[pos] == ',') {
+                    ++pos;
+                    maxTimes = (pos < s.size() && s[pos] == '}') ? -1 : parseNumber();
+                }
+                if (pos >= s.size() || s[pos] != '}') { error("missing '}'"); }
+                if (maxTimes != -1 && maxTimes < minTimes) { error("bad repetition range"); }
+            } else {
+                return;
+            }
+            ++pos;
+
+            // Lazy quantifiers match the same language
+            if (pos < s.size() && s[pos] == '?') { ++pos; }
+
+            RegexNode repeat;
+            repeat.type = RegexNode::REPEAT;
+            repeat.minTimes = minTimes;
+            repeat.maxTimes = maxTimes;
+            repeat.children.push_back(std::move(atom));
+            atom = std::move(repeat);
+        }
+    }
+
+    int parseNumber() {
+        size_t start = pos;
+        int value = 0;
+        while (pos < s.size() && s[pos] >= '0' && s[pos] <= '9') {
+            value = value * 10 + (s[pos++] - '0');
+            if (value > kMaxRepeat) { error("repetition count is too large"); }
+        }
+        if (pos == start) { error("bad repetition count"); }
+        return value;
+    }
+
+    ByteSet parseClass() {
+        ByteSet set;
+        bool negate = false;
+        if (pos < s.size() && s[pos] == '^') {
+            negate = true;
+            ++pos;
+        }
+
+        bool first = true;
+        while (pos < s.size() && (s[pos] != ']' || first)) {
+            first = false;
+            ByteSet item;
+            int lo = classByte(item);
+            if (lo >= 0 && pos + 1 < s.size() && s[pos] == '-' && s[pos + 1] != ']') {
+                ++pos;
+                int hi = classByte(item);
+                if (hi < lo) { error("bad range in class"); }
+                for (int b = lo; b <= hi; ++b) {
+                    item.set(b);
+                }
+            } else if (lo >= 0) {
+                item.set(lo);
+            }
+            set |= item;
+        }
+        if (pos >= s.size()) { error("missing ']'"); }
+        ++pos;
+
+        return negate ? ~set : set;
+    }
+
+    // One byte of a class, or -1 if it is a set (like \d) which is merged into item
+    int classByte(ByteSet &item) {
+        unsigned char c = s[pos++];
+        if (c != '\\') { return c; }
+
+        ByteSet set;
+        std::string literal;
+        if (!parseEscape(set, literal)) { error("non-ASCII escape in class"); }
+        if (set.count() == 1) {
+            for (int b = 0; b < 256; ++b) {
+                if (set.test(b)) { return b; }
+            }
+        }
+        item |= set;
+        return -1;
+    }
+
+    // Return false if the escape is a literal of multiple bytes (non-ASCII \uXXXX), put into literal
+    bool parseEscape(ByteSet &set, std::string &literal) {
+        if (pos >= s.size()) { error("trailing '\\'"); }
+        unsigned char c = s[pos++];
+        if (classEscape(c, set)) { return true; }
+        if (classEscape(c - 'A' + 'a', set)) {
+            set.flip();
+            return true;
+        }
+        switch (c) {
+            case 'n': set.set('\n'); break;
+            case 't': set.set('\t'); break;
+            case 'r': set.set('\r'); break;
+            case 'f': set.set('\f'); break;
+            case 'v': set.set('\v'); break;
+            case 'u': {
+                if (pos + 4 > s.size()) { error("bad \\u escape"); }
+                unsigned int cp = std::strtoul(s.substr(pos, 4).c_str(), nullptr, 16);
+                pos += 4;
+                if (cp < 0x80) {
+                    set.set(cp);
+                    break;
+                }
+                literal = utf8(cp);
+                return false;
+            }
+            default: set.set(c); break;
+        }
+        return true;
+    }
+
+    // \d, \w or \s
+    static bool classEscape(unsigned char c, ByteSet &set) {
+        if (c == 'd') {
+            setRange(set, '0', '9');
+        } else if (c == 'w') {
+            setRange(set, '0', '9');
+            setRange(set, 'a', 'z');
+            setRange(set, 'A', 'Z');
+            set.set('_');
+        } else if (c == 's') {
+            for (char w : std::string(" \t\n\r\f\v")) {
+                set.set((unsigned char)w);
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static std::string utf8(unsigned int cp) {
+        std::string out;
+        if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+        } else {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        }
+        out += (char)(0x80 | (cp & 0x3F));
+        return out;
+    }
+
+    static void setRange(ByteSet &set, int lo, int hi) {
+        for (int b = lo; b <= hi; ++b) {
+            set.set(b);
+        }
+    }
+
+    static RegexNode bytesNode(const ByteSet &bytes) {
+        RegexNode node;
+        node.type = RegexNode::BYTES;
+        node.bytes = bytes;
+        return node;
+    }
+
+    static RegexNode byteNode(unsigned char b) {
+        ByteSet set;
+        set.set(b);
+        return bytesNode(set);
+    }
+
+    void error(const char *msg) {
+        throw std::runtime_error("Bad regular expression at " + std::to_string(pos) + ": " + msg);
+    }
+
+    std::string s;
+    size_t pos;
+};
+
+// Thompson NFA, states are connected by epsilon edges or byte edges
+struct Nfa {
+    std::vector<std::vector<int>> eps;
+    std::vector<std::vector<std::pair<ByteSet, int>>> edges;
+
+    int add() {
+        eps.emplace_back();
+        edges.emplace_back();
+        return eps.size() - 1;
+    }
+
+    // Return the start and the end of the fragment
+    std::pair<int, int> build(const RegexNode &node) {
+        int start = add();
+        int cur = start;
+        switch (node.type) {
+            case RegexNode::BYTES: {
+                int end = add();
+                edges[start].emplace_back(node.bytes, end);
+                return {start, end};
+            }
+            case RegexNode::CONCAT:
+                for (const RegexNode &child : node.children) {
+                    cur = append(cur, child);
+                }
+                return {start, cur};
+            case RegexNode::ALTER: {
+                int end = add();
+                for (const RegexNode &child : node.children) {
+                    auto frag = build(child);
+                    eps[start].push_back(frag.first);
+                    eps[frag.second].push_back(end);
+                }
+                return {start, end};
+            }
+            case RegexNode::REPEAT: {
+                for (int i = 0; i < node.minTimes; ++i) {
+                    cur = append(cur, node.children[0]);
+                }
+                if (node.maxTimes == -1) {
+                    auto frag = build(node.children[0]);
+                    eps[cur].push_back(frag.first);
+                    eps[frag.second].push_back(cur);
+                    return {start, cur};
+                }
+                int end = add();
+                eps[cur].push_back(end);
+                for (int i = node.minTimes; i < node.maxTimes; ++i) {
+                    cur = append(cur, node.children[0]);
+                    eps[cur].push_back(end);
+                }
+                return {start, end};
+            }
+        }
+        return {start, cur};
+    }
+
+    int append(int cur, const RegexNode &node) {
+        auto frag = build(node);
+        eps[cur].push_back(frag.first);
+        return frag.second;
+    }
+
+    std::vector<int> closure(std::vector<int> states) const {
+        std::vector<bool> visited(eps.size(), false);
+        std::vector<int> stack(states);
+        states.clear();
+        while (!stack.empty()) {
+            int s = stack.back();
+            stack.pop_back();
+            if (visited[s]) { continue; }
+            visited[s] = true;
+            states.push_back(s);
+            for (int t : eps[s]) {
+                if (!visited[t]) { stack.push_back(t); }
+            }
+        }
+        std::sort(states.begin(), states.end());
+        return states;
+    }
+};
+
+std::shared_ptr<TokenGrammar> fail(const std::string &msg, std::string *error) {
+    if (error != nullptr) {
+        *error = msg;
+        return nullptr;
+    }
+    printf("[ERROR] %s.\n", msg.c_str());
+    exit(-1);
+}
+} // namespace
+
+std::shared_ptr<TokenGrammar> TokenGrammar::fromRegex(
+        const std::string &pattern, const std::vector<std::string> &tokens, int eosTokenId, std::string *error) {
+    TimeLine t("TokenGrammar.fromRegex");
+    RegexNode root;
+    try {
+        root = RegexParser(pattern).parse();
+    } catch (const std::runtime_error &e) { return fail(e.what(), error); }
+
+    Nfa nfa;
+    auto frag = nfa.build(root);
+
+    // Subset construction
+    std::vector<std::vector<int>> subsets;
+    std::map<std::vector<int>, int> subsetIds;
+    std::vector<int> transitions;
+    std::vector<int> accepting;
+
+    subsets.push_back(nfa.closure({frag.first}));
+    subsetIds[subsets[0]] = 0;
+    for (int d = 0; d < (int)subsets.size(); ++d) {
+        transitions.resize((subsets.size() + 1) * 256, -1);
+        accepting.push_back(std::binary_search(subsets[d].begin(), subsets[d].end(), frag.second));
+
+        for (int b = 0; b < 256; ++b) {
+            std::vector<int> targets;
+            for (int s : subsets[d]) {
+                for (const auto &edge : nfa.edges[s]) {
+                    if (edge.first.test(b)) { targets.push_back(edge.second); }
+                }
+            }
+            if (targets.empty()) { continue; }
+
+            targets = nfa.closure(targets);
+            auto it = subsetIds.find(targets);
+            if (it == subsetIds.end()) {
+                if (subsets.size() >= kMaxDfaStates) {
+                    std::string msg = "more than " + std::to_string(kMaxDfaStates) + " states";
+                    return fail("Regular expression is too complex, " + msg, error);
+                }
+                it = subsetIds.emplace(targets, subsets.size()).first;
+                subsets.push_back(targets);
+            }
+            transitions[d * 256 + b] = it->second;
+        }
+    }
+    int dfaStates = subsets.size();
+
+    // Only keep states from which the expression can still be matched
+    std::vector<std::vector<int>> sources(dfaStates);
+    for (int d = 0; d < dfaStates; ++d) {
+        for (int b = 0; b < 256; ++b) {
+            int to = transitions[d * 256 + b];
+            if (to >= 0) { sources[to].push_back(d); }
+        }
+    }
+    std::vector<bool> live(dfaStates, false);
+    std::deque<int> queue;
+    for (int d = 0; d < dfaStates; ++d) {
+        if (accepting[d]) {
+            live[d] = true;
+            queue.push_back(d);
+        }
+    }
+    while (!queue.empty()) {
+        int d = queue.front();
+        queue.pop_front();
+        for (int from : sources[d]) {
+            if (!live[from]) {
+                live[from] = true;
+                queue.push_back(from);
+            }
+        }
+    }
+    if (!live[0]) { return fail("Nothing can match the regular expression", error); }
+
+    // The start state stays at 0
+    std::vector<int> newIds(dfaStates, -1);
+    int states = 0;
+    for (int d = 0; d < dfaStates; ++d) {
+        if (live[d]) { newIds[d] = states++; }
+    }
+
+    std::shared_ptr<TokenGrammar> grammar(new TokenGrammar());
+    grammar->states = states;
+    grammar->transitions.resize(states * 256);
+    grammar->accepting.resize(states);
+    for (int d = 0; d < dfaStates; ++d) {
+        if (!live[d]) { continue; }
+        for (int b = 0; b < 256; ++b) {
+            int to = transitions[d * 256 + b];
+            grammar->transitions[newIds[d] * 256 + b] = to >= 0 ? newIds[to] : -1;
+        }
+        grammar->accepting[newIds[d]] = accepting[d];
+    }
+
+    grammar->tokens = tokens;
+    grammar->eosTokenId = eosTokenId;
+    grammar->vocabSize = std::max((int)tokens.size(), eosTokenId + 1);
+    grammar->maskWords = (grammar->vocabSize + 31) / 32 + 1;
+    grammar->compileMasks();
+
+    return grammar;
+}
+
+// Walk a trie of the token bytes from each state, so that common prefixes of tokens are only walked once
+void TokenGrammar::compileMasks() {
+    TimeLine t("TokenGrammar.compileMasks");
+    struct TrieNode {
+        std::vector<std::pair<unsigned char, int>> children;
+        std::vector<int> tokenIds; // Tokens ending here
+    };
+
+    std::vector<TrieNode> trie(1);
+    for (int id = 0; id < (int)tokens.size(); ++id) {
+        int node = 0;
+        for (unsigned char b : tokens[id]) {
+            auto &children = trie[node].children;
+            auto it = std::find_if(children.begin(), children.end(), [b](const auto &c) { return c.first == b; });
+            if (it != children.end()) {
+                node = it->second;
+            } else {
+                children.emplace_back(b, trie.size());
+                node = trie.size();
+                trie.emplace_back();
+            }
+        }
+        if (node != 0) { trie[node].tokenIds.push_back(id); }
+    }
+
+    std::vector<uint32_t> stateMasks((size_t)states * maskWords, 0);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int state = 0; state < states; ++state) {
+        uint32_t *mask = stateMasks.data() + (size_t)state * maskWords;
+        std::vector<std::pair<int, int>> stack = {{0, state}};
+        bool any = false;
+
+        while (!stack.empty()) {
+            auto top = stack.back();
+            stack.pop_back();
+            for (const auto &child : trie[top.first].children) {
+                int to = transitions[top.second * 256 + child.first];
+                if (to < 0) { continue; }
+                for (int id : trie[child.second].tokenIds) {
+                    mask[id / 32] |= (1u << (id % 32));
+                    any = true;
+                }
+                if (!trie[child.second].children.empty()) { stack.emplace_back(child.second, to); }
+            }
+        }
+
+        // EOS is also allowed when nothing else is, not to get stuck
+        if ((accepting[state] || !any) && eosTokenId >= 0) { mask[eosTokenId / 32] |= (1u << (eosTokenId % 32)); }
+    }
+
+    // States allowing the same tokens share the mask
+    std::unordered_map<std::string, int> uniqueIds;
+    maskIds.resize(states);
+    masks.clear();
+    for (int state = 0; state < states; ++state) {
+        const uint32_t *mask = stateMasks.data() + (size_t)state * maskWords;
+        std::string key((const char *)mask, maskWords * sizeof(uint32_t));
+        auto it = uniqueIds.find(key);
+        if (it == uniqueIds.end()) {
+            it = uniqueIds.emplace(key, uniqueIds.size()).first;
+            masks.insert(masks.end(), mask, mask + maskWords);
+        }
+        maskIds[state] = it->second;
+    }
+}
+
+int TokenGrammar::next(int state, int tokenId) const {
+    if (tokenId < 0 || tokenId >= vocabSize) { return -1; }
+
+    const uint32_t *mask = getMask(state);
+    if ((mask[tokenId / 32] & (1u << (tokenId % 32))) == 0) { return -1; }
+    if (tokenId == eosTokenId) { return state; }
+
+    for (unsigned char b : tokens[tokenId]) {
+        state = transitions[state * 256 + b];
+    }
+    return state;
+}
+
+void TokenGrammar::applyMask(int state, float *logits, int sampleOffset, int sampleSize) const {
+    const uint32_t *mask = getMask(state);
+    const __m512 vNegInf = _mm512_set1_ps(-INFINITY);
+
+    // Tokens beyond the vocabulary of the grammar (like padding of the model's vocabulary) are never allowed
+    int end = std::min(sampleSize, std::max(vocabSize - sampleOffset, 0));
+    for (int j = 0; j < end; j += 16) {
+        int id = sampleOffset + j;
+        uint64_t bits = mask[id / 32] | ((uint64_t)mask[id / 32 + 1] << 32);
+        __mmask16 allowed = (__mmask16)(bits >> (id % 32));
+        __mmask16 valid = end - j >= 16 ? 0xffff : (__mmask16)((1u << (end - j)) - 1);
+        _mm512_mask_storeu_ps(logits + j, valid & ~allowed, vNegInf);
+    }
+    for (int j = end; j < sampleSize; ++j) {
+        logits[j] = -INFINITY;
+    }
+}
+
+// Layout: vocabSize, eosTokenId, states, maskWords, unique masks, token count, then transitions, accepting, maskIds,
+// masks, token lengths, and token bytes (4 bytes in each value)
+std::vector<int> TokenGrammar::serialize() const {
+    int uniqueMasks = masks.size() / maskWords;
+    std::vector<int> data = {vocabSize, eosTokenId, states, maskWords, uniqueMasks, (int)tokens.size()};
+    data.insert(data.end(), transitions.begin(), transitions.end());
+    data.insert(data.end(), accepting.begin(), accepting.end());
+    data.insert(data.end(), maskIds.begin(), maskIds.end());
+    data.insert(data.end(), masks.begin(), masks.end());
+
+    std::string bytes;
+    for (const std::string &token : tokens) {
+        data.push_back(token.size());
+        bytes += token;
+    }
+    size_t offset = data.size();
+    data.resize(offset + (bytes.size() + 3) / 4, 0);
+    memcpy(data.data() + offset, bytes.data(), bytes.size());
+
+    return data;
+}
+
+std::shared_ptr<TokenGrammar> TokenGrammar::deserialize(const std::vector<int> &data) {
+    std::shared_ptr<TokenGrammar> grammar(new TokenGrammar());
+    grammar->vocabSize = data[0];
+    grammar->eosTokenId = data[1];
+    grammar->states = data[2];
+    grammar->maskWords = data[3];
+    int uniqueMasks = data[4];
+    int tokenCount = data[5];
+
+    auto p = data.begin() + 6;
+    grammar->transitions.assign(p, p + grammar->states * 256);
+    p += grammar->states * 256;
+    grammar->accepting.assign(p, p + grammar->states);
+    p += grammar->states;
+    grammar->maskIds.assign(p, p + grammar->states);
+    p += grammar->states;
+    grammar->masks.assign(p, p + (size_t)uniqueMasks * grammar->maskWords);
+    p += (size_t)uniqueMasks * grammar->maskWords;
+
+    std::vector<int> lengths(p, p + tokenCount);
+    p += tokenCount;
+    const char *bytes = (const char *)(data.data() + (p - data.begin()));
+    grammar->tokens.resize(tokenCount);
+    for (int i = 0; i < tokenCount; ++i) {
+        grammar->tokens[i].assign(bytes, lengths[i]);
+        bytes += lengths[i];
+    }
+
+    return grammar;
+}
@@ -245,11 +245,20 @@ public:
     }
 #endif
 
-    // General version
-    static void computeSoftmax(DecoderContext *ctx, float *data, const float *attnMask, int size) {
+    // ALiBi bias of the 16 elements starting from 'start': slope * (start + [0, 16))
+    static inline __m512 alibiBias(float slope, int start) {
+        const __m512 viota = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        return _mm512_set1_ps(slope) * (_mm512_set1_ps(start) + viota);
+    }
+
+    // General version, attnMask could be nullptr if nothing is masked out
+    // If alibiSlope is not 0, alibiSlope * (j + alibiOff) is added to element j (after scaling)
+    static void computeSoftmax(
+            DecoderContext *ctx, float *data, const float *attnMask, int size, float alibiSlope = 0, int alibiOff = 0) {
         int vecs = (size + 15) / 16; // how many avx512 vectors
         __mmask16 tailMask = (size % 16 == 0 ? 0xffff : (1 << (size % 16)) - 1); // mask of last vector
 
+        __m512 vzero = _mm512_set1_ps(0);
         __m512 vsum = _mm512_set1_ps(0);
 
         // maxVal is used to avoid exp(x) = inf
@@ -261,7 +270,8 @@ public:
         for (i = 0; i < vecs; ++i) {
             __mmask16 k = (i == vecs - 1 ? tailMask : 0xffff);
             __m512 vx = _mm512_maskz_loadu_ps(k, data + i * 16);
-            __m512 vmask = _mm512_maskz_loadu_ps(k, attnMask + i * 16);
+            __m512 vmask = attnMask ? _mm512_maskz_loadu_ps(k, attnMask + i * 16) : vzero;
+            if (alibiSlope != 0) { vmask = vmask + alibiBias(alibiSlope, alibiOff + i * 16); }
             vmax = _mm512_mask_max_ps(vmax, k, vmax, vx * vfactor + vmask);
         }
 
@@ -272,7 +282,8 @@ public:
         for (i = 0; i < vecs; ++i) {
             __mmask16 k = (i == vecs - 1 ? tailMask : 0xffff);
             __m512 vx = _mm512_maskz_loadu_ps(k, data + i * 16);
-            __m512 vmask = _mm512_maskz_loadu_ps(k, attnMask + i * 16);
+            __m512 vmask = attnMask ? _mm512_maskz_loadu_ps(k, attnMask + i * 16) : vzero;
+            if (alibiSlope != 0) { vmask = vmask + alibiBias(alibiSlope, alibiOff + i * 16); }
             vx = BertUtil::vexp(vx * vfactor + vmask - vmax);
             _mm512_mask_storeu_ps(data + i * 16, k, vx);
             vsum = _mm512_mask_add_ps(vsum, k, vsum, vx);
@@ -290,6 +301,13 @@ public:
         }
     }
 
+    // Softmax over the first 'visible' elements, the rest are masked out (set to 0) without reading any mask
+    static void softmaxVisible(
+            DecoderContext *ctx, float *data, int visible, int size, float alibiSlope = 0, int alibiOff = 0) {
+        if (visible > 0) { computeSoftmax(ctx, data, nullptr, visible, alibiSlope, alibiOff); }
+        if (visible < size) { memset(data + visible, 0, (size - visible) * sizeof(float)); }
+    }
+
     // Softmax: skip the calculation when attention mask is the lowest value
     static void softmaxSkipMask(DecoderContext *ctx, float *data, const float *attnMask, int size) {
         int vecs = (size + 15) / 16; // how many avx512 vectors
@@ -380,10 +398,12 @@ public:
 
     // Same implementation with softmax, but:
     // Return max value, and the sum value of exp
-    static std::pair<float, float> softmaxWithStats(DecoderContext *ctx, float *data, const float *attnMask, int size) {
+    static std::pair<float, float> softmaxWithStats(
+            DecoderContext *ctx, float *data, const float *attnMask, int size, float alibiSlope = 0, int alibiOff = 0) {
         int vecs = (size + 15) / 16; // how many avx512 vectors
         __mmask16 tailMask = (size % 16 == 0 ? 0xffff : (1 << (size % 16)) - 1); // mask of last vector
 
+        __m512 vzero = _mm512_set1_ps(0);
         __m512 vsum = _mm512_set1_ps(0);
 
         // maxVal is used to avoid exp(x) = inf
@@ -395,7 +415,8 @@ public:
         for (i = 0; i < vecs; ++i) {
             __mmask16 k = (i == vecs - 1 ? tailMask : 0xffff);
             __m512 vx = _mm512_maskz_loadu_ps(k, data + i * 16);
-            __m512 vmask = _mm512_maskz_loadu_ps(k, attnMask + i * 16);
+            __m512 vmask = attnMask ? _mm512_maskz_loadu_ps(k, attnMask + i * 16) : vzero;
+            if (alibiSlope != 0) { vmask = vmask + alibiBias(alibiSlope, alibiOff + i * 16); }
             vmax = _mm512_mask_max_ps(vmax, k, vmax, vx * vfactor + vmask);
         }
 
@@ -406,7 +427,8 @@ public:
         for (i = 0; i < vecs; ++i) {
             __mmask16 k = (i == vecs - 1 ? tailMask : 0xffff);
             __m512 vx = _mm512_maskz_loadu_ps(k, data + i * 16);
-            __m512 vmask = _mm512_maskz_loadu_ps(k, attnMask + i * 16);
+            __m512 vmask = attnMask ? _mm512_maskz_loadu_ps(k, attnMask + i * 16) : vzero;
+            if (alibiSlope != 0) { vmask = vmask + alibiBias(alibiSlope, alibiOff + i * 16); }
             vx = BertUtil::vexp(vx * vfactor + vmask - vmax);
             _mm512_mask_storeu_ps(data + i * 16, k, vx);
             vsum = _mm512_mask_add_ps(vsum, k, vsum, vx);
@@ -482,23 +504,38 @@ public:
         }
     }
 
+    // Bits of the elements [lo, hi) in a vector of 16
+    static __mmask16 rangeMask(int lo, int hi) {
+        lo = std::max(lo, 0);
+        hi = std::min(hi, 16);
+        if (lo >= hi) { return 0; }
+        return (__mmask16)(((1u << hi) - 1) & ~((1u << lo) - 1));
+    }
+
     // need to do for res.
+    // Without attnMask, keys of row i after visibleLens[i] or before firstKeys[i] are masked out (nothing masked if
+    // the array is nullptr), and ALiBi bias alibiSlope * (j + alibiOff - i) is added to element j of row i if
+    // alibiSlope is not 0
     template <typename ImT>
     static void softmaxTile(float *AB, ImT *ABout, float *sum, float *max, float *preSum, float *preMax, float refac,
-            const float *attnMask, int m, int k, int attnMskStride) {
+            const float *attnMask, int m, int k, int attnMskStride, const int *visibleLens = nullptr,
+            float alibiSlope = 0, int alibiOff = 0, const int *firstKeys = nullptr) {
         float maxVal = std::numeric_limits<float>::lowest();
         __m512 vrefac = _mm512_set1_ps(refac);
+        __m512 vzero = _mm512_set1_ps(0);
         for (int i = 0; i < m; ++i) {
             float *buf = AB + i * k;
             ImT *obuf = ABout + i * k;
-            const float *attnMsk = attnMask + i * attnMskStride;
+            const float *attnMsk = attnMask ? attnMask + i * attnMskStride : nullptr;
+            int valid = (attnMask == nullptr && visibleLens != nullptr) ? std::min(visibleLens[i], k) : k;
+            int first = (attnMask == nullptr && firstKeys != nullptr) ? std::max(firstKeys[i], 0) : 0;
             // max val for avoiding inf and nan
             __m512 vmax = _mm512_set1_ps(maxVal);
-            for (int off = 0; off < k; off += 16) {
-                int remain = k - off;
-                __mmask16 mask = (remain >= 16 ? 0xffff : (1 << remain) - 1);
+            for (int off = first / 16 * 16; off < valid; off += 16) {
+                __mmask16 mask = rangeMask(first - off, valid - off);
                 __m512 vx = xft::load_avx512(mask, buf + off);
-                __m512 vmask = xft::load_avx512(mask, attnMsk + off);
+                __m512 vmask = attnMsk ? xft::load_avx512(mask, attnMsk + off) : vzero;
+                if (alibiSlope != 0) { vmask = vmask + alibiBias(alibiSlope, alibiOff - i + off); }
 
                 vmax = _mm512_mask_max_ps(vmax, mask, vmax, vx * vrefac + vmask);
             }
@@ -509,20 +546,22 @@ public:
             merr = BertUtil::vexp(merr);
             max[i] = _max;
 
-            // exp and get sum
+            // exp and get sum, masked out keys get 0
             __m512 vsum = _mm512_set1_ps(0);
             vmax = _mm512_set1_ps(_max);
             for (int off = 0; off < k; off += 16) {
                 int remain = k - off;
                 __mmask16 mask = (remain >= 16 ? 0xffff : (1 << remain) - 1);
+                __mmask16 validMask = rangeMask(first - off, valid - off);
 
-                __m512 vx = xft::load_avx512(mask, buf + off);
-                __m512 vmask = xft::load_avx512(mask, attnMsk + off);
-                vx = BertUtil::vexp(vx * vrefac + vmask - vmax);
+                __m512 vx = xft::load_avx512(validMask, buf + off);
+                __m512 vmask = attnMsk ? xft::load_avx512(validMask, attnMsk + off) : vzero;
+                if (alibiSlope != 0) { vmask = vmask + alibiBias(alibiSlope, alibiOff - i + off); }
+                vx = _mm512_maskz_mov_ps(validMask, BertUtil::vexp(vx * vrefac + vmask - vmax));
 
                 xft::store_avx512(obuf + off, mask, vx);
 
-                vsum = _mm512_mask_add_ps(vsum, mask, vsum, vx);
+                vsum = _mm512_mask_add_ps(vsum, validMask, vsum, vx);
             }
             float _sum = _mm512_reduce_add_ps(vsum);
             float fac = _mm512_cvtss_f32(merr);
@@ -530,9 +569,9 @@ public:
             _sum = sum[i];
 
             // Compute exp/sum(exp) and store
-            __m512 vrsum = _mm512_set1_ps(1.0f / _sum);
-            for (int off = 0; off < k; off += 16) {
-                int remain = k - off;
+            __m512 vrsum = _mm512_set1_ps(_sum > 0 ? 1.0f / _sum : 0);
+            for (int off = 0; off < valid; off += 16) {
+                int remain = valid - off;
                 __mmask16 mask = (remain >= 16 ? 0xffff : (1 << remain) - 1);
 
                 __m512 vx = xft::load_avx512(mask, obuf + off);
@@ -551,7 +590,8 @@ public:
             T *outbuf = output + i * stride;
             __m512 merr = _mm512_set1_ps(preMax[i] - max[i]);
             merr = BertUtil::vexp(merr);
-            __m512 vfac = _mm512_set1_ps(preSum[i] / sum[i]);
+            // Nothing is visible to the row so far (like a padding token before the tile)
+            __m512 vfac = _mm512_set1_ps(sum[i] > 0 ? preSum[i] / sum[i] : 0);
             for (int off = 0; off < n; off += 16) {
                 int remain = n - off;
                 __mmask16 mask = (remain >= 16 ? 0xffff : (1 << remain) - 1);
@@ -572,10 +612,12 @@ public:
     template <typename T, typename ImT>
     static void incrementalTileAttention(const T *A, const T *B, const T *C, const float *attnMask, int m, int n, int k,
             int attnMskStride, float *preSum, float *sum, float *preMax, float *max, float refac, float *AB,
-            float *expABC, ImT *output, int qStride, int kStride, int vStride, int stride) {
+            float *expABC, ImT *output, int qStride, int kStride, int vStride, int stride,
+            const int *visibleLens = nullptr, float alibiSlope = 0, int alibiOff = 0, const int *firstKeys = nullptr) {
         sgemm(A, B, AB, m, k, n, qStride, kStride, k, false, true);
         // TODO:optimize
-	softmaxTile(AB, (T *)AB, sum, max, preSum, preMax, refac, attnMask, m, k, attnMskStride);
+	softmaxTile(AB, (T *)AB, sum, max, preSum, preMax, refac, attnMask, m, k, attnMskStride, visibleLens, alibiSlope,
+                alibiOff, firstKeys);
 
         sgemm((T *)AB, C, expABC, m, n, k, k, vStride, n, false, false);
         updateOutTile(output, expABC, preSum, sum, preMax, max, m, n, stride);
@@ -26,6 +26,15 @@ public:
 
         // init Pipeline Parallel
         initPipelineStage();
+        initPipelineMicroBatch();
+        initPipelineBF16Transfer();
+
+        // init Sequence Parallel
+        initSequenceParallel();
+
+        // init SHM waiting
+        initShmSpinCount();
+        initShmTimeout();
 
         // init Engine Kind and Index
         initEngineKindIndex();
@@ -49,6 +58,21 @@ public:
     // get Engine Kind and Index
     static int getPipelineStage() { return pipelineStageValue(); }
 
+    // Number of micro-batches in pipeline parallel, 0 means the same as stages
+    static int getPipelineMicroBatch() { return pipelineMicroBatchValue(); }
+
+    // Whether activations between pipeline stages are transferred in BF16
+    static bool getPipelineBF16Transfer() { return pipelineBF16TransferValue(); }
+
+    // Min tokens of a forward to use sequence parallel under tensor parallel, 0 means disabled
+    static int getSequenceParallel() { return sequenceParallelValue(); }
+
+    // Rounds of spinning (with pause) before sleeping when waiting for other ranks in SHM reduction
+    static int getShmSpinCount() { return shmSpinCountValue(); }
+
+    // Seconds to wait for other ranks in SHM reduction before reporting a stuck rank, 0 means forever
+    static int getShmTimeout() { return shmTimeoutValue(); }
+
     // get AMX Threshold M
     static int getAMXThresholdM() { return AMXThresholdMValue(); }
 
@@ -141,6 +165,98 @@ private:
         }
     }
 
+    static int &pipelineMicroBatchValue() {
+        static int value = 0;
+        return value;
+    }
+
+    static void initPipelineMicroBatch() {
+        char *xft_micro_batch_value = getenv("XFT_PIPELINE_MICRO_BATCH");
+        if (xft_micro_batch_value != NULL) {
+#ifdef PIPELINE_PARALLEL
+            int value = atoi(xft_micro_batch_value);
+            if (value >= 1)
+                pipelineMicroBatchValue() = value;
+            else
+                printf("[ERROR] XFT_PIPELINE_MICRO_BATCH value need to be greater than 0.\n");
+#else
+            printf("[WARNING] XFT_PIPELINE_MICRO_BATCH need to build with WITH_PIPELINE_PARALLEL=ON.\n");
+#endif
+        } else {
+            pipelineMicroBatchValue() = 0;
+        }
+    }
+
+    static bool &pipelineBF16TransferValue() {
+        static bool value = true;
+        return value;
+    }
+
+    static void initPipelineBF16Transfer() {
+        char *xft_bf16_transfer_value = getenv("XFT_PIPELINE_BF16_TRANSFER");
+        if (xft_bf16_transfer_value != NULL) {
+#ifdef PIPELINE_PARALLEL
+            pipelineBF16TransferValue() = atoi(xft_bf16_transfer_value) != 0;
+#else
+            printf("[WARNING] XFT_PIPELINE_BF16_TRANSFER need to build with WITH_PIPELINE_PARALLEL=ON.\n");
+#endif
+        } else {
+            pipelineBF16TransferValue() = true;
+        }
+    }
+
+    // Sequence Parallel
+    static int &sequenceParallelValue() {
+        static int value = 0;
+        return value;
+    }
+
+    static void initSequenceParallel() {
+        char *xft_seq_parallel_value = getenv("XFT_SEQUENCE_PARALLEL");
+        if (xft_seq_parallel_value != NULL) {
+            int value = atoi(xft_seq_parallel_value);
+            if (value >= 0)
+                sequenceParallelValue() = value;
+            else
+                printf("[ERROR] XFT_SEQUENCE_PARALLEL value need to be greater than or equal to 0.\n");
+        } else {
+            sequenceParallelValue() = 0;
+        }
+    }
+
+    // SHM waiting
+    static int &shmSpinCountValue() {
+        static int value = 2048;
+        return value;
+    }
+
+    static void initShmSpinCount() {
+        char *xft_spin_value = getenv("XFT_SHM_SPIN_COUNT");
+        if (xft_spin_value != NULL) {
+            int value = atoi(xft_spin_value);
+            if (value >= 0)
+                shmSpinCountValue() = value;
+            else
+                printf("[ERROR] XFT_SHM_SPIN_COUNT value need to be greater than or equal to 0.\n");
+        }
+    }
+
+    static int &shmTimeoutValue() {
+        static int value = 300;
+        return value;
+    }
+
+    static void initShmTimeout() {
+        char *xft_timeout_value = getenv("XFT_SHM_TIMEOUT");
+        if (xft_timeout_value != NULL) {
+            int value = atoi(xft_timeout_value);
+            if (value >= 0)
+                shmTimeoutValue() = value;
+            else
+                printf("[ERROR] XFT_SHM_TIMEOUT value need to be greater than or equal to 0.\n");
+        }
+    }
+
     // AMX Threshold M
     static int &AMXThresholdMValue() {
         static int value = 1;
@@ -16,8 +16,10 @@
 #include <mpi.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <dlfcn.h>
 #include <iostream>
+#include <vector>
 
 #include "bfloat16.h"
 #include "compile_util.h"
@@ -55,10 +57,18 @@ private:
         helperAllgatherv = (void (*)(const float *, size_t, float *, const std::vector<long unsigned int> &))dlsym(
                 commHelperHanlde, "allgatherv");
 
+        helperReduceScatter = (void (*)(float *, float *, size_t))dlsym(commHelperHanlde, "reduceScatter");
         helperWorldSendFP32 = (void (*)(const float *, int, int, int))dlsym(commHelperHanlde, "worldSendFP32");
         helperWorldRecvFP32 = (void (*)(float *, int, int, int))dlsym(commHelperHanlde, "worldRecvFP32");
         helperWorldSendINT32 = (void (*)(const int32_t *, int, int, int))dlsym(commHelperHanlde, "worldSendINT32");
         helperWorldRecvINT32 = (void (*)(int32_t *, int, int, int))dlsym(commHelperHanlde, "worldRecvINT32");
+        helperInitHierarchy = (void (*)(int *, int *, int *))dlsym(commHelperHanlde, "initHierarchy");
+        helperLeaderAllreduce = (void (*)(float *, float *, size_t))dlsym(commHelperHanlde, "leaderAllreduce");
+        helperLeaderAllreduceBF16
+                = (void (*)(bfloat16_t *, bfloat16_t *, size_t))dlsym(commHelperHanlde, "leaderAllreduceBF16");
+        helperLeaderReduceScatter
+                = (void (*)(float *, float *, size_t))dlsym(commHelperHanlde, "leaderReduceScatter");
+        helperLocalBroadcast = (void (*)(int *, size_t))dlsym(commHelperHanlde, "localBroadcast");
 
         atexit(Messenger::mpi_finalize);
 
@@ -66,11 +76,22 @@ private:
         int sameHostnames = (*helperInit)(&size, &rank, &color);
 
 #ifdef USE_SHM
+        localRanksFlag = false;
+        hierarchicalFlag = false;
+        pshm = nullptr;
         if (sameHostnames && !std::getenv("XFT_ONECCL")) {
             localRanksFlag = true;
             pshm = new ShmReduction(rank, size, [this](int *pidFd, size_t count) { this->broadcast(pidFd, count); });
-        } else {
-            localRanksFlag = false;
+        } else if (size > 1 && !std::getenv("XFT_ONECCL")) {
+            // Ranks span hosts: reduce by SHM within a host, and only leaders of hosts reduce through the network
+            hierarchicalFlag = true;
+            int blocked = 0;
+            (*helperInitHierarchy)(&localRank, &localSize, &blocked);
+            blockedHosts = blocked;
+            if (localSize > 1) {
+                pshm = new ShmReduction(localRank, localSize,
+                        [this](int *pidFd, size_t count) { (*helperLocalBroadcast)(pidFd, count); });
+            }
         }
 #endif
     }
@@ -103,8 +124,10 @@ public:
         TimeLine t("Messenger.reduceAdd");
 
 #ifdef USE_SHM
-        if (count * sizeof(float) > pshm->getSHMSize() || !localRanksFlag) {
+        if (count * sizeof(float) > MAX_SHM_SIZE || !(localRanksFlag || hierarchicalFlag)) {
             (*helperAllreduce)(sendBuf, recvBuf, count);
+        } else if (hierarchicalFlag) {
+            hierarchicalReduceAdd(sendBuf, recvBuf, count, helperLeaderAllreduce);
         } else {
             pshm->reduceAdd(sendBuf, recvBuf, count, rank, size);
         }
@@ -117,8 +140,10 @@ public:
         TimeLine t("Messenger.reduceAdd");
 
 #ifdef USE_SHM
-        if (count * sizeof(bfloat16_t) > pshm->getSHMSize() || !localRanksFlag) {
+        if (count * sizeof(bfloat16_t) > MAX_SHM_SIZE || !(localRanksFlag || hierarchicalFlag)) {
             (*helperAllreduceBF16)(sendBuf, recvBuf, count);
+        } else if (hierarchicalFlag) {
+            hierarchicalReduceAdd(sendBuf, recvBuf, count, helperLeaderAllreduceBF16);
         } else {
             pshm->reduceAdd(sendBuf, recvBuf, count, rank, size);
         }
@@ -151,6 +176,60 @@ public:
         if (check()) { (*helperAllgatherv)(send_buf, count, recv_buf, recv_counts); }
     }
 
+    // Sum of sendBuf (count * size) of all ranks, of which recvBuf gets the count elements from count * rank
+    void reduceScatter(float *sendBuf, float *recvBuf, size_t count) {
+        TimeLine t("Messenger.reduceScatter");
+        if (!check()) {
+            if (sendBuf != recvBuf) { memcpy(recvBuf, sendBuf, count * sizeof(float)); }
+            return;
+        }
+
+#ifdef USE_SHM
+        if (count * size * sizeof(float) <= MAX_SHM_SIZE && localRanksFlag) {
+            pshm->reduceScatter(sendBuf, recvBuf, count * size, rank, size, count * rank, count);
+            return;
+        } else if (count * size * sizeof(float) <= MAX_SHM_SIZE && hierarchicalFlag && localSize > 1
+                && blockedHosts) {
+            // Slices of the host are consecutive: leaders reduce-scatter the sums of hosts, each gets the slices of
+            // its host, put back at the same place of the SHM buffer where ranks in the host copy their slices
+            const size_t hostCount = count * localSize;
+            const size_t hostOffset = count * (rank - localRank);
+            pshm->reduceScatter(sendBuf, recvBuf, count * size, localRank, localSize, count * rank, count,
+                    std::function<void(float *, size_t)>([this, hostCount, hostOffset](float *buf, size_t) {
+                        leaderBuf.resize(hostCount);
+                        (*helperLeaderReduceScatter)(buf, leaderBuf.data(), hostCount);
+                        memcpy(buf + hostOffset, leaderBuf.data(), hostCount * sizeof(float));
+                    }));
+            return;
+        } else if (count * size * sizeof(float) <= MAX_SHM_SIZE && hierarchicalFlag && localSize > 1) {
+            // Otherwise the whole buffer (slices of all hosts) is reduced among leaders
+            pshm->reduceScatter(sendBuf, recvBuf, count * size, localRank, localSize, count * rank, count,
+                    std::function<void(float *, size_t)>(
+                            [this](float *buf, size_t n) { (*helperLeaderAllreduce)(buf, buf, n); }));
+            return;
+        }
+#endif
+        (*helperReduceScatter)(sendBuf, recvBuf, count);
+    }
+
+    // recvBuf (count * size) gets sendBuf (count) of all ranks in the order of ranks
+    void allgather(const float *sendBuf, size_t count, float *recvBuf) {
+        TimeLine t("Messenger.allgather");
+        if (!check()) {
+            if (sendBuf != recvBuf) { memcpy(recvBuf, sendBuf, count * sizeof(float)); }
+            return;
+        }
+
+#ifdef USE_SHM
+        if (count * size * sizeof(float) <= MAX_SHM_SIZE && localRanksFlag) {
+            pshm->allgather(sendBuf, count, recvBuf, rank, size);
+            return;
+        }
+#endif
+        std::vector<long unsigned int> recvCounts(size, count);
+        (*helperAllgatherv)(sendBuf, count, recvBuf, recvCounts);
+    }
+
     void worldSendFP32(const float *buf, int count, int dest, int tag) {
         if (check()) { (*helperWorldSendFP32)(buf, count, dest, tag); }
     }
@@ -187,6 +266,20 @@ private:
         }
     }
 
+#ifdef USE_SHM
+    // Sum of the host is in the SHM buffer of the leader (the last rank in the host), which is allreduced in place
+    // among leaders, then ranks in the host copy the result from the SHM buffer
+    template <typename T>
+    void hierarchicalReduceAdd(T *sendBuf, T *recvBuf, size_t count, void (*leaderAllreduce)(T *, T *, size_t)) {
+        if (localSize == 1) {
+            (*leaderAllreduce)(sendBuf, recvBuf, count);
+        } else {
+            pshm->reduceAdd(sendBuf, recvBuf, count, localRank, localSize,
+                    std::function<void(T *, size_t)>([=](T *buf, size_t n) { (*leaderAllreduce)(buf, buf, n); }));
+        }
+    }
+#endif
+
     // Check if indeed need to communicate
     bool check() {
         if (unlikely(size > 1 && !commHelperHanlde)) {
@@ -201,9 +294,14 @@ private:
     int rank;
     int color; // Processes with the same color will be placed into the same sub-communicator
     bool localRanksFlag;
+    bool hierarchicalFlag; // Ranks are on multiple hosts, see hierarchicalReduceAdd
+    bool blockedHosts = false; // Ranks of each host are consecutive and hosts have the same number of ranks
+    int localRank; // Rank in the host
+    int localSize; // Ranks in the host
 
 #ifdef USE_SHM
     ShmReduction *pshm;
+    std::vector<float> leaderBuf; // Slices of the host received by the leader in reduceScatter
 #endif
     void *commHelperHanlde;
     int (*helperInit)(int *, int *, int *);
@@ -212,8 +310,14 @@ private:
     void (*helperAllreduceBF16)(bfloat16_t *, bfloat16_t *, size_t);
     void (*helperBroadcast)(int *, size_t);
     void (*helperAllgatherv)(const float *, size_t, float *, const std::vector<long unsigned int> &);
+    void (*helperReduceScatter)(float *, float *, size_t);
     void (*helperWorldSendFP32)(const float *, int, int, int);
     void (*helperWorldRecvFP32)(float *, int, int, int);
     void (*helperWorldSendINT32)(const int32_t *, int, int, int);
     void (*helperWorldRecvINT32)(int32_t *, int, int, int);
+    void (*helperInitHierarchy)(int *, int *, int *);
+    void (*helperLeaderAllreduce)(float *, float *, size_t);
+    void (*helperLeaderAllreduceBF16)(bfloat16_t *, bfloat16_t *, size_t);
+    void (*helperLeaderReduceScatter)(float *, float *, size_t);
+    void (*helperLocalBroadcast)(int *, size_t);
 };
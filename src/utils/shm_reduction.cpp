@@ -34,7 +34,7 @@ ShmReduction::ShmReduction(int rank, int size, std::function<void(int *, size_t)
     shmCtx_.nblocks = MAX_SHM_BLOCK_COUNT;
     if (rank_ == 0) {
         xft::create_shm(&shmCtx_);
-        memset(shmCtx_.state, 0, shmCtx_.nstates * sizeof(int));
+        memset(shmCtx_.state, 0, 2 * shmCtx_.nstates * sizeof(int));
         memset((void *)shmCtx_.blockState, 0, shmCtx_.nstates * shmCtx_.nblocks);
     }
 
@@ -48,7 +48,38 @@ int ShmReduction::getSHMSize() {
 }
 
 template <typename T>
-void ShmReduction::reduceAdd(T *sendBuf, T *recvBuf, size_t size, int rank, int rankSize) {
+void ShmReduction::reduceAdd(T *sendBuf, T *recvBuf, size_t size, int rank, int rankSize,
+        const std::function<void(T *, size_t)> &hostsReduce) {
+    reduce(sendBuf, recvBuf, size, rank, rankSize, hostsReduce, 0, size);
+}
+
+template <typename T>
+void ShmReduction::reduceScatter(T *sendBuf, T *recvBuf, size_t size, int rank, int rankSize, size_t recvOffset,
+        size_t recvCount, const std::function<void(T *, size_t)> &hostsReduce) {
+    reduce(sendBuf, recvBuf, size, rank, rankSize, hostsReduce, recvOffset, recvCount);
+}
+
+// Ranks except the last one are done with state 3, then the last rank resets all states to release them.
+// Its own state is reset first, as a released rank may start the next collective before all states are reset, and
+// must not take its state of this collective (like 1 of allgather) as of the next one.
+void ShmReduction::finish(int rank, int rankSize) {
+    if (rank == rankSize - 1) {
+        for (int i = 0; i < rankSize - 1; i++) {
+            xft::wait_state_until(&shmCtx_, i, 3);
+        }
+
+        xft::set_state(&shmCtx_, rank, 0);
+        for (int i = 0; i < rankSize - 1; i++) {
+            xft::set_state(&shmCtx_, i, 0);
+        }
+    } else {
+        xft::set_state(&shmCtx_, rank, 3);
+    }
+}
+
+template <typename T>
+void ShmReduction::reduce(T *sendBuf, T *recvBuf, size_t size, int rank, int rankSize,
+        const std::function<void(T *, size_t)> &hostsReduce, size_t recvOffset, size_t recvCount) {
     int nbytes = size * sizeof(T);
     int nBlockBytes = SHM_BLOCK_SIZE * sizeof(T);
     int nblocks = (size + SHM_BLOCK_SIZE - 1) / SHM_BLOCK_SIZE;
@@ -58,8 +89,9 @@ void ShmReduction::reduceAdd(T *sendBuf, T *recvBuf, size_t size, int rank, int
     uint8_t *blocks = (uint8_t *)shmCtx_.blockState;
     int *states = shmCtx_.state;
 
+    // Each rank waits for its own state reset by the last one (see finish) before setting it again
     if (rank == 0) {
-        for (int i = 1; i < rankSize; i++) {
+        for (int i = 0; i < rankSize; i++) {
             xft::wait_state_until(&shmCtx_, i, 0);
         }
         multiThreadCopy((char *)address, (char *)sendBuf, nbytes);
@@ -67,7 +99,7 @@ void ShmReduction::reduceAdd(T *sendBuf, T *recvBuf, size_t size, int rank, int
         xft::wait_state_until(&shmCtx_, rank, 0);
         xft::wait_state_until(&shmCtx_, 0, 1);
     }
-    shmCtx_.state[rank] = 1;
+    xft::set_state(&shmCtx_, rank, 1);
 
     if (rank != 0) {
 #pragma omp parallel for num_threads(nthreads)
@@ -92,25 +124,42 @@ void ShmReduction::reduceAdd(T *sendBuf, T *recvBuf, size_t size, int rank, int
             shmCtx_.blockState[blockIndex * rankSize + rank - 1] = 0;
             shmCtx_.blockState[blockIndex * rankSize + rank] = 1;
         }
-        shmCtx_.state[rank] = 2;
+
+        // All blocks are summed up by the last rank
+        if (hostsReduce && rank == rankSize - 1) { hostsReduce(address, size); }
+        xft::set_state(&shmCtx_, rank, 2);
     }
 
     xft::wait_state_until(&shmCtx_, rankSize - 1, 2);
 
-    multiThreadCopy((char *)recvBuf, (char *)address, nbytes);
+    multiThreadCopy((char *)recvBuf, (char *)(address + recvOffset), recvCount * sizeof(T));
 
-    if (rank == rankSize - 1) {
-        for (int i = 0; i < rankSize - 1; i++) {
-            xft::wait_state_until(&shmCtx_, i, 3);
-        }
+    finish(rank, rankSize);
+}
 
-        for (int i = 0; i < rankSize; i++) {
-            shmCtx_.state[i] = 0;
-        }
-    } else {
-        shmCtx_.state[rank] = 3;
+template void ShmReduction::reduceAdd<float>(float *sendBuf, float *recvBuf, size_t size, int rank, int rankSize,
+        const std::function<void(float *, size_t)> &hostsReduce);
+template void ShmReduction::reduceAdd<bfloat16_t>(bfloat16_t *sendBuf, bfloat16_t *recvBuf, size_t size, int rank,
+        int rankSize, const std::function<void(bfloat16_t *, size_t)> &hostsReduce);
+template void ShmReduction::reduceScatter<float>(float *sendBuf, float *recvBuf, size_t size, int rank, int rankSize,
+        size_t recvOffset, size_t recvCount, const std::function<void(float *, size_t)> &hostsReduce);
+
+void ShmReduction::allgather(const float *sendBuf, size_t count, float *recvBuf, int rank, int rankSize) {
+    float *address = (float *)shmCtx_.address;
+
+    // States of the last collective are reset one by one (see finish), wait till all are reset (or set by this one),
+    // otherwise a state not reset yet would be taken as written. Each rank writes its own slice, no chain is needed.
+    for (int i = 0; i < rankSize; i++) {
+        xft::wait_state(&shmCtx_, i, [](int value) { return value < 2; });
     }
-}
+    multiThreadCopy((char *)(address + count * rank), (char *)sendBuf, count * sizeof(float));
+    xft::set_state(&shmCtx_, rank, 1);
 
-template void ShmReduction::reduceAdd<float>(float *sendBuf, float *recvBuf, size_t size, int rank, int rankSize);
-template void ShmReduction::reduceAdd<bfloat16_t>(bfloat16_t *sendBuf, bfloat16_t *recvBuf, size_t size, int rank, int rankSize);
\ No newline at end of file
+    for (int i = 0; i < rankSize; i++) {
+        xft::wait_state_at_least(&shmCtx_, i, 1);
+    }
+
+    multiThreadCopy((char *)recvBuf, (char *)address, count * rankSize * sizeof(float));
+
+    finish(rank, rankSize);
+}
@@ -15,6 +15,7 @@
 #pragma once
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
@@ -24,8 +25,11 @@
 #include <iostream>
 #include <math.h>
 #include <omp.h>
+#include <sched.h>
 #include <unistd.h>
+#include "environment.h"
 #include "float16.h"
+#include <linux/futex.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -42,6 +46,7 @@ struct ShmContext {
     int fp;
     int pid_fd[2];
     int *state;
+    int *waiters; // Ranks sleeping on each state word, to skip waking when nobody sleeps
     uint8_t *blockState;
     void *address;
     size_t nstates;
@@ -53,16 +58,70 @@ static inline int memfd_create(const char *name, unsigned int flags) {
     return syscall(__NR_memfd_create, name, flags);
 }
 
-inline void wait_state_until(const ShmContext *ctx, const int index, int state) {
+// A stuck peer is reported instead of waiting forever
+inline void check_deadline(std::chrono::steady_clock::time_point start, const char *what, int index, int value) {
+    int timeout = Env::getShmTimeout();
+    if (timeout > 0 && std::chrono::steady_clock::now() - start > std::chrono::seconds(timeout)) {
+        printf("Error: waited %d seconds for SHM %s %d (still %d), some rank may be stuck.\n", timeout, what, index,
+                value);
+        exit(-1);
+    }
+}
+
+// Wait for a state word of the peers: spin with pause for a while, then sleep on the futex of the word till woken
+// by set_state. Each sleep is bounded, thus a missed wake-up only costs a little and the deadline is checked.
+template <typename Pred>
+inline void wait_state(const ShmContext *ctx, const int index, Pred ready) {
     volatile int *state_ptr = ctx->state + index;
-    while (*state_ptr != state)
-        ;
+    const int spins = Env::getShmSpinCount();
+    for (int i = 0; i < spins; ++i) {
+        if (ready(*state_ptr)) { return; }
+        _mm_pause();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        int value = *state_ptr;
+        if (ready(value)) { return; }
+        __atomic_fetch_add(ctx->waiters + index, 1, __ATOMIC_SEQ_CST);
+        struct timespec ts = {0, 1000000};
+        syscall(SYS_futex, ctx->state + index, FUTEX_WAIT, value, &ts, nullptr, 0);
+        __atomic_fetch_sub(ctx->waiters + index, 1, __ATOMIC_SEQ_CST);
+        check_deadline(start, "state of rank", index, *state_ptr);
+    }
+}
+
+inline void wait_state_until(const ShmContext *ctx, const int index, int state) {
+    wait_state(ctx, index, [state](int value) { return value == state; });
+}
+
+// Other ranks may already go further when the state is seen
+inline void wait_state_at_least(const ShmContext *ctx, const int index, int state) {
+    wait_state(ctx, index, [state](int value) { return value >= state; });
 }
 
+// The store is a full barrier, thus either the waiter sees the new state or the setter sees the waiter
+inline void set_state(ShmContext *ctx, const int index, int state) {
+    __atomic_store_n(ctx->state + index, state, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ctx->waiters + index, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, ctx->state + index, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+}
+
+// Block states are bytes (not futex words), thus yield instead of sleeping after spinning
 inline void wait_block_until(const ShmContext *ctx, const int index, uint8_t state) {
     volatile uint8_t *state_ptr = ctx->blockState + index;
-    while (*state_ptr != state)
-        ;
+    const int spins = Env::getShmSpinCount();
+    for (int i = 0; i < spins; ++i) {
+        if (*state_ptr == state) { return; }
+        _mm_pause();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; *state_ptr != state; ++i) {
+        sched_yield();
+        if (i % 1024 == 0) { check_deadline(start, "block", index, *state_ptr); }
+    }
 }
 
 inline void connect_shm(ShmContext *ctx) {
@@ -74,7 +133,7 @@ inline void connect_shm(ShmContext *ctx) {
         exit(-1);
     }
 
-    const int total_size = ctx->nstates * sizeof(int) + ctx->nbytes + ctx->nblocks * ctx->nstates;
+    const int total_size = 2 * ctx->nstates * sizeof(int) + ctx->nbytes + ctx->nblocks * ctx->nstates;
 
     // Map the shared memory into the address space of the process
     void *shm_ptr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fp, 0);
@@ -83,7 +142,8 @@ inline void connect_shm(ShmContext *ctx) {
         exit(-1);
     }
     ctx->state = (int *)shm_ptr;
-    ctx->blockState = (uint8_t *)((int *)shm_ptr + ctx->nstates);
+    ctx->waiters = (int *)shm_ptr + ctx->nstates;
+    ctx->blockState = (uint8_t *)((int *)shm_ptr + 2 * ctx->nstates);
     ctx->address = (void *)((uint8_t *)ctx->blockState + ctx->nblocks * ctx->nstates);
 }
 
@@ -94,7 +154,7 @@ inline void create_shm(ShmContext *ctx) {
         perror("shm open failed.");
         exit(-1);
     }
-    const int total_size = ctx->nstates * sizeof(int) + ctx->nbytes + ctx->nblocks * ctx->nstates;
+    const int total_size = 2 * ctx->nstates * sizeof(int) + ctx->nbytes + ctx->nblocks * ctx->nstates;
     // Truncate the shared memory to the desired size
     if (ftruncate(ctx->fp, total_size) == -1) {
         perror("shm ftruncate failed.");
@@ -110,7 +170,8 @@ inline void create_shm(ShmContext *ctx) {
     ctx->pid_fd[0] = getpid();
     ctx->pid_fd[1] = ctx->fp;
     ctx->state = (int *)shm_ptr;
-    ctx->blockState = (uint8_t *)((int *)shm_ptr + ctx->nstates);
+    ctx->waiters = (int *)shm_ptr + ctx->nstates;
+    ctx->blockState = (uint8_t *)((int *)shm_ptr + 2 * ctx->nstates);
     ctx->address = (void *)((uint8_t *)ctx->blockState + ctx->nblocks * ctx->nstates);
 }
 
@@ -132,12 +193,30 @@ public:
 
     int getSHMSize();
 
+    // If hostsReduce is given, the last rank calls it with the sum of ranks in the host (the SHM buffer), which is
+    // to be reduced in place with other hosts before others copy the result
     template <typename T>
-    void reduceAdd(T *sendBuf, T *recvBuf, size_t count, int rank, int rankSize);
+    void reduceAdd(T *sendBuf, T *recvBuf, size_t count, int rank, int rankSize,
+            const std::function<void(T *, size_t)> &hostsReduce = nullptr);
+
+    // Sum of sendBuf (size elements) like reduceAdd, recvBuf only gets the recvCount elements from recvOffset
+    template <typename T>
+    void reduceScatter(T *sendBuf, T *recvBuf, size_t size, int rank, int rankSize, size_t recvOffset,
+            size_t recvCount, const std::function<void(T *, size_t)> &hostsReduce = nullptr);
+
+    // recvBuf (count * rankSize) gets sendBuf of all ranks in the order of ranks
+    void allgather(const float *sendBuf, size_t count, float *recvBuf, int rank, int rankSize);
 
     int rank_;
     int rank_size_;
 
 private:
+    template <typename T>
+    void reduce(T *sendBuf, T *recvBuf, size_t size, int rank, int rankSize,
+            const std::function<void(T *, size_t)> &hostsReduce, size_t recvOffset, size_t recvCount);
+
+    // Mark this rank done with the collective, the last rank resets states after all are done
+    void finish(int rank, int rankSize);
+
     xft::ShmContext shmCtx_;
 };
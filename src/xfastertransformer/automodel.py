@@ -12,6 +12,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 # ============================================================================
+import asyncio
+import os
 import torch
 from typing import Union, List
 
@@ -38,6 +40,11 @@ class AutoModel:
         else:
             raise Exception(f"{self.__class__.__name__} don't support {dtype}.")
 
+        # State of generate_async()
+        self._engine_fd = None
+        self._engine_loop = None
+        self._engine_queues = {}
+
     @classmethod
     def from_pretrained(cls, path, dtype: str = "fp16"):
         return cls(path, dtype)
@@ -91,6 +98,16 @@ class AutoModel:
     def forward(self):
         return self.model.generate()
 
+    # Log-probability of each token given the tokens before it, in shape of [batch_size, seq_len - 1].
+    # Only master gets the result, other ranks call it with None.
+    def score(self, input_ids=None):
+        return self.model.score(input_ids)
+
+    # Hidden states after the final layer norm, the LM head is skipped. pooling is "last", "mean" or "none".
+    # Only master gets the result, other ranks call it with None.
+    def embed(self, input_ids=None, pooling: str = "last"):
+        return self.model.embed(input_ids, pooling)
+
     def prefix_sharing(self, input_ids=None, truncate_tail=0):
         if input_ids is not None and truncate_tail > 0:
             input_ids = input_ids[:, :-truncate_tail]
@@ -157,3 +174,88 @@ class AutoModel:
             streamer.end()
 
         return self.finalize()
+
+    # Run generation on a C++ thread, which never holds the GIL, for generate_async().
+    # Only returns on master, other ranks follow master's steps inside this call.
+    def start_engine(self, max_batch_size: int = 8):
+        if self._engine_fd is None:
+            self._engine_fd = self.model.start_engine(max_batch_size)
+
+    def stop_engine(self):
+        if self._engine_fd is None:
+            return
+        if self._engine_loop is not None:
+            self._engine_loop.remove_reader(self._engine_fd)
+        self.model.stop_engine()
+        for queue in self._engine_queues.values():
+            queue.put_nowait(None)
+        self._engine_queues.clear()
+        self._engine_fd = None
+        self._engine_loop = None
+
+    # Called by the event loop when the engine has stepped, hand new tokens to the waiting coroutines
+    def _on_engine_event(self):
+        try:
+            os.read(self._engine_fd, 4096)
+        except BlockingIOError:
+            pass
+        for request_id, queue in list(self._engine_queues.items()):
+            tokens, finished = self.model.fetch(request_id)
+            if tokens.numel() > 0:
+                queue.put_nowait(tokens)
+            if finished:
+                queue.put_nowait(None)
+                del self._engine_queues[request_id]
+
+    # Asynchronously generate for one prompt (token ids of shape [seq_len] or [1, seq_len]), yield tensors of new
+    # tokens as they come. Concurrent calls are batched by the engine, the event loop is free between tokens.
+    # priority is "interactive" or "batch", see Model::addRequest(). Master only.
+    async def generate_async(
+        self,
+        input_ids,
+        max_length=20,
+        do_sample=False,
+        temperature=1.0,
+        top_k=50,
+        top_p=1.0,
+        repetition_penalty=1.0,
+        eos_token_id=-1,
+        stop_words_ids: Union[List[List[int]], None] = None,
+        session_id: int = -1,
+        priority: str = "interactive",
+        **kwargs,
+    ):
+        self.start_engine()
+        loop = asyncio.get_running_loop()
+        if self._engine_loop is not loop:
+            if self._engine_loop is not None:
+                self._engine_loop.remove_reader(self._engine_fd)
+            loop.add_reader(self._engine_fd, self._on_engine_event)
+            self._engine_loop = loop
+
+        request_id = self.model.submit(
+            input_ids,
+            max_length,
+            do_sample,
+            temperature,
+            top_k,
+            top_p,
+            repetition_penalty,
+            eos_token_id,
+            stop_words_ids,
+            session_id,
+            priority,
+        )
+        queue = asyncio.Queue()
+        self._engine_queues[request_id] = queue
+
+        try:
+            while True:
+                tokens = await queue.get()
+                if tokens is None:
+                    break
+                yield tokens
+        finally:
+            # Abandoned by the caller before the end
+            if self._engine_queues.pop(request_id, None) is not None:
+                self.model.cancel_request(request_id)
@@ -0,0 +1,232 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "attention.h"
+#include "kvcache_tensor.h"
+#include "gtest/gtest.h"
+
+static constexpr int batchSize = 2;
+static constexpr int headNum = 4;
+static constexpr int kvHeadNum = 2;
+static constexpr int headSize = 64;
+static constexpr int maxSeqLen = 64;
+
+// Position embedding and norm are not involved in the attention core
+struct NoPosEmbed {
+    NoPosEmbed(int dim, int maxPos) {}
+};
+
+struct NoNorm {};
+
+class MaskedAttention : public Attention<float, NoPosEmbed, NoNorm> {
+public:
+    MaskedAttention(DecoderContext *ctx) : Attention(0, ctx) {}
+
+    using Attention::fusedAttention;
+    using Attention::scaledDpAttention;
+};
+
+// The mask models used to build before attention generated it: 0 for visible keys, lowest() for others;
+// with prefixLens, the first prefixLens[b] tokens of sample b see each other (only for the first step);
+// with padLens, the first padLens[b] tokens of sample b are hidden from others, and only see themselves
+static std::vector<float> denseMask(
+        int srcLen, int pastSeqLen, const int *prefixLens = nullptr, const int *padLens = nullptr) {
+    int tgtLen = pastSeqLen + srcLen;
+    std::vector<float> mask(batchSize * srcLen * tgtLen, std::numeric_limits<float>::lowest());
+    for (int b = 0; b < batchSize; ++b) {
+        for (int i = 0; i < srcLen; ++i) {
+            int visible = pastSeqLen + i + 1;
+            if (prefixLens && prefixLens[b] > i + 1) { visible = prefixLens[b]; }
+            int first = padLens ? std::min(padLens[b], pastSeqLen + i) : 0;
+            float *row = mask.data() + (b * srcLen + i) * tgtLen;
+            std::fill(row + first, row + visible, 0.0f);
+        }
+    }
+    return mask;
+}
+
+static std::vector<float> randomData(int size, int seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(size);
+    for (auto &v : data) {
+        v = dist(gen);
+    }
+    return data;
+}
+
+static void expectClose(const std::vector<float> &expected, const std::vector<float> &actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_NEAR(expected[i], actual[i], 1e-4f * std::max(1.0f, std::abs(expected[i]))) << "at " << i;
+    }
+}
+
+class AttentionMaskTest : public ::testing::Test {
+protected:
+    AttentionMaskTest()
+        : ctx(1, headNum * headSize, headNum, kvHeadNum, 256, "silu", 1e-6f, 1000, headNum * headSize, maxSeqLen,
+                maxSeqLen, maxSeqLen, 0, 1)
+        , attn(&ctx) {
+        keys.resize(maxSeqLen, batchSize, kvHeadNum, headSize);
+        values.resize(maxSeqLen, batchSize, kvHeadNum, headSize);
+        denseKeys.resize(maxSeqLen, batchSize, kvHeadNum, headSize);
+        denseValues.resize(maxSeqLen, batchSize, kvHeadNum, headSize);
+    }
+
+    // Attend seqLen new tokens of each sample, both with the descriptor and the dense mask on separate caches
+    void step(const AttnMaskDesc &desc, const std::vector<float> &mask, int seqLen, int pastSeqLen, int seed) {
+        int rows = batchSize * seqLen;
+        auto q = randomData(rows * headNum * headSize, seed);
+        auto k = randomData(rows * kvHeadNum * headSize, seed + 1);
+        auto v = randomData(rows * kvHeadNum * headSize, seed + 2);
+        hpj::Matrix<float> query(q.data(), rows, headNum * headSize, headNum * headSize);
+        hpj::Matrix<float> key(k.data(), rows, kvHeadNum * headSize, kvHeadNum * headSize);
+        hpj::Matrix<float> value(v.data(), rows, kvHeadNum * headSize, kvHeadNum * headSize);
+
+        std::vector<float> out(rows * headNum * headSize);
+        std::vector<float> expected(rows * headNum * headSize);
+        hpj::Matrix<float> result(out.data(), rows, headNum * headSize, headNum * headSize);
+        hpj::Matrix<float> denseResult(expected.data(), rows, headNum * headSize, headNum * headSize);
+
+        ctx.resize(batchSize, seqLen, pastSeqLen > 0);
+
+        ctx.maskDesc = AttnMaskDesc();
+        attn.fusedAttention(&ctx, query, key, value, denseResult, denseKeys, denseValues, mask.data(), pastSeqLen);
+
+        ctx.maskDesc = desc;
+        attn.fusedAttention(&ctx, query, key, value, result, keys, values, (const float *)nullptr, pastSeqLen);
+
+        expectClose(expected, out);
+    }
+
+    // Cached keys/values of sample b before len are never computed (like a sample joining the batch), only in the
+    // cache used with the descriptor, the dense mask cannot skip them
+    void poison(int b, int len) {
+        for (int seq = 0; seq < len; ++seq) {
+            for (int h = 0; h < kvHeadNum; ++h) {
+                std::fill_n(keys.getSequence(seq, b, h), headSize, std::numeric_limits<float>::quiet_NaN());
+                std::fill_n(values.getSequence(seq, b, h), headSize, std::numeric_limits<float>::quiet_NaN());
+            }
+        }
+    }
+
+    // Flash attention (first step only) of seqLen tokens with the descriptor and the dense mask
+    void flashStep(const AttnMaskDesc &desc, const std::vector<float> &mask, int seqLen, int seed) {
+        int rows = batchSize * seqLen;
+        auto q = randomData(rows * headNum * headSize, seed);
+        auto k = randomData(rows * kvHeadNum * headSize, seed + 1);
+        auto v = randomData(rows * kvHeadNum * headSize, seed + 2);
+        std::vector<float> out(rows * headNum * headSize);
+        std::vector<float> expected(rows * headNum * headSize);
+
+        int qStride = headNum * headSize;
+        int kvStride = kvHeadNum * headSize;
+        float scale = ctx.attFactor;
+        attn.scaledDpAttention(q.data(), k.data(), v.data(), mask.data(), desc, scale, batchSize, seqLen, seqLen,
+                headNum, kvHeadNum, headSize, expected.data(), qStride, kvStride, qStride);
+        attn.scaledDpAttention(q.data(), k.data(), v.data(), (const float *)nullptr, desc, scale, batchSize, seqLen,
+                seqLen, headNum, kvHeadNum, headSize, out.data(), qStride, kvStride, qStride);
+
+        expectClose(expected, out);
+    }
+
+    DecoderContext ctx;
+    MaskedAttention attn;
+    KVCacheTensor<float> keys, values;
+    KVCacheTensor<float> denseKeys, denseValues;
+};
+
+TEST_F(AttentionMaskTest, Causal) {
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::CAUSAL;
+
+    step(desc, denseMask(11, 0), 11, 0, 100);
+    // Verification of several tokens, then decoding
+    step(desc, denseMask(3, 11), 3, 11, 200);
+    step(desc, denseMask(1, 14), 1, 14, 300);
+}
+
+TEST_F(AttentionMaskTest, PrefixLM) {
+    // Sample 0 has a bidirectional context of 5 tokens, sample 1 has none (-1 as ChatGLM sets without a start ID)
+    std::vector<int> prefixLens = {5, -1};
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::PREFIX_LM;
+    desc.prefixLens = prefixLens.data();
+
+    step(desc, denseMask(11, 0, prefixLens.data()), 11, 0, 100);
+
+    desc.type = AttnMaskDesc::CAUSAL;
+    step(desc, denseMask(1, 11), 1, 11, 200);
+}
+
+TEST_F(AttentionMaskTest, LeftPadding) {
+    // Prompts of 11 and 7 tokens batched by padding the shorter one, queries in the padding only see themselves
+    std::vector<int> padLens = {0, 4};
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::CAUSAL;
+    desc.padLens = padLens.data();
+
+    step(desc, denseMask(11, 0, nullptr, padLens.data()), 11, 0, 100);
+    step(desc, denseMask(3, 11, nullptr, padLens.data()), 3, 11, 200);
+    step(desc, denseMask(1, 14, nullptr, padLens.data()), 1, 14, 300);
+}
+
+TEST_F(AttentionMaskTest, JoinedSample) {
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::CAUSAL;
+    step(desc, denseMask(9, 0), 9, 0, 100);
+
+    // Sample 1 joins after 9 tokens, the cache before its input is garbage and must not be read
+    poison(1, 9);
+    std::vector<int> padLens = {0, 9};
+    desc.padLens = padLens.data();
+    step(desc, denseMask(3, 9, nullptr, padLens.data()), 3, 9, 200);
+    step(desc, denseMask(1, 12, nullptr, padLens.data()), 1, 12, 300);
+}
+
+TEST_F(AttentionMaskTest, FlashCausal) {
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::CAUSAL;
+    flashStep(desc, denseMask(40, 0), 40, 100);
+}
+
+TEST_F(AttentionMaskTest, FlashPrefixLM) {
+    // Prefixes crossing the query and key tiles
+    std::vector<int> prefixLens = {23, 1};
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::PREFIX_LM;
+    desc.prefixLens = prefixLens.data();
+    flashStep(desc, denseMask(40, 0, prefixLens.data()), 40, 100);
+}
+
+TEST_F(AttentionMaskTest, FlashLeftPadding) {
+    // Padding crossing the query tiles
+    std::vector<int> padLens = {21, 0};
+    AttnMaskDesc desc;
+    desc.type = AttnMaskDesc::CAUSAL;
+    desc.padLens = padLens.data();
+    flashStep(desc, denseMask(40, 0, nullptr, padLens.data()), 40, 100);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
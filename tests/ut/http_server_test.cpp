@@ -0,0 +1,105 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "http_server.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+// Parse raw bytes sent by a peer (which then closes its end) through a socket pair
+static int parse(const std::string &raw, xft::HttpRequest &req) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) { return -1; }
+
+    std::thread peer([&]() {
+        size_t sent = 0;
+        while (sent < raw.size()) {
+            ssize_t n = send(fds[1], raw.data() + sent, raw.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) { break; }
+            sent += n;
+        }
+        shutdown(fds[1], SHUT_WR);
+    });
+    int status = xft::readHttpRequest(fds[0], req);
+    // Unblock the peer if the request was rejected before all is read
+    shutdown(fds[0], SHUT_RD);
+    peer.join();
+
+    close(fds[0]);
+    close(fds[1]);
+    return status;
+}
+
+TEST(HttpServerTest, ParseRequest) {
+    xft::HttpRequest req;
+    std::string raw = "POST /generate?x=1 HTTP/1.1\r\n"
+                      "Host: localhost\r\n"
+                      "Content-Type:  application/json \r\n"
+                      "Content-Length: 16\r\n\r\n"
+                      "{\"input_ids\":[]}";
+    EXPECT_EQ(parse(raw, req), 200);
+    EXPECT_EQ(req.method, "POST");
+    EXPECT_EQ(req.path, "/generate");
+    EXPECT_EQ(req.headers["host"], "localhost");
+    EXPECT_EQ(req.headers["content-type"], "application/json");
+    EXPECT_EQ(req.body, "{\"input_ids\":[]}");
+}
+
+TEST(HttpServerTest, BodyInPieces) {
+    // A body larger than a single read, data after Content-Length is dropped
+    std::string body(100000, 'x');
+    std::string raw = "POST /v1/completions HTTP/1.1\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n"
+            + body + "trailing";
+    xft::HttpRequest req;
+    EXPECT_EQ(parse(raw, req), 200);
+    EXPECT_EQ(req.body, body);
+}
+
+TEST(HttpServerTest, NoBody) {
+    xft::HttpRequest req;
+    EXPECT_EQ(parse("GET /health HTTP/1.1\r\n\r\n", req), 200);
+    EXPECT_EQ(req.method, "GET");
+    EXPECT_EQ(req.path, "/health");
+    EXPECT_TRUE(req.body.empty());
+}
+
+TEST(HttpServerTest, Malformed) {
+    xft::HttpRequest req;
+    EXPECT_EQ(parse("GARBAGE\r\n\r\n", req), 400);
+    EXPECT_EQ(parse("POST /generate HTTP/1.1\r\nContent-Length: abc\r\n\r\n", req), 400);
+    EXPECT_EQ(parse("POST /generate HTTP/1.1\r\nContent-Length: -1\r\n\r\n", req), 400);
+
+    // Peer gone before the header or the body is complete
+    EXPECT_EQ(parse("POST /generate HTTP/1.1\r\nHost: x\r\n", req), 400);
+    EXPECT_EQ(parse("POST /generate HTTP/1.1\r\nContent-Length: 10\r\n\r\n{}", req), 400);
+
+    // Header without an end is not buffered forever
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nX: " + std::string(100000, 'a'), req), 400);
+}
+
+TEST(HttpServerTest, BodyTooLarge) {
+    xft::HttpRequest req;
+    EXPECT_EQ(parse("POST /generate HTTP/1.1\r\nContent-Length: 67108865\r\n\r\n", req), 413);
+    EXPECT_EQ(parse("POST /generate HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n", req), 413);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,290 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include <vector>
+
+#include "kvcache_tensor.h"
+#include "gtest/gtest.h"
+
+// Value is unique for each (seq, batch, head, i), to check where it is moved
+static float encode(int seq, int b, int h, int i) {
+    return seq * 1000000 + b * 10000 + h * 100 + i;
+}
+
+template <typename Layout>
+static void fillTensor(KVCacheTensor<float, Layout> &tensor, int seqLen, int batchSize, int headNum, int headSize) {
+    for (int s = 0; s < seqLen; ++s) {
+        for (int b = 0; b < batchSize; ++b) {
+            for (int h = 0; h < headNum; ++h) {
+                float *p = tensor.getSequence(s, b, h);
+                for (int i = 0; i < headSize; ++i) {
+                    p[i] = encode(s, b, h, i);
+                }
+            }
+        }
+    }
+}
+
+template <typename Layout = KVLayoutSeqMajor>
+static void testSqueeze(std::vector<int> idx, int batchSize) {
+    const int maxSeqLen = 16, seqLen = 11, headNum = 3, headSize = 8;
+
+    KVCacheTensor<float, Layout> tensor;
+    tensor.resize(maxSeqLen, batchSize, headNum, headSize);
+    fillTensor(tensor, seqLen, batchSize, headNum, headSize);
+
+    tensor.squeezeSequence(idx.data(), idx.size(), seqLen);
+    EXPECT_EQ(tensor.getBatchSize(), idx.size());
+
+    for (int s = 0; s < seqLen; ++s) {
+        for (int b = 0; b < (int)idx.size(); ++b) {
+            for (int h = 0; h < headNum; ++h) {
+                float *p = tensor.getSequence(s, b, h);
+                for (int i = 0; i < headSize; ++i) {
+                    EXPECT_EQ(p[i], encode(s, idx[b], h, i));
+                }
+            }
+        }
+    }
+}
+
+TEST(KVCacheTensor, squeezeKeepAll) {
+    testSqueeze({0, 1, 2, 3}, 4);
+}
+
+TEST(KVCacheTensor, squeezeFirst) {
+    testSqueeze({1, 2, 3}, 4);
+}
+
+TEST(KVCacheTensor, squeezeLast) {
+    testSqueeze({0, 1, 2}, 4);
+}
+
+TEST(KVCacheTensor, squeezeMiddle) {
+    testSqueeze({0, 3, 5, 6}, 8);
+}
+
+TEST(KVCacheTensor, squeezeToOne) {
+    testSqueeze({5}, 8);
+}
+
+TEST(KVCacheTensor, squeezeHeadMajor) {
+    testSqueeze<KVLayoutHeadMajor>({0, 1, 2, 3}, 4);
+    testSqueeze<KVLayoutHeadMajor>({1, 2, 3}, 4);
+    testSqueeze<KVLayoutHeadMajor>({0, 3, 5, 6}, 8);
+}
+
+template <typename Layout>
+static void testExpand(int userSideBS, int beamSize) {
+    const int maxSeqLen = 16, seqLen = 11, headNum = 3, headSize = 8;
+    const int batchSize = userSideBS * beamSize;
+
+    KVCacheTensor<float, Layout> tensor;
+    tensor.resize(maxSeqLen, batchSize, headNum, headSize);
+    fillTensor(tensor, seqLen, userSideBS, headNum, headSize);
+
+    tensor.expandAllSequence(userSideBS, beamSize, seqLen);
+
+    for (int s = 0; s < seqLen; ++s) {
+        for (int b = 0; b < batchSize; ++b) {
+            for (int h = 0; h < headNum; ++h) {
+                float *p = tensor.getSequence(s, b, h);
+                for (int i = 0; i < headSize; ++i) {
+                    EXPECT_EQ(p[i], encode(s, b / beamSize, h, i));
+                }
+            }
+        }
+    }
+}
+
+TEST(KVCacheTensor, expandSeqMajor) {
+    testExpand<KVLayoutSeqMajor>(2, 3);
+}
+
+TEST(KVCacheTensor, expandHeadMajor) {
+    testExpand<KVLayoutHeadMajor>(2, 3);
+}
+
+// Existing samples keep their sequences, whether moved in place or into a bigger buffer
+template <typename Layout>
+static void testGrow(int batchSize, int newBatchSize) {
+    const int maxSeqLen = 16, seqLen = 11, headNum = 3, headSize = 8;
+
+    KVCacheTensor<float, Layout> tensor;
+    tensor.resize(maxSeqLen, 4, headNum, headSize);
+    tensor.resize(maxSeqLen, batchSize, headNum, headSize);
+    fillTensor(tensor, seqLen, batchSize, headNum, headSize);
+
+    tensor.growBatch(newBatchSize, seqLen);
+    EXPECT_EQ(tensor.getBatchSize(), newBatchSize);
+
+    for (int s = 0; s < seqLen; ++s) {
+        for (int b = 0; b < batchSize; ++b) {
+            for (int h = 0; h < headNum; ++h) {
+                float *p = tensor.getSequence(s, b, h);
+                for (int i = 0; i < headSize; ++i) {
+                    EXPECT_EQ(p[i], encode(s, b, h, i));
+                }
+            }
+        }
+    }
+}
+
+TEST(KVCacheTensor, growSeqMajor) {
+    testGrow<KVLayoutSeqMajor>(2, 3);
+    testGrow<KVLayoutSeqMajor>(3, 6);
+}
+
+TEST(KVCacheTensor, growHeadMajor) {
+    testGrow<KVLayoutHeadMajor>(2, 3);
+    testGrow<KVLayoutHeadMajor>(3, 6);
+}
+
+// A head read by attention is a matrix of (seq x headSize) with the returned stride
+template <typename Layout>
+static void testGetHead() {
+    const int maxSeqLen = 16, seqLen = 11, batchSize = 2, headNum = 3, headSize = 8;
+
+    KVCacheTensor<float, Layout> tensor;
+    tensor.resize(maxSeqLen, batchSize, headNum, headSize);
+    fillTensor(tensor, seqLen, batchSize, headNum, headSize);
+
+    for (int b = 0; b < batchSize; ++b) {
+        for (int h = 0; h < headNum; ++h) {
+            auto head = tensor.getHead(b, h);
+            for (int s = 0; s < seqLen; ++s) {
+                EXPECT_EQ(head.first[s * head.second + 1], encode(s, b, h, 1));
+            }
+        }
+    }
+}
+
+TEST(KVCacheTensor, getHead) {
+    testGetHead<KVLayoutSeqMajor>();
+    testGetHead<KVLayoutHeadMajor>();
+}
+
+// Beams share the prompt and diverge by the block table, reading through the runs sees the right history
+TEST(KVCacheTensor, blockTable) {
+    const int blockSize = KVBlockTable::kBlockSize;
+    const int maxSeqLen = 4 * blockSize, userSideBS = 1, beamSize = 3, headNum = 2, headSize = 16;
+    const int batchSize = userSideBS * beamSize, promptLen = blockSize + 5;
+
+    KVCacheTensor<float> tensor;
+    tensor.resize(maxSeqLen, batchSize, headNum, headSize);
+    fillTensor(tensor, promptLen, userSideBS, headNum, headSize);
+
+    KVBlockTable table;
+    table.reset(maxSeqLen, batchSize);
+    tensor.setBlockTable(&table);
+    table.share(userSideBS, beamSize, promptLen);
+
+    // history[b] is the sample which wrote each token of beam b
+    std::vector<std::vector<int>> history(batchSize, std::vector<int>(promptLen, 0));
+    int idx[][batchSize] = {{0, 0, 0}, {1, 1, 0}, {2, 0, 0}};
+    int seqLen = promptLen;
+    for (int step = 0; step < 3; ++step, ++seqLen) {
+        table.reorder(idx[step], seqLen);
+        auto copies = table.own(seqLen);
+        for (auto &c : copies) {
+            for (int s = seqLen / blockSize * blockSize; s < seqLen; ++s) {
+                for (int h = 0; h < headNum; ++h) {
+                    memcpy(tensor.getSlotSequence(s, c.second, h), tensor.getSlotSequence(s, c.first, h),
+                            headSize * sizeof(float));
+                }
+            }
+        }
+
+        auto old = history;
+        for (int b = 0; b < batchSize; ++b) {
+            history[b] = old[idx[step][b]];
+            history[b].push_back(b);
+            for (int h = 0; h < headNum; ++h) {
+                float *p = tensor.getSequence(seqLen, b, h);
+                for (int i = 0; i < headSize; ++i) {
+                    p[i] = encode(seqLen, b, h, i);
+                }
+            }
+        }
+    }
+
+    for (int b = 0; b < batchSize; ++b) {
+        for (int s = 0, len = 0; s < seqLen; s += len) {
+            len = std::min(seqLen - s, tensor.getRunLength(b, s));
+            float *p = tensor.getSequence(s, b, 1);
+            for (int j = 0; j < len; ++j) {
+                EXPECT_EQ(p[j * tensor.getSeqStride()], encode(s + j, history[b][s + j], 1, 0));
+            }
+        }
+    }
+}
+
+// Samples forked from a prompt keep sharing it after some of them are dropped
+template <typename Layout>
+static void testSqueezeShared() {
+    const int blockSize = KVBlockTable::kBlockSize;
+    const int maxSeqLen = 3 * blockSize, userSideBS = 2, numSamples = 3, headNum = 2, headSize = 16;
+    const int batchSize = userSideBS * numSamples, promptLen = blockSize + 3, seqLen = promptLen + 1;
+
+    KVCacheTensor<float, Layout> tensor;
+    tensor.resize(maxSeqLen, batchSize, headNum, headSize);
+    fillTensor(tensor, promptLen, userSideBS, headNum, headSize);
+
+    KVBlockTable table;
+    table.reset(maxSeqLen, batchSize);
+    tensor.setBlockTable(&table);
+    table.share(userSideBS, numSamples, promptLen);
+
+    // The last block of the prompt is copied into a free slot, then each sample appends a token
+    for (auto &c : table.own(promptLen)) {
+        for (int s = blockSize; s < promptLen; ++s) {
+            for (int h = 0; h < headNum; ++h) {
+                memcpy(tensor.getSlotSequence(s, c.second, h), tensor.getSlotSequence(s, c.first, h),
+                        headSize * sizeof(float));
+            }
+        }
+    }
+    for (int b = 0; b < batchSize; ++b) {
+        for (int h = 0; h < headNum; ++h) {
+            float *p = tensor.getSequence(promptLen, b, h);
+            for (int i = 0; i < headSize; ++i) {
+                p[i] = encode(promptLen, b, h, i);
+            }
+        }
+    }
+
+    std::vector<int> idx = {1, 2, 3};
+    auto kept = table.squeeze(idx.data(), idx.size(), seqLen);
+    tensor.squeezeSequence(kept, blockSize, idx.size(), seqLen);
+
+    EXPECT_EQ(kept[0].size(), 2); // the first block is still shared
+    for (int b = 0; b < (int)idx.size(); ++b) {
+        for (int s = 0; s < seqLen; ++s) {
+            int writer = s < promptLen ? idx[b] / numSamples : idx[b];
+            for (int h = 0; h < headNum; ++h) {
+                EXPECT_EQ(tensor.getSequence(s, b, h)[3], encode(s, writer, h, 3));
+            }
+        }
+    }
+}
+
+TEST(KVCacheTensor, squeezeShared) {
+    testSqueezeShared<KVLayoutSeqMajor>();
+    testSqueezeShared<KVLayoutHeadMajor>();
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
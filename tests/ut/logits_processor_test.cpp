@@ -0,0 +1,161 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "logits_processor.h"
+
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+static const int vocabSize = 48;
+static const int eosId = 47;
+
+// Reference of one row, applied to the whole vocabulary
+static std::vector<float> reference(const SearcherConfig &config, const std::vector<int> &prompt,
+        const std::vector<int> &generated, const std::vector<float> &logits) {
+    std::vector<float> out = logits;
+    std::map<int, int> counts;
+    for (int id : prompt) {
+        counts[id] += 0;
+    }
+    for (int id : generated) {
+        counts[id] += 1;
+    }
+    for (auto &kv : counts) {
+        float &x = out[kv.first];
+        x = x < 0 ? x * config.repetitionPenalty : x / config.repetitionPenalty;
+        if (kv.second > 0) { x -= config.presencePenalty + config.frequencyPenalty * kv.second; }
+    }
+    if ((int)generated.size() < config.minNewTokens) { out[eosId] = -INFINITY; }
+    return out;
+}
+
+static std::vector<float> randomLogits(int rows) {
+    std::vector<float> logits(rows * vocabSize);
+    for (int i = 0; i < (int)logits.size(); ++i) {
+        logits[i] = (float)((i * 37) % 23) - 11.0f;
+    }
+    return logits;
+}
+
+TEST(LogitsProcessorTest, Penalties) {
+    SearcherConfig config;
+    config.repetitionPenalty = 1.3f;
+    config.presencePenalty = 0.5f;
+    config.frequencyPenalty = 0.25f;
+    config.minNewTokens = 3;
+
+    std::vector<int> prompts = {1, 5, 5, 9, 30, 2, 2, 40, 41, 3};
+    std::vector<std::vector<int>> steps = {{5, 40}, {7, 40}, {5, 12}, {eosId, 31}};
+
+    // Rows are split among two "ranks" like the vocabulary of the LM head
+    for (int split : {0, 20}) {
+        LogitsProcessor processor(config, eosId);
+        processor.begin(prompts.data(), 2, 5);
+
+        std::vector<std::vector<int>> generated(2);
+        for (const auto &tokens : steps) {
+            std::vector<float> logits = randomLogits(2);
+            std::vector<float> expected;
+            for (int b = 0; b < 2; ++b) {
+                std::vector<int> prompt(prompts.begin() + b * 5, prompts.begin() + (b + 1) * 5);
+                std::vector<float> row(logits.begin() + b * vocabSize, logits.begin() + (b + 1) * vocabSize);
+                std::vector<float> ref = reference(config, prompt, generated[b], row);
+                expected.insert(expected.end(), ref.begin(), ref.end());
+            }
+
+            std::vector<float> result(logits.size());
+            for (int offset : {0, split}) {
+                int size = (offset == 0 && split > 0) ? split : vocabSize - offset;
+                std::vector<float> part(2 * size);
+                for (int b = 0; b < 2; ++b) {
+                    std::copy(logits.begin() + b * vocabSize + offset, logits.begin() + b * vocabSize + offset + size,
+                            part.begin() + b * size);
+                }
+                processor.process(part.data(), offset, size, 2);
+                for (int b = 0; b < 2; ++b) {
+                    std::copy(part.begin() + b * size, part.begin() + (b + 1) * size,
+                            result.begin() + b * vocabSize + offset);
+                }
+                if (split == 0) { break; }
+            }
+            EXPECT_EQ(result, expected);
+
+            processor.update(tokens);
+            for (int b = 0; b < 2; ++b) {
+                generated[b].push_back(tokens[b]);
+            }
+        }
+    }
+}
+
+TEST(LogitsProcessorTest, ReorderAndSqueeze) {
+    SearcherConfig config;
+    config.frequencyPenalty = 1.0f;
+
+    // Each prompt is repeated for 2 rows, like beams
+    std::vector<int> prompts = {1, 2, 3, 4};
+    LogitsProcessor processor(config, eosId);
+    processor.begin(prompts.data(), 2, 2, 2);
+    processor.update({10, 11, 12, 13});
+
+    // Row 1 continues row 0, row 2 continues row 3
+    int idx[4] = {0, 0, 3, 3};
+    processor.reorder(idx, 4);
+    int kept[2] = {1, 2};
+    processor.squeeze(kept, 2);
+
+    std::vector<float> logits(2 * vocabSize, 0);
+    processor.process(logits.data(), 0, vocabSize, 2);
+    EXPECT_EQ(logits[10], -1.0f);
+    EXPECT_EQ(logits[vocabSize + 13], -1.0f);
+    EXPECT_EQ(logits[11], 0);
+    EXPECT_EQ(logits[vocabSize + 12], 0);
+}
+
+TEST(LogitsProcessorTest, Grammar) {
+    std::vector<std::string> tokens(vocabSize);
+    for (int i = 0; i < 26; ++i) {
+        tokens[i] = std::string(1, 'a' + i);
+    }
+    SearcherConfig config;
+    LogitsProcessor processor(config, eosId);
+    EXPECT_FALSE(processor.enabled());
+
+    // The second prompt continues from the state after "a"
+    auto grammar = TokenGrammar::fromRegex("ab*c", tokens, eosId);
+    processor.setGrammar(grammar, {grammar->getStartState(), grammar->next(grammar->getStartState(), 0)});
+    std::vector<int> prompts = {30, 31};
+    processor.begin(prompts.data(), 2, 1);
+    EXPECT_TRUE(processor.enabled());
+
+    std::vector<float> logits(2 * vocabSize, 0);
+    processor.process(logits.data(), 0, vocabSize, 2);
+    std::vector<int> allowed[2];
+    for (int b = 0; b < 2; ++b) {
+        for (int i = 0; i < vocabSize; ++i) {
+            if (!std::isinf(logits[b * vocabSize + i])) { allowed[b].push_back(i); }
+        }
+    }
+    EXPECT_EQ(allowed[0], std::vector<int>({0}));
+    EXPECT_EQ(allowed[1], std::vector<int>({1, 2}));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
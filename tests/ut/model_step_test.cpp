@@ -0,0 +1,354 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "abstract_decoder.h"
+#include "gtest/gtest.h"
+#include "models.h"
+
+// A decoder predicting the token after the last one, thus a prompt ending with x gets x+1, x+2, ... till EOS;
+// the batch size and length of each prefill (excluding a resumed session) and of each group of joining samples are
+// recorded to check how requests are batched, a kept session takes 100 bytes per token
+class CountingDecoder : public AbstractDecoder {
+public:
+    CountingDecoder() : ctx(1, 64, 1, 1, 64, "silu", 1e-6f, vocabSize, 64, 512, 512, 512, 0, 1, 1, 0, nullptr, 4) {}
+
+    std::tuple<float *, int, int> forward(int *ids, int64_t *dims, int step, bool logitsAll = false) {
+        int batchSize = dims[0];
+        int seqLen = dims[2];
+
+        if (step == 0) {
+            prefills.push_back({batchSize, seqLen - prefixLen});
+            last.assign(batchSize, 0);
+            padLens.resize(batchSize);
+            EXPECT_TRUE(padding || std::all_of(padLens.begin(), padLens.end(), [](int len) { return len == 0; }));
+        }
+        logits.assign(batchSize * vocabSize, 0);
+        for (int b = 0; b < batchSize; ++b) {
+            last[b] = ids[(b + 1) * seqLen - 1];
+            logits[b * vocabSize + (last[b] + 1) % vocabSize] = 1.0f;
+        }
+        return std::tuple<float *, int, int>(logits.data(), 0, vocabSize);
+    }
+
+    void score(int *ids, int64_t *dims, const int *targets, float *logprobs) {}
+    void embed(int *ids, int64_t *dims, PoolingMode pooling, float *output) {}
+    void reorderCache(int *idx, int size) {}
+
+    void squeezeCache(int *idx, int size) {
+        squeezes.push_back(size);
+        for (int i = 0; i < size; ++i) {
+            last[i] = last[idx[i]];
+        }
+        last.resize(size);
+    }
+
+    void rollbackCache(int tokens) {}
+    bool supportsRollback() { return true; }
+
+    DecoderContext *getContext() { return &ctx; }
+    Messenger &getMessenger() { return Messenger::getInstance(); }
+    int getRank() { return 0; }
+    int getEndId() { return vocabSize - 1; }
+    void setPrefix(int *ids, int seqLen) {}
+    void unsetPrefix() { prefixLen = 0; }
+
+    size_t saveSession(int sessionId, int sampleIdx, int seqLen) {
+        if (!sessions) { return 0; }
+        saved[sessionId] = seqLen;
+        return seqLen * 100;
+    }
+
+    bool loadSession(int sessionId) {
+        auto it = saved.find(sessionId);
+        if (it == saved.end()) { return false; }
+        prefixLen = it->second;
+        return true;
+    }
+
+    void dropSession(int sessionId) {
+        saved.erase(sessionId);
+        dropped.push_back(sessionId);
+    }
+
+    bool supportsSessions() { return sessions; }
+
+    void setPadding(const int *padLens, int size) { this->padLens.assign(padLens, padLens + size); }
+
+    void appendSamples(const int *ids, int batchSize, int seqLen, const int *padLens) {
+        joins.push_back({batchSize, seqLen});
+        last.resize(last.size() + batchSize);
+    }
+
+    bool supportsPadding() { return padding; }
+
+    std::vector<std::pair<int, int>> prefills; // (batchSize, seqLen)
+    std::vector<std::pair<int, int>> joins; // (batchSize, seqLen)
+    std::vector<int> padLens; // Of the last prefill
+    std::vector<int> squeezes;
+    std::map<int, int> saved; // Session ID -> seqLen
+    std::vector<int> dropped;
+    bool sessions = true;
+    bool padding = true;
+
+    static constexpr int vocabSize = 64;
+
+private:
+    DecoderContext ctx;
+    std::vector<float> logits;
+    std::vector<int> last;
+    int prefixLen = 0;
+};
+
+class ModelStepTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        decoder = new CountingDecoder();
+        model.setDecoder(decoder); // Deleted by the model
+        config.maxLen = 60;
+    }
+
+    int add(std::vector<int> ids, xft::RequestPriority priority = xft::RequestPriority::INTERACTIVE,
+            int sessionId = -1) {
+        return model.addRequest(ids, config, {}, sessionId, priority);
+    }
+
+    // Run a request of the session till done
+    std::vector<int> chat(std::vector<int> ids, int sessionId) {
+        int handle = add(ids, xft::RequestPriority::INTERACTIVE, sessionId);
+        while (model.step()) {}
+        return model.poll(handle);
+    }
+
+    // Tokens from firstToken till EOS (excluded)
+    static std::vector<int> counting(int firstToken) {
+        std::vector<int> ret;
+        for (int id = firstToken; id < CountingDecoder::vocabSize - 1; ++id) {
+            ret.push_back(id);
+        }
+        return ret;
+    }
+
+    xft::Model model;
+    CountingDecoder *decoder;
+    SearcherConfig config;
+};
+
+TEST_F(ModelStepTest, StepAndPoll) {
+    int a = add({50, 51, 52});
+    int b = add({10, 58, 59});
+
+    std::vector<int> outA;
+    std::vector<int> outB;
+    while (model.step()) {
+        auto tokens = model.poll(a);
+        outA.insert(outA.end(), tokens.begin(), tokens.end());
+    }
+    auto tokens = model.poll(a);
+    outA.insert(outA.end(), tokens.begin(), tokens.end());
+    outB = model.poll(b);
+
+    EXPECT_EQ(outA, counting(53));
+    EXPECT_EQ(outB, counting(60));
+    EXPECT_TRUE(model.isFinished(a));
+    EXPECT_TRUE(model.isFinished(b));
+
+    // Same prompt length and config, thus batched together; b is dropped from the batch once done
+    ASSERT_EQ(decoder->prefills.size(), 1u);
+    EXPECT_EQ(decoder->prefills[0], std::make_pair(2, 3));
+    ASSERT_FALSE(decoder->squeezes.empty());
+    EXPECT_EQ(decoder->squeezes[0], 1);
+}
+
+// Prompts of different lengths are padded into one batch, requests arriving later join it at step boundaries
+TEST_F(ModelStepTest, PaddingAndJoining) {
+    int a = add({50, 51, 52});
+    int b = add({55, 56});
+    model.step();
+    int c = add({40, 41, 42});
+    int d = add({20, 21, 22, 23, 24, 25, 26}); // Waits till the batch is as long
+    while (model.step()) {}
+
+    EXPECT_EQ(model.poll(a), counting(53));
+    EXPECT_EQ(model.poll(b), counting(57));
+    EXPECT_EQ(model.poll(c), counting(43));
+    EXPECT_EQ(model.poll(d), counting(27));
+
+    std::vector<std::pair<int, int>> expected = {{2, 3}};
+    EXPECT_EQ(decoder->prefills, expected);
+    EXPECT_EQ(decoder->padLens, std::vector<int>({0, 1}));
+
+    // The last token of a joining prompt is fed with the next step
+    expected = {{1, 2}, {1, 6}};
+    EXPECT_EQ(decoder->joins, expected);
+}
+
+// Without padding, requests of different prompt lengths or arriving while a batch runs wait for it
+TEST_F(ModelStepTest, StaticBatching) {
+    decoder->padding = false;
+    int a = add({50, 51, 52});
+    int b = add({55, 56});
+    model.step();
+    int c = add({40, 41, 42});
+    while (model.step()) {}
+
+    EXPECT_EQ(model.poll(a), counting(53));
+    EXPECT_EQ(model.poll(b), counting(57));
+    EXPECT_EQ(model.poll(c), counting(43));
+
+    std::vector<std::pair<int, int>> expected = {{1, 3}, {1, 2}, {1, 3}};
+    EXPECT_EQ(decoder->prefills, expected);
+    EXPECT_TRUE(decoder->joins.empty());
+}
+
+TEST_F(ModelStepTest, MaxLen) {
+    config.maxLen = 5;
+    int a = add({50, 51, 52});
+    int b = add({10, 11});
+    while (model.step()) {}
+
+    // Prompt plus generated tokens of each request
+    EXPECT_EQ(model.poll(a), std::vector<int>({53, 54}));
+    EXPECT_EQ(model.poll(b), std::vector<int>({12, 13, 14}));
+}
+
+TEST_F(ModelStepTest, Cancel) {
+    int a = add({40, 41, 42});
+    int b = add({50, 51, 52});
+    model.step();
+    model.step();
+    model.cancel(a);
+    while (model.step()) {}
+
+    EXPECT_TRUE(model.isFinished(a));
+    EXPECT_TRUE(model.poll(a).empty());
+    EXPECT_EQ(model.poll(b), counting(53));
+    ASSERT_FALSE(decoder->squeezes.empty());
+    EXPECT_EQ(decoder->squeezes[0], 1);
+
+    // Cancelling the last running request gives up the batch
+    int c = add({40, 41, 42});
+    model.step();
+    model.cancel(c);
+    EXPECT_FALSE(model.step());
+}
+
+// A waiting interactive request joins the running batch, only as many batch-class rows as needed give way to it
+TEST_F(ModelStepTest, Preemption) {
+    model.setMaxBatchSize(2);
+    int first = add({40, 41, 42}, xft::RequestPriority::BATCH);
+    int second = add({30, 31, 32}, xft::RequestPriority::BATCH);
+    model.step();
+    model.step();
+    int interactive = add({58, 59, 60});
+
+    std::vector<int> outSecond = model.poll(second);
+    while (model.step()) {
+        auto tokens = model.poll(second);
+        outSecond.insert(outSecond.end(), tokens.begin(), tokens.end());
+    }
+    auto tokens = model.poll(second);
+    outSecond.insert(outSecond.end(), tokens.begin(), tokens.end());
+
+    EXPECT_EQ(model.poll(first), counting(43));
+    EXPECT_EQ(outSecond, counting(33));
+    EXPECT_EQ(model.poll(interactive), counting(61));
+
+    // The last row is preempted, and joins again with its prompt and tokens once the interactive request is done
+    std::vector<std::pair<int, int>> expected = {{2, 3}};
+    EXPECT_EQ(decoder->prefills, expected);
+    expected = {{1, 2}, {1, 4}};
+    EXPECT_EQ(decoder->joins, expected);
+}
+
+// An interactive request unable to join (here of another config) preempts a batch without interactive requests
+TEST_F(ModelStepTest, PreemptBatch) {
+    int batch = add({40, 41, 42}, xft::RequestPriority::BATCH);
+    model.step();
+    model.step();
+    config.topK = config.topK + 1;
+    int interactive = add({58, 59, 60});
+
+    std::vector<int> outBatch = model.poll(batch);
+    while (model.step()) {
+        auto tokens = model.poll(batch);
+        outBatch.insert(outBatch.end(), tokens.begin(), tokens.end());
+    }
+    auto tokens = model.poll(batch);
+    outBatch.insert(outBatch.end(), tokens.begin(), tokens.end());
+
+    EXPECT_EQ(outBatch, counting(43));
+    EXPECT_EQ(model.poll(interactive), counting(61));
+
+    // The preempted request recomputes its prompt and tokens after the interactive one
+    std::vector<std::pair<int, int>> expected = {{1, 3}, {1, 3}, {1, 5}};
+    EXPECT_EQ(decoder->prefills, expected);
+    EXPECT_TRUE(decoder->joins.empty());
+}
+
+TEST_F(ModelStepTest, SessionResume) {
+    EXPECT_EQ(chat({50, 51, 52}, 7), counting(53));
+
+    // The kept session has the input and generated tokens except EOS (not fed to the model)
+    std::vector<int> ids = {50, 51, 52};
+    ids.insert(ids.end(), {53, 54, 55, 56, 57, 58, 59, 60, 61, 62});
+    ids.insert(ids.end(), {20, 21});
+    EXPECT_EQ(chat(ids, 7), counting(22));
+    EXPECT_EQ(decoder->saved[7], 13);
+
+    // Only the new tokens are prefilled
+    std::vector<std::pair<int, int>> expected = {{1, 3}, {1, 2}};
+    EXPECT_EQ(decoder->prefills, expected);
+
+    // An input not starting with the kept tokens is computed again
+    EXPECT_EQ(chat({50, 30, 31}, 7), counting(32));
+    EXPECT_EQ(decoder->prefills.back(), std::make_pair(1, 3));
+}
+
+TEST_F(ModelStepTest, SessionEviction) {
+    model.setSessionPolicy(0, 3000);
+    chat({50, 51, 52}, 1); // 13 tokens kept
+    chat({40, 41, 42}, 2); // 23 tokens kept
+    EXPECT_TRUE(decoder->dropped.empty());
+
+    // Session 2 is saved at the first step, then the least recently used session exceeds the limit
+    chat({30, 31, 32}, -1);
+    EXPECT_EQ(decoder->dropped, std::vector<int>({1}));
+    EXPECT_EQ(decoder->saved.count(2), 1u);
+
+    model.closeSession(2);
+    chat({30, 31, 32}, -1);
+    EXPECT_EQ(decoder->dropped, std::vector<int>({1, 2}));
+    EXPECT_TRUE(decoder->saved.empty());
+}
+
+TEST_F(ModelStepTest, SessionUnsupported) {
+    decoder->sessions = false;
+    EXPECT_FALSE(model.supportsSessions());
+
+    EXPECT_EQ(chat({50, 51, 52}, 7), counting(53));
+    EXPECT_EQ(chat({50, 51, 52, 53, 20, 21}, 7), counting(22));
+    EXPECT_TRUE(decoder->saved.empty());
+
+    std::vector<std::pair<int, int>> expected = {{1, 3}, {1, 6}};
+    EXPECT_EQ(decoder->prefills, expected);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
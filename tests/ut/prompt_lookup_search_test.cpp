@@ -0,0 +1,180 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "prompt_lookup_search.h"
+
+#include <cstdlib>
+#include <vector>
+
+#include "greedy_search.h"
+#include "gtest/gtest.h"
+
+// A decoder predicting the token after the latest occurrence of the last token, thus copying from the context,
+// while it deviates from time to time; the input tokens of each sample are kept like the KV cache
+class CopyingDecoder : public AbstractDecoder {
+public:
+    CopyingDecoder() : ctx(1, 64, 1, 1, 64, "silu", 1e-6f, vocabSize, 64, 512, 512, 512, 0, 1, 1, 0, nullptr, 4) {}
+
+    std::tuple<float *, int, int> forward(int *ids, int64_t *dims, int step, bool logitsAll = false) {
+        int batchSize = dims[0];
+        int seqLen = dims[2];
+        int rows = logitsAll ? seqLen : 1;
+        forwards += 1;
+
+        if (step == 0) { cache.assign(batchSize, {}); }
+        logits.assign(batchSize * rows * vocabSize, 0);
+        for (int b = 0; b < batchSize; ++b) {
+            cache[b].insert(cache[b].end(), ids + b * seqLen, ids + (b + 1) * seqLen);
+            for (int r = 0; r < rows; ++r) {
+                int len = cache[b].size() - rows + 1 + r;
+                logits[(b * rows + r) * vocabSize + predict(cache[b], len)] = 1.0f;
+            }
+        }
+        return std::tuple<float *, int, int>(logits.data(), 0, vocabSize);
+    }
+
+    void score(int *ids, int64_t *dims, const int *targets, float *logprobs) {}
+    void embed(int *ids, int64_t *dims, PoolingMode pooling, float *output) {}
+    void reorderCache(int *idx, int size) {}
+
+    void squeezeCache(int *idx, int size) {
+        for (int i = 0; i < size; ++i) {
+            cache[i] = cache[idx[i]];
+        }
+        cache.resize(size);
+    }
+
+    void rollbackCache(int tokens) {
+        for (auto &tokenIds : cache) {
+            tokenIds.resize(tokenIds.size() - tokens);
+        }
+    }
+
+    bool supportsRollback() { return true; }
+
+    DecoderContext *getContext() { return &ctx; }
+    Messenger &getMessenger() { return Messenger::getInstance(); }
+    int getRank() { return 0; }
+    int getEndId() { return vocabSize - 1; }
+    void setPrefix(int *ids, int seqLen) {}
+    void unsetPrefix() {}
+    size_t saveSession(int sessionId, int sampleIdx, int seqLen) { return 0; }
+    bool loadSession(int sessionId) { return false; }
+    void dropSession(int sessionId) {}
+    bool supportsSessions() { return false; }
+    void setPadding(const int *padLens, int size) {}
+    void appendSamples(const int *ids, int batchSize, int seqLen, const int *padLens) {}
+    bool supportsPadding() { return false; }
+
+    int forwards = 0;
+
+private:
+    // Predict the token after the first len tokens
+    int predict(const std::vector<int> &tokenIds, int len) {
+        int last = tokenIds[len - 1];
+        if (len % 11 == 0) { return (last * 7 + len) % (vocabSize - 2); }
+        for (int i = len - 2; i >= 0; --i) {
+            if (tokenIds[i] == last) { return tokenIds[i + 1]; }
+        }
+        return (last * 3 + 1) % (vocabSize - 2);
+    }
+
+    static constexpr int vocabSize = 40;
+    DecoderContext ctx;
+    std::vector<float> logits;
+    std::vector<std::vector<int>> cache;
+};
+
+template <typename Searcher>
+static std::vector<int> generate(const SearcherConfig &config, std::vector<int> ids, int batchSize, int &forwards,
+        int squeezeStep = -1, std::shared_ptr<const TokenGrammar> grammar = nullptr) {
+    CopyingDecoder decoder;
+    Searcher searcher(decoder, config);
+    searcher.setGrammar(grammar);
+    searcher.getNextToken(ids.data(), batchSize, ids.size() / batchSize);
+    for (int step = 1; !searcher.isDone(); ++step) {
+        if (step == squeezeStep) {
+            int idx[1] = {1};
+            searcher.squeeze(idx, 1);
+        }
+        searcher.getNextToken();
+    }
+    forwards = decoder.forwards;
+    return searcher.finalize();
+}
+
+static const std::vector<int> prompts = {1, 2, 3, 7, 5, 6, 1, 2, 3, 4, 5, 6, 9, 9, 1, 2, 3, 4, 5, 8, 6, 1, 2, 3, 4, 5,
+        6, 9, 9, 1, 2, 3};
+
+TEST(PromptLookupSearchTest, SameAsGreedy) {
+    for (int numDrafts : {1, 3, 5}) {
+        SearcherConfig config;
+        config.maxLen = 80;
+        config.promptLookupNum = numDrafts;
+
+        int greedyForwards = 0;
+        int lookupForwards = 0;
+        auto expected = generate<GreedySearch>(config, prompts, 2, greedyForwards);
+        auto result = generate<PromptLookupSearch>(config, prompts, 2, lookupForwards);
+        EXPECT_EQ(result, expected);
+        EXPECT_LT(lookupForwards, greedyForwards);
+    }
+}
+
+TEST(PromptLookupSearchTest, Squeeze) {
+    SearcherConfig config;
+    config.maxLen = 80;
+    config.promptLookupNum = 4;
+
+    int greedyForwards = 0;
+    int lookupForwards = 0;
+    auto expected = generate<GreedySearch>(config, prompts, 2, greedyForwards, 5);
+    auto result = generate<PromptLookupSearch>(config, prompts, 2, lookupForwards, 5);
+    EXPECT_EQ(result, expected);
+}
+
+TEST(PromptLookupSearchTest, Grammar) {
+    // Token i is a letter for i < 26, a digit for i < 36, others are special; letters and digits have to alternate
+    std::vector<std::string> tokens(40);
+    for (int i = 0; i < 36; ++i) {
+        tokens[i] = std::string(1, i < 26 ? 'a' + i : '0' + i - 26);
+    }
+    auto grammar = TokenGrammar::fromRegex("(?:[a-z][0-9])*", tokens, 39);
+
+    SearcherConfig config;
+    config.maxLen = 80;
+    config.promptLookupNum = 3;
+
+    int greedyForwards = 0;
+    int lookupForwards = 0;
+    auto expected = generate<GreedySearch>(config, prompts, 2, greedyForwards, -1, grammar);
+    auto result = generate<PromptLookupSearch>(config, prompts, 2, lookupForwards, -1, grammar);
+    EXPECT_EQ(result, expected);
+
+    int rowLen = expected.size() / 2;
+    int promptLen = prompts.size() / 2;
+    for (int b = 0; b < 2; ++b) {
+        int state = grammar->getStartState();
+        for (int i = promptLen; i < rowLen && expected[b * rowLen + i] != 39; ++i) {
+            state = grammar->next(state, expected[b * rowLen + i]);
+            ASSERT_GE(state, 0);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    setenv("SINGLE_INSTANCE", "1", 1);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
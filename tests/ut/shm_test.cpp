@@ -13,6 +13,7 @@
 // limitations under the License.
 // ============================================================================
 #include <chrono>
+#include <vector>
 
 #include "messenger.h"
 #include "gtest/gtest.h"
@@ -105,6 +106,67 @@ TEST_F(MyTestSuite, allreduce_8K) {
     test(batchSize, seqLen, hiddenSize);
 }
 
+// Back to back like layers in sequence parallel, data of each round differs to catch slices of the last round
+TEST_F(MyTestSuite, reduce_scatter_allgather) {
+    Messenger &myMessenger = Messenger::getInstance();
+    int size = myMessenger.getSize();
+    int rank = myMessenger.getRank();
+    size_t count = 4096;
+    std::vector<float> send(count * size), slice(count), gathered(count * size);
+
+    int errors = 0;
+    for (int round = 0; round < 100; ++round) {
+        for (size_t i = 0; i < send.size(); ++i) {
+            send[i] = rank + i % 5 + round;
+        }
+        myMessenger.reduceScatter(send.data(), slice.data(), count);
+        for (size_t i = 0; i < count; ++i) {
+            float expected = size * (size - 1) / 2 + size * ((count * rank + i) % 5 + round);
+            if (slice[i] != expected) { errors += 1; }
+        }
+
+        myMessenger.allgather(slice.data(), count, gathered.data());
+        for (size_t i = 0; i < gathered.size(); ++i) {
+            float expected = size * (size - 1) / 2 + size * (i % 5 + round);
+            if (gathered[i] != expected) { errors += 1; }
+        }
+
+        std::vector<float> mine(count, rank * 1000 + round);
+        myMessenger.allgather(mine.data(), count, gathered.data());
+        for (size_t i = 0; i < gathered.size(); ++i) {
+            if (gathered[i] != (i / count) * 1000 + round) { errors += 1; }
+        }
+    }
+    EXPECT_EQ(errors, 0);
+}
+
+// Ranks taken as on hosts of XFT_COMM_HOST_RANKS ranks each, so that the SHM reduction in hosts and the collectives
+// among leaders are both used, like: mpirun -n 4 -env XFT_COMM_HOST_RANKS 2 ./shm_test
+TEST_F(MyTestSuite, hierarchical_reduce_scatter) {
+    if (std::getenv("XFT_COMM_HOST_RANKS") == nullptr) { GTEST_SKIP() << "XFT_COMM_HOST_RANKS is not set"; }
+
+    Messenger &myMessenger = Messenger::getInstance();
+    int size = myMessenger.getSize();
+    int rank = myMessenger.getRank();
+
+    int errors = 0;
+    for (size_t count : {1, 17, 4096, 65536}) {
+        std::vector<float> send(count * size), slice(count);
+        for (int round = 0; round < 10; ++round) {
+            // Each element differs, a slice from the wrong place (or host) does not match
+            for (size_t i = 0; i < send.size(); ++i) {
+                send[i] = (rank + 1) * (i % 97 + round);
+            }
+            myMessenger.reduceScatter(send.data(), slice.data(), count);
+            for (size_t i = 0; i < count; ++i) {
+                float expected = size * (size + 1) / 2 * ((count * rank + i) % 97 + round);
+                if (slice[i] != expected) { errors += 1; }
+            }
+        }
+    }
+    EXPECT_EQ(errors, 0);
+}
+
 int main(int argc, char **argv) {
     // Use system clock for seed
     srand(time(NULL));
@@ -0,0 +1,87 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "token_grammar.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+static const std::vector<std::string> tokens = {"{", "}", "\"", "name", "\":", " ", "\"a", "b", "c", "12", "3", "-",
+        "true", "false", ",", "", "{\"", "ab\"", "x", "\",\"n\":"};
+static const int eosId = 15;
+static const char *pattern = "\\{\"name\": ?\"[^\"\\\\]{1,5}\",\"n\":-?\\d+\\}";
+
+static bool accepts(const TokenGrammar &grammar, const std::vector<int> &ids) {
+    int state = grammar.getStartState();
+    for (int id : ids) {
+        state = grammar.next(state, id);
+        if (state < 0) { return false; }
+    }
+    return true;
+}
+
+TEST(TokenGrammarTest, Match) {
+    auto grammar = TokenGrammar::fromRegex(pattern, tokens, eosId);
+
+    EXPECT_TRUE(accepts(*grammar, {16, 3, 4, 5, 6, 7, 19, 11, 9, 1, eosId}));
+    EXPECT_TRUE(accepts(*grammar, {0, 2, 3, 4, 6, 19, 10, 1, eosId}));
+    EXPECT_FALSE(accepts(*grammar, {16, 3, 4, 5, 6, eosId})); // Not finished
+    EXPECT_FALSE(accepts(*grammar, {16, 3, 4, 2, 2})); // Empty name
+    EXPECT_FALSE(accepts(*grammar, {16, 3, 4, 6, 7, 7, 7, 7, 7})); // Name is too long
+
+    auto alter = TokenGrammar::fromRegex("(?:true|false)|[a-c]+x?|(ab|\\w)*", tokens, eosId);
+    EXPECT_TRUE(accepts(*alter, {12, eosId}));
+    EXPECT_TRUE(accepts(*alter, {7, 8, 18, eosId}));
+    EXPECT_TRUE(accepts(*alter, {13, 12, 9}));
+    EXPECT_FALSE(accepts(*alter, {12, 11}));
+
+    std::string error;
+    EXPECT_EQ(TokenGrammar::fromRegex("(a", tokens, eosId, &error), nullptr);
+    EXPECT_FALSE(error.empty());
+}
+
+TEST(TokenGrammarTest, Mask) {
+    auto grammar = TokenGrammar::fromRegex(pattern, tokens, eosId);
+    int state = grammar->next(grammar->getStartState(), 0);
+
+    // The row is split, covering IDs [2, 34), where IDs out of the vocabulary are never allowed
+    std::vector<float> logits(32, 1.0f);
+    grammar->applyMask(state, logits.data(), 2, 32);
+    std::vector<int> allowed;
+    for (int i = 0; i < (int)logits.size(); ++i) {
+        if (!std::isinf(logits[i])) { allowed.push_back(i + 2); }
+    }
+    EXPECT_EQ(allowed, std::vector<int>({2}));
+
+    // EOS is only allowed once matched
+    std::vector<float> row(tokens.size(), 1.0f);
+    grammar->applyMask(state, row.data(), 0, row.size());
+    EXPECT_TRUE(std::isinf(row[eosId]));
+}
+
+TEST(TokenGrammarTest, Serialize) {
+    auto grammar = TokenGrammar::fromRegex(pattern, tokens, eosId);
+    std::vector<int> data = grammar->serialize();
+    auto restored = TokenGrammar::deserialize(data);
+    EXPECT_EQ(restored->serialize(), data);
+    EXPECT_TRUE(accepts(*restored, {16, 3, 4, 5, 6, 7, 19, 11, 9, 1, eosId}));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
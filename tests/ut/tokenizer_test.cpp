@@ -0,0 +1,219 @@
+// Copyright (c) 2024 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ============================================================================
+#include "tokenizer.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// GPT-2 bytes_to_unicode(), byte b is token b of the byte level fixture
+static std::string byteSymbol(int b) {
+    static std::vector<std::string> symbols;
+    if (symbols.empty()) {
+        int shift = 0;
+        for (int i = 0; i < 256; ++i) {
+            bool printable = (i >= 33 && i <= 126) || (i >= 161 && i <= 172) || (i >= 174 && i <= 255);
+            int cp = printable ? i : 256 + shift++;
+            std::string s;
+            if (cp < 0x80) {
+                s += (char)cp;
+            } else {
+                s += (char)(0xC0 | (cp >> 6));
+                s += (char)(0x80 | (cp & 0x3F));
+            }
+            symbols.push_back(s);
+        }
+    }
+    return symbols[b];
+}
+
+static std::string quote(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; }
+        out += c;
+    }
+    return out + "\"";
+}
+
+// GPT-2 style: "hello" and " world" are built by merges, "é" (C3 A9) is merged into one token
+static std::string byteLevelJson() {
+    std::vector<std::string> merged = {"Ġw", "he", "ll", "hell", "hello", "or", "Ġwor", "Ġworl", "Ġworld",
+            byteSymbol(0xC3) + byteSymbol(0xA9)};
+    std::vector<std::string> merges = {"Ġ w", "h e", "l l", "he ll", "hell o", "o r", "Ġw or", "Ġwor l", "Ġworl d",
+            byteSymbol(0xC3) + " " + byteSymbol(0xA9)};
+
+    std::string vocab;
+    for (int b = 0; b < 256; ++b) {
+        vocab += quote(byteSymbol(b)) + ":" + std::to_string(b) + ",";
+    }
+    for (size_t i = 0; i < merged.size(); ++i) {
+        vocab += quote(merged[i]) + ":" + std::to_string(256 + i) + ",";
+    }
+    vocab += "\"<|endoftext|>\":266";
+
+    std::string mergeList;
+    for (const auto &m : merges) {
+        mergeList += (mergeList.empty() ? "" : ",") + quote(m);
+    }
+
+    return "{\"added_tokens\":[{\"id\":266,\"content\":\"<|endoftext|>\",\"special\":true}],"
+           "\"normalizer\":null,\"pre_tokenizer\":{\"type\":\"ByteLevel\",\"add_prefix_space\":false},"
+           "\"decoder\":{\"type\":\"ByteLevel\"},"
+           "\"model\":{\"type\":\"BPE\",\"vocab\":{"
+            + vocab + "},\"merges\":[" + mergeList + "]}}";
+}
+
+// Llama-2 style: spaces become U+2581 with one prepended, characters out of the vocabulary fall back to <0xNN>
+static std::string sentencePieceJson() {
+    std::string vocab = "\"<unk>\":0,\"<s>\":1,\"</s>\":2,";
+    for (int b = 0; b < 256; ++b) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "\"<0x%02X>\":%d,", b, 3 + b);
+        vocab += buf;
+    }
+    vocab += "\"▁\":259,\"h\":260,\"i\":261,\"▁h\":262,\"▁hi\":263,\"e\":264,\"l\":265,\"o\":266,\"ll\":267,"
+             "\"ell\":268,\"▁hell\":269,\"▁hello\":270";
+
+    return "{\"added_tokens\":[{\"id\":0,\"content\":\"<unk>\",\"special\":true},"
+           "{\"id\":1,\"content\":\"<s>\",\"special\":true},{\"id\":2,\"content\":\"</s>\",\"special\":true}],"
+           "\"normalizer\":{\"type\":\"Sequence\",\"normalizers\":[{\"type\":\"Prepend\",\"prepend\":\"▁\"},"
+           "{\"type\":\"Replace\",\"pattern\":{\"String\":\" \"},\"content\":\"▁\"}]},"
+           "\"pre_tokenizer\":null,"
+           "\"post_processor\":{\"type\":\"TemplateProcessing\",\"single\":[{\"SpecialToken\":{\"id\":\"<s>\","
+           "\"type_id\":0}},{\"Sequence\":{\"id\":\"A\",\"type_id\":0}}]},"
+           "\"decoder\":{\"type\":\"Sequence\",\"decoders\":[{\"type\":\"ByteFallback\"}]},"
+           "\"model\":{\"type\":\"BPE\",\"unk_token\":\"<unk>\",\"byte_fallback\":true,\"vocab\":{"
+            + vocab
+            + "},\"merges\":[\"▁ h\",\"▁h i\",\"l l\",\"e ll\",\"▁h ell\",\"▁hell o\"]}}";
+}
+
+class TokenizerTest : public ::testing::Test {
+protected:
+    void TearDown() override {
+        for (const auto &path : files) {
+            std::remove(path.c_str());
+        }
+    }
+
+    // Write the fixture to a temporary file
+    xft::Tokenizer load(const std::string &json) {
+        char path[] = "/tmp/xft_tokenizer_XXXXXX.json";
+        int fd = mkstemps(path, 5);
+        EXPECT_GE(fd, 0);
+        close(fd);
+        std::ofstream(path) << json;
+        files.push_back(path);
+        return xft::Tokenizer(path);
+    }
+
+    std::vector<std::string> files;
+};
+
+TEST_F(TokenizerTest, ByteLevelMerges) {
+    xft::Tokenizer tok = load(byteLevelJson());
+    EXPECT_EQ(tok.vocabSize(), 267);
+    EXPECT_EQ(tok.bosId(), -1);
+    EXPECT_EQ(tok.eosId(), 266);
+
+    EXPECT_EQ(tok.encode("hello world"), std::vector<int>({260, 264}));
+
+    // "h e" and "l l" first, then "he ll" and "hell o" win over the later ranked "o r"
+    EXPECT_EQ(tok.encode("hellor"), std::vector<int>({260, 'r'}));
+
+    // Bytes of "é" are merged, "€" has no merge and stays as three byte tokens
+    EXPECT_EQ(tok.encode("café"), std::vector<int>({'c', 'a', 'f', 265}));
+    EXPECT_EQ(tok.encode("€"), std::vector<int>({0xE2, 0x82, 0xAC}));
+}
+
+TEST_F(TokenizerTest, ByteLevelRoundTrip) {
+    xft::Tokenizer tok = load(byteLevelJson());
+    std::vector<std::string> texts
+            = {"hello world", "Hello, world! It's 2024.", "  spaces\tand\nlines  ", "café €5 — 你好"};
+    for (const auto &text : texts) {
+        EXPECT_EQ(tok.decode(tok.encode(text)), text);
+    }
+}
+
+TEST_F(TokenizerTest, SpecialTokens) {
+    xft::Tokenizer tok = load(byteLevelJson());
+
+    // Matched literally, never split by BPE
+    std::vector<int> ids = tok.encode("hello<|endoftext|> world");
+    EXPECT_EQ(ids, std::vector<int>({260, 266, 264}));
+    EXPECT_EQ(tok.tokenId("<|endoftext|>"), 266);
+
+    EXPECT_EQ(tok.decode(ids), "hello world");
+    EXPECT_EQ(tok.decode(ids, false), "hello<|endoftext|> world");
+}
+
+TEST_F(TokenizerTest, SentencePieceByteFallback) {
+    xft::Tokenizer tok = load(sentencePieceJson());
+    EXPECT_EQ(tok.bosId(), 1);
+    EXPECT_EQ(tok.eosId(), 2);
+
+    // "你" (E4 BD A0) is not in the vocabulary
+    std::vector<int> ids = tok.encode("hi hello 你");
+    EXPECT_EQ(ids, std::vector<int>({1, 263, 270, 259, 3 + 0xE4, 3 + 0xBD, 3 + 0xA0}));
+    EXPECT_EQ(tok.decode(ids), "hi hello 你");
+
+    EXPECT_EQ(tok.encode("hi", false), std::vector<int>({263}));
+}
+
+TEST_F(TokenizerTest, StreamSplitCharacter) {
+    xft::Tokenizer tok = load(byteLevelJson());
+    xft::StreamDecoder stream(tok);
+
+    // "€" arrives byte by byte and comes out at once
+    EXPECT_EQ(stream.push('a'), "a");
+    EXPECT_EQ(stream.push(0xE2), "");
+    EXPECT_EQ(stream.push(0x82), "");
+    EXPECT_EQ(stream.push(0xAC), "€");
+    EXPECT_EQ(stream.push(265), "é");
+    EXPECT_EQ(stream.push(266), ""); // Special token
+
+    // A character cut at the end is given by flush
+    EXPECT_EQ(stream.push(0xE2), "");
+    EXPECT_EQ(stream.flush(), "\xE2");
+    EXPECT_EQ(stream.flush(), "");
+}
+
+TEST_F(TokenizerTest, StreamByteFallback) {
+    xft::Tokenizer tok = load(sentencePieceJson());
+    xft::StreamDecoder stream(tok);
+
+    std::string text;
+    for (int id : tok.encode("hi 你 hello", false)) {
+        std::string piece = stream.push(id);
+        // Never a partial character
+        for (size_t i = 0; i < piece.size(); ++i) {
+            EXPECT_FALSE(i == 0 && (piece[i] & 0xC0) == 0x80);
+        }
+        text += piece;
+    }
+    text += stream.flush();
+    EXPECT_EQ(text, " hi 你 hello");
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}